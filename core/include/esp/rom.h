@@ -23,6 +23,12 @@ void Cache_Read_Disable(void);
  */
 void Cache_Read_Enable(uint32_t odd_even, uint32_t mb_count, uint32_t no_idea);
 
+/* Megabyte of flash that Cache_Read_Enable maps at 0x40200000, the one
+   holding the running rboot ROM slot (see core/spiflash-cache-enable.S).
+   Flash offset N in that megabyte reads back at 0x40200000 + N.
+ */
+extern uint8_t rboot_megabyte;
+
 /* Low-level SPI flash read/write routines */
 int Enable_QMode(sdk_flashchip_t *chip);
 int Disable_QMode(sdk_flashchip_t *chip);
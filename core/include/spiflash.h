@@ -33,6 +33,16 @@
 /**
  * Read data from SPI flash.
  *
+ * Reads longer than SPI_READ_CHUNK_SIZE (2048 bytes by default) are done in
+ * chunks, with interrupts enabled and the cache on between them. The read
+ * is therefore not atomic: another task, or an interrupt handler, can write
+ * or erase the same flash area in the middle of it, and the buffer then
+ * holds data from before and after that change. Callers sharing an area
+ * with a writer must lock it themselves. A read of up to
+ * SPI_READ_CHUNK_SIZE bytes is still done in one go, and building with
+ * SPI_READ_CHUNK_SIZE larger than the biggest read makes every read atomic
+ * again.
+ *
  * @param addr Address to read from. Can be not aligned.
  * @param buf Buffer to read to. Doesn't have to be aligned.
  * @param size Size of data to read. Buffer size must be >= than data size.
@@ -61,4 +71,33 @@ bool IRAM spiflash_write(uint32_t addr, uint8_t *buf, uint32_t size);
  */
 bool IRAM spiflash_erase_sector(uint32_t addr);
 
+/**
+ * Shortest erase slice, erase suspend/resume takes tens of microseconds and
+ * the erase needs time between a resume and the next suspend to progress.
+ */
+#ifndef SPIFLASH_MIN_ERASE_SLICE_US
+#define SPIFLASH_MIN_ERASE_SLICE_US 200
+#endif
+
+/**
+ * Limit how long the cache stays disabled during spiflash_erase_sector.
+ *
+ * A sector erase takes tens of milliseconds during which no code can run
+ * from flash, so interrupt handlers that are not in IRAM are delayed for
+ * all of it. With a slice set the erase is suspended every max_cache_off_us,
+ * pending interrupts are served with the cache enabled and then the erase
+ * is resumed. Other tasks don't run until the erase is complete.
+ *
+ * This needs a flash chip with erase suspend/resume commands, which is
+ * detected from the JEDEC manufacturer ID (Winbond, GigaDevice, XMC,
+ * Micron and Macronix).
+ *
+ * @param max_cache_off_us Longest cache-off window in microseconds, or 0 to
+ *        erase in one go (the default).
+ *
+ * @return false if the chip doesn't support erase suspend, in which case
+ *         erases are done in one go.
+ */
+bool spiflash_set_erase_slice(uint32_t max_cache_off_us);
+
 #endif  // __SPIFLASH_H__
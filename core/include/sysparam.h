@@ -13,6 +13,35 @@
 #define DEFAULT_SYSPARAM_SECTORS 4
 #endif
 
+/* Number of regions the default sysparam area (created at startup if none is
+ * found) is split into.  Each compaction moves the parameters on to the next
+ * region in turn, so using more regions spreads erases over more sectors, at
+ * the cost of less space per region.  DEFAULT_SYSPARAM_SECTORS must be a
+ * multiple of this.  With more than 2 regions the area is created in the ring
+ * format, which firmware built before ring areas existed cannot read (see
+ * sysparam_create_ring_area()).
+ */
+#ifndef DEFAULT_SYSPARAM_REGIONS
+#define DEFAULT_SYSPARAM_REGIONS 2
+#endif
+
+/* Maximum number of regions a sysparam area can be split into (sets the size
+ * of the erase count table kept in RAM and returned by sysparam_get_stats()).
+ */
+#ifndef SYSPARAM_MAX_REGIONS
+#define SYSPARAM_MAX_REGIONS 8
+#endif
+
+/* Maximum number of keys tracked by the in-RAM key index.  Each entry uses 16
+ * bytes of RAM.  When the index is enabled, lookups of indexed keys go
+ * straight to the key/value entries in flash instead of scanning the whole
+ * region.  Keys beyond this limit still work, but fall back to scanning.  Set
+ * to 0 to disable the index entirely.
+ */
+#ifndef SYSPARAM_INDEX_SIZE
+#define SYSPARAM_INDEX_SIZE 0
+#endif
+
 /** @file sysparam.h
  *
  *  Read/write "system parameters" to persistent flash.
@@ -60,6 +89,32 @@ typedef struct {
     struct sysparam_context *ctx;
 } sysparam_iter_t;
 
+/** Wear and usage statistics for the current sysparam area, filled in by
+ *  sysparam_get_stats().
+ *
+ *  All the sectors of a region are erased together, so sector `n` of the area
+ *  has been erased `erase_count[n / region_sectors]` times.  In ring format
+ *  areas erase counts are kept in the region headers, so they persist across
+ *  reboots.  Two-region areas keep the original on-flash format, which has no
+ *  room for them, so their erase counts start from zero at sysparam_init(), as
+ *  do the other counters.
+ */
+typedef struct {
+    uint32_t base_addr;       ///< Flash address of the start of the area
+    uint16_t region_sectors;  ///< Number of sectors in each region
+    uint8_t num_regions;      ///< Number of regions the area rotates through
+    uint8_t active_region;    ///< Index of the region currently in use
+    bool ring_format;         ///< Area uses ring format (persistent erase count) headers
+    size_t used_bytes;        ///< Bytes used in the current region
+    size_t free_bytes;        ///< Bytes still free in the current region
+    uint32_t erase_count[SYSPARAM_MAX_REGIONS]; ///< Erases of each region's sectors
+    uint32_t min_erase_count; ///< Lowest entry in `erase_count`
+    uint32_t max_erase_count; ///< Highest entry in `erase_count`
+    uint32_t bytes_written;   ///< Bytes written to flash since sysparam_init()
+    uint32_t sectors_erased;  ///< Sectors erased since sysparam_init()
+    uint32_t compactions;     ///< Compactions since sysparam_init()
+} sysparam_stats_t;
+
 /** Initialize sysparam and set up the current area of flash to use.
  *
  *  This must be called (and return successfully) before any other sysparam
@@ -122,6 +177,38 @@ sysparam_status_t sysparam_init(uint32_t base_addr, uint32_t top_addr);
  */
 sysparam_status_t sysparam_create_area(uint32_t base_addr, uint16_t num_sectors, bool force);
 
+/** Create a new sysparam area which rotates through several regions.
+ *
+ *  This works like sysparam_create_area(), but splits the area into
+ *  `num_regions` equal regions instead of two.  Each time the parameters are
+ *  compacted they move on to the next region, so erases are spread evenly over
+ *  all of the sectors in the area.  The useable parameter space is roughly the
+ *  size of one region.
+ *
+ *  With 2 regions this creates the same area as sysparam_create_area().  With
+ *  more, the area uses ring format region headers, which also record each
+ *  region's erase count.  Firmware built before ring areas existed cannot read
+ *  a ring format area, so do not create one on devices which may be rolled back
+ *  to such firmware.  An area keeps the format it was created with; existing
+ *  two-region areas are never converted.
+ *
+ *  @param[in] base_addr   The flash address at which it should start
+ *                         (must be a multiple of the sector size)
+ *  @param[in] num_sectors The total number of flash sectors to use for the
+ *                         sysparam area (must be a multiple of `num_regions`)
+ *  @param[in] num_regions The number of regions (2 to SYSPARAM_MAX_REGIONS)
+ *  @param[in] force       Proceed even if the space does not appear to be empty
+ *
+ *  @retval ::SYSPARAM_OK           Area (re)created successfully.
+ *  @retval ::SYSPARAM_NOTFOUND     `force` was not specified, and the area at
+ *                                  `base_addr` appears to have other data.  No
+ *                                  action taken.
+ *  @retval ::SYSPARAM_ERR_BADVALUE `num_regions` was out of range, or
+ *                                  `num_sectors` was not a multiple of it
+ *  @retval ::SYSPARAM_ERR_IO       I/O error reading/writing flash
+ */
+sysparam_status_t sysparam_create_ring_area(uint32_t base_addr, uint16_t num_sectors, uint8_t num_regions, bool force);
+
 /** Get the start address and size of the currently active sysparam area
  *
  *  Fills in `base_addr` and `num_sectors` with the location and size of the
@@ -138,6 +225,15 @@ sysparam_status_t sysparam_create_area(uint32_t base_addr, uint16_t num_sectors,
  */
 sysparam_status_t sysparam_get_info(uint32_t *base_addr, uint32_t *num_sectors);
 
+/** Get wear and usage statistics for the currently active sysparam area
+ *
+ *  @param[out] stats  Filled in with the statistics (see ::sysparam_stats_t)
+ *
+ *  @retval ::SYSPARAM_OK           Completed successfully
+ *  @retval ::SYSPARAM_ERR_NOINIT   No current sysparam area is active
+ */
+sysparam_status_t sysparam_get_stats(sysparam_stats_t *stats);
+
 /** Compact the sysparam area.
  *
  *  This also flattens the log.
@@ -326,6 +422,10 @@ sysparam_status_t sysparam_get_bool(const char *key, bool *result);
  *  to (for example) print binary data differently than text entries when
  *  printing parameter values.
  *
+ *  If the calling task has a transaction open (see sysparam_begin()), the
+ *  change is only buffered, and will not be written until sysparam_commit()
+ *  is called.
+ *
  *  @param[in] key        Key name (zero-terminated string)
  *  @param[in] value      Pointer to a buffer containing the value data
  *  @param[in] value_len  Length of the data in the buffer
@@ -420,6 +520,57 @@ sysparam_status_t sysparam_set_int8(const char *key, int8_t value);
  */
 sysparam_status_t sysparam_set_bool(const char *key, bool value);
 
+/** Start a transaction
+ *
+ *  After this call, any changes made by the calling task through
+ *  sysparam_set_data() (or any of the other `sysparam_set_*` functions) are
+ *  buffered in RAM instead of being written to flash immediately.  They are
+ *  then written all together by sysparam_commit(), or thrown away by
+ *  sysparam_abort().
+ *
+ *  Reads made while the transaction is open (by any task) continue to return
+ *  the values currently stored in flash, not the buffered ones.
+ *
+ *  Only one transaction can be open at a time.  If another task already has
+ *  one open, this will wait until it has been committed or aborted.
+ *
+ *  @retval ::SYSPARAM_OK           Transaction started
+ *  @retval ::SYSPARAM_ERR_NOINIT   sysparam_init() must be called first
+ *  @retval ::SYSPARAM_ERR_BADVALUE The calling task already has a transaction
+ *                                  open (transactions cannot be nested)
+ */
+sysparam_status_t sysparam_begin(void);
+
+/** Write all changes made since sysparam_begin() and end the transaction
+ *
+ *  The changes are written in a single sequential pass, compacting the
+ *  sysparam area at most once if needed to make room.  They take effect
+ *  atomically: if power is lost part way through, sysparam_init() will find
+ *  either all of the changes or none of them.
+ *
+ *  The transaction is ended whether or not this succeeds.  If an error is
+ *  returned, none of the changes have been applied.
+ *
+ *  @retval ::SYSPARAM_OK           All changes written successfully
+ *  @retval ::SYSPARAM_ERR_NOINIT   sysparam_init() must be called first
+ *  @retval ::SYSPARAM_ERR_BADVALUE The calling task does not have a
+ *                                  transaction open
+ *  @retval ::SYSPARAM_ERR_FULL     No space left in sysparam area
+ *                                  (or too many keys in use)
+ *  @retval ::SYSPARAM_ERR_NOMEM    Unable to allocate memory
+ *  @retval ::SYSPARAM_ERR_CORRUPT  Sysparam region has bad/corrupted data
+ *  @retval ::SYSPARAM_ERR_IO       I/O error reading/writing flash
+ */
+sysparam_status_t sysparam_commit(void);
+
+/** Discard all changes made since sysparam_begin() and end the transaction
+ *
+ *  @retval ::SYSPARAM_OK           Transaction discarded
+ *  @retval ::SYSPARAM_ERR_BADVALUE The calling task does not have a
+ *                                  transaction open
+ */
+sysparam_status_t sysparam_abort(void);
+
 /** Begin iterating through all key/value pairs
  *
  *  This function initializes a sysparam_iter_t structure to prepare it for
@@ -28,7 +28,9 @@
 #include "include/esp/spi_regs.h"
 
 #include <FreeRTOS.h>
+#include <task.h>
 #include <string.h>
+#include <espressif/esp_system.h>
 
 /**
  * Note about Wait_SPI_Idle.
@@ -52,6 +54,15 @@
 // http://bbs.espressif.com/viewtopic.php?f=6&t=2439
 #define SPI_READ_MAX_SIZE   60
 
+/**
+ * Largest number of bytes read with interrupts disabled. Bigger reads are
+ * split so interrupts and higher priority tasks are not held off for the
+ * whole transfer, which makes them non-atomic, see spiflash_read().
+ */
+#ifndef SPI_READ_CHUNK_SIZE
+#define SPI_READ_CHUNK_SIZE 2048
+#endif
+
 
 /**
  * Low level SPI flash write. Write block of data up to 64 bytes.
@@ -172,6 +183,9 @@ bool IRAM spiflash_write(uint32_t addr, uint8_t *buf, uint32_t size)
 
 /**
  * Read SPI flash up to 64 bytes.
+ *
+ * The read uses the flash mode (QIO/DIO/QOUT/DOUT/FASTRD) that the
+ * bootloader configured in SPI(0).CTRL0 from the image header.
  */
 static inline void IRAM read_block(sdk_flashchip_t *chip, uint32_t addr,
         uint8_t *buf, uint32_t size)
@@ -183,23 +197,31 @@ static inline void IRAM read_block(sdk_flashchip_t *chip, uint32_t addr,
 
     __asm__ volatile("memw");
 
-    memcpy(buf, (const void*)SPI(0).W, size);
+    if (((uint32_t)buf & 0b11) == 0) {
+        // Word aligned destination, copy whole words straight from
+        // the data registers and only the tail byte by byte
+        uint32_t *dst32 = (uint32_t*)buf;
+        uint32_t words = size >> 2;
+        uint32_t i;
+
+        for (i = 0; i < words; i++) {
+            dst32[i] = SPI(0).W[i];
+        }
+        if (size & 0b11) {
+            uint32_t last = SPI(0).W[i];
+            memcpy(&dst32[i], &last, size & 0b11);
+        }
+    } else {
+        memcpy(buf, (const void*)SPI(0).W, size);
+    }
 }
 
 /**
  * Read SPI flash data. Data region doesn't need to be page aligned.
  */
-static inline bool IRAM read_data(sdk_flashchip_t *flashchip, uint32_t addr,
+static inline void IRAM read_data(sdk_flashchip_t *flashchip, uint32_t addr,
         uint8_t *dst, uint32_t size)
 {
-    if (size < 1) {
-        return true;
-    }
-
-    if ((addr + size) > flashchip->chip_size) {
-        return false;
-    }
-
     while (size >= SPI_READ_MAX_SIZE) {
         read_block(flashchip, addr, dst, SPI_READ_MAX_SIZE);
         dst += SPI_READ_MAX_SIZE;
@@ -210,25 +232,192 @@ static inline bool IRAM read_data(sdk_flashchip_t *flashchip, uint32_t addr,
     if (size > 0) {
         read_block(flashchip, addr, dst, size);
     }
-
-    return true;
 }
 
 bool IRAM spiflash_read(uint32_t dest_addr, uint8_t *buf, uint32_t size)
 {
-    bool result = false;
+    if (!buf) {
+        return false;
+    }
+
+    if ((dest_addr + size) > sdk_flashchip.chip_size) {
+        return false;
+    }
+
+    while (size > 0) {
+        // Chunks are a multiple of the block size so that only the last
+        // block of the whole read is a short one
+        uint32_t chunk = size;
+        if (chunk > SPI_READ_CHUNK_SIZE) {
+            chunk = SPI_READ_CHUNK_SIZE - SPI_READ_CHUNK_SIZE % SPI_READ_MAX_SIZE;
+        }
 
-    if (buf) {
         vPortEnterCritical();
         Cache_Read_Disable();
 
-        result = read_data(&sdk_flashchip, dest_addr, buf, size);
+        read_data(&sdk_flashchip, dest_addr, buf, chunk);
 
         Cache_Read_Enable(0, 0, 1);
         vPortExitCritical();
+
+        dest_addr += chunk;
+        buf += chunk;
+        size -= chunk;
     }
 
-    return result;
+    return true;
+}
+
+/**
+ * Erase suspend/resume commands of the chips that support them, keyed by
+ * JEDEC manufacturer ID.
+ */
+static const struct {
+    uint8_t manufacturer;
+    uint8_t suspend;
+    uint8_t resume;
+} erase_suspend_cmds[] = {
+    { 0xEF, 0x75, 0x7A },  // Winbond
+    { 0xC8, 0x75, 0x7A },  // GigaDevice
+    { 0x20, 0x75, 0x7A },  // XMC, Micron
+    { 0xC2, 0xB0, 0x30 },  // Macronix
+};
+
+/* Longest cache-off window during an erase in microseconds, 0 if disabled.
+ * Converted to cycles at each erase as the CPU clock may have changed.
+ */
+static uint32_t erase_slice_us;
+static uint8_t erase_suspend_cmd;
+static uint8_t erase_resume_cmd;
+
+static inline uint32_t IRAM get_ccount(void)
+{
+    uint32_t ccount;
+    __asm__ volatile("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+}
+
+/**
+ * Send a single byte command with no address or data.
+ */
+static void IRAM spi_command(uint8_t cmd)
+{
+    uint32_t user0 = SPI(0).USER0;
+    uint32_t user2 = SPI(0).USER2;
+
+    SPI(0).USER0 = (user0 & ~(SPI_USER0_ADDR | SPI_USER0_DUMMY |
+                SPI_USER0_MISO | SPI_USER0_MOSI)) | SPI_USER0_COMMAND;
+    SPI(0).USER2 = (7 << SPI_USER2_COMMAND_BITLEN_S) | cmd;
+    SPI(0).CMD = SPI_CMD_USR;
+    while (SPI(0).CMD) {};
+
+    SPI(0).USER0 = user0;
+    SPI(0).USER2 = user2;
+}
+
+static inline bool IRAM flash_busy(void)
+{
+    uint32_t status = 0;
+    SPI_read_status(&sdk_flashchip, &status);
+    return status & 0x01;
+}
+
+/**
+ * Read the JEDEC ID. Runs from IRAM as the cache is off meanwhile, and is
+ * not inlined so callers in flash never run with the cache off.
+ */
+static uint32_t IRAM __attribute__((noinline)) read_flash_id(void)
+{
+    uint32_t id;
+
+    vPortEnterCritical();
+    Cache_Read_Disable();
+
+    SPI(0).CMD = SPI_CMD_READ_ID;
+    while (SPI(0).CMD) {};
+    id = SPI(0).W[0];
+
+    Cache_Read_Enable(0, 0, 1);
+    vPortExitCritical();
+
+    return id;
+}
+
+bool spiflash_set_erase_slice(uint32_t max_cache_off_us)
+{
+    uint32_t id;
+
+    if (!max_cache_off_us) {
+        erase_slice_us = 0;
+        return true;
+    }
+
+    id = read_flash_id();
+
+    for (int i = 0; i < sizeof(erase_suspend_cmds) / sizeof(erase_suspend_cmds[0]); i++) {
+        if (erase_suspend_cmds[i].manufacturer == (id & 0xFF)) {
+            if (max_cache_off_us < SPIFLASH_MIN_ERASE_SLICE_US) {
+                max_cache_off_us = SPIFLASH_MIN_ERASE_SLICE_US;
+            }
+            erase_suspend_cmd = erase_suspend_cmds[i].suspend;
+            erase_resume_cmd = erase_suspend_cmds[i].resume;
+            erase_slice_us = max_cache_off_us;
+            return true;
+        }
+    }
+
+    erase_slice_us = 0;
+    return false;
+}
+
+/**
+ * Erase a sector, suspending the erase every erase_slice_us to let
+ * interrupt handlers run with the cache enabled.
+ *
+ * Other tasks are kept from running until the erase is done, as a program
+ * or erase issued while the erase is suspended would be ignored by the chip.
+ */
+static bool IRAM erase_sector_sliced(uint32_t addr)
+{
+    // Still with the cache on, the SDK call may live in flash
+    uint32_t slice_cycles = erase_slice_us * sdk_system_get_cpu_freq();
+
+    vTaskSuspendAll();
+    vPortEnterCritical();
+    Cache_Read_Disable();
+
+    SPI_write_enable(&sdk_flashchip);
+
+    SPI(0).ADDR = addr & 0x00FFFFFF;
+    SPI(0).CMD = SPI_CMD_SE;
+    while (SPI(0).CMD) {};
+
+    for (;;) {
+        uint32_t start = get_ccount();
+        while (flash_busy() && (get_ccount() - start) < slice_cycles) {}
+        if (!flash_busy()) {
+            break;
+        }
+
+        // If the erase finishes just before this the chip ignores both the
+        // suspend and the resume, and the next poll ends the loop
+        spi_command(erase_suspend_cmd);
+        Wait_SPI_Idle(&sdk_flashchip);
+
+        Cache_Read_Enable(0, 0, 1);
+        vPortExitCritical();
+        // Interrupts that became pending during the slice are served here
+        vPortEnterCritical();
+        Cache_Read_Disable();
+
+        spi_command(erase_resume_cmd);
+    }
+
+    Cache_Read_Enable(0, 0, 1);
+    vPortExitCritical();
+    xTaskResumeAll();
+
+    return true;
 }
 
 bool IRAM spiflash_erase_sector(uint32_t addr)
@@ -241,6 +430,10 @@ bool IRAM spiflash_erase_sector(uint32_t addr)
         return false;
     }
 
+    if (erase_slice_us) {
+        return erase_sector_sliced(addr);
+    }
+
     vPortEnterCritical();
     Cache_Read_Disable();
 
@@ -5,6 +5,7 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <sysparam.h>
@@ -12,6 +13,7 @@
 #include "flashchip.h"
 #include <common_macros.h>
 #include "FreeRTOS.h"
+#include "task.h"
 #include "semphr.h"
 
 /* The "magic" value that indicates the start of a sysparam region in flash.
@@ -44,6 +46,7 @@
  * will probably require some code changes if they are tweaked).
  */
 #define REGION_HEADER_SIZE 8 // NOTE: Must be multiple of 4
+#define RING_HEADER_SIZE 16  // NOTE: Must be multiple of 4
 #define ENTRY_HEADER_SIZE 4  // NOTE: Must be multiple of 4
 
 /* These are limited by the format to 0xffff, but could be set lower if desired
@@ -56,8 +59,9 @@
  */
 #define MAX_KEY_ID 0x0ffe
 
-#define REGION_FLAG_SECOND  0x8000 // First (0) or second (1) region
+#define REGION_FLAG_SECOND  0x8000 // First (0) or second (1) region (two-region format only)
 #define REGION_FLAG_ACTIVE  0x4000 // Stale (0) or active (1) region
+#define REGION_FLAG_RING    0x2000 // Two-region (0) or ring (1) format header
 #define REGION_MASK_SIZE    0x0fff // Region size in sectors
 
 #define ENTRY_FLAG_ALIVE    0x8000 // Deleted (0) or active (1)
@@ -70,6 +74,15 @@
 #define ENTRY_ID_END   0xfff
 #define ENTRY_ID_ANY  0x1000
 
+/* Key ids start at 1, so id 0 is used for the marker entries written by
+ * sysparam_commit().  The marker's payload is the (32-bit) number of bytes of
+ * entries belonging to the transaction which follow it.  Its "invalid" flag is
+ * cleared once all of them have been written, which is the point at which the
+ * transaction takes effect.
+ */
+#define ENTRY_ID_TXN   0
+#define TXN_MARKER_LEN 4
+
 #ifndef SYSPARAM_DEBUG
 #define SYSPARAM_DEBUG 0
 #endif
@@ -90,10 +103,24 @@
 
 /********************* Internal datatypes and structures *********************/
 
+/* Two-region areas use the original format, with an 8-byte header and
+ * `pending` always zero, so that firmware from before ring areas existed can
+ * still read them.  Areas with more regions use ring format headers
+ * (REGION_FLAG_RING), which are RING_HEADER_SIZE bytes and also record where
+ * the region is in the ring and how worn it is.  They are written (with
+ * `pending` set) as soon as the region has been erased, so that the erase
+ * count is not lost, and `pending` is cleared once the region's contents are
+ * complete.  An area keeps the format it was created with.
+ */
 struct region_header {
     uint32_t magic;
     uint16_t flags_size;
-    uint16_t reserved;
+    uint16_t pending;       // Non-zero while the region is still being written
+    // The rest is only present in ring format headers
+    uint8_t region;         // Index of this region within the area
+    uint8_t num_regions;    // Number of regions in the area
+    uint16_t generation;    // Incremented each time a new region becomes active
+    uint32_t erase_count;   // Number of times this region has been erased
 } __attribute__ ((packed));
 
 struct entry_header {
@@ -109,15 +136,62 @@ struct sysparam_context {
     uint16_t max_key_id;
 };
 
+/* One slot of the in-RAM key index.  `value` holds a copy of the value's entry
+ * header (or just the key id in `value.idflags`, if the key has no current
+ * value), so a lookup does not need to re-read it from flash.
+ */
+struct index_entry {
+    uint32_t key_addr;    // Address of the key entry (0 = unused slot)
+    uint32_t value_addr;  // Address of the value entry (0 = no value)
+    uint16_t hash;
+    uint16_t key_len;
+    struct entry_header value;
+};
+
+/* A change made by sysparam_set_data() between sysparam_begin() and
+ * sysparam_commit().  For buffered changes, the key and value data follow the
+ * structure.
+ */
+struct txn_op {
+    struct txn_op *next;
+    const char *key;
+    const uint8_t *value;
+    uint16_t key_len;
+    uint16_t value_len;
+    uint16_t binary_flag;
+    bool done;
+    // The following are filled in by sysparam_commit()
+    int key_id;
+    uint32_t key_addr;
+    uint32_t value_addr;
+    uint8_t data[];
+};
+
 /*************************** Global variables/data ***************************/
 
 static struct {
     uint32_t cur_base;
-    uint32_t alt_base;
     uint32_t end_addr;
     size_t region_size;
+    uint32_t area_base;
+    uint8_t num_regions;
+    uint8_t cur_region;
+    size_t header_size;
+    struct region_header header;
+    uint32_t erase_count[SYSPARAM_MAX_REGIONS];
+    uint32_t bytes_written;
+    uint32_t sectors_erased;
+    uint32_t compactions;
     bool force_compact;
     SemaphoreHandle_t sem;
+    SemaphoreHandle_t txn_sem;
+    TaskHandle_t txn_owner;
+    bool txn_active;
+    struct txn_op *txn;
+    bool index_complete;
+#if SYSPARAM_INDEX_SIZE > 0
+    struct index_entry index[SYSPARAM_INDEX_SIZE];
+#endif
 } _sysparam_info;
 
 /***************************** Internal routines *****************************/
@@ -129,6 +203,7 @@ static sysparam_status_t _write_and_verify(uint32_t addr, const void *data, size
         size_t count = min(data_size - i, BOUNCE_BUFFER_SIZE);
         memcpy(bounce, data + i, count);
         CHECK_FLASH_OP(spiflash_write(addr + i, bounce, count));
+        _sysparam_info.bytes_written += count;
         CHECK_FLASH_OP(spiflash_read(addr + i, bounce, count));
         if (memcmp(data + i, bounce, count) != 0) {
             debug(1, "Flash write (@ 0x%08x) verify failed!", addr);
@@ -144,44 +219,100 @@ static sysparam_status_t _format_region(uint32_t addr, uint16_t num_sectors) {
 
     for (i = 0; i < num_sectors; i++) {
         CHECK_FLASH_OP(spiflash_erase_sector(addr + (i * SPI_FLASH_SECTOR_SIZE)));
+        _sysparam_info.sectors_erased++;
     }
     return SYSPARAM_OK;
 }
 
-/** Write the magic data at the beginning of a region */
-static inline sysparam_status_t _write_region_header(uint32_t addr, uint32_t other, bool active) {
-    struct region_header header;
+/** Write the magic data at the beginning of a region
+ *
+ *  `size` is the size of the header (RING_HEADER_SIZE for ring format headers,
+ *  REGION_HEADER_SIZE when rewriting an old two-region header).  The magic
+ *  number is written last, so if we lose power part way through the header
+ *  will not be recognised.
+ */
+static inline sysparam_status_t _write_region_header(uint32_t addr, const struct region_header *header, size_t size) {
+    struct region_header zero;
     sysparam_status_t status;
-    int16_t num_sectors;
 
-    header.magic = SYSPARAM_MAGIC;
-    if (addr < other) {
-        num_sectors = (other - addr) / sdk_flashchip.sector_size;
-        header.flags_size = num_sectors & REGION_MASK_SIZE;
-    } else {
-        num_sectors = (addr - other) / sdk_flashchip.sector_size;
-        header.flags_size = num_sectors & REGION_MASK_SIZE;
-        header.flags_size |= REGION_FLAG_SECOND;
-    }
-    if (active) {
-        header.flags_size |= REGION_FLAG_ACTIVE;
+    debug(3, "write region header (0x%04x) @ 0x%08x", header->flags_size, addr);
+    status = _write_and_verify(addr + sizeof(header->magic), (uint8_t *)header + sizeof(header->magic), size - sizeof(header->magic));
+    if (status == SYSPARAM_OK) {
+        status = _write_and_verify(addr, &header->magic, sizeof(header->magic));
     }
-    header.reserved = 0;
-
-    debug(3, "write region header (0x%04x) @ 0x%08x", header.flags_size, addr);
-    status = _write_and_verify(addr, &header, REGION_HEADER_SIZE);
     if (status != SYSPARAM_OK) {
         // Uh oh.. Something failed, so we don't know whether what we wrote is
         // actually in the flash or not.  Try to zero it out to be sure and
         // return an error.
         debug(3, "zero region header @ 0x%08x", addr);
-        memset(&header, 0, REGION_HEADER_SIZE);
-        _write_and_verify(addr, &header, REGION_HEADER_SIZE);
+        memset(&zero, 0, size);
+        _write_and_verify(addr, &zero, size);
         return SYSPARAM_ERR_IO;
     }
     return SYSPARAM_OK;
 }
 
+/** Fill in an original two-region format header (REGION_HEADER_SIZE bytes) */
+static void _init_legacy_region_header(struct region_header *header, uint16_t num_sectors, uint8_t region, bool active) {
+    memset(header, 0, sizeof(*header));
+    header->magic = SYSPARAM_MAGIC;
+    header->flags_size = num_sectors & REGION_MASK_SIZE;
+    if (region) {
+        header->flags_size |= REGION_FLAG_SECOND;
+    }
+    if (active) {
+        header->flags_size |= REGION_FLAG_ACTIVE;
+    }
+}
+
+/** Fill in a ring format region header */
+static void _init_region_header(struct region_header *header, uint16_t num_sectors, uint8_t region, uint8_t num_regions, uint16_t generation, uint32_t erase_count, bool active) {
+    memset(header, 0, sizeof(*header));
+    header->magic = SYSPARAM_MAGIC;
+    header->flags_size = (num_sectors & REGION_MASK_SIZE) | REGION_FLAG_RING;
+    if (active) {
+        header->flags_size |= REGION_FLAG_ACTIVE;
+    }
+    header->region = region;
+    header->num_regions = num_regions;
+    header->generation = generation;
+    header->erase_count = erase_count;
+}
+
+/** Check that a region header looks intact and work out the layout of the
+ *  area it belongs to.  A header which was only partly written when power was
+ *  lost can have a good magic number but a garbage size.
+ */
+static bool _check_region_header(const struct region_header *header, uint32_t addr, uint32_t *area_base, uint8_t *num_regions, uint8_t *region) {
+    uint32_t size = (header->flags_size & REGION_MASK_SIZE) * sdk_flashchip.sector_size;
+
+    if (header->magic != SYSPARAM_MAGIC || !size) return false;
+    if (header->flags_size & REGION_FLAG_RING) {
+        *num_regions = header->num_regions;
+        *region = header->region;
+    } else {
+        *num_regions = 2;
+        *region = (header->flags_size & REGION_FLAG_SECOND) ? 1 : 0;
+    }
+    if (*num_regions < 2 || *num_regions > SYSPARAM_MAX_REGIONS || *region >= *num_regions) return false;
+    if (*region * size > addr) return false;
+    *area_base = addr - *region * size;
+    return *area_base + *num_regions * size <= sdk_flashchip.chip_size;
+}
+
+/** Return true if the active region header `a` was written more recently than
+ *  the active region header `b` (if we lost power during a compaction, there
+ *  can be two).
+ */
+static bool _region_newer(const struct region_header *a, const struct region_header *b) {
+    if (!(a->flags_size & REGION_FLAG_RING) || !(b->flags_size & REGION_FLAG_RING)) {
+        // Two-region format headers have no generation, so keep the first one
+        // (as older versions did).
+        return false;
+    }
+    return (int16_t)(a->generation - b->generation) > 0;
+}
+
 /** Initialize a context structure at the beginning of the active region */
 static void _init_context(struct sysparam_context *ctx) {
     memset(ctx, 0, sizeof(*ctx));
@@ -207,7 +338,7 @@ static sysparam_status_t _find_entry(struct sysparam_context *ctx, uint16_t matc
 
     while (true) {
         if (ctx->addr == _sysparam_info.cur_base) {
-            ctx->addr += REGION_HEADER_SIZE;
+            ctx->addr += _sysparam_info.header_size;
         } else {
             uint32_t next_addr = ctx->addr + ENTRY_SIZE(ctx->entry.len);
             if (next_addr > _sysparam_info.cur_base + _sysparam_info.region_size) {
@@ -246,7 +377,11 @@ static sysparam_status_t _find_entry(struct sysparam_context *ctx, uint16_t matc
         id = ctx->entry.idflags & ENTRY_MASK_ID;
         if ((ctx->entry.idflags & (ENTRY_FLAG_ALIVE | ENTRY_FLAG_INVALID)) == ENTRY_FLAG_ALIVE) {
             debug(3, "  entry is alive and valid");
-            if (!(ctx->entry.idflags & ENTRY_FLAG_VALUE)) {
+            if (!(ctx->entry.idflags & ENTRY_FLAG_VALUE) && id == ENTRY_ID_TXN) {
+                // A transaction marker (only present while a transaction is
+                // being committed, or before recovery in sysparam_init)
+                debug(3, "  entry is a transaction marker");
+            } else if (!(ctx->entry.idflags & ENTRY_FLAG_VALUE)) {
                 debug(3, "  entry is a key");
                 ctx->max_key_id = id;
                 ctx->unused_keys++;
@@ -344,6 +479,223 @@ static inline sysparam_status_t _find_value(struct sysparam_context *ctx, uint16
     return _find_entry(ctx, id_field & ENTRY_MASK_ID, true);
 }
 
+/********************************* Key index *********************************/
+
+#if SYSPARAM_INDEX_SIZE > 0
+
+/** Add a block of data to a running FNV-1a hash.  Start with INDEX_HASH_INIT
+ *  and use _index_hash_fold() on the result to get the 16-bit index hash.
+ */
+#define INDEX_HASH_INIT 0x811c9dc5
+
+static uint32_t _index_hash_update(uint32_t hash, const uint8_t *data, size_t len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+static inline uint16_t _index_hash_fold(uint32_t hash) {
+    return (hash >> 16) ^ (hash & 0xffff);
+}
+
+static inline uint16_t _index_hash(const char *key, uint16_t key_len) {
+    return _index_hash_fold(_index_hash_update(INDEX_HASH_INIT, (const uint8_t *)key, key_len));
+}
+
+/** Throw away all index entries.  If `complete` is false, lookups which do not
+ *  find a key in the index will fall back to scanning the flash.
+ */
+static void _index_reset(bool complete) {
+    memset(_sysparam_info.index, 0, sizeof(_sysparam_info.index));
+    _sysparam_info.index_complete = complete;
+}
+
+/** Find the slot for the key with the specified id, or the empty slot where it
+ *  would go if it is not currently in the index.  Returns NULL if the key is
+ *  not present and the index is full.
+ */
+static struct index_entry *_index_slot(uint16_t hash, uint16_t key_id) {
+    struct index_entry *slot;
+    int i;
+
+    for (i = 0; i < SYSPARAM_INDEX_SIZE; i++) {
+        slot = &_sysparam_info.index[(hash + i) % SYSPARAM_INDEX_SIZE];
+        if (!slot->key_addr) return slot;
+        if (slot->hash == hash && (slot->value.idflags & ENTRY_MASK_ID) == key_id) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/** Record the location of a key (and optionally its value) in the index.
+ *
+ *  If the key is already present, only the value information is updated.  If
+ *  it is not present and `key_addr` is zero (unknown), or there is no room
+ *  left, the index is flagged as incomplete instead.
+ */
+static void _index_update(uint16_t hash, uint16_t key_len, uint16_t key_id, uint32_t key_addr, uint32_t value_addr, const struct entry_header *value) {
+    struct index_entry *slot = _index_slot(hash, key_id);
+
+    if (!slot || (!slot->key_addr && !key_addr)) {
+        debug(2, "key 0x%03x not indexed", key_id);
+        _sysparam_info.index_complete = false;
+        return;
+    }
+    if (!slot->key_addr) {
+        slot->key_addr = key_addr;
+        slot->hash = hash;
+        slot->key_len = key_len;
+    }
+    slot->value_addr = value_addr;
+    if (value_addr) {
+        slot->value = *value;
+    } else {
+        slot->value.idflags = key_id;
+        slot->value.len = 0;
+    }
+}
+
+/** Look up a key in the index
+ *
+ *  On return, `*result` points to the matching slot, or NULL if the key was not
+ *  found in the index.
+ */
+static sysparam_status_t _index_lookup(const char *key, uint16_t key_len, uint16_t hash, struct index_entry **result) {
+    struct sysparam_context ctx;
+    struct index_entry *slot;
+    sysparam_status_t status;
+    int i;
+
+    *result = NULL;
+    for (i = 0; i < SYSPARAM_INDEX_SIZE; i++) {
+        slot = &_sysparam_info.index[(hash + i) % SYSPARAM_INDEX_SIZE];
+        if (!slot->key_addr) break;
+        if (slot->hash != hash || slot->key_len != key_len) continue;
+        ctx.addr = slot->key_addr;
+        ctx.entry.len = key_len;
+        status = _compare_payload(&ctx, (uint8_t *)key, key_len);
+        if (status == SYSPARAM_OK) {
+            debug(3, "index hit for key @ 0x%08x", slot->key_addr);
+            *result = slot;
+            break;
+        }
+        if (status != SYSPARAM_NOTFOUND) return status;
+    }
+    return SYSPARAM_OK;
+}
+
+/** Scan the active region and build a new index of all keys and values */
+static sysparam_status_t _index_rebuild(void) {
+    struct sysparam_context ctx;
+    struct index_entry *slot;
+    sysparam_status_t status;
+    uint8_t bounce[BOUNCE_BUFFER_SIZE];
+    uint32_t hash;
+    uint16_t id;
+    int i;
+
+    _index_reset(true);
+
+    // First pass: index all live keys
+    _init_context(&ctx);
+    while (true) {
+        status = _find_key(&ctx, NULL, 0);
+        if (status != SYSPARAM_OK) break;
+        hash = INDEX_HASH_INIT;
+        for (i = 0; i < ctx.entry.len; i += BOUNCE_BUFFER_SIZE) {
+            size_t count = min(ctx.entry.len - i, BOUNCE_BUFFER_SIZE);
+            if (!spiflash_read(ctx.addr + ENTRY_HEADER_SIZE + i, bounce, count)) {
+                status = SYSPARAM_ERR_IO;
+                break;
+            }
+            hash = _index_hash_update(hash, bounce, count);
+        }
+        if (status != SYSPARAM_OK) break;
+        _index_update(_index_hash_fold(hash), ctx.entry.len, ctx.entry.idflags & ENTRY_MASK_ID, ctx.addr, 0, NULL);
+    }
+
+    // Second pass: attach each live value to its key.  If there is more than
+    // one live value for a key (interrupted update), the first one wins, the
+    // same as for _find_value().
+    if (status == SYSPARAM_NOTFOUND) {
+        _init_context(&ctx);
+        while (true) {
+            status = _find_entry(&ctx, ENTRY_ID_ANY, true);
+            if (status != SYSPARAM_OK) break;
+            id = ctx.entry.idflags & ENTRY_MASK_ID;
+            for (i = 0; i < SYSPARAM_INDEX_SIZE; i++) {
+                slot = &_sysparam_info.index[i];
+                if (slot->key_addr && (slot->value.idflags & ENTRY_MASK_ID) == id) {
+                    if (!slot->value_addr) {
+                        slot->value_addr = ctx.addr;
+                        slot->value = ctx.entry;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    if (status < 0) {
+        _index_reset(false);
+        return status;
+    }
+    debug(2, "index rebuilt (%s)", _sysparam_info.index_complete ? "complete" : "partial");
+    return SYSPARAM_OK;
+}
+
+#else /* SYSPARAM_INDEX_SIZE == 0 */
+
+static inline uint16_t _index_hash(const char *key, uint16_t key_len) {
+    return 0;
+}
+
+static inline void _index_reset(bool complete) {
+}
+
+static inline void _index_update(uint16_t hash, uint16_t key_len, uint16_t key_id, uint32_t key_addr, uint32_t value_addr, const struct entry_header *value) {
+}
+
+static inline sysparam_status_t _index_lookup(const char *key, uint16_t key_len, uint16_t hash, struct index_entry **result) {
+    *result = NULL;
+    return SYSPARAM_OK;
+}
+
+static inline sysparam_status_t _index_rebuild(void) {
+    return SYSPARAM_OK;
+}
+
+#endif /* SYSPARAM_INDEX_SIZE */
+
+/** Find the current value entry for the specified key name
+ *
+ *  Uses the index if possible, otherwise scans the region from the start.
+ */
+static sysparam_status_t _find_key_value(struct sysparam_context *ctx, const char *key, uint16_t key_len) {
+    struct index_entry *slot;
+    sysparam_status_t status;
+
+    status = _index_lookup(key, key_len, _index_hash(key, key_len), &slot);
+    if (status < 0) return status;
+    if (slot) {
+        if (!slot->value_addr) return SYSPARAM_NOTFOUND;
+        memset(ctx, 0, sizeof(*ctx));
+        ctx->addr = slot->value_addr;
+        ctx->entry = slot->value;
+        return SYSPARAM_OK;
+    }
+    if (_sysparam_info.index_complete) return SYSPARAM_NOTFOUND;
+
+    _init_context(ctx);
+    status = _find_key(ctx, key, key_len);
+    if (status != SYSPARAM_OK) return status;
+    return _find_value(ctx, ctx->entry.idflags);
+}
+
 /** Write an entry at the specified address */
 static inline sysparam_status_t _write_entry(uint32_t addr, uint16_t id, const uint8_t *payload, uint16_t len) {
     struct entry_header entry;
@@ -407,26 +759,72 @@ static inline sysparam_status_t _delete_entry(uint32_t addr) {
     return _write_and_verify(addr, &entry, ENTRY_HEADER_SIZE);
 }
 
+/** Find the buffered change (if any) for the specified key */
+static struct txn_op *_txn_find(struct txn_op *txn, const char *key, uint16_t key_len) {
+    struct txn_op *op;
+
+    for (op = txn; op; op = op->next) {
+        if (op->key_len == key_len && !memcmp(op->key, key, key_len)) break;
+    }
+    return op;
+}
+
+/** Write a key entry (and its value, if `value_len` is non-zero) to the region
+ *  being built by _compact_params(), making sure it stays within the region.
+ */
+static sysparam_status_t _compact_write(uint32_t *addr, uint32_t new_base, uint16_t key_id, const char *key, uint16_t key_len, const uint8_t *value, uint16_t value_len, uint16_t binary_flag) {
+    sysparam_status_t status;
+    uint32_t key_addr = *addr;
+    size_t size = ENTRY_SIZE(key_len) + (value_len ? ENTRY_SIZE(value_len) : 0);
+    struct entry_header value_entry;
+
+    if (key_id > MAX_KEY_ID || *addr + size > new_base + _sysparam_info.region_size) {
+        debug(1, "compacted result does not fit");
+        return SYSPARAM_ERR_FULL;
+    }
+
+    debug(2, "writing %d key @ 0x%08x", key_id, *addr);
+    status = _write_entry(*addr, key_id, (uint8_t *)key, key_len);
+    if (status < 0) return status;
+    *addr += ENTRY_SIZE(key_len);
+
+    if (!value_len) {
+        _index_update(_index_hash(key, key_len), key_len, key_id, key_addr, 0, NULL);
+        return SYSPARAM_OK;
+    }
+
+    debug(2, "writing %d value @ 0x%08x", key_id, *addr);
+    status = _write_entry(*addr, key_id | ENTRY_FLAG_VALUE | binary_flag, value, value_len);
+    if (status < 0) return status;
+    value_entry.idflags = key_id | ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE | binary_flag;
+    value_entry.len = value_len;
+    _index_update(_index_hash(key, key_len), key_len, key_id, key_addr, *addr, &value_entry);
+    *addr += ENTRY_SIZE(value_len);
+
+    return SYSPARAM_OK;
+}
+
 /** Compact the current region, removing all deleted/unused entries, and write
- *  the result to the alternate region, then make the new alternate region the
- *  active one.
+ *  the result to the next region in the ring, then make that region the active
+ *  one.
  *
- *  @param key_id  A pointer to the "current" key ID, or NULL if none.
+ *  @param txn     A list of changes to merge into the result, or NULL if none.
  *
- *  NOTE: The value corresponding to the passed key ID will not be written to
- *  the output (because it is assumed it will be overwritten as the next step
- *  in `sysparam_set_data` anyway).  When compacting, this routine will
- *  automatically update *key_id to contain the ID of this key in the new
- *  compacted result as well.
+ *  Changes in `txn` replace (or delete) the corresponding existing values.
+ *  Since the new region only becomes active once it has been completely
+ *  written, either all of them or none of them take effect.
  */
-static sysparam_status_t _compact_params(struct sysparam_context *ctx, int *key_id) {
-    uint32_t new_base = _sysparam_info.alt_base;
+static sysparam_status_t _compact_params(struct sysparam_context *ctx, struct txn_op *txn) {
+    uint8_t new_region = (_sysparam_info.cur_region + 1) % _sysparam_info.num_regions;
+    uint32_t new_base = _sysparam_info.area_base + new_region * _sysparam_info.region_size;
     sysparam_status_t status;
-    uint32_t addr = new_base + REGION_HEADER_SIZE;
+    bool ring = _sysparam_info.header_size == RING_HEADER_SIZE;
+    uint32_t addr = new_base + _sysparam_info.header_size;
     uint16_t current_key_id = 0;
     sysparam_iter_t iter;
-    uint16_t binary_flag;
     uint16_t num_sectors = _sysparam_info.region_size / sdk_flashchip.sector_size;
+    struct region_header header;
+    struct txn_op *op;
 
     debug(1, "compacting region (current size %d, expect to recover %d%s bytes)...",
             _sysparam_info.end_addr - _sysparam_info.cur_base,
@@ -435,54 +833,91 @@ static sysparam_status_t _compact_params(struct sysparam_context *ctx, int *key_
 
     status = _format_region(new_base, num_sectors);
     if (status < 0) return status;
+    _sysparam_info.erase_count[new_region]++;
+    if (ring) {
+        _init_region_header(&header, num_sectors, new_region, _sysparam_info.num_regions,
+                _sysparam_info.header.generation + 1, _sysparam_info.erase_count[new_region], true);
+        header.pending = 0xffff;
+        status = _write_region_header(new_base, &header, RING_HEADER_SIZE);
+        if (status < 0) return status;
+    } else {
+        // Written once the contents are complete, as older versions did
+        _init_legacy_region_header(&header, num_sectors, new_region, true);
+    }
     status = sysparam_iter_start(&iter);
     if (status < 0) return status;
 
+    // The index is rebuilt as we go, so it describes the new region once we
+    // switch over to it.
+    _index_reset(true);
+
+    for (op = txn; op; op = op->next) {
+        op->done = false;
+    }
+
     while (true) {
         status = sysparam_iter_next(&iter);
         if (status != SYSPARAM_OK) break;
 
-        current_key_id++;
+        op = _txn_find(txn, iter.key, iter.key_len);
+        if (op) {
+            op->done = true;
+            if (!op->value_len) {
+                // Deleted by the transaction.  Drop the key too.
+                continue;
+            }
+        }
 
-        // Write the key to the new region
-        debug(2, "writing %d key @ 0x%08x", current_key_id, addr);
-        status = _write_entry(addr, current_key_id, (uint8_t *)iter.key, iter.key_len);
-        if (status < 0) break;
-        addr += ENTRY_SIZE(iter.key_len);
+        current_key_id++;
 
-        if (key_id && (iter.ctx->entry.idflags & ENTRY_MASK_ID) == *key_id) {
-            // Update key_id to have the correct id for the compacted result
-            *key_id = current_key_id;
-            // Don't copy the old value, since we'll just be deleting it
-            // and writing a new one as soon as we return.
-            continue;
+        if (op) {
+            status = _compact_write(&addr, new_base, current_key_id, iter.key, iter.key_len, op->value, op->value_len, op->binary_flag);
+        } else {
+            status = _compact_write(&addr, new_base, current_key_id, iter.key, iter.key_len, iter.value, iter.value_len, iter.binary ? ENTRY_FLAG_BINARY : 0);
         }
-
-        // Copy the value to the new region
-        debug(2, "writing %d value @ 0x%08x", current_key_id, addr);
-        binary_flag = iter.binary ? ENTRY_FLAG_BINARY : 0;
-        status = _write_entry(addr, current_key_id | ENTRY_FLAG_VALUE | binary_flag, iter.value, iter.value_len);
         if (status < 0) break;
-        addr += ENTRY_SIZE(iter.value_len);
     }
     sysparam_iter_end(&iter);
 
+    // Add any keys which are new in this transaction
+    for (op = txn; op && status >= 0; op = op->next) {
+        if (op->done || !op->value_len) continue;
+        current_key_id++;
+        status = _compact_write(&addr, new_base, current_key_id, op->key, op->key_len, op->value, op->value_len, op->binary_flag);
+    }
+
     // If we broke out with an error, return the error instead of continuing.
     if (status < 0) {
         debug(1, "error encountered during compacting (%d)", status);
+        _index_reset(false);
         return status;
     }
 
     // Switch to officially using the new region.
-    status = _write_region_header(new_base, _sysparam_info.cur_base, true);
-    if (status < 0) return status;
-    status = _write_region_header(_sysparam_info.cur_base, new_base, false);
-    if (status < 0) return status;
+    if (ring) {
+        header.pending = 0;
+        debug(3, "mark region complete @ 0x%08x", new_base);
+        status = _write_and_verify(new_base + offsetof(struct region_header, pending), &header.pending, sizeof(header.pending));
+    } else {
+        status = _write_region_header(new_base, &header, REGION_HEADER_SIZE);
+    }
+    if (status < 0) {
+        _index_reset(false);
+        return status;
+    }
+    _sysparam_info.header.flags_size &= ~REGION_FLAG_ACTIVE;
+    status = _write_region_header(_sysparam_info.cur_base, &_sysparam_info.header, _sysparam_info.header_size);
+    if (status < 0) {
+        _index_reset(false);
+        return status;
+    }
 
-    _sysparam_info.alt_base = _sysparam_info.cur_base;
     _sysparam_info.cur_base = new_base;
+    _sysparam_info.cur_region = new_region;
+    _sysparam_info.header = header;
     _sysparam_info.end_addr = addr;
     _sysparam_info.force_compact = false;
+    _sysparam_info.compactions++;
 
     if (ctx) {
         // Fix up ctx so it doesn't point to invalid stuff
@@ -496,14 +931,376 @@ static sysparam_status_t _compact_params(struct sysparam_context *ctx, int *key_
     return SYSPARAM_OK;
 }
 
+/** Finish off the transaction whose marker entry is at `marker_addr`.
+ *
+ *  If the transaction was committed, any older values of the keys it changed
+ *  are deleted, followed by the empty values it used to record deletions.  If
+ *  it was not committed, all of its entries are deleted instead.  Either way,
+ *  the marker itself is deleted last, so that this can safely be repeated if
+ *  it gets interrupted.
+ */
+static sysparam_status_t _txn_resolve(uint32_t marker_addr, bool committed) {
+    sysparam_status_t status = SYSPARAM_OK;
+    struct entry_header entry;
+    uint32_t start = marker_addr + ENTRY_SIZE(TXN_MARKER_LEN);
+    uint32_t end = _sysparam_info.end_addr;
+    uint32_t span;
+    uint32_t addr;
+    uint16_t *ids = NULL;
+    int num_ids = 0;
+    int i;
+
+    debug(1, "%s transaction @ 0x%08x", committed ? "completing" : "rolling back", marker_addr);
+    CHECK_FLASH_OP(spiflash_read(marker_addr + ENTRY_HEADER_SIZE, (uint8_t *)&span, TXN_MARKER_LEN));
+    if (start <= end && span < end - start) {
+        end = start + span;
+    }
+
+    for (addr = start; addr + ENTRY_HEADER_SIZE <= end; addr += ENTRY_SIZE(entry.len)) {
+        CHECK_FLASH_OP(spiflash_read(addr, (uint8_t *)&entry, ENTRY_HEADER_SIZE));
+        if (entry.idflags == 0xffff) break;
+        if (!(entry.idflags & ENTRY_FLAG_ALIVE)) continue;
+        if (!committed) {
+            status = _delete_entry(addr);
+            if (status < 0) return status;
+        } else if ((entry.idflags & (ENTRY_FLAG_INVALID | ENTRY_FLAG_VALUE)) == ENTRY_FLAG_VALUE) {
+            num_ids++;
+        }
+    }
+
+    if (num_ids) {
+        ids = malloc(num_ids * sizeof(uint16_t));
+        if (!ids) return SYSPARAM_ERR_NOMEM;
+        num_ids = 0;
+        for (addr = start; addr + ENTRY_HEADER_SIZE <= end; addr += ENTRY_SIZE(entry.len)) {
+            if (!spiflash_read(addr, (uint8_t *)&entry, ENTRY_HEADER_SIZE)) {
+                status = SYSPARAM_ERR_IO;
+                goto done;
+            }
+            if (entry.idflags == 0xffff) break;
+            if ((entry.idflags & (ENTRY_FLAG_ALIVE | ENTRY_FLAG_INVALID | ENTRY_FLAG_VALUE)) == (ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE)) {
+                ids[num_ids++] = entry.idflags & ENTRY_MASK_ID;
+            }
+        }
+
+        // Delete the values these replace
+        for (addr = _sysparam_info.cur_base + _sysparam_info.header_size; addr < marker_addr; addr += ENTRY_SIZE(entry.len)) {
+            if (!spiflash_read(addr, (uint8_t *)&entry, ENTRY_HEADER_SIZE)) {
+                status = SYSPARAM_ERR_IO;
+                goto done;
+            }
+            if ((entry.idflags & (ENTRY_FLAG_ALIVE | ENTRY_FLAG_INVALID | ENTRY_FLAG_VALUE)) != (ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE)) {
+                continue;
+            }
+            for (i = 0; i < num_ids; i++) {
+                if (ids[i] == (entry.idflags & ENTRY_MASK_ID)) {
+                    status = _delete_entry(addr);
+                    if (status < 0) goto done;
+                    break;
+                }
+            }
+        }
+
+        // Now the deletion records are no longer needed either
+        for (addr = start; addr + ENTRY_HEADER_SIZE <= end; addr += ENTRY_SIZE(entry.len)) {
+            if (!spiflash_read(addr, (uint8_t *)&entry, ENTRY_HEADER_SIZE)) {
+                status = SYSPARAM_ERR_IO;
+                goto done;
+            }
+            if (entry.idflags == 0xffff) break;
+            if ((entry.idflags & (ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE)) == (ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE) && !entry.len) {
+                status = _delete_entry(addr);
+                if (status < 0) goto done;
+            }
+        }
+    }
+
+    status = _delete_entry(marker_addr);
+
+ done:
+    free(ids);
+    return status;
+}
+
+/** Find and finish off any transaction left over from an interrupted
+ *  sysparam_commit()
+ */
+static sysparam_status_t _recover_txn(void) {
+    sysparam_status_t status;
+    struct entry_header entry;
+    uint32_t addr;
+
+    for (addr = _sysparam_info.cur_base + _sysparam_info.header_size; addr + ENTRY_HEADER_SIZE <= _sysparam_info.end_addr; addr += ENTRY_SIZE(entry.len)) {
+        CHECK_FLASH_OP(spiflash_read(addr, (uint8_t *)&entry, ENTRY_HEADER_SIZE));
+        if ((entry.idflags & (ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE | ENTRY_MASK_ID)) == (ENTRY_FLAG_ALIVE | ENTRY_ID_TXN)) {
+            status = _txn_resolve(addr, !(entry.idflags & ENTRY_FLAG_INVALID));
+            if (status < 0) return status;
+        }
+    }
+    return SYSPARAM_OK;
+}
+
+/** Delete all but the most recent live value of each key.
+ *
+ *  sysparam_set_data() writes the new value before deleting the old one, so
+ *  if it is interrupted in between, both are left alive.  Finish the job, so
+ *  that the older value can't resurface later.
+ */
+static sysparam_status_t _recover_values(void) {
+    sysparam_status_t status = SYSPARAM_OK;
+    struct sysparam_context ctx;
+    uint32_t *addrs;
+    uint16_t *ids;
+    int count = 0;
+    int i, j;
+
+    _init_context(&ctx);
+    while ((status = _find_entry(&ctx, ENTRY_ID_ANY, true)) == SYSPARAM_OK) {
+        count++;
+    }
+    if (status < 0) return status;
+    if (count < 2) return SYSPARAM_OK;
+
+    addrs = malloc(count * (sizeof(uint32_t) + sizeof(uint16_t)));
+    if (!addrs) return SYSPARAM_ERR_NOMEM;
+    ids = (uint16_t *)(addrs + count);
+
+    _init_context(&ctx);
+    for (i = 0; i < count; i++) {
+        status = _find_entry(&ctx, ENTRY_ID_ANY, true);
+        if (status != SYSPARAM_OK) break;
+        addrs[i] = ctx.addr;
+        ids[i] = ctx.entry.idflags & ENTRY_MASK_ID;
+    }
+    if (status == SYSPARAM_OK) {
+        for (i = 0; i < count && status == SYSPARAM_OK; i++) {
+            for (j = i + 1; j < count; j++) {
+                if (ids[j] == ids[i]) {
+                    debug(1, "removing superseded value @ 0x%08x", addrs[i]);
+                    status = _delete_entry(addrs[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    free(addrs);
+    return status < 0 ? status : SYSPARAM_OK;
+}
+
+/** Work out what a buffered change needs to do.  Fills in `op->key_id` and
+ *  `op->key_addr` (if the key already exists), and sets `op->done` if the
+ *  change would not actually modify anything.
+ */
+static sysparam_status_t _txn_lookup(struct txn_op *op) {
+    struct sysparam_context ctx;
+    struct index_entry *slot;
+    sysparam_status_t status;
+    uint32_t value_addr = 0;
+
+    op->key_id = -1;
+    op->key_addr = 0;
+    op->value_addr = 0;
+    op->done = false;
+
+    status = _index_lookup(op->key, op->key_len, _index_hash(op->key, op->key_len), &slot);
+    if (status < 0) return status;
+    if (slot) {
+        op->key_id = slot->value.idflags & ENTRY_MASK_ID;
+        op->key_addr = slot->key_addr;
+        if (slot->value_addr) {
+            value_addr = slot->value_addr;
+            ctx.addr = value_addr;
+            ctx.entry = slot->value;
+        }
+    } else if (!_sysparam_info.index_complete) {
+        _init_context(&ctx);
+        status = _find_key(&ctx, op->key, op->key_len);
+        if (status < 0) return status;
+        if (status == SYSPARAM_OK) {
+            op->key_id = ctx.entry.idflags & ENTRY_MASK_ID;
+            op->key_addr = ctx.addr;
+            status = _find_value(&ctx, op->key_id);
+            if (status < 0) return status;
+            if (status == SYSPARAM_OK) value_addr = ctx.addr;
+        }
+    }
+
+    if (!value_addr) {
+        // Deleting something which isn't there is a no-op
+        op->done = !op->value_len;
+    } else if (op->value_len && (ctx.entry.idflags & ENTRY_FLAG_BINARY) == op->binary_flag) {
+        status = _compare_payload(&ctx, (uint8_t *)op->value, op->value_len);
+        if (status < 0) return status;
+        op->done = (status == SYSPARAM_OK);
+    }
+    return SYSPARAM_OK;
+}
+
+/** Apply a list of buffered changes as a single atomic update
+ *
+ *  Normally, the changes are appended to the end of the region as a single
+ *  group, preceded by a marker entry (see ENTRY_ID_TXN) which is only flagged
+ *  as valid once all of them have been written.  If there is not enough space
+ *  for that, the region is instead compacted once with the changes merged in.
+ */
+static sysparam_status_t _txn_apply(struct txn_op *txn) {
+    struct sysparam_context ctx;
+    sysparam_status_t status;
+    struct entry_header marker;
+    struct entry_header value_entry;
+    struct txn_op *op;
+    uint32_t marker_addr;
+    uint32_t span = 0;
+    size_t free_space;
+    int new_keys = 0;
+
+    for (op = txn; op; op = op->next) {
+        status = _txn_lookup(op);
+        if (status < 0) return status;
+        if (op->done) continue;
+        if (op->key_id < 0) {
+            span += ENTRY_SIZE(op->key_len);
+            new_keys++;
+        }
+        // (Deletions are recorded as empty values, to be cleaned up after
+        // the transaction has been committed.)
+        span += ENTRY_SIZE(op->value_len);
+    }
+    if (!span) {
+        debug(1, "transaction contains no changes");
+        return SYSPARAM_OK;
+    }
+
+    _init_context(&ctx);
+    status = _find_entry(&ctx, ENTRY_ID_END, false);
+    if (status < 0) return status;
+
+    free_space = _sysparam_info.cur_base + _sysparam_info.region_size - _sysparam_info.end_addr;
+    if (_sysparam_info.force_compact || ENTRY_SIZE(TXN_MARKER_LEN) + span > free_space ||
+            ctx.max_key_id + new_keys > MAX_KEY_ID) {
+        debug(1, "transaction needs %d of %d remaining, compacting", ENTRY_SIZE(TXN_MARKER_LEN) + span, free_space);
+        return _compact_params(&ctx, txn);
+    }
+
+    debug(1, "writing transaction (%d bytes) @ 0x%08x", span, _sysparam_info.end_addr);
+    marker_addr = _sysparam_info.end_addr;
+    marker.idflags = ENTRY_ID_TXN | ENTRY_FLAG_ALIVE | ENTRY_FLAG_INVALID;
+    marker.len = TXN_MARKER_LEN;
+    status = _write_and_verify(marker_addr, &marker, ENTRY_HEADER_SIZE);
+    if (status < 0) {
+        // We don't know what state the header is in, so make sure nothing
+        // else gets written after it until it has been compacted away.
+        _sysparam_info.force_compact = true;
+        return status;
+    }
+    _sysparam_info.end_addr += ENTRY_SIZE(TXN_MARKER_LEN);
+    status = _write_and_verify(marker_addr + ENTRY_HEADER_SIZE, &span, TXN_MARKER_LEN);
+
+    for (op = txn; op && status >= 0; op = op->next) {
+        if (op->done) continue;
+        if (op->key_id < 0) {
+            op->key_id = ++ctx.max_key_id;
+            op->key_addr = _sysparam_info.end_addr;
+            status = _write_entry(op->key_addr, op->key_id, (uint8_t *)op->key, op->key_len);
+            if (status < 0) break;
+        }
+        op->value_addr = op->value_len ? _sysparam_info.end_addr : 0;
+        status = _write_entry(_sysparam_info.end_addr, op->key_id | ENTRY_FLAG_VALUE | op->binary_flag, op->value, op->value_len);
+    }
+
+    if (status >= 0) {
+        // This is the point at which the transaction takes effect.
+        debug(3, "set transaction marker valid @ 0x%08x", marker_addr);
+        marker.idflags &= ~ENTRY_FLAG_INVALID;
+        status = _write_and_verify(marker_addr, &marker, ENTRY_HEADER_SIZE);
+    }
+    if (status < 0) {
+        debug(1, "error writing transaction (%d)", status);
+        _txn_resolve(marker_addr, false);
+        return status;
+    }
+
+    status = _txn_resolve(marker_addr, true);
+    if (status < 0) {
+        // The old values may still be around, so don't trust the index.
+        _index_reset(false);
+        return status;
+    }
+
+    for (op = txn; op; op = op->next) {
+        if (op->done) continue;
+        value_entry.idflags = op->key_id | ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE | op->binary_flag;
+        value_entry.len = op->value_len;
+        _index_update(_index_hash(op->key, op->key_len), op->key_len, op->key_id, op->key_addr, op->value_addr, &value_entry);
+    }
+
+    return SYSPARAM_OK;
+}
+
+/** Add a change to the transaction being built by the current task */
+static sysparam_status_t _txn_add(const char *key, uint16_t key_len, const uint8_t *value, uint16_t value_len, bool is_binary) {
+    struct txn_op *op;
+    struct txn_op **prev;
+
+    debug(2, "buffering value for '%s' (%d bytes)", key, value_len);
+
+    // Replace any earlier change to the same key
+    for (prev = &_sysparam_info.txn; *prev; prev = &(*prev)->next) {
+        op = *prev;
+        if (op->key_len == key_len && !memcmp(op->key, key, key_len)) {
+            *prev = op->next;
+            free(op);
+            break;
+        }
+    }
+
+    op = malloc(sizeof(struct txn_op) + key_len + value_len);
+    if (!op) return SYSPARAM_ERR_NOMEM;
+    op->next = NULL;
+    op->key_len = key_len;
+    op->value_len = value_len;
+    op->binary_flag = is_binary ? ENTRY_FLAG_BINARY : 0;
+    op->key = (char *)op->data;
+    op->value = op->data + key_len;
+    memcpy(op->data, key, key_len);
+    if (value_len) memcpy(op->data + key_len, value, value_len);
+
+    for (prev = &_sysparam_info.txn; *prev; prev = &(*prev)->next) {}
+    *prev = op;
+
+    return SYSPARAM_OK;
+}
+
+/** Release the buffered changes of the current transaction and end it */
+static void _txn_end(void) {
+    struct txn_op *op;
+
+    while (_sysparam_info.txn) {
+        op = _sysparam_info.txn;
+        _sysparam_info.txn = op->next;
+        free(op);
+    }
+    _sysparam_info.txn_owner = NULL;
+    _sysparam_info.txn_active = false;
+    xSemaphoreGive(_sysparam_info.txn_sem);
+}
+
 /***************************** Public Functions ******************************/
 
 sysparam_status_t sysparam_init(uint32_t base_addr, uint32_t top_addr) {
     sysparam_status_t status;
-    uint32_t addr0, addr1;
-    struct region_header header0, header1;
+    uint32_t addr, area_base, other_base;
+    struct region_header header, active_header;
     struct sysparam_context ctx;
     uint16_t num_sectors;
+    uint8_t num_regions, other_regions, region;
+    uint32_t region_size;
+    uint32_t erase_count[SYSPARAM_MAX_REGIONS];
+    bool known[SYSPARAM_MAX_REGIONS];
+    uint32_t max_erase_count = 0;
+    int active = -1;
+    int i;
 
     // Make sure we're starting at the beginning of the sector
     base_addr -= (base_addr % sdk_flashchip.sector_size);
@@ -512,62 +1309,84 @@ sysparam_status_t sysparam_init(uint32_t base_addr, uint32_t top_addr) {
         // Only scan the specified sector, nowhere else.
         top_addr = base_addr + sdk_flashchip.sector_size;
     }
-    for (addr0 = base_addr; addr0 < top_addr; addr0 += sdk_flashchip.sector_size) {
-        CHECK_FLASH_OP(spiflash_read(addr0, (void*) &header0, REGION_HEADER_SIZE));
-        if (header0.magic == SYSPARAM_MAGIC) {
+    for (addr = base_addr; addr < top_addr; addr += sdk_flashchip.sector_size) {
+        CHECK_FLASH_OP(spiflash_read(addr, (void*) &header, sizeof(header)));
+        if (_check_region_header(&header, addr, &area_base, &num_regions, &region)) {
             // Found a starting point...
             break;
         }
     }
-    if (addr0 >= top_addr) {
+    if (addr >= top_addr) {
         return SYSPARAM_NOTFOUND;
     }
 
-    // We've found a valid header at addr0.  Now find the other half of the sysparam area.
-    num_sectors = header0.flags_size & REGION_MASK_SIZE;
+    // We've found a valid header, which tells us where the rest of the
+    // sysparam area is.  Now look at all of its regions to find the active
+    // one (and the erase counts).
+    num_sectors = header.flags_size & REGION_MASK_SIZE;
+    region_size = num_sectors * sdk_flashchip.sector_size;
 
-    if (header0.flags_size & REGION_FLAG_SECOND) {
-        addr1 = addr0 - num_sectors * sdk_flashchip.sector_size;
-    } else {
-        addr1 = addr0 + num_sectors * sdk_flashchip.sector_size;
+    for (i = 0; i < num_regions; i++) {
+        known[i] = false;
+        addr = area_base + i * region_size;
+        CHECK_FLASH_OP(spiflash_read(addr, (void*) &header, sizeof(header)));
+        if (!_check_region_header(&header, addr, &other_base, &other_regions, &region) ||
+                other_base != area_base || other_regions != num_regions ||
+                (header.flags_size & REGION_MASK_SIZE) != num_sectors) {
+            // Erased, or something went wrong at a critical point when
+            // writing it.  Either way there's nothing there for us.
+            debug(2, "No valid region header @ 0x%08x", addr);
+            continue;
+        }
+        known[i] = true;
+        erase_count[i] = (header.flags_size & REGION_FLAG_RING) ? header.erase_count : 0;
+        max_erase_count = max(max_erase_count, erase_count[i]);
+        if (!(header.flags_size & REGION_FLAG_ACTIVE) || header.pending) continue;
+        if (active < 0 || _region_newer(&header, &active_header)) {
+            active = i;
+            active_header = header;
+        }
+    }
+    if (active < 0) {
+        // We only found stale regions.  We have no idea how old they are, so
+        // we shouldn't use them without some sort of confirmation/recovery.
+        // We'll have to bail for now.
+        debug(1, "Found stale-region headers @ 0x%08x, but no active region.", area_base);
+        return SYSPARAM_ERR_CORRUPT;
     }
-    CHECK_FLASH_OP(spiflash_read(addr1, (uint8_t*) &header1, REGION_HEADER_SIZE));
 
-    if (header1.magic == SYSPARAM_MAGIC) {
-        // Yay! Found the other one.  Sanity-check it..
-        if ((header0.flags_size & REGION_FLAG_SECOND) == (header1.flags_size & REGION_FLAG_SECOND)) {
-            // Hmm.. they both say they're the same region.  That can't be right...
-            debug(1, "Found region headers @ 0x%08x and 0x%08x, but both claim to be the same region.", addr0, addr1);
-            return SYSPARAM_ERR_CORRUPT;
+    for (i = 0; i < num_regions; i++) {
+        if (!known[i]) {
+            // We lost this one's erase count, but regions are used in turn so
+            // it can't be far off the others.
+            erase_count[i] = max_erase_count;
+            continue;
         }
-    } else {
-        // Didn't find a valid header at the alternate location (which probably means something clobbered it or something went wrong at a critical point when rewriting it.  Is the one we did find the active or stale one?
-        if (header0.flags_size & REGION_FLAG_ACTIVE) {
-            // Found the active one.  We can work with this.  Try to recreate the missing stale region...
-            debug(2, "Found active region header @ 0x%08x but no stale region @ 0x%08x. Trying to recreate stale region.", addr0, addr1);
-            status = _format_region(addr1, num_sectors);
+        if (i == active) continue;
+        addr = area_base + i * region_size;
+        CHECK_FLASH_OP(spiflash_read(addr, (void*) &header, sizeof(header)));
+        if ((header.flags_size & REGION_FLAG_ACTIVE) && !header.pending) {
+            // We lost power while switching regions, after the new region was
+            // completely written but before the old one was marked as stale.
+            debug(2, "Marking older active region @ 0x%08x as stale", addr);
+            header.flags_size &= ~REGION_FLAG_ACTIVE;
+            status = _write_region_header(addr, &header, (header.flags_size & REGION_FLAG_RING) ? RING_HEADER_SIZE : REGION_HEADER_SIZE);
             if (status != SYSPARAM_OK) return status;
-            status = _write_region_header(addr1, addr0, false);
-            if (status != SYSPARAM_OK) return status;
-        } else {
-            // Found the stale one.  We have no idea how old it is, so we shouldn't use it without some sort of confirmation/recovery.  We'll have to bail for now.
-            debug(1, "Found stale-region header @ 0x%08x, but no active region.", addr0);
-            return SYSPARAM_ERR_CORRUPT;
         }
     }
-    // At this point we have confirmed valid regions at addr0 and addr1.
 
-    _sysparam_info.region_size = num_sectors * sdk_flashchip.sector_size;
-    if (header0.flags_size & REGION_FLAG_ACTIVE) {
-        _sysparam_info.cur_base = addr0;
-        _sysparam_info.alt_base = addr1;
-        debug(3, "Active region @ 0x%08x (0x%04x).  Stale region @ 0x%08x (0x%04x).", addr0, header0.flags_size, addr1, header1.flags_size);
-
-    } else {
-        _sysparam_info.cur_base = addr1;
-        _sysparam_info.alt_base = addr0;
-        debug(3, "Active region @ 0x%08x (0x%04x).  Stale region @ 0x%08x (0x%04x).", addr1, header1.flags_size, addr0, header0.flags_size);
-    }
+    _sysparam_info.area_base = area_base;
+    _sysparam_info.num_regions = num_regions;
+    _sysparam_info.region_size = region_size;
+    _sysparam_info.cur_region = active;
+    _sysparam_info.cur_base = area_base + active * region_size;
+    _sysparam_info.header = active_header;
+    _sysparam_info.header_size = (active_header.flags_size & REGION_FLAG_RING) ? RING_HEADER_SIZE : REGION_HEADER_SIZE;
+    memcpy(_sysparam_info.erase_count, erase_count, sizeof(erase_count));
+    _sysparam_info.bytes_written = 0;
+    _sysparam_info.sectors_erased = 0;
+    _sysparam_info.compactions = 0;
+    debug(3, "Active region @ 0x%08x (0x%04x), %d of %d.", _sysparam_info.cur_base, active_header.flags_size, active, num_regions);
 
     // Find the actual end
     _sysparam_info.end_addr = _sysparam_info.cur_base + _sysparam_info.region_size;
@@ -576,7 +1395,6 @@ sysparam_status_t sysparam_init(uint32_t base_addr, uint32_t top_addr) {
     status = _find_entry(&ctx, ENTRY_ID_END, false);
     if (status < 0) {
         _sysparam_info.cur_base = 0;
-        _sysparam_info.alt_base = 0;
         _sysparam_info.end_addr = 0;
         return status;
     }
@@ -584,29 +1402,57 @@ sysparam_status_t sysparam_init(uint32_t base_addr, uint32_t top_addr) {
         _sysparam_info.end_addr = ctx.addr;
     }
 
+    status = _recover_txn();
+    if (status == SYSPARAM_OK) {
+        status = _recover_values();
+    }
+    if (status == SYSPARAM_OK) {
+        status = _index_rebuild();
+    }
+    if (status < 0) {
+        _sysparam_info.cur_base = 0;
+        _sysparam_info.end_addr = 0;
+        return status;
+    }
+
     _sysparam_info.sem = xSemaphoreCreateMutex();
+    _sysparam_info.txn_sem = xSemaphoreCreateMutex();
 
     return SYSPARAM_OK;
 }
 
 sysparam_status_t sysparam_create_area(uint32_t base_addr, uint16_t num_sectors, bool force) {
+    return sysparam_create_ring_area(base_addr, num_sectors, 2, force);
+}
+
+sysparam_status_t sysparam_create_ring_area(uint32_t base_addr, uint16_t num_sectors, uint8_t num_regions, bool force) {
     size_t region_size;
     sysparam_status_t status;
     uint32_t buffer[SCAN_BUFFER_SIZE];
-    uint32_t addr;
+    uint32_t erase_count[SYSPARAM_MAX_REGIONS];
+    struct region_header header;
+    uint32_t addr, area_base;
+    uint8_t other_regions, region;
+    bool ring = num_regions > 2;
     int i;
 
     // Convert "number of sectors for area" into "number of sectors per region"
-    if (num_sectors < 1 || (num_sectors & 1)) {
+    if (num_regions < 2 || num_regions > SYSPARAM_MAX_REGIONS) {
+        return SYSPARAM_ERR_BADVALUE;
+    }
+    if (num_sectors < 1 || (num_sectors % num_regions)) {
+        return SYSPARAM_ERR_BADVALUE;
+    }
+    num_sectors /= num_regions;
+    if (num_sectors > REGION_MASK_SIZE) {
         return SYSPARAM_ERR_BADVALUE;
     }
-    num_sectors >>= 1;
     region_size = num_sectors * sdk_flashchip.sector_size;
 
     if (!force) {
         // First, scan through the area and make sure it's actually empty and
         // we're not going to be clobbering something else important.
-        for (addr = base_addr; addr < base_addr + region_size * 2; addr += SCAN_BUFFER_SIZE) {
+        for (addr = base_addr; addr < base_addr + region_size * num_regions; addr += SCAN_BUFFER_SIZE) {
             debug(3, "read %d words @ 0x%08x", SCAN_BUFFER_SIZE, addr);
             CHECK_FLASH_OP(spiflash_read(addr, (uint8_t*)buffer, SCAN_BUFFER_SIZE * 4));
             for (i = 0; i < SCAN_BUFFER_SIZE; i++) {
@@ -618,20 +1464,38 @@ sysparam_status_t sysparam_create_area(uint32_t base_addr, uint16_t num_sectors,
         }
     }
 
-    if (_sysparam_info.cur_base == base_addr || _sysparam_info.alt_base == base_addr) {
+    if (_sysparam_info.cur_base &&
+            base_addr < _sysparam_info.area_base + _sysparam_info.region_size * _sysparam_info.num_regions &&
+            base_addr + region_size * num_regions > _sysparam_info.area_base) {
         // We're reformating the same region we're already using.
         // De-initialize everything to force the caller to do a clean
         // `sysparam_init()` afterwards.
         memset(&_sysparam_info, 0, sizeof(_sysparam_info));
     }
-    status = _format_region(base_addr, num_sectors);
-    if (status < 0) return status;
-    status = _format_region(base_addr + region_size, num_sectors);
-    if (status < 0) return status;
-    status = _write_region_header(base_addr, base_addr + region_size, true);
-    if (status < 0) return status;
-    status = _write_region_header(base_addr + region_size, base_addr, false);
-    if (status < 0) return status;
+    for (i = 0; i < num_regions; i++) {
+        addr = base_addr + i * region_size;
+        // If this is being recreated with the same layout, carry on counting
+        // erases from where we were
+        erase_count[i] = 1;
+        CHECK_FLASH_OP(spiflash_read(addr, (void*) &header, sizeof(header)));
+        if (ring && _check_region_header(&header, addr, &area_base, &other_regions, &region) &&
+                (header.flags_size & REGION_FLAG_RING) && area_base == base_addr &&
+                other_regions == num_regions && (header.flags_size & REGION_MASK_SIZE) == num_sectors) {
+            erase_count[i] = header.erase_count + 1;
+        }
+        status = _format_region(addr, num_sectors);
+        if (status < 0) return status;
+    }
+    for (i = 0; i < num_regions; i++) {
+        if (ring) {
+            _init_region_header(&header, num_sectors, i, num_regions, 0, erase_count[i], i == 0);
+            status = _write_region_header(base_addr + i * region_size, &header, RING_HEADER_SIZE);
+        } else {
+            _init_legacy_region_header(&header, num_sectors, i, i == 0);
+            status = _write_region_header(base_addr + i * region_size, &header, REGION_HEADER_SIZE);
+        }
+        if (status < 0) return status;
+    }
 
     return SYSPARAM_OK;
 }
@@ -639,11 +1503,45 @@ sysparam_status_t sysparam_create_area(uint32_t base_addr, uint16_t num_sectors,
 sysparam_status_t sysparam_get_info(uint32_t *base_addr, uint32_t *num_sectors) {
     if (!_sysparam_info.cur_base) return SYSPARAM_ERR_NOINIT;
 
-    *base_addr = min(_sysparam_info.cur_base, _sysparam_info.alt_base);
-    *num_sectors = (_sysparam_info.region_size / sdk_flashchip.sector_size) * 2;
+    *base_addr = _sysparam_info.area_base;
+    *num_sectors = (_sysparam_info.region_size / sdk_flashchip.sector_size) * _sysparam_info.num_regions;
     return SYSPARAM_OK;
 }
 
+sysparam_status_t sysparam_get_stats(sysparam_stats_t *stats) {
+    sysparam_status_t status = SYSPARAM_OK;
+    int i;
+
+    xSemaphoreTake(_sysparam_info.sem, portMAX_DELAY);
+
+    if (!_sysparam_info.cur_base) {
+        status = SYSPARAM_ERR_NOINIT;
+        goto done;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->base_addr = _sysparam_info.area_base;
+    stats->region_sectors = _sysparam_info.region_size / sdk_flashchip.sector_size;
+    stats->num_regions = _sysparam_info.num_regions;
+    stats->ring_format = _sysparam_info.header_size == RING_HEADER_SIZE;
+    stats->active_region = _sysparam_info.cur_region;
+    stats->used_bytes = _sysparam_info.end_addr - _sysparam_info.cur_base;
+    stats->free_bytes = _sysparam_info.region_size - stats->used_bytes;
+    stats->min_erase_count = _sysparam_info.erase_count[0];
+    for (i = 0; i < _sysparam_info.num_regions; i++) {
+        stats->erase_count[i] = _sysparam_info.erase_count[i];
+        stats->min_erase_count = min(stats->min_erase_count, stats->erase_count[i]);
+        stats->max_erase_count = max(stats->max_erase_count, stats->erase_count[i]);
+    }
+    stats->bytes_written = _sysparam_info.bytes_written;
+    stats->sectors_erased = _sysparam_info.sectors_erased;
+    stats->compactions = _sysparam_info.compactions;
+
+ done:
+    xSemaphoreGive(_sysparam_info.sem);
+    return status;
+}
+
 sysparam_status_t sysparam_compact() {
     xSemaphoreTake(_sysparam_info.sem, portMAX_DELAY);
     sysparam_status_t status;
@@ -673,12 +1571,8 @@ sysparam_status_t sysparam_get_data(const char *key, uint8_t **destptr, size_t *
         goto done;
     }
 
-    _init_context(&ctx);
-    status = _find_key(&ctx, key, key_len);
-    if (status != SYSPARAM_OK) goto done;
-
-    // Find the associated value
-    status = _find_value(&ctx, ctx.entry.idflags);
+    // Find the key and its associated value
+    status = _find_key_value(&ctx, key, key_len);
     if (status != SYSPARAM_OK) goto done;
 
     buffer = malloc(ctx.entry.len + 1);
@@ -722,10 +1616,7 @@ sysparam_status_t sysparam_get_data_static(const char *key, uint8_t *dest, size_
         goto done;
     }
 
-    _init_context(&ctx);
-    status = _find_key(&ctx, key, key_len);
-    if (status != SYSPARAM_OK) goto done;
-    status = _find_value(&ctx, ctx.entry.idflags);
+    status = _find_key_value(&ctx, key, key_len);
     if (status != SYSPARAM_OK) goto done;
     status = _read_payload(&ctx, dest, dest_size);
     if (status != SYSPARAM_OK) goto done;
@@ -841,8 +1732,15 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
     size_t free_space;
     size_t needed_space;
     int key_id = -1;
+    uint32_t key_addr = 0;
+    uint32_t value_addr = 0;
     uint32_t old_value_addr = 0;
-    uint16_t binary_flag;
+    uint16_t binary_flag = 0;
+    uint16_t hash;
+    struct index_entry *slot;
+    struct entry_header value_entry;
+    struct txn_op op;
+    bool compact = false;
 
     if (!key_len) return SYSPARAM_ERR_BADVALUE;
     if (key_len > MAX_KEY_LEN) return SYSPARAM_ERR_BADVALUE;
@@ -850,6 +1748,10 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
 
     if (!value) value_len = 0;
 
+    if (_sysparam_info.txn_active && _sysparam_info.txn_owner == xTaskGetCurrentTaskHandle()) {
+        return _txn_add(key, key_len, value, value_len, is_binary);
+    }
+
     debug(1, "updating value for '%s' (%d bytes)", key, value_len);
 
     xSemaphoreTake(_sysparam_info.sem, portMAX_DELAY);
@@ -860,17 +1762,34 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
     }
 
     do {
+        hash = _index_hash(key, key_len);
+        status = _index_lookup(key, key_len, hash, &slot);
+        if (status < 0) break;
         _init_context(&ctx);
-        status = _find_key(&ctx, key, key_len);
-        if (status == SYSPARAM_OK) {
-            // Key already exists, see if there's a current value.
-            key_id = ctx.entry.idflags & ENTRY_MASK_ID;
-            status = _find_value(&ctx, key_id);
-            if (status == SYSPARAM_OK) {
+        if (slot) {
+            // Key is in the index, so we know where it and its current value
+            // (if any) are without scanning.  Note that this leaves `ctx`
+            // without any of the statistics gathered by a scan.
+            key_id = slot->value.idflags & ENTRY_MASK_ID;
+            key_addr = slot->key_addr;
+            if (slot->value_addr) {
+                ctx.addr = slot->value_addr;
+                ctx.entry = slot->value;
                 old_value_addr = ctx.addr;
             }
+        } else {
+            status = _find_key(&ctx, key, key_len);
+            if (status == SYSPARAM_OK) {
+                // Key already exists, see if there's a current value.
+                key_id = ctx.entry.idflags & ENTRY_MASK_ID;
+                key_addr = ctx.addr;
+                status = _find_value(&ctx, key_id);
+                if (status == SYSPARAM_OK) {
+                    old_value_addr = ctx.addr;
+                }
+            }
+            if (status < 0) break;
         }
-        if (status < 0) break;
 
         binary_flag = is_binary ? ENTRY_FLAG_BINARY : 0;
 
@@ -909,33 +1828,35 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
                 // Can we compact things?
                 // First, scan all remaining entries up to the end so we can
                 // get a reasonably accurate "compactable" reading.
+                if (slot) {
+                    // Nothing has been scanned yet, so start from the
+                    // beginning (keeping the old value's size, which was
+                    // already accounted for above).
+                    size_t old_value_size = ctx.compactable;
+                    _init_context(&ctx);
+                    ctx.compactable = old_value_size;
+                }
                 _find_entry(&ctx, ENTRY_ID_END, false);
                 if (needed_space <= free_space + ctx.compactable) {
                     // We should be able to get enough space by compacting.
-                    status = _compact_params(&ctx, &key_id);
-                    if (status < 0) break;
-                    old_value_addr = 0;
+                    compact = true;
                 } else if (ctx.unused_keys > 0) {
                     // Compacting will gain more space than expected, because
                     // there are some keys that can be omitted too, but we
                     // don't know exactly how much that will gain, so all we
                     // can do is give it a try and see if it gives us enough.
-                    status = _compact_params(&ctx, &key_id);
-                    if (status < 0) break;
-                    old_value_addr = 0;
+                    compact = true;
+                } else {
+                    // Nothing we can do here.. We're full.
+                    // (at least full enough that compacting won't help us
+                    // store this value)
+                    debug(1, "region full (need %d of %d remaining)", needed_space, free_space);
+                    status = SYSPARAM_ERR_FULL;
+                    break;
                 }
-                free_space = _sysparam_info.cur_base + _sysparam_info.region_size - _sysparam_info.end_addr;
-            }
-            if (needed_space > free_space) {
-                // Nothing we can do here.. We're full.
-                // (at least full enough that compacting won't help us store
-                // this value)
-                debug(1, "region full (need %d of %d remaining)", needed_space, free_space);
-                status = SYSPARAM_ERR_FULL;
-                break;
             }
 
-            if (key_id < 0) {
+            if (key_id < 0 && !compact) {
                 // We need to write a key entry for a new key.
                 // If we didn't find the key, then we already know _find_entry
                 // has gone through the entire contents, and thus
@@ -943,9 +1864,7 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
                 // region.
                 if (ctx.max_key_id >= MAX_KEY_ID) {
                     if (ctx.unused_keys > 0) {
-                        status = _compact_params(&ctx, &key_id);
-                        if (status < 0) break;
-                        old_value_addr = 0;
+                        compact = true;
                     } else {
                         debug(1, "out of ids!");
                         status = SYSPARAM_ERR_FULL;
@@ -958,8 +1877,22 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
                 // We didn't need to compact above, but due to previously
                 // detected inconsistencies, we should compact anyway before
                 // writing anything new, so do that.
-                status = _compact_params(&ctx, &key_id);
-                if (status < 0) break;
+                compact = true;
+            }
+
+            if (compact) {
+                // Write the new value as part of the compacted result rather
+                // than afterwards, so that if we lose power part way through
+                // we are left with either the old value or the new one (never
+                // neither).  This also takes care of the index.
+                memset(&op, 0, sizeof(op));
+                op.key = key;
+                op.key_len = key_len;
+                op.value = value;
+                op.value_len = value_len;
+                op.binary_flag = binary_flag;
+                status = _compact_params(&ctx, &op);
+                break;
             }
 
             init_write_context(&write_ctx);
@@ -969,12 +1902,14 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
                 key_id = ctx.max_key_id + 1;
                 status = _write_entry(write_ctx.addr, key_id, (uint8_t *)key, key_len);
                 if (status < 0) break;
+                key_addr = write_ctx.addr;
                 write_ctx.addr += ENTRY_SIZE(key_len);
             }
 
             // Write new value
             status = _write_entry(write_ctx.addr, key_id | ENTRY_FLAG_VALUE | binary_flag, value, value_len);
             if (status < 0) break;
+            value_addr = write_ctx.addr;
             write_ctx.addr += ENTRY_SIZE(value_len);
             _sysparam_info.end_addr = write_ctx.addr;
         }
@@ -985,6 +1920,12 @@ sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_
             if (status < 0) break;
         }
 
+        if (key_id >= 0) {
+            value_entry.idflags = key_id | ENTRY_FLAG_ALIVE | ENTRY_FLAG_VALUE | binary_flag;
+            value_entry.len = value_len;
+            _index_update(hash, key_len, key_id, key_addr, value_addr, &value_entry);
+        }
+
         debug(1, "New addr is 0x%08x (%d bytes remaining)", _sysparam_info.end_addr, _sysparam_info.cur_base + _sysparam_info.region_size - _sysparam_info.end_addr);
     } while (false);
 
@@ -1020,6 +1961,48 @@ sysparam_status_t sysparam_set_bool(const char *key, bool value) {
     return sysparam_set_data(key, buf, 1, false);
 }
 
+sysparam_status_t sysparam_begin(void) {
+    if (!_sysparam_info.cur_base) return SYSPARAM_ERR_NOINIT;
+    if (_sysparam_info.txn_active && _sysparam_info.txn_owner == xTaskGetCurrentTaskHandle()) {
+        // Transactions can't be nested
+        return SYSPARAM_ERR_BADVALUE;
+    }
+
+    xSemaphoreTake(_sysparam_info.txn_sem, portMAX_DELAY);
+    _sysparam_info.txn = NULL;
+    _sysparam_info.txn_owner = xTaskGetCurrentTaskHandle();
+    _sysparam_info.txn_active = true;
+
+    return SYSPARAM_OK;
+}
+
+sysparam_status_t sysparam_commit(void) {
+    sysparam_status_t status;
+
+    if (!_sysparam_info.txn_active || _sysparam_info.txn_owner != xTaskGetCurrentTaskHandle()) {
+        return SYSPARAM_ERR_BADVALUE;
+    }
+
+    xSemaphoreTake(_sysparam_info.sem, portMAX_DELAY);
+    if (_sysparam_info.cur_base) {
+        status = _txn_apply(_sysparam_info.txn);
+    } else {
+        status = SYSPARAM_ERR_NOINIT;
+    }
+    xSemaphoreGive(_sysparam_info.sem);
+
+    _txn_end();
+    return status;
+}
+
+sysparam_status_t sysparam_abort(void) {
+    if (!_sysparam_info.txn_active || _sysparam_info.txn_owner != xTaskGetCurrentTaskHandle()) {
+        return SYSPARAM_ERR_BADVALUE;
+    }
+    _txn_end();
+    return SYSPARAM_OK;
+}
+
 sysparam_status_t sysparam_iter_start(sysparam_iter_t *iter) {
     if (!_sysparam_info.cur_base) return SYSPARAM_ERR_NOINIT;
 
@@ -129,10 +129,11 @@ static int mqtt_ssl_write(mqtt_network_t* n, unsigned char* buffer, int len,
 static void mqtt_task(void *pvParameters) {
     int ret = 0;
     struct mqtt_network network;
-    mqtt_client_t client = mqtt_client_default;
+    // The client is about 410 bytes, see MQTTClient.h
+    static mqtt_client_t client = mqtt_client_default;
+    static uint8_t mqtt_buf[100];
+    static uint8_t mqtt_readbuf[100];
     char mqtt_client_id[20];
-    uint8_t mqtt_buf[100];
-    uint8_t mqtt_readbuf[100];
     mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
 
     memset(mqtt_client_id, 0, sizeof(mqtt_client_id));
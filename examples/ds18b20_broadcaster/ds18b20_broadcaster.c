@@ -23,14 +23,15 @@
 void broadcast_temperature(void *pvParameters)
 {
 
-    uint8_t amount = 0;
     uint8_t sensors = 1;
-    ds18b20_addr_t addrs[sensors];
-    float results[sensors];
+    ds18b20_bus_t bus;
+    float results[DS18B20_BUS_MAX_DEVICES];
     
     // Use GPIO 13 as one wire pin. 
     uint8_t GPIO_FOR_ONE_WIRE = 13;
 
+    ds18b20_bus_init(&bus, GPIO_FOR_ONE_WIRE);
+
     char msg[100];
 
     // Broadcaster part
@@ -62,18 +63,18 @@ void broadcast_temperature(void *pvParameters)
         }
 
         for(;;) {
-            // Search all DS18B20, return its amount and feed 't' structure with result data.
-            amount = ds18b20_scan_devices(GPIO_FOR_ONE_WIRE, addrs, sensors);
+            // Convert on all DS18B20 at once and read them. The bus is only
+            // searched again when a sensor fails to answer.
+            ds18b20_bus_measure_and_read(&bus, results);
 
-            if (amount < sensors){
-                printf("Something is wrong, I expect to see %d sensors \nbut just %d was detected!\n", sensors, amount);
+            if (bus.count < sensors){
+                printf("Something is wrong, I expect to see %d sensors \nbut just %d was detected!\n", sensors, bus.count);
             }
 
-            ds18b20_measure_and_read_multi(GPIO_FOR_ONE_WIRE, addrs, sensors, results);
-            for (int i = 0; i < sensors; ++i)
+            for (int i = 0; i < bus.count; ++i)
             {
                 // ("\xC2\xB0" is the degree character (U+00B0) in UTF-8)
-                sprintf(msg, "Sensor %08x%08x reports: %f \xC2\xB0""C\n", (uint32_t)(addrs[i] >> 32), (uint32_t)addrs[i], results[i]);
+                sprintf(msg, "Sensor %08x%08x reports: %f \xC2\xB0""C\n", (uint32_t)(bus.addr_list[i] >> 32), (uint32_t)bus.addr_list[i], results[i]);
                 printf("%s", msg);
 
                 struct netbuf* buf = netbuf_new();
@@ -0,0 +1,102 @@
+/*
+ * Example of polling several I2C sensors with one batch per pass.
+ *
+ * Reads the raw result registers of a BMP280, an INA3221 and an ADS1115
+ * on bus 0 and of a BH1750 on bus 1, then prints the bus counters.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include <espressif/esp_common.h>
+#include <esp/uart.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <stdio.h>
+
+#include <i2c/i2c.h>
+
+#define BUS_SENSORS 0
+#define SCL_PIN_0   5
+#define SDA_PIN_0   4
+
+#define BUS_LIGHT   1
+#define SCL_PIN_1   14
+#define SDA_PIN_1   12
+
+#define BMP280_ADDR   0x76
+#define INA3221_ADDR  0x40
+#define ADS111X_ADDR  0x48
+#define BH1750_ADDR   0x23
+
+#define BH1750_CONTINUOUS_HIGH_RES 0x10
+
+static void poll_task(void *pvParameters)
+{
+    uint8_t bmp280[6];   // press_msb .. temp_xlsb
+    uint8_t ina3221[12]; // shunt and bus voltage of 3 channels
+    uint8_t ads111x[2];
+    uint8_t bh1750[2];
+    uint8_t bh1750_mode = BH1750_CONTINUOUS_HIGH_RES;
+    i2c_stats_t stats;
+
+    i2c_op_t sensors[] = {
+        I2C_READ_REG(BMP280_ADDR, 0xf7, bmp280, sizeof(bmp280)),
+        I2C_READ_REG(INA3221_ADDR, 0x01, ina3221, sizeof(ina3221)),
+        I2C_READ_REG(ADS111X_ADDR, 0x00, ads111x, sizeof(ads111x)),
+    };
+    i2c_op_t light = {
+        .addr = BH1750_ADDR, .read = true, .buf = bh1750, .len = sizeof(bh1750)
+    };
+
+    i2c_bus_slave_write(BUS_LIGHT, BH1750_ADDR, NULL, &bh1750_mode, 1);
+
+    TickType_t last = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last, 1000 / portTICK_PERIOD_MS);
+
+        // Both buses every time, an error on one doesn't affect the other
+        int sensors_err = i2c_bus_transfer(BUS_SENSORS, sensors, sizeof(sensors) / sizeof(sensors[0]));
+        int light_err = i2c_bus_transfer(BUS_LIGHT, &light, 1);
+
+        if (sensors_err) {
+            for (int i = 0; i < sizeof(sensors) / sizeof(sensors[0]); i++) {
+                // Results are only set if the list ran, not if the bus was busy
+                if (sensors_err != -EIO)
+                    sensors[i].result = sensors_err;
+                if (sensors[i].result)
+                    printf("Sensor 0x%02x: error %d\n", sensors[i].addr, sensors[i].result);
+            }
+        }
+        if (light_err)
+            printf("Sensor 0x%02x: error %d\n", light.addr, light_err);
+
+        if (!sensors[0].result)
+            printf("BMP280 raw press %d temp %d\n",
+                    (bmp280[0] << 12) | (bmp280[1] << 4) | (bmp280[2] >> 4),
+                    (bmp280[3] << 12) | (bmp280[4] << 4) | (bmp280[5] >> 4));
+        if (!sensors[1].result)
+            printf("INA3221 ch1 shunt 0x%04x bus 0x%04x\n",
+                    (ina3221[0] << 8) | ina3221[1], (ina3221[2] << 8) | ina3221[3]);
+        if (!sensors[2].result)
+            printf("ADS111x conversion %d\n", (int16_t)((ads111x[0] << 8) | ads111x[1]));
+        if (!light_err)
+            printf("BH1750 raw %d\n", (bh1750[0] << 8) | bh1750[1]);
+
+        i2c_bus_get_stats(BUS_SENSORS, &stats);
+        printf("Bus %d: %d Hz, %u transactions, %u errors (%u nack, %u timeout), "
+                "%u bytes, %u us busy, longest %u us\n", BUS_SENSORS,
+                stats.scl_freq, stats.transactions, stats.errors, stats.nacks,
+                stats.timeouts, stats.bytes, stats.busy_us, stats.max_us);
+    }
+}
+
+void user_init(void)
+{
+    uart_set_baud(0, 115200);
+    printf("SDK version:%s\n", sdk_system_get_sdk_version());
+
+    i2c_bus_init(BUS_SENSORS, SCL_PIN_0, SDA_PIN_0, 400000);
+    i2c_bus_init(BUS_LIGHT, SCL_PIN_1, SDA_PIN_1, 100000);
+
+    xTaskCreate(poll_task, "poll_task", 384, NULL, 2, NULL);
+}
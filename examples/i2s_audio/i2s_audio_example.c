@@ -6,12 +6,13 @@
  *
  * The example reads a file with name "sample.wav" from the file system and
  * feeds audio samples into DMA subsystem which outputs it into I2S bus.
- * Currently only 44100 Hz 16 bit 2 channel audio is supported.
+ * Samples are written with the i2s_stream layer, which takes care of the
+ * DMA ring and underruns. 16 bit mono or stereo audio is supported.
  *
  * In order to test this example you need to place a file with name "sample.wav"
  * into directory "files". This file will be uploaded into spiffs on the device.
  * The size of the sample file must be less than 1MB to fit into spiffs image.
- * The format of the sample file must be 44100Hz, 16bit, 2 channels.
+ * The format of the sample file must be 16bit, 1 or 2 channels.
  * Also you need a DAC connected to ESP8266 to convert I2S stream to analog
  * output. Three wire must be connected: DATA, WS, CLOCK.
  *
@@ -19,7 +20,6 @@
  */
 #include "esp/uart.h"
 #include "FreeRTOS.h"
-#include "queue.h"
 #include "task.h"
 #include "esp8266.h"
 
@@ -30,7 +30,7 @@
 #include <stdint.h>
 
 #include "esp_spiffs.h"
-#include "i2s_dma/i2s_dma.h"
+#include "i2s_stream/i2s_stream.h"
 
 // Very simple WAV header, ignores most fields
 typedef struct __attribute__((packed)) {
@@ -44,88 +44,20 @@ typedef struct __attribute__((packed)) {
     uint8_t data[];
 } dumb_wav_header_t;
 
-// When samples are not sent fast enough underrun condition occurs
-volatile uint32_t underrun_counter = 0;
+#define CHUNK_FRAMES    256
 
-#define DMA_BUFFER_SIZE         2048
-#define DMA_QUEUE_SIZE          8
+static int16_t chunk[CHUNK_FRAMES * 2];
 
-// Circular list of descriptors
-static dma_descriptor_t dma_block_list[DMA_QUEUE_SIZE];
-
-// Array of buffers for circular list of descriptors
-static uint8_t dma_buffer[DMA_QUEUE_SIZE][DMA_BUFFER_SIZE];
-
-// Queue of empty DMA blocks
-static QueueHandle_t dma_queue;
-
-/**
- * Create a circular list of DMA descriptors
- */
-static inline void init_descriptors_list()
-{
-    memset(dma_buffer, 0, DMA_QUEUE_SIZE * DMA_BUFFER_SIZE);
-
-    for (int i = 0; i < DMA_QUEUE_SIZE; i++) {
-        dma_block_list[i].owner = 1;
-        dma_block_list[i].eof = 1;
-        dma_block_list[i].sub_sof = 0;
-        dma_block_list[i].unused = 0;
-        dma_block_list[i].buf_ptr = dma_buffer[i];
-        dma_block_list[i].datalen = DMA_BUFFER_SIZE;
-        dma_block_list[i].blocksize = DMA_BUFFER_SIZE;
-        if (i == (DMA_QUEUE_SIZE - 1)) {
-            dma_block_list[i].next_link_ptr = &dma_block_list[0];
-        } else {
-            dma_block_list[i].next_link_ptr = &dma_block_list[i + 1];
-        }
-    }
-
-    // The queue depth is one smaller than the amount of buffers we have,
-    // because there's always a buffer that is being used by the DMA subsystem
-    // *right now* and we don't want to be able to write to that simultaneously
-    dma_queue = xQueueCreate(DMA_QUEUE_SIZE - 1, sizeof(uint8_t*));
-}
-
-// DMA interrupt handler. It is called each time a DMA block is finished processing.
-static void dma_isr_handler(void)
-{
-    portBASE_TYPE task_awoken = pdFALSE;
-
-    if (i2s_dma_is_eof_interrupt()) {
-        dma_descriptor_t *descr = i2s_dma_get_eof_descriptor();
-
-        if (xQueueIsQueueFullFromISR(dma_queue)) {
-            // List of empty blocks is full. Sender don't send data fast enough.
-            int dummy;
-            underrun_counter++;
-            // Discard top of the queue
-            xQueueReceiveFromISR(dma_queue, &dummy, &task_awoken);
-        }
-        // Push the processed buffer to the queue so sender can refill it.
-        xQueueSendFromISR(dma_queue, (void*)(&descr->buf_ptr), &task_awoken);
-    }
-    i2s_dma_clear_interrupt();
-
-    portEND_SWITCHING_ISR(task_awoken);
-}
-
-static bool play_data(int fd)
+static bool play_data(int fd, int channels)
 {
-    uint8_t *curr_dma_buf;
-
-    // Get a free block from the DMA queue. This call will suspend the task
-    // until a free block is available in the queue.
-    if (xQueueReceive(dma_queue, &curr_dma_buf, portMAX_DELAY) == pdFALSE) {
-        // Or timeout occurs
-        printf("Cound't get free blocks to push data\n");
-    }
-
-    int read_bytes = read(fd, curr_dma_buf, DMA_BUFFER_SIZE);
+    int read_bytes = read(fd, chunk, sizeof(chunk));
     if (read_bytes <= 0) {
         return false;
     }
 
+    // Blocks until there is room in the DMA ring
+    i2s_stream_write(chunk, read_bytes / (2 * channels), portMAX_DELAY);
+
     return true;
 }
 
@@ -155,33 +87,34 @@ void play_task(void *pvParameters)
         return;
     }
 
-    if (wav_header.num_channels != 2) {
-        printf("Only 2 channels is supported\n");
+    if (wav_header.num_channels != 1 && wav_header.num_channels != 2) {
+        printf("Only 1 or 2 channels are supported\n");
         return;
     }
 
-    i2s_clock_div_t clock_div = i2s_get_clock_div(
-            wav_header.sample_rate * 2 * 16);
+    i2s_stream_config_t config;
+    i2s_stream_get_default_config(&config);
+    config.sample_rate = wav_header.sample_rate;
+    config.channels = wav_header.num_channels;
+    config.block_size = 2048;
+    config.block_count = 8;
+    config.start_blocks = 4;
 
-    printf("i2s clock dividers, bclk=%d, clkm=%d\n",
-            clock_div.bclk_div, clock_div.clkm_div);
-
-    i2s_pins_t i2s_pins = {.data = true, .clock = true, .ws = true};
-
-    i2s_dma_init(dma_isr_handler, clock_div, i2s_pins);
+    if (!i2s_stream_init(&config)) {
+        printf("Error initializing i2s stream\n");
+        return;
+    }
 
     while (1) {
-        init_descriptors_list();
-
-        i2s_dma_start(dma_block_list);
         lseek(fd, sizeof(dumb_wav_header_t), SEEK_SET);
 
-        while (play_data(fd)) {};
-        i2s_dma_stop();
-
-        vQueueDelete(dma_queue);
+        while (play_data(fd, wav_header.num_channels)) {};
+        i2s_stream_flush(portMAX_DELAY);
 
-        printf("underrun counter: %d\n", underrun_counter);
+        i2s_stream_stats_t stats;
+        i2s_stream_get_stats(&stats);
+        printf("blocks played: %u, underrun counter: %u\n",
+                stats.blocks, stats.underruns);
 
         vTaskDelay(1000 / portTICK_PERIOD_MS);
     }
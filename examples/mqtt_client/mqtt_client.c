@@ -88,10 +88,12 @@ static void  mqtt_task(void *pvParameters)
 {
     int ret         = 0;
     struct mqtt_network network;
-    mqtt_client_t client   = mqtt_client_default;
+    // The client is about 410 bytes, see MQTTClient.h, so keep it and its
+    // buffers off the task's stack
+    static mqtt_client_t client   = mqtt_client_default;
+    static uint8_t mqtt_buf[100];
+    static uint8_t mqtt_readbuf[100];
     char mqtt_client_id[20];
-    uint8_t mqtt_buf[100];
-    uint8_t mqtt_readbuf[100];
     mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
 
     mqtt_network_new( &network );
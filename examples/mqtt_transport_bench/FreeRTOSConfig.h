@@ -0,0 +1,11 @@
+/**
+
+ Configuration overrides for FreeRTOS.
+
+ The idle hook counts idle time for the CPU load measurement.
+
+**/
+
+#define configUSE_IDLE_HOOK 1
+
+#include_next "FreeRTOSConfig.h"
@@ -0,0 +1,230 @@
+/*
+ * Compares the socket and the netconn transports of the paho MQTT client.
+ *
+ * For each transport a fresh task connects to the broker, subscribes to a
+ * topic of its own and publishes MESSAGES QoS1 messages to it one at a time,
+ * waiting to receive each one back. Reported per transport:
+ *
+ *  - heap held by the open connection and the subscription
+ *  - stack used by the client task
+ *  - round trip time per message
+ *  - CPU time per message, from the idle time lost while the messages go
+ *    round, so it includes the work done in the tcpip thread
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include <espressif/esp_common.h>
+#include <esp/uart.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <stdio.h>
+#include <string.h>
+#include <ssid_config.h>
+
+#include <paho_mqtt_c/MQTTESP8266.h>
+#include <paho_mqtt_c/MQTTNetconn.h>
+#include <paho_mqtt_c/MQTTClient.h>
+
+#define MQTT_HOST "test.mosquitto.org"
+#define MQTT_PORT 1883
+
+#define MESSAGES    100
+#define PAYLOAD_LEN 64
+#define BENCH_STACK 1024    // words
+
+typedef struct {
+    const char *name;
+    bool netconn;
+    bool ok;
+    uint32_t heap;          // bytes
+    uint32_t stack;         // bytes
+    uint32_t rtt_us;
+    uint32_t cpu_us;
+} bench_t;
+
+static bench_t benches[] = {
+    { .name = "socket" },
+    { .name = "netconn", .netconn = true },
+};
+
+static volatile uint32_t idle_count;
+static uint32_t idle_per_sec;
+static SemaphoreHandle_t bench_done;
+
+/* Kept out of the bench task so its stack use is the client and transport */
+static struct mqtt_network socket_network;
+static mqtt_netconn_t netconn_network;
+static mqtt_client_t client = mqtt_client_default;
+static uint8_t mqtt_buf[128];
+static uint8_t mqtt_readbuf[128];
+static char topic[32];
+static volatile int received;
+
+void vApplicationIdleHook(void)
+{
+    idle_count++;
+}
+
+static void message_received(mqtt_message_data_t *md)
+{
+    received++;
+}
+
+static bool bench_connect(bench_t *b)
+{
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+    mqtt_network_t *network;
+    int ret;
+
+    if (b->netconn) {
+        mqtt_netconn_new(&netconn_network);
+        ret = mqtt_netconn_connect(&netconn_network, MQTT_HOST, MQTT_PORT);
+        network = &netconn_network.network;
+    } else {
+        mqtt_network_new(&socket_network);
+        ret = mqtt_network_connect(&socket_network, MQTT_HOST, MQTT_PORT);
+        network = &socket_network;
+    }
+    if (ret) {
+        printf("%s: connect error %d\n", b->name, ret);
+        return false;
+    }
+
+    mqtt_client_new(&client, network, 5000, mqtt_buf, sizeof(mqtt_buf),
+            mqtt_readbuf, sizeof(mqtt_readbuf));
+    data.MQTTVersion = 3;
+    data.clientID.cstring = topic + strlen("bench/");
+    data.keepAliveInterval = 60;
+    if (mqtt_connect(&client, &data) != MQTT_SUCCESS ||
+            mqtt_subscribe(&client, topic, MQTT_QOS0, message_received) != MQTT_SUCCESS) {
+        printf("%s: MQTT connect failed\n", b->name);
+        return false;
+    }
+    return true;
+}
+
+static void bench_disconnect(bench_t *b)
+{
+    mqtt_disconnect(&client);
+    if (b->netconn) {
+        mqtt_netconn_disconnect(&netconn_network);
+    } else {
+        mqtt_network_disconnect(&socket_network);
+    }
+}
+
+static bool run(bench_t *b)
+{
+    char payload[PAYLOAD_LEN];
+    mqtt_message_t message = {
+        .qos = MQTT_QOS1,
+        .payload = payload,
+        .payloadlen = sizeof(payload),
+    };
+    uint32_t start, elapsed, idle, busy_us;
+
+    memset(payload, 'x', sizeof(payload));
+    received = 0;
+    idle = idle_count;
+    start = sdk_system_get_time();
+    for (int i = 0; i < MESSAGES; i++) {
+        uint32_t sent = sdk_system_get_time();
+
+        if (mqtt_publish(&client, topic, &message) != MQTT_SUCCESS) {
+            printf("%s: publish failed\n", b->name);
+            return false;
+        }
+        while (received <= i) {
+            if (mqtt_yield(&client, 100) == MQTT_DISCONNECTED ||
+                    sdk_system_get_time() - sent > 10000000) {
+                printf("%s: message %d not received\n", b->name, i);
+                return false;
+            }
+        }
+    }
+    elapsed = sdk_system_get_time() - start;
+    idle = idle_count - idle;
+
+    // Idle time is what the idle hook would have counted in that time
+    busy_us = elapsed - (uint64_t)idle * 1000000 / idle_per_sec;
+    if ((int32_t)busy_us < 0) {
+        busy_us = 0;
+    }
+    b->rtt_us = elapsed / MESSAGES;
+    b->cpu_us = busy_us / MESSAGES;
+    return true;
+}
+
+static void bench_task(void *pvParameters)
+{
+    bench_t *b = pvParameters;
+    uint32_t heap = xPortGetFreeHeapSize();
+
+    if (bench_connect(b)) {
+        b->heap = heap - xPortGetFreeHeapSize();
+        b->ok = run(b);
+        b->stack = (BENCH_STACK - uxTaskGetStackHighWaterMark(NULL)) * sizeof(StackType_t);
+    }
+    bench_disconnect(b);
+
+    xSemaphoreGive(bench_done);
+    vTaskDelete(NULL);
+}
+
+static void main_task(void *pvParameters)
+{
+    uint8_t mac[6];
+    uint32_t idle;
+
+    while (sdk_wifi_station_get_connect_status() != STATION_GOT_IP) {
+        vTaskDelay(500 / portTICK_PERIOD_MS);
+    }
+    sdk_wifi_get_macaddr(STATION_IF, mac);
+    snprintf(topic, sizeof(topic), "bench/esp-%02x%02x%02x", mac[3], mac[4], mac[5]);
+
+    // Let things settle, then see how often the idle hook runs with nothing to do
+    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    idle = idle_count;
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    idle_per_sec = idle_count - idle;
+
+    for (int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        xTaskCreate(bench_task, "bench", BENCH_STACK, &benches[i], 4, NULL);
+        xSemaphoreTake(bench_done, portMAX_DELAY);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    }
+
+    printf("\n%d QoS1 messages of %d bytes, published and received back\n",
+            MESSAGES, PAYLOAD_LEN);
+    printf("transport   heap  stack  rtt/msg  cpu/msg\n");
+    for (int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        bench_t *b = &benches[i];
+        if (!b->ok) {
+            printf("%-9s   failed\n", b->name);
+            continue;
+        }
+        printf("%-9s %6u %6u %6uus %6uus\n", b->name, b->heap, b->stack,
+                b->rtt_us, b->cpu_us);
+    }
+
+    vTaskDelete(NULL);
+}
+
+void user_init(void)
+{
+    struct sdk_station_config config = {
+        .ssid = WIFI_SSID,
+        .password = WIFI_PASS,
+    };
+
+    uart_set_baud(0, 115200);
+    printf("SDK version:%s\n", sdk_system_get_sdk_version());
+
+    sdk_wifi_set_opmode(STATION_MODE);
+    sdk_wifi_station_set_config(&config);
+
+    bench_done = xSemaphoreCreateBinary();
+    xTaskCreate(main_task, "main", 512, NULL, 3, NULL);
+}
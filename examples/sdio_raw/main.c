@@ -66,6 +66,53 @@ inline static void test_read(sdio_card_t *card)
     printf("\nDone. Time: %u ms, speed: %.4f sectors/s, sector in %.4f s, %u bytes/s \n", time, speed, stime, bs);
 }
 
+#define BENCH_SECTORS 8
+#define BENCH_ROUNDS  32
+
+static uint8_t bench_buf[SDIO_BLOCK_SIZE * BENCH_SECTORS];
+
+/*
+ * Read and write BENCH_SECTORS sectors in the middle of the card, one at a
+ * time and all at once. The writes put back the data that was read first,
+ * so the card contents are preserved.
+ */
+static bool bench(sdio_card_t *card, bool write, uint32_t count)
+{
+    uint32_t base = card->sectors / 2;
+    uint32_t start = sdk_system_get_time();
+
+    for (uint32_t r = 0; r < BENCH_ROUNDS; r++)
+    {
+        for (uint32_t i = 0; i < BENCH_SECTORS; i += count)
+        {
+            sdio_error_t err = write
+                ? sdio_write_sectors(card, base + i, bench_buf + i * SDIO_BLOCK_SIZE, count)
+                : sdio_read_sectors(card, base + i, bench_buf + i * SDIO_BLOCK_SIZE, count);
+            if (err != SDIO_ERR_NONE)
+            {
+                printf("Error: %d (%s)\n", card->error, errors[card->error]);
+                return false;
+            }
+        }
+    }
+    uint32_t time = sdk_system_get_time() - start;
+    uint32_t bytes = BENCH_ROUNDS * BENCH_SECTORS * SDIO_BLOCK_SIZE;
+
+    printf("%5s %u sector%s: %u KB/s\n", write ? "Write" : "Read", count,
+        count > 1 ? "s" : " ", (uint32_t)((uint64_t)bytes * 1000000 / time / 1024));
+    return true;
+}
+
+inline static void test_throughput(sdio_card_t *card)
+{
+    printf("Throughput test, %u sectors at a time:\n", BENCH_SECTORS);
+    // The first read also fills bench_buf with the data written back later
+    bench(card, false, BENCH_SECTORS)
+        && bench(card, false, 1)
+        && bench(card, true, 1)
+        && bench(card, true, BENCH_SECTORS);
+}
+
 inline static void dump_card(sdio_card_t *card)
 {
     char product_name[6];
@@ -90,6 +137,7 @@ inline static void dump_card(sdio_card_t *card)
     printf("%20s :", "CSD");
     dump_line(card->csd.data);
     test_read(card);
+    test_throughput(card);
 }
 
 void user_init(void)
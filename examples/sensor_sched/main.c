@@ -0,0 +1,179 @@
+/*
+ * Example of sampling several sensors with the sensor scheduler.
+ *
+ * BMP280, BH1750, INA3221 and ADS1115 share an I2C bus and a DS18B20 sits
+ * on a onewire pin. Each driver is wrapped in start/ready/read callbacks and
+ * the scheduler overlaps their conversions.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include <espressif/esp_common.h>
+#include <esp/uart.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <stdio.h>
+
+#include <i2c/i2c.h>
+#include <bmp280/bmp280.h>
+#include <bh1750/bh1750.h>
+#include <ina3221/ina3221.h>
+#include <ads111x/ads111x.h>
+#include <ds18b20/ds18b20.h>
+#include <sensor_sched/sensor_sched.h>
+
+#define SCL_PIN     5
+#define SDA_PIN     4
+#define ONEWIRE_PIN 14
+
+#define BH1750_ADDR  BH1750_ADDR_LO
+#define ADS111X_ADDR ADS111X_ADDR_GND
+
+static bmp280_t bmp280 = { .i2c_addr = BMP280_I2C_ADDRESS_0 };
+static ina3221_t ina3221 = {
+    .addr = INA3221_ADDR_0,
+    .shunt = { 100, 100, 100 },
+    .mask.mask_register = INA3221_DEFAULT_MASK,
+    .config.config_register = INA3221_DEFAULT_CONFIG,
+};
+
+static bool bmp280_start(void *ctx)
+{
+    return bmp280_force_measurement(ctx);
+}
+
+static bool bmp280_ready(void *ctx)
+{
+    return !bmp280_is_measuring(ctx);
+}
+
+static int bmp280_read(void *ctx, float *values)
+{
+    return bmp280_read_float(ctx, &values[0], &values[1], NULL) ? 2 : -1;
+}
+
+static int bh1750_read_lux(void *ctx, float *values)
+{
+    values[0] = bh1750_read(BH1750_ADDR) / 1.2;
+    return 1;
+}
+
+static bool ina3221_start(void *ctx)
+{
+    return ina3221_trigger(ctx) == 0;
+}
+
+static bool ina3221_ready(void *ctx)
+{
+    ina3221_t *dev = ctx;
+    return ina3221_getStatus(dev) == 0 && dev->mask.cvrf;
+}
+
+static int ina3221_read(void *ctx, float *values)
+{
+    float shunt;
+
+    if (ina3221_getBusVoltage(ctx, CHANNEL_1, &values[0]) ||
+            ina3221_getShuntValue(ctx, CHANNEL_1, &shunt, &values[1]))
+        return -1;
+    return 2;
+}
+
+static bool ads111x_start(void *ctx)
+{
+    ads111x_start_conversion(ADS111X_ADDR);
+    return true;
+}
+
+static bool ads111x_ready(void *ctx)
+{
+    return !ads111x_busy(ADS111X_ADDR);
+}
+
+static int ads111x_read(void *ctx, float *values)
+{
+    values[0] = ads111x_get_value(ADS111X_ADDR) * 4.096 / ADS111X_MAX_VALUE;
+    return 1;
+}
+
+static bool ds18b20_start(void *ctx)
+{
+    return ds18b20_measure(ONEWIRE_PIN, DS18B20_ANY, false);
+}
+
+static int ds18b20_read(void *ctx, float *values)
+{
+    values[0] = ds18b20_read_temperature(ONEWIRE_PIN, DS18B20_ANY);
+    return values[0] == values[0] ? 1 : -1; // NaN on error
+}
+
+static const sensor_sched_config_t sensors[] = {
+    { .name = "bmp280", .period_ms = 1000, .latency_ms = 40,
+      .start = bmp280_start, .ready = bmp280_ready, .read = bmp280_read, .ctx = &bmp280 },
+    { .name = "bh1750", .period_ms = 500, .latency_ms = 0,
+      .read = bh1750_read_lux },
+    { .name = "ina3221", .period_ms = 200, .latency_ms = 30,
+      .start = ina3221_start, .ready = ina3221_ready, .read = ina3221_read, .ctx = &ina3221 },
+    { .name = "ads1115", .period_ms = 100, .latency_ms = 8,
+      .start = ads111x_start, .ready = ads111x_ready, .read = ads111x_read },
+    { .name = "ds18b20", .period_ms = 2000, .latency_ms = 750,
+      .start = ds18b20_start, .read = ds18b20_read },
+};
+
+#define SENSOR_COUNT (sizeof(sensors) / sizeof(sensors[0]))
+
+static void print_task(void *pvParameters)
+{
+    sensor_sample_t sample;
+    sensor_sched_stats_t stats;
+    TickType_t last_stats = xTaskGetTickCount();
+
+    while (1) {
+        if (sensor_sched_receive(&sample, 1000 / portTICK_PERIOD_MS)) {
+            printf("%u %s:", sample.time_us, sensors[sample.sensor].name);
+            if (!sample.count)
+                printf(" error");
+            for (int i = 0; i < sample.count; i++)
+                printf(" %.3f", sample.value[i]);
+            printf("\n");
+        }
+
+        if (xTaskGetTickCount() - last_stats < 10000 / portTICK_PERIOD_MS)
+            continue;
+        last_stats = xTaskGetTickCount();
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            if (!sensor_sched_get_stats(i, &stats))
+                continue;
+            printf("%-8s %u samples %u errors %u dropped, latency %u/%u us, jitter %u/%u us\n",
+                    sensors[i].name, stats.samples, stats.errors, stats.dropped,
+                    stats.latency_us, stats.max_latency_us,
+                    stats.jitter_us, stats.max_jitter_us);
+            sensor_sched_reset_stats(i);
+        }
+    }
+}
+
+void user_init(void)
+{
+    bmp280_params_t params;
+
+    uart_set_baud(0, 115200);
+    printf("SDK version:%s\n", sdk_system_get_sdk_version());
+
+    i2c_init(SCL_PIN, SDA_PIN);
+
+    bmp280_init_default_params(&params);
+    params.mode = BMP280_MODE_FORCED;
+    bmp280_init(&bmp280, &params);
+    bh1750_configure(BH1750_ADDR, BH1750_CONTINUOUS_MODE | BH1750_HIGH_RES_MODE);
+    ina3221_setting(&ina3221, false, true, true);
+    ads111x_set_mode(ADS111X_ADDR, ADS111X_MODE_SINGLE_SHOT);
+    ads111x_set_gain(ADS111X_ADDR, ADS111X_GAIN_4V096);
+
+    sensor_sched_init();
+    // The ids match the index in the sensors array
+    for (int i = 0; i < SENSOR_COUNT; i++)
+        sensor_sched_add(&sensors[i]);
+
+    xTaskCreate(print_task, "print_task", 384, NULL, 2, NULL);
+}
@@ -0,0 +1,156 @@
+/* Two devices sharing HSPI through the asynchronous transfer queue.
+ *
+ * A "display" task streams 4KB frames at 20MHz to a device selected by
+ * GPIO 4, queueing them with a completion callback, while a "sensor" task
+ * polls a slow 1MHz mode 3 device selected by GPIO 5 with blocking
+ * transfers. A low priority task counts loop iterations to show how much
+ * CPU time is left while the bus is busy. For comparison the same frames
+ * are first sent with spi_transfer(), before the sensor task is started.
+ *
+ * Connect MOSI (GPIO 13) to MISO (GPIO 12) to have the received data
+ * checked against what was sent. No devices are needed otherwise.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include "espressif/esp_common.h"
+#include "esp/uart.h"
+#include "esp/gpio.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "spi_async/spi_async.h"
+#include <stdio.h>
+#include <string.h>
+
+#define DISPLAY_CS  4
+#define SENSOR_CS   5
+
+#define FRAME_SIZE  4096
+#define FRAMES      50
+
+static const spi_settings_t display_settings = {
+    .mode = SPI_MODE0,
+    .freq_divider = SPI_FREQ_DIV_20M,
+    .msb = true,
+    .endianness = SPI_LITTLE_ENDIAN,
+};
+
+static const spi_settings_t sensor_settings = {
+    .mode = SPI_MODE3,
+    .freq_divider = SPI_FREQ_DIV_1M,
+    .msb = true,
+    .endianness = SPI_LITTLE_ENDIAN,
+};
+
+static spi_async_device_t display;
+static spi_async_device_t sensor;
+
+static uint8_t frame[FRAME_SIZE];
+static uint8_t frame_in[FRAME_SIZE];
+static SemaphoreHandle_t frame_done;
+
+static volatile uint32_t idle_count;
+static volatile bool loopback = true;
+
+static void frame_sent(spi_async_trans_t *trans)
+{
+    BaseType_t woken = pdFALSE;
+
+    xSemaphoreGiveFromISR(frame_done, &woken);
+    portEND_SWITCHING_ISR(woken);
+}
+
+static void idle_task(void *pvParameters)
+{
+    for (;;) {
+        idle_count++;
+    }
+}
+
+static void sensor_task(void *pvParameters)
+{
+    uint8_t out[4] = { 0x80, 0x00, 0x00, 0x00 };
+    uint8_t in[4];
+
+    for (;;) {
+        spi_async_transfer(&sensor, out, in, sizeof(out), SPI_8BIT);
+        if (memcmp(out, in, sizeof(out))) {
+            loopback = false;
+        }
+        out[1]++;
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+}
+
+static void display_task(void *pvParameters)
+{
+    spi_async_trans_t trans = {
+        .dev = &display,
+        .out = frame,
+        .in = frame_in,
+        .len = FRAME_SIZE,
+        .word_size = SPI_8BIT,
+        .cb = frame_sent,
+    };
+
+    for (int i = 0; i < FRAME_SIZE; i++) {
+        frame[i] = i * 7;
+    }
+
+    // Busy waiting driver first, it needs the bus to itself
+    spi_settings_t s = display_settings;
+    s.minimal_pins = true;
+    spi_set_settings(1, &s);
+    uint32_t start_idle = idle_count;
+    uint32_t start = sdk_system_get_time();
+    for (int i = 0; i < FRAMES; i++) {
+        gpio_write(DISPLAY_CS, false);
+        spi_transfer(1, frame, frame_in, FRAME_SIZE, SPI_8BIT);
+        gpio_write(DISPLAY_CS, true);
+    }
+    printf("%d frames of %d bytes\n", FRAMES, FRAME_SIZE);
+    printf("spi_transfer: %u us, idle loops %u\n",
+           sdk_system_get_time() - start, idle_count - start_idle);
+
+    xTaskCreate(sensor_task, "sensor", 256, NULL, 3, NULL);
+
+    for (;;) {
+        start_idle = idle_count;
+        start = sdk_system_get_time();
+        for (int i = 0; i < FRAMES; i++) {
+            frame[0] = i;
+            spi_async_queue(&trans, portMAX_DELAY);
+            xSemaphoreTake(frame_done, portMAX_DELAY);
+            if (memcmp(frame, frame_in, FRAME_SIZE)) {
+                loopback = false;
+            }
+        }
+        uint32_t async_us = sdk_system_get_time() - start;
+        uint32_t async_idle = idle_count - start_idle;
+
+        printf("queued: %u us, idle loops %u, loopback %s\n",
+               async_us, async_idle,
+               loopback ? "ok" : "mismatch (MOSI not connected to MISO?)");
+        loopback = true;
+
+        vTaskDelay(2000 / portTICK_PERIOD_MS);
+    }
+}
+
+void user_init(void)
+{
+    uart_set_baud(0, 115200);
+    printf("SDK version:%s\n", sdk_system_get_sdk_version());
+
+    frame_done = xSemaphoreCreateBinary();
+    if (!spi_async_init()) {
+        printf("spi_async_init failed\n");
+        return;
+    }
+    spi_async_device_init(&display, DISPLAY_CS, &display_settings);
+    spi_async_device_init(&sensor, SENSOR_CS, &sensor_settings);
+
+    xTaskCreate(idle_task, "idle_count", 256, NULL, 1, NULL);
+    xTaskCreate(display_task, "display", 512, NULL, 2, NULL);
+}
@@ -0,0 +1,94 @@
+/* Measure SPI flash read throughput of spiflash_read.
+ *
+ * Reads are done for small and large block sizes, with word aligned and
+ * unaligned flash addresses and RAM buffers. The SDK's spi_flash_read, which
+ * only supports aligned reads, is measured alongside as a reference.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include "espressif/esp_common.h"
+#include "esp/uart.h"
+#include "esp/spi_regs.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "spiflash.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Read from the beginning of the firmware image, it is always present */
+#define BENCH_ADDR      0x2000
+#define BENCH_BYTES     (64 * 1024)
+#define BUF_SIZE        4096
+
+static const uint32_t block_sizes[] = { 16, 60, 256, 1024, 4096 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *flash_mode(void)
+{
+    uint32_t ctrl0 = SPI(0).CTRL0;
+
+    if (ctrl0 & SPI_CTRL0_QIO_MODE) return "QIO";
+    if (ctrl0 & SPI_CTRL0_QOUT_MODE) return "QOUT";
+    if (ctrl0 & SPI_CTRL0_DIO_MODE) return "DIO";
+    if (ctrl0 & SPI_CTRL0_DOUT_MODE) return "DOUT";
+    if (ctrl0 & SPI_CTRL0_FASTRD_MODE) return "FASTRD";
+    return "SLOW";
+}
+
+/* Returns throughput in kB/s or 0 if a read failed */
+static uint32_t bench(uint32_t block, uint32_t addr_offset, uint8_t *buf,
+        bool sdk)
+{
+    uint32_t count = BENCH_BYTES / block;
+    uint32_t start = sdk_system_get_time();
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t addr = BENCH_ADDR + addr_offset + i * block;
+        if (sdk) {
+            if (sdk_spi_flash_read(addr, (uint32_t*)buf, block) != SPI_FLASH_RESULT_OK) {
+                return 0;
+            }
+        } else if (!spiflash_read(addr, buf, block)) {
+            return 0;
+        }
+    }
+
+    uint32_t us = sdk_system_get_time() - start;
+    return us ? (uint64_t)count * block * 1000 / us : 0;
+}
+
+static void bench_task(void *pvParameters)
+{
+    uint8_t *mem = malloc(BUF_SIZE + 4);
+    if (!mem) {
+        printf("Not enough memory\n");
+        vTaskDelete(NULL);
+    }
+    uint8_t *aligned = (uint8_t*)(((uint32_t)mem + 3) & ~3);
+
+    printf("spiflash read benchmark, flash mode %s, %d bytes per test\n",
+            flash_mode(), BENCH_BYTES);
+    printf("%6s %10s %10s %10s %10s\n", "block", "aligned", "unal.addr",
+            "unal.buf", "sdk");
+    for (int i = 0; i < ARRAY_SIZE(block_sizes); i++) {
+        uint32_t block = block_sizes[i];
+        printf("%6u %7u kB/s %7u kB/s %7u kB/s %7u kB/s\n", block,
+                bench(block, 0, aligned, false),
+                bench(block, 1, aligned, false),
+                bench(block, 0, aligned + 1, false),
+                bench(block, 0, aligned, true));
+    }
+    free(mem);
+
+    vTaskDelete(NULL);
+}
+
+void user_init(void)
+{
+    uart_set_baud(0, 115200);
+    printf("SDK version:%s\n", sdk_system_get_sdk_version());
+
+    xTaskCreate(bench_task, "bench_task", 512, NULL, 2, NULL);
+}
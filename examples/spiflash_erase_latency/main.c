@@ -0,0 +1,116 @@
+/* Show how sector erases delay interrupt handlers that run from flash.
+ *
+ * A timer interrupt whose handler is not in IRAM fires every 100us and
+ * records the time since it last ran in a histogram. Sectors are erased
+ * first in one go and then with erase suspend/resume slices (see
+ * spiflash_set_erase_slice), and the histograms are printed for both.
+ *
+ * WARNING: This erases ERASE_SECTORS sectors starting at ERASE_ADDR.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include "espressif/esp_common.h"
+#include "esp/uart.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "esp8266.h"
+#include "spiflash.h"
+#include <stdio.h>
+#include <string.h>
+
+#define ERASE_ADDR      0x80000
+#define ERASE_SECTORS   16
+#define TIMER_FREQ      10000
+#define SLICE_US        500
+
+static const uint32_t bucket_us[] = {
+    150, 300, 500, 1000, 2000, 5000, 10000, 20000, 50000
+};
+
+#define NUM_BUCKETS (sizeof(bucket_us) / sizeof(bucket_us[0]) + 1)
+
+static volatile uint32_t histogram[NUM_BUCKETS];
+static volatile uint32_t max_interval;
+static uint32_t last_ccount;
+static uint32_t cpu_mhz;
+
+static inline uint32_t get_ccount(void)
+{
+    uint32_t ccount;
+    __asm__ volatile("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+}
+
+/* Deliberately not IRAM, so it can only run while the cache is enabled */
+static void timer_handler(void)
+{
+    uint32_t now = get_ccount();
+    uint32_t us = (now - last_ccount) / cpu_mhz;
+    int i;
+
+    last_ccount = now;
+    for (i = 0; i < NUM_BUCKETS - 1 && us >= bucket_us[i]; i++) {}
+    histogram[i]++;
+    if (us > max_interval) {
+        max_interval = us;
+    }
+}
+
+static void run(const char *name)
+{
+    memset((void *)histogram, 0, sizeof(histogram));
+    max_interval = 0;
+    last_ccount = get_ccount();
+
+    uint32_t start = sdk_system_get_time();
+    for (int i = 0; i < ERASE_SECTORS; i++) {
+        if (!spiflash_erase_sector(ERASE_ADDR + i * SPI_FLASH_SECTOR_SIZE)) {
+            printf("Erase failed\n");
+            return;
+        }
+    }
+    uint32_t elapsed = sdk_system_get_time() - start;
+
+    printf("\n%s: %d sectors in %u ms, longest interrupt gap %u us\n",
+            name, ERASE_SECTORS, elapsed / 1000, max_interval);
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (i < NUM_BUCKETS - 1) {
+            printf("  < %6u us: %u\n", bucket_us[i], histogram[i]);
+        } else {
+            printf(" >= %6u us: %u\n", bucket_us[i - 1], histogram[i]);
+        }
+    }
+}
+
+static void erase_task(void *pvParameters)
+{
+    cpu_mhz = sdk_system_get_cpu_freq();
+
+    _xt_isr_attach(INUM_TIMER_FRC1, timer_handler);
+    timer_set_frequency(FRC1, TIMER_FREQ);
+    timer_set_interrupts(FRC1, true);
+    timer_set_run(FRC1, true);
+
+    spiflash_set_erase_slice(0);
+    run("Erase in one go");
+
+    if (spiflash_set_erase_slice(SLICE_US)) {
+        run("Erase in slices");
+    } else {
+        printf("\nFlash chip doesn't support erase suspend\n");
+    }
+    spiflash_set_erase_slice(0);
+
+    timer_set_run(FRC1, false);
+    timer_set_interrupts(FRC1, false);
+    vTaskDelete(NULL);
+}
+
+void user_init(void)
+{
+    uart_set_baud(0, 115200);
+    printf("SDK version:%s\n", sdk_system_get_sdk_version());
+
+    xTaskCreate(erase_task, "erase_task", 512, NULL, 2, NULL);
+}
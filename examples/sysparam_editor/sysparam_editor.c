@@ -32,6 +32,7 @@ void usage(void) {
         "  <key>:<hexdata> -- Set <key> to binary value represented as hex\n"
         "  dump            -- Show all currently set keys/values\n"
         "  compact         -- Compact the sysparam area\n"
+        "  stats           -- Show space used and flash wear\n"
         "  reformat        -- Reinitialize (clear) the sysparam area\n"
         "  echo-off        -- Disable input echo\n"
         "  echo-on         -- Enable input echo\n"
@@ -110,6 +111,27 @@ sysparam_status_t dump_params(void) {
     }
 }
 
+sysparam_status_t dump_stats(void) {
+    sysparam_status_t status;
+    sysparam_stats_t stats;
+    int i;
+
+    status = sysparam_get_stats(&stats);
+    if (status < 0) return status;
+
+    printf("  area at 0x%08x: %d regions of %d sectors, using region %d\n",
+            stats.base_addr, stats.num_regions, stats.region_sectors, stats.active_region);
+    printf("  %d bytes used, %d bytes free\n", stats.used_bytes, stats.free_bytes);
+    printf("  erase counts:");
+    for (i = 0; i < stats.num_regions; i++) {
+        printf(" %u", stats.erase_count[i]);
+    }
+    printf("\n");
+    printf("  since boot: %u bytes written, %u sectors erased, %u compactions\n",
+            stats.bytes_written, stats.sectors_erased, stats.compactions);
+    return SYSPARAM_OK;
+}
+
 uint8_t *parse_hexdata(char *string, size_t *result_length) {
     size_t string_len = strlen(string);
     uint8_t *buf = malloc(string_len / 2);
@@ -155,6 +177,8 @@ void sysparam_editor_task(void *pvParameters) {
     size_t len;
     uint8_t *data;
     uint32_t base_addr, num_sectors;
+    uint8_t num_regions = DEFAULT_SYSPARAM_REGIONS;
+    sysparam_stats_t stats;
     bool echo = true;
 
     if (!cmd_buffer) {
@@ -167,6 +191,9 @@ void sysparam_editor_task(void *pvParameters) {
     status = sysparam_get_info(&base_addr, &num_sectors);
     if (status == SYSPARAM_OK) {
         printf("[current sysparam region is at 0x%08x (%d sectors)]\n", base_addr, num_sectors);
+        if (sysparam_get_stats(&stats) == SYSPARAM_OK) {
+            num_regions = stats.num_regions;
+        }
     } else {
         printf("[NOTE: No current sysparam region (initialization problem during boot?)]\n");
         // Default to the same place/size as the normal system initialization
@@ -212,12 +239,14 @@ void sysparam_editor_task(void *pvParameters) {
         } else if (!strcmp(cmd_buffer, "dump")) {
             printf("Dumping all params:\n");
             status = dump_params();
+        } else if (!strcmp(cmd_buffer, "stats")) {
+            status = dump_stats();
         } else if (!strcmp(cmd_buffer, "compact")) {
             printf("Compacting...\n");
             status = sysparam_compact();
         } else if (!strcmp(cmd_buffer, "reformat")) {
             printf("Re-initializing region...\n");
-            status = sysparam_create_area(base_addr, num_sectors, true);
+            status = sysparam_create_ring_area(base_addr, num_sectors, num_regions, true);
             if (status == SYSPARAM_OK) {
                 // We need to re-init after wiping out the region we've been
                 // using.
@@ -0,0 +1,99 @@
+/**
+ * Example of the ws2812_i2s streaming mode.
+ *
+ * A rainbow scrolls along a long strip. Each frame is rendered into one of
+ * two pixel arrays while the other one is sent, and the frame done callback
+ * hands an array back once the DMA has finished with it. Once a second the
+ * frame rate, latency, dropped frames and underruns are printed.
+ *
+ * As ws2812_i2s library using hardware I2S the output pin is GPIO3 and
+ * can not be changed.
+ *
+ * This sample code is in the public domain.
+ */
+#include "espressif/esp_common.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "esp/uart.h"
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ws2812_i2s/ws2812_i2s.h"
+
+#define LED_NUMBER      300
+
+static ws2812_pixel_t buf[2][LED_NUMBER];
+static SemaphoreHandle_t free_bufs;
+
+static void frame_done(const ws2812_pixel_t *pixels)
+{
+    BaseType_t woken = pdFALSE;
+
+    xSemaphoreGiveFromISR(free_bufs, &woken);
+    portEND_SWITCHING_ISR(woken);
+}
+
+static ws2812_pixel_t wheel(uint8_t pos)
+{
+    ws2812_pixel_t colour;
+
+    if (pos < 85) {
+        colour.red = 255 - pos * 3;
+        colour.green = pos * 3;
+        colour.blue = 0;
+    } else if (pos < 170) {
+        pos -= 85;
+        colour.red = 0;
+        colour.green = 255 - pos * 3;
+        colour.blue = pos * 3;
+    } else {
+        pos -= 170;
+        colour.red = pos * 3;
+        colour.green = 0;
+        colour.blue = 255 - pos * 3;
+    }
+    return colour;
+}
+
+static void render(ws2812_pixel_t *pixels, uint32_t offset)
+{
+    for (int i = 0; i < LED_NUMBER; i++) {
+        pixels[i] = wheel((i * 256 / LED_NUMBER + offset) & 0xff);
+    }
+}
+
+static void demo(void *pvParameters)
+{
+    ws2812_i2s_stats_t stats;
+    TickType_t last_report = xTaskGetTickCount();
+    uint32_t offset = 0;
+
+    free_bufs = xSemaphoreCreateCounting(2, 2);
+    if (!free_bufs || !ws2812_i2s_init_stream(LED_NUMBER, frame_done)) {
+        printf("ws2812_i2s: out of memory\n");
+        vTaskDelete(NULL);
+    }
+
+    for (int i = 0;; i ^= 1) {
+        xSemaphoreTake(free_bufs, portMAX_DELAY);
+        render(buf[i], offset++);
+        ws2812_i2s_update_async(buf[i]);
+
+        if (xTaskGetTickCount() - last_report >= 1000 / portTICK_PERIOD_MS) {
+            last_report = xTaskGetTickCount();
+            ws2812_i2s_get_stats(&stats);
+            printf("%u frames, %u fps, latency %u us (max %u), %u dropped, %u underruns\n",
+                    stats.frames, stats.frame_us ? 1000000 / stats.frame_us : 0,
+                    stats.latency_us, stats.max_latency_us, stats.dropped,
+                    stats.underruns);
+        }
+    }
+}
+
+void user_init(void)
+{
+    uart_set_baud(0, 115200);
+
+    xTaskCreate(&demo, "ws2812_i2s", 512, NULL, 10, NULL);
+}
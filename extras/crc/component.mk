@@ -0,0 +1,14 @@
+# Component makefile for extras/crc
+
+# onewire and sdio include this file themselves, so it can be seen twice
+ifndef crc_AR
+
+# expected anyone using it includes it as 'crc/crc.h'
+INC_DIRS += $(crc_ROOT)..
+
+# args for passing into compile rule generation
+crc_SRC_DIR = $(crc_ROOT)
+
+$(eval $(call component_compile_rules,crc))
+
+endif
@@ -0,0 +1,75 @@
+/**
+ * Table driven CRC routines shared by the drivers.
+ *
+ * All functions take the CRC of the preceding data as the last argument, so
+ * a CRC can be computed over several buffers. Use the documented initial
+ * value for the first buffer.
+ *
+ * The lookup tables are stored as 32-bit words so they can be read from
+ * flash (the default) or IRAM, neither of which supports byte loads.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Attribute for the lookup tables. Leave empty to keep them in flash, or
+ * define as IRAM_DATA to move them to IRAM (about 6KB).
+ */
+#ifndef CRC_TABLE_ATTR
+#define CRC_TABLE_ATTR
+#endif
+
+/**
+ * Use slice-by-4 tables for CRC32, which processes a word per iteration
+ * at the cost of another 3KB of tables.
+ */
+#ifndef CRC32_SLICE_BY_4
+#define CRC32_SLICE_BY_4 0
+#endif
+
+/**
+ * CRC-7/MMC as used for SD card commands (polynomial 0x09, initial 0).
+ *
+ * @return The 7-bit CRC. SD commands send it as (crc << 1) | 1.
+ */
+uint8_t crc7(const uint8_t *data, size_t len, uint8_t crc);
+
+/**
+ * CRC-8/MAXIM as used by 1-Wire devices (reflected polynomial 0x31,
+ * initial 0).
+ */
+uint8_t crc8_maxim(const uint8_t *data, size_t len, uint8_t crc);
+
+/**
+ * CRC-16/XMODEM as used for SD card data blocks (polynomial 0x1021,
+ * initial 0).
+ */
+uint16_t crc16_ccitt(const uint8_t *data, size_t len, uint16_t crc);
+
+/**
+ * CRC-16/ARC as used by 1-Wire devices (reflected polynomial 0x8005,
+ * initial 0).
+ */
+uint16_t crc16_ibm(const uint8_t *data, size_t len, uint16_t crc);
+
+/**
+ * CRC-32 as used by zlib and Ethernet (reflected polynomial 0x04c11db7).
+ * Pass 0 as the initial value, the pre and post inversion is done here.
+ */
+uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRC_H__ */
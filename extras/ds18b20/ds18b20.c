@@ -1,6 +1,7 @@
 #include "FreeRTOS.h"
 #include "task.h"
 #include "math.h"
+#include <string.h>
 
 #include "ds18b20.h"
 
@@ -32,6 +33,14 @@ uint8_t ds18b20_read_all(uint8_t pin, ds_sensor_t *result) {
     onewire_search_t search;
     uint8_t sensor_id = 0;
 
+    // Convert on all devices at once
+    onewire_reset(pin);
+    onewire_skip_rom(pin);
+    onewire_write(pin, DS18B20_CONVERT_T);
+
+    onewire_power(pin);
+    vTaskDelay(750 / portTICK_PERIOD_MS);
+
     onewire_search_start(&search);
 
     while ((addr = onewire_search_next(&search, pin)) != ONEWIRE_NONE) {
@@ -41,13 +50,6 @@ uint8_t ds18b20_read_all(uint8_t pin, ds_sensor_t *result) {
             return 0;
         }
 
-        onewire_reset(pin);
-        onewire_select(pin, addr);
-        onewire_write(pin, DS18B20_CONVERT_T);
-
-        onewire_power(pin);
-        vTaskDelay(750 / portTICK_PERIOD_MS);
-
         onewire_reset(pin);
         onewire_select(pin, addr);
         onewire_write(pin, DS18B20_READ_SCRATCHPAD);
@@ -172,14 +174,9 @@ bool ds18b20_read_scratchpad(int pin, ds18b20_addr_t addr, uint8_t *buffer) {
     return true;
 }
 
-float ds18b20_read_temperature(int pin, ds18b20_addr_t addr) {
-    uint8_t scratchpad[8];
+static float scratchpad_temperature(ds18b20_addr_t addr, const uint8_t *scratchpad) {
     int16_t temp;
 
-    if (!ds18b20_read_scratchpad(pin, addr, scratchpad)) {
-        return NAN;
-    }
-
     temp = scratchpad[1] << 8 | scratchpad[0];
 
     float res;
@@ -193,6 +190,15 @@ float ds18b20_read_temperature(int pin, ds18b20_addr_t addr) {
     return res;
 }
 
+float ds18b20_read_temperature(int pin, ds18b20_addr_t addr) {
+    uint8_t scratchpad[8];
+
+    if (!ds18b20_read_scratchpad(pin, addr, scratchpad)) {
+        return NAN;
+    }
+    return scratchpad_temperature(addr, scratchpad);
+}
+
 float ds18b20_measure_and_read(int pin, ds18b20_addr_t addr) {
     if (!ds18b20_measure(pin, addr, true)) {
         return NAN;
@@ -241,3 +247,103 @@ bool ds18b20_read_temp_multi(int pin, ds18b20_addr_t *addr_list, int addr_count,
 }
 
 
+
+void ds18b20_bus_init(ds18b20_bus_t *bus, int pin) {
+    memset(bus, 0, sizeof(*bus));
+    bus->pin = pin;
+    bus->rescan = true;
+}
+
+int ds18b20_bus_scan(ds18b20_bus_t *bus) {
+    int found = ds18b20_scan_devices(bus->pin, bus->addr_list, DS18B20_BUS_MAX_DEVICES);
+
+    bus->count = found < DS18B20_BUS_MAX_DEVICES ? found : DS18B20_BUS_MAX_DEVICES;
+    bus->rescan = false;
+
+    // Parasite powered devices pull the bus low in the read slot
+    bus->parasitic = true;
+    if (bus->count && onewire_reset(bus->pin)) {
+        onewire_skip_rom(bus->pin);
+        onewire_write(bus->pin, DS18B20_READ_PWRSUPPLY);
+        bus->parasitic = onewire_read(bus->pin) != 0xff;
+    }
+    debug("%d devices cached, %s power", bus->count, bus->parasitic ? "parasitic" : "external");
+
+    return bus->count;
+}
+
+bool ds18b20_bus_measure(ds18b20_bus_t *bus) {
+    if (bus->rescan) {
+        ds18b20_bus_scan(bus);
+    }
+    if (!bus->count) {
+        return false;
+    }
+    if (!bus->parasitic) {
+        if (!ds18b20_measure(bus->pin, DS18B20_ANY, false)) {
+            bus->rescan = true;
+            return false;
+        }
+        // Externally powered devices answer read slots with 0 until all of
+        // them have finished converting
+        onewire_depower(bus->pin);
+        for (int waited = 0; waited < 750; waited += DS18B20_BUS_POLL_MS) {
+            os_sleep_ms(DS18B20_BUS_POLL_MS);
+            int done = onewire_read(bus->pin);
+            if (done < 0) {
+                break;
+            }
+            if (done) {
+                return true;
+            }
+        }
+        os_sleep_ms(DS18B20_BUS_POLL_MS);
+        return true;
+    }
+    if (!ds18b20_measure(bus->pin, DS18B20_ANY, true)) {
+        bus->rescan = true;
+        return false;
+    }
+    return true;
+}
+
+bool ds18b20_bus_read(ds18b20_bus_t *bus, float *result_list) {
+    uint8_t scratchpad[9];
+    bool result = true;
+
+    for (int i = 0; i < bus->count; i++) {
+        ds18b20_addr_t addr = bus->addr_list[i];
+
+        result_list[i] = NAN;
+        if (!onewire_reset(bus->pin)) {
+            result = false;
+            continue;
+        }
+        onewire_select(bus->pin, addr);
+        onewire_write(bus->pin, DS18B20_READ_SCRATCHPAD);
+        // The CRC over the data and its CRC byte is zero
+        if (!onewire_read_bytes(bus->pin, scratchpad, sizeof(scratchpad)) ||
+                onewire_crc8(scratchpad, sizeof(scratchpad)) != 0) {
+            debug("CRC check failed reading %08x%08x", (uint32_t)(addr >> 32), (uint32_t)addr);
+            bus->crc_errors++;
+            result = false;
+            continue;
+        }
+        result_list[i] = scratchpad_temperature(addr, scratchpad);
+    }
+    if (!result) {
+        // A device may have gone or been replaced
+        bus->rescan = true;
+    }
+    return result;
+}
+
+bool ds18b20_bus_measure_and_read(ds18b20_bus_t *bus, float *result_list) {
+    if (!ds18b20_bus_measure(bus)) {
+        for (int i = 0; i < bus->count; i++) {
+            result_list[i] = NAN;
+        }
+        return false;
+    }
+    return ds18b20_bus_read(bus, result_list);
+}
@@ -136,6 +136,75 @@ bool ds18b20_measure_and_read_multi(int pin, ds18b20_addr_t *addr_list, int addr
  */
 bool ds18b20_read_scratchpad(int pin, ds18b20_addr_t addr, uint8_t *buffer);
 
+/** Maximum number of devices remembered by a ::ds18b20_bus_t */
+#ifndef DS18B20_BUS_MAX_DEVICES
+#define DS18B20_BUS_MAX_DEVICES 16
+#endif
+
+/** How often an externally powered bus is polled for the end of a conversion */
+#ifndef DS18B20_BUS_POLL_MS
+#define DS18B20_BUS_POLL_MS 10
+#endif
+
+/** A bus of DS18B20 devices with a cached search result.
+ *
+ *  The ds18b20_bus_*() functions sample all devices on the bus with one
+ *  conversion: a SKIP ROM + CONVERT T reaches all of them at once, so N
+ *  devices take one conversion time (750ms at 12 bits) instead of N.  On an
+ *  externally powered bus the end of the conversion is detected by polling,
+ *  so this is usually shorter.
+ *
+ *  The bus is searched on the first measurement and again only after a
+ *  device failed to answer or returned a bad CRC, or when ds18b20_bus_scan()
+ *  is called.
+ */
+typedef struct {
+    int pin;
+    /** Number of devices in `addr_list` */
+    int count;
+    /** At least one device uses parasite power */
+    bool parasitic;
+    /** Search the bus again before the next measurement */
+    bool rescan;
+    /** Scratchpads read with a bad CRC */
+    uint32_t crc_errors;
+    ds18b20_addr_t addr_list[DS18B20_BUS_MAX_DEVICES];
+} ds18b20_bus_t;
+
+/** Initialize a bus, the devices are searched on first use.
+ *
+ *  @param bus  The bus to initialize
+ *  @param pin  The GPIO pin connected to the DS18B20 bus
+ */
+void ds18b20_bus_init(ds18b20_bus_t *bus, int pin);
+
+/** Search the bus and cache the addresses of the DS18B20 devices.
+ *
+ *  @returns The number of devices cached, at most ::DS18B20_BUS_MAX_DEVICES
+ */
+int ds18b20_bus_scan(ds18b20_bus_t *bus);
+
+/** Start a conversion on all devices and wait for it to finish.
+ *
+ *  @returns `true` if the conversion was done, `false` on error or if there
+ *  are no devices.
+ */
+bool ds18b20_bus_measure(ds18b20_bus_t *bus);
+
+/** Read the results of the last conversion from all cached devices.
+ *
+ *  @param bus          The bus
+ *  @param result_list  An array of at least `bus->count` floats.  Devices
+ *                      that failed are returned as NaN, in the order of
+ *                      `bus->addr_list`.
+ *
+ *  @returns `true` if all temperatures were read successfully
+ */
+bool ds18b20_bus_read(ds18b20_bus_t *bus, float *result_list);
+
+/** Perform a ds18b20_bus_measure() followed by ds18b20_bus_read() */
+bool ds18b20_bus_measure_and_read(ds18b20_bus_t *bus, float *result_list);
+
 // The following are obsolete/deprecated APIs
 
 typedef struct {
@@ -3,7 +3,39 @@
 # expected anyone using httpd includes it as 'httpd/httpd.h'
 INC_DIRS += $(httpd_ROOT)..
 
+# Flash address of the file system image created by make_httpd_fs_image.
+# Must be past the end of the firmware, in the same megabyte of flash (the
+# first one unless the firmware runs from another rboot OTA slot).
+HTTPD_FS_ADDR ?= 0xC0000
+PROGRAM_CFLAGS += -DHTTPD_FS_ADDR=$(HTTPD_FS_ADDR)
+
 # args for passing into compile rule generation
 httpd_SRC_DIR = $(httpd_ROOT)
 
+# Create a flash file system image (HTTPD_FS_FLASH) of the specified directory
+# and flash it at HTTPD_FS_ADDR with the rest of the firmware.
+#
+# Argumens:
+#   $(1) - directory with files which go into the image
+#
+# Example:
+#  $(eval $(call make_httpd_fs_image,fs))
+define make_httpd_fs_image
+HTTPD_FS_IMAGE = $(addprefix $(FIRMWARE_DIR),httpd_fs.bin)
+HTTPD_FS_FILE_LIST = $(shell find $(1))
+
+all: $$(HTTPD_FS_IMAGE)
+
+clean: clean_httpd_fs_img
+
+$$(HTTPD_FS_IMAGE): $(httpd_ROOT)mkfsblob.py $$(HTTPD_FS_FILE_LIST) | $$(FIRMWARE_DIR)
+	$$(vecho) "HTTPD FS $$@"
+	$$(Q) $(httpd_ROOT)mkfsblob.py $(1) $$@ > /dev/null
+
+clean_httpd_fs_img:
+	$$(Q) rm -f $$(HTTPD_FS_IMAGE)
+
+HTTPD_FS_ESPTOOL_ARGS = $(HTTPD_FS_ADDR) $$(HTTPD_FS_IMAGE)
+endef
+
 $(eval $(call component_compile_rules,httpd))
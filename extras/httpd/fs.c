@@ -41,11 +41,122 @@
 #define HTTPD_USE_CUSTOM_FSDATA 0
 #endif
 
+#if HTTPD_FS_FSDATA
 #if HTTPD_USE_CUSTOM_FSDATA
 #include "fsdata_custom.c"
 #else /* HTTPD_USE_CUSTOM_FSDATA */
 #include "fsdata.c"
 #endif /* HTTPD_USE_CUSTOM_FSDATA */
+#else /* HTTPD_FS_FSDATA */
+#define FS_ROOT NULL
+#endif /* HTTPD_FS_FSDATA */
+
+/*-----------------------------------------------------------------------------------*/
+
+#if HTTPD_FS_FLASH
+#include "esp/rom.h"
+
+/** The cache maps one megabyte of flash at this address, the one the
+ * running rboot ROM slot is in (rboot_megabyte) */
+#ifndef FS_FLASH_MAP_BASE
+#define FS_FLASH_MAP_BASE   0x40200000
+#endif
+#define FS_FLASH_MAP_SIZE   0x100000
+
+static const struct fs_flash_header *fs_flash_image;
+
+/** Mapped flash must be read with aligned 32-bit loads, so pack the name
+ * into words (NUL padded, like the names in the image) and compare those. */
+static int
+fs_flash_name_matches(const struct fs_flash_entry *e, const char *name, u32_t len)
+{
+  const u32_t *fname = (const u32_t *)((const u8_t *)fs_flash_image + e->name_offset);
+  u32_t i, j, word;
+
+  if (e->name_len != len) {
+    return 0;
+  }
+  for (i = 0; i <= len; i += 4) {
+    word = 0;
+    for (j = 0; j < 4 && i + j < len; j++) {
+      word |= (u32_t)(u8_t)name[i + j] << (8 * j);
+    }
+    if (fname[i / 4] != word) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+err_t
+fs_flash_mount(u32_t flash_addr)
+{
+  const struct fs_flash_header *hdr;
+  const struct fs_flash_entry *e;
+  u32_t i, size, offset;
+
+  fs_flash_image = NULL;
+  /* Only the megabyte of the running ROM slot is mapped, an image anywhere
+   * else would be read from the wrong part of flash */
+  offset = flash_addr - ((u32_t)rboot_megabyte << 20);
+  if ((flash_addr & 3) || (offset >= FS_FLASH_MAP_SIZE) ||
+      (offset + sizeof(struct fs_flash_header) > FS_FLASH_MAP_SIZE)) {
+    return ERR_ARG;
+  }
+  hdr = (const struct fs_flash_header *)(FS_FLASH_MAP_BASE + offset);
+  size = hdr->size;
+  if ((hdr->magic != FS_FLASH_MAGIC) || (size & 3) ||
+      (size > FS_FLASH_MAP_SIZE - offset) ||
+      (hdr->num_files > (size - sizeof(*hdr)) / sizeof(*e))) {
+    return ERR_VAL;
+  }
+  /* Validate the entries once so fs_open can trust them */
+  e = (const struct fs_flash_entry *)(hdr + 1);
+  for (i = 0; i < hdr->num_files; i++, e++) {
+    if ((e->name_offset & 3) || (e->data_offset & 3) ||
+        (e->name_offset > size) || (e->name_len >= size - e->name_offset) ||
+        (e->data_offset > size) || (e->data_len > size - e->data_offset)) {
+      return ERR_VAL;
+    }
+  }
+  fs_flash_image = hdr;
+  return ERR_OK;
+}
+
+void
+fs_flash_unmount(void)
+{
+  fs_flash_image = NULL;
+}
+
+static int
+fs_flash_open(struct fs_file *file, const char *name)
+{
+  const struct fs_flash_entry *e;
+  u32_t i, len;
+
+  if (fs_flash_image == NULL) {
+    return 0;
+  }
+  len = strlen(name);
+  e = (const struct fs_flash_entry *)(fs_flash_image + 1);
+  for (i = 0; i < fs_flash_image->num_files; i++, e++) {
+    if (fs_flash_name_matches(e, name, len)) {
+      file->data = (const char *)fs_flash_image + e->data_offset;
+      file->len = e->data_len;
+      file->index = e->data_len;
+      file->pextension = NULL;
+      file->http_header_included = (e->flags & FS_FLASH_FLAG_HTTP_HEADER) ? 1 : 0;
+#if HTTPD_PRECALCULATED_CHECKSUM
+      file->chksum_count = 0;
+      file->chksum = NULL;
+#endif /* HTTPD_PRECALCULATED_CHECKSUM */
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif /* HTTPD_FS_FLASH */
 
 /*-----------------------------------------------------------------------------------*/
 
@@ -76,6 +187,15 @@ fs_open(struct fs_file *file, const char *name)
   file->is_custom_file = 0;
 #endif /* LWIP_HTTPD_CUSTOM_FILES */
 
+#if HTTPD_FS_FLASH
+  if (fs_flash_open(file, name)) {
+#if LWIP_HTTPD_FILE_STATE
+    file->state = fs_state_init(file, name);
+#endif /* #if LWIP_HTTPD_FILE_STATE */
+    return ERR_OK;
+  }
+#endif /* HTTPD_FS_FLASH */
+
   for (f = FS_ROOT; f != NULL; f = f->next) {
     if (!strcmp(name, (char *)f->name)) {
       file->data = (const char *)f->data;
@@ -75,6 +75,23 @@
 #define LWIP_HTTPD_FS_ASYNC_READ      0
 #endif
 
+/** HTTPD_FS_FLASH==1: serve files from an image in memory-mapped flash,
+ * created by mkfsblob.py and registered with fs_flash_mount().
+ * fs_open() returns a pointer straight into the mapped flash, so file data
+ * is never copied to a heap buffer before it is passed to tcp_write().
+ * Files in the image take precedence over the ones in fsdata.c.
+ */
+#ifndef HTTPD_FS_FLASH
+#define HTTPD_FS_FLASH                0
+#endif
+
+/** HTTPD_FS_FSDATA==0: don't include fsdata.c, e.g. when all files are
+ * served from a flash image (HTTPD_FS_FLASH).
+ */
+#ifndef HTTPD_FS_FSDATA
+#define HTTPD_FS_FSDATA               1
+#endif
+
 #define FS_READ_EOF     -1
 #define FS_READ_DELAYED -2
 
@@ -122,6 +139,48 @@ int fs_is_file_ready(struct fs_file *file, fs_wait_cb callback_fn, void *callbac
 #endif /* LWIP_HTTPD_FS_ASYNC_READ */
 int fs_bytes_left(struct fs_file *file);
 
+#if HTTPD_FS_FLASH
+/** Magic number at the start of a flash file system image ("HFS1") */
+#define FS_FLASH_MAGIC        0x31534648
+
+/** Flash file system image header. All fields are little endian and all
+ * offsets are relative to the start of the image. */
+struct fs_flash_header {
+  u32_t magic;
+  u32_t num_files;
+  u32_t size;          /* total image size in bytes */
+  u32_t reserved;
+};
+
+/** Flash file system image entry, num_files of them follow the header.
+ * Names and data are 4-byte aligned and names are NUL padded to a
+ * multiple of 4 bytes so they can be compared with 32-bit loads. */
+struct fs_flash_entry {
+  u32_t name_offset;
+  u32_t name_len;      /* without the terminating NUL */
+  u32_t data_offset;
+  u32_t data_len;
+  u32_t flags;         /* FS_FLASH_FLAG_* */
+};
+
+#define FS_FLASH_FLAG_HTTP_HEADER   0x01
+
+/** Use the image at flash_addr for subsequent fs_open() calls.
+ * The cache only maps the megabyte of flash the running firmware is in, so
+ * the image must be in that megabyte. Without OTA that is the first one.
+ * With rboot OTA it is the megabyte of the current ROM slot, so each slot
+ * needs its own copy of the image, e.g. at HTTPD_FS_ADDR in slot 0 and
+ * 0x100000 + HTTPD_FS_ADDR in slot 1. Mount it with
+ * fs_flash_mount((rboot_megabyte << 20) + HTTPD_FS_ADDR).
+ * @param flash_addr Flash offset of the image, 4-byte aligned.
+ * @return ERR_OK, ERR_ARG if the address is unaligned or outside the mapped
+ *         megabyte, or ERR_VAL for a bad image.
+ */
+err_t fs_flash_mount(u32_t flash_addr);
+/** Stop using the flash image. */
+void fs_flash_unmount(void);
+#endif /* HTTPD_FS_FLASH */
+
 #if LWIP_HTTPD_FILE_STATE
 /** This user-defined function is called when a file is opened. */
 void *fs_state_init(struct fs_file *file, const char *name);
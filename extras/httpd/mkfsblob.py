@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+#
+# Create a flash file system image for httpd (HTTPD_FS_FLASH).
+#
+# The image is flashed at a fixed address in the first megabyte of flash and
+# registered with fs_flash_mount(). Files are served straight from the
+# memory-mapped flash. The layout is described in fs.h. Like makefsdata, an
+# HTTP header is prepended to each file unless -n is given.
+#
+# Part of esp-open-rtos
+# BSD Licensed as described in the file LICENSE
+#
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = 0x31534648
+HEADER = struct.Struct('<IIII')
+ENTRY = struct.Struct('<IIIII')
+FLAG_HTTP_HEADER = 0x01
+
+CONTENT_TYPES = {
+    '.html': 'text/html',
+    '.htm': 'text/html',
+    '.shtml': 'text/html',
+    '.shtm': 'text/html',
+    '.ssi': 'text/html',
+    '.js': 'application/x-javascript',
+    '.css': 'text/css',
+    '.ico': 'image/x-icon',
+    '.gif': 'image/gif',
+    '.png': 'image/png',
+    '.jpg': 'image/jpeg',
+    '.bmp': 'image/bmp',
+    '.svg': 'image/svg+xml',
+    '.json': 'application/json',
+    '.class': 'application/octet-stream',
+}
+
+
+def http_header(name):
+    status = '404 File not found' if '404' in name else '200 OK'
+    ext = os.path.splitext(name)[1].lower()
+    ctype = CONTENT_TYPES.get(ext, 'text/plain')
+    return ('HTTP/1.0 %s\r\nServer: esp-open-rtos httpd\r\n'
+            'Content-type: %s\r\n\r\n' % (status, ctype)).encode()
+
+
+def pad4(data):
+    return data + b'\0' * (-len(data) % 4)
+
+
+def build_image(root, add_headers):
+    files = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for fn in sorted(filenames):
+            if fn.endswith('~'):
+                continue
+            path = os.path.join(dirpath, fn)
+            name = '/' + os.path.relpath(path, root).replace(os.sep, '/')
+            with open(path, 'rb') as f:
+                data = f.read()
+            flags = 0
+            if add_headers and not (fn.endswith('.plain') or 'cgi' in name):
+                data = http_header(name) + data
+                flags |= FLAG_HTTP_HEADER
+            files.append((name.encode(), data, flags))
+
+    offset = HEADER.size + ENTRY.size * len(files)
+    entries = []
+    blobs = []
+    for name, data, flags in files:
+        name_offset = offset
+        blobs.append(pad4(name + b'\0'))
+        offset += len(blobs[-1])
+        data_offset = offset
+        blobs.append(pad4(data))
+        offset += len(blobs[-1])
+        entries.append(ENTRY.pack(name_offset, len(name), data_offset,
+                                  len(data), flags))
+
+    image = HEADER.pack(MAGIC, len(files), offset, 0)
+    image += b''.join(entries) + b''.join(blobs)
+    assert len(image) == offset
+    return image, [f[0].decode() for f in files]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Create a flash file system image for httpd')
+    parser.add_argument('directory', help='directory with the files to serve')
+    parser.add_argument('output', help='image file to create')
+    parser.add_argument('-n', '--no-headers', action='store_true',
+                        help='do not prepend HTTP headers to the files')
+    args = parser.parse_args()
+
+    image, names = build_image(args.directory, not args.no_headers)
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    for name in names:
+        print(name)
+    print('%d files, %d bytes' % (len(names), len(image)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -25,6 +25,7 @@
 #include <esp8266.h>
 #include <espressif/esp_misc.h> // sdk_os_delay_us
 #include <espressif/esp_system.h>
+#include <string.h>
 #include "i2c.h"
 
 //#define I2C_DEBUG true
@@ -35,224 +36,284 @@
 #define debug(fmt, ...)
 #endif
 
-#define CLK_STRETCH  (10)
+// Clock pulses used to calibrate the bus timing
+#define CALIBRATION_BITS 9
 
-static bool started;
-static bool flag;
-static bool force;
-static uint8_t freq ;
-static uint8_t g_scl_pin;
-static uint8_t g_sda_pin;
+typedef struct {
+    uint8_t scl_pin;
+    uint8_t sda_pin;
+    bool started;
+    bool flag;          // bus taken by a Level 1 call
+    bool force;
+    bool timeout;       // clock stretching budget exceeded in this call
+    bool arb_lost;      // arbitration lost in this call
+    uint8_t cpu_mhz;    // CPU frequency the timing was calculated for
+    uint32_t freq;
+    uint32_t stretch_us;
+    uint32_t stretch_cycles;
+    uint32_t overhead_cycles; // one clock period with no delay
+    uint32_t delay_cycles;    // padding of each half period
+    i2c_stats_t stats;
+} i2c_bus_t;
 
-inline bool i2c_status(void)
+static i2c_bus_t buses[I2C_MAX_BUS];
+
+static inline uint32_t get_ccount(void)
 {
-    return started;
+    uint32_t ccount;
+    __asm__ volatile("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
 }
 
-void i2c_init(uint8_t scl_pin, uint8_t sda_pin)
+static inline i2c_bus_t *get_bus(uint8_t bus)
 {
-    started = false;
-    flag = false ;
-    g_scl_pin = scl_pin;
-    g_sda_pin = sda_pin;
-
-    // Just to prevent these pins floating too much if not connected.
-    gpio_set_pullup(g_scl_pin, 1, 1);
-    gpio_set_pullup(g_sda_pin, 1, 1);
+    if (bus >= I2C_MAX_BUS || !buses[bus].freq)
+        return NULL;
+    return &buses[bus];
+}
 
-    gpio_enable(g_scl_pin, GPIO_OUT_OPEN_DRAIN);
-    gpio_enable(g_sda_pin, GPIO_OUT_OPEN_DRAIN);
+static void set_timing(i2c_bus_t *b)
+{
+    uint32_t period = b->cpu_mhz * 1000000 / b->freq;
 
-    // I2C bus idle state.
-    gpio_write(g_scl_pin, 1);
-    gpio_write(g_sda_pin, 1);
+    b->delay_cycles = period > b->overhead_cycles ? (period - b->overhead_cycles) / 2 : 0;
+    b->stretch_cycles = b->stretch_us * b->cpu_mhz;
+}
 
-    // Prevent user, if frequency is high
-    if (sdk_system_get_cpu_freq() == SYS_CPU_80MHZ)
-        if (I2C_CUSTOM_DELAY_80MHZ == 1)
-            debug("Max frequency is 320Khz at 80MHz");
+// Follow a CPU frequency change. GPIO access time does not depend on the
+// CPU clock, so the overhead scales with it.
+static inline void check_cpu_freq(i2c_bus_t *b)
+{
+    uint8_t cpu_mhz = sdk_system_get_cpu_freq();
 
+    if (cpu_mhz != b->cpu_mhz && b->cpu_mhz) {
+        b->overhead_cycles = b->overhead_cycles * cpu_mhz / b->cpu_mhz;
+        b->cpu_mhz = cpu_mhz;
+        set_timing(b);
+    }
 }
 
-static inline void i2c_delay(void)
+static inline void i2c_delay(i2c_bus_t *b)
 {
-    uint32_t delay;
-    if (freq == SYS_CPU_160MHZ)
-    {
-        __asm volatile (
-            "movi %0, %1" "\n"
-            "1: addi %0, %0, -1" "\n"
-            "bnez %0, 1b" "\n"
-        : "=a" (delay) : "i" (I2C_CUSTOM_DELAY_160MHZ));
-    }
-    else
-    {
-        __asm volatile (
-            "movi %0, %1" "\n"
-            "1: addi %0, %0, -1" "\n"
-            "bnez %0, 1b" "\n"
-        : "=a" (delay) : "i" (I2C_CUSTOM_DELAY_80MHZ));
-    }
+    uint32_t start = get_ccount();
+    while (get_ccount() - start < b->delay_cycles) ;
 }
 
 // Set SCL as input, allowing it to float high, and return current
 // level of line, 0 or 1
-static inline bool read_scl(void)
+static inline bool read_scl(i2c_bus_t *b)
+{
+    gpio_write(b->scl_pin, 1);
+    return gpio_read(b->scl_pin); // Clock high, valid ACK
+}
+
+// Release SCL and wait for slaves stretching the clock, for at most the
+// clock stretching budget
+static inline bool wait_scl(i2c_bus_t *b)
 {
-    gpio_write(g_scl_pin, 1);
-    return gpio_read(g_scl_pin); // Clock high, valid ACK
+    if (read_scl(b))
+        return true;
+
+    uint32_t start = get_ccount();
+    while (!gpio_read(b->scl_pin)) {
+        if (get_ccount() - start > b->stretch_cycles) {
+            debug("clock stretching timeout");
+            b->timeout = true;
+            return false;
+        }
+    }
+    return true;
 }
 
 // Set SDA as input, allowing it to float high, and return current
 // level of line, 0 or 1
-static inline bool read_sda(void)
+static inline bool read_sda(i2c_bus_t *b)
 {
-    gpio_write(g_sda_pin, 1);
-    // TODO: Without this delay we get arbitration lost in i2c_stop
-    i2c_delay();
-    return gpio_read(g_sda_pin); // Clock high, valid ACK
+    gpio_write(b->sda_pin, 1);
+    return gpio_read(b->sda_pin); // Clock high, valid ACK
 }
 
 // Actively drive SCL signal low
-static inline void clear_scl(void)
+static inline void clear_scl(i2c_bus_t *b)
 {
-    gpio_write(g_scl_pin, 0);
+    gpio_write(b->scl_pin, 0);
 }
 
 // Actively drive SDA signal low
-static inline void clear_sda(void)
+static inline void clear_sda(i2c_bus_t *b)
 {
-    gpio_write(g_sda_pin, 0);
+    gpio_write(b->sda_pin, 0);
+}
+
+static inline void arbitration_lost(i2c_bus_t *b, const char *where)
+{
+    debug("arbitration lost in %s", where);
+    b->arb_lost = true;
 }
 
 // Output start condition
-void i2c_start(void)
+static void bus_start(i2c_bus_t *b)
 {
-    uint32_t clk_stretch = CLK_STRETCH;
-    freq = sdk_system_get_cpu_freq();
-    if (started) { // if started, do a restart cond
+    if (b->started) { // if started, do a restart cond
         // Set SDA to 1
-        (void) read_sda();
-        i2c_delay();
-        while (read_scl() == 0 && clk_stretch--) ;
+        (void) read_sda(b);
+        i2c_delay(b);
+        wait_scl(b);
         // Repeated start setup time, minimum 4.7us
-        i2c_delay();
+        i2c_delay(b);
+    } else {
+        check_cpu_freq(b);
     }
-    started = true;
-    if (read_sda() == 0) {
-        debug("arbitration lost in i2c_start");
+    b->started = true;
+    if (read_sda(b) == 0) {
+        arbitration_lost(b, "i2c_start");
     }
     // SCL is high, set SDA from 1 to 0.
-    clear_sda();
-    i2c_delay();
-    clear_scl();
+    clear_sda(b);
+    i2c_delay(b);
+    clear_scl(b);
 }
 
 // Output stop condition
-bool i2c_stop(void)
+static bool bus_stop(i2c_bus_t *b)
 {
-    uint32_t clk_stretch = CLK_STRETCH;
     // Set SDA to 0
-    clear_sda();
-    i2c_delay();
+    clear_sda(b);
+    i2c_delay(b);
     // Clock stretching
-    while (read_scl() == 0 && clk_stretch--) ;
+    wait_scl(b);
     // Stop bit setup time, minimum 4us
-    i2c_delay();
+    i2c_delay(b);
     // SCL is high, set SDA from 0 to 1
-    if (read_sda() == 0) {
-        debug("arbitration lost in i2c_stop");
+    (void) read_sda(b);
+    // Let SDA rise before checking it, this is also the bus free time
+    i2c_delay(b);
+    if (gpio_read(b->sda_pin) == 0) {
+        arbitration_lost(b, "i2c_stop");
     }
-    i2c_delay();
-    if (!started) {
+    if (!b->started) {
         debug("link was break!");
         return false ; //If bus was stop in other way, the current transmission Failed
     }
-    started = false;
+    b->started = false;
     return true;
 }
 
 // Write a bit to I2C bus
-static void i2c_write_bit(bool bit)
+static void write_bit(i2c_bus_t *b, bool bit)
 {
-    uint32_t clk_stretch = CLK_STRETCH;
     if (bit) {
-        (void) read_sda();
+        (void) read_sda(b);
     } else {
-        clear_sda();
+        clear_sda(b);
     }
-    i2c_delay();
+    i2c_delay(b);
     // Clock stretching
-    while (read_scl() == 0 && clk_stretch--) ;
+    wait_scl(b);
     // SCL is high, now data is valid
     // If SDA is high, check that nobody else is driving SDA
-    if (bit && read_sda() == 0) {
-        debug("arbitration lost in i2c_write_bit");
+    if (bit && gpio_read(b->sda_pin) == 0) {
+        arbitration_lost(b, "i2c_write_bit");
     }
-    i2c_delay();
-    clear_scl();
+    i2c_delay(b);
+    clear_scl(b);
 }
 
 // Read a bit from I2C bus
-static bool i2c_read_bit(void)
+static bool read_bit(i2c_bus_t *b)
 {
-    uint32_t clk_stretch = CLK_STRETCH;
     bool bit;
     // Let the slave drive data
-    (void) read_sda();
-    i2c_delay();
+    (void) read_sda(b);
+    i2c_delay(b);
     // Clock stretching
-    while (read_scl() == 0 && clk_stretch--) ;
+    wait_scl(b);
     // SCL is high, now data is valid
-    bit = read_sda();
-    i2c_delay();
-    clear_scl();
+    bit = gpio_read(b->sda_pin);
+    i2c_delay(b);
+    clear_scl(b);
     return bit;
 }
 
-bool i2c_write(uint8_t byte)
+static bool write_byte(i2c_bus_t *b, uint8_t byte)
 {
     bool nack;
     uint8_t bit;
     for (bit = 0; bit < 8; bit++) {
-        i2c_write_bit((byte & 0x80) != 0);
+        write_bit(b, (byte & 0x80) != 0);
         byte <<= 1;
     }
-    nack = i2c_read_bit();
+    nack = read_bit(b);
+    b->stats.bytes++;
     return !nack;
 }
 
-uint8_t i2c_read(bool ack)
+static uint8_t read_byte(i2c_bus_t *b, bool ack)
 {
     uint8_t byte = 0;
     uint8_t bit;
     for (bit = 0; bit < 8; bit++) {
-        byte = (byte << 1) | i2c_read_bit();
+        byte = (byte << 1) | read_bit(b);
     }
-    i2c_write_bit(ack);
+    write_bit(b, ack);
+    b->stats.bytes++;
     return byte;
 }
 
-void i2c_force_bus(bool state)
+// Measure one clock period, in CPU cycles, with the current delay
+static uint32_t measure_period(i2c_bus_t *b)
 {
-    force = state ;
+    uint32_t start;
+
+    taskENTER_CRITICAL();
+    start = get_ccount();
+    for (int i = 0; i < CALIBRATION_BITS; i++)
+        write_bit(b, 1);
+    start = get_ccount() - start;
+    taskEXIT_CRITICAL();
+
+    return start / CALIBRATION_BITS;
 }
 
-static int i2c_bus_test()
+// Clock the bus with SDA released and time it. This is also the usual bus
+// recovery sequence, it lets a slave stuck in a read finish its byte.
+static int calibrate(i2c_bus_t *b)
+{
+    b->cpu_mhz = sdk_system_get_cpu_freq();
+    b->overhead_cycles = 0;
+    b->delay_cycles = 0;
+    b->stretch_cycles = b->stretch_us * b->cpu_mhz;
+    b->timeout = false;
+
+    b->overhead_cycles = measure_period(b);
+    set_timing(b);
+    b->stats.scl_freq = b->cpu_mhz * 1000000 / measure_period(b);
+
+    // Leave the bus idle
+    bus_stop(b);
+    b->arb_lost = false;
+
+    debug("SCL %d Hz, target %d Hz", b->stats.scl_freq, b->freq);
+
+    return b->timeout ? -ETIMEDOUT : 0;
+}
+
+static int bus_test(i2c_bus_t *b)
 {
     taskENTER_CRITICAL(); // To prevent task swaping after checking flag and before set it!
-    bool status = flag ; // get current status
-    if(force)
+    bool status = b->flag ; // get current status
+    if(b->force)
     {
-        flag = true ; // force bus on
+        b->flag = true ; // force bus on
         taskEXIT_CRITICAL();
         if(status)
-           i2c_stop(); //Bus was busy, stop it.
+           bus_stop(b); //Bus was busy, stop it.
     }
     else
     {
         if (status)
         {
+            b->stats.busy++;
             taskEXIT_CRITICAL();
             debug("busy");
             taskYIELD(); // If bus busy, change task to try finish last com.
@@ -260,68 +321,284 @@ static int i2c_bus_test()
         }
         else
         {
-            flag = true ; // Set Bus busy
+            b->flag = true ; // Set Bus busy
             taskEXIT_CRITICAL();
         }
     }
+    b->timeout = false;
+    b->arb_lost = false;
     return 0 ;
 }
 
-int i2c_slave_write(uint8_t slave_addr, const uint8_t *data, const uint8_t *buf, uint32_t len)
+// Account for one transaction started at cycle count 'start'
+static int finish(i2c_bus_t *b, uint32_t start, int err)
 {
-    if(i2c_bus_test())
-        return -EBUSY ;
-    i2c_start();
-    if (!i2c_write(slave_addr << 1))
+    uint32_t us = (get_ccount() - start) / b->cpu_mhz;
+
+    if (!err && b->timeout)
+        err = -ETIMEDOUT;
+    if (!err && b->arb_lost)
+        err = -EIO;
+    if (b->timeout)
+        b->stats.timeouts++;
+    if (b->arb_lost)
+        b->stats.arbitration++;
+    b->timeout = false;
+    b->arb_lost = false;
+
+    b->stats.transactions++;
+    if (err)
+        b->stats.errors++;
+    b->stats.busy_us += us;
+    if (us > b->stats.max_us)
+        b->stats.max_us = us;
+
+    return err;
+}
+
+static int do_write(i2c_bus_t *b, uint8_t slave_addr, const uint8_t *data, const uint8_t *buf, uint32_t len)
+{
+    bus_start(b);
+    if (!write_byte(b, slave_addr << 1))
         goto error;
     if(data != NULL)
-        if (!i2c_write(*data))
+        if (!write_byte(b, *data))
             goto error;
     while (len--) {
-        if (!i2c_write(*buf++))
+        if (!write_byte(b, *buf++))
             goto error;
     }
-    if (!i2c_stop())
-        goto error;
-    flag = false ; // Bus free
+    if (!bus_stop(b))
+        return -EIO;
     return 0;
 
     error:
     debug("Write Error");
-    i2c_stop();
-    flag = false ; // Bus free
+    b->stats.nacks++;
+    bus_stop(b);
     return -EIO;
 }
 
-int i2c_slave_read(uint8_t slave_addr, const uint8_t *data, uint8_t *buf, uint32_t len)
+// With 'restart' the register address write is followed by a repeated
+// start, otherwise by a stop and a new start.
+static int do_read(i2c_bus_t *b, uint8_t slave_addr, const uint8_t *data, uint8_t *buf, uint32_t len, bool restart)
 {
-    if(i2c_bus_test())
-        return -EBUSY ;
     if(data != NULL) {
-        i2c_start();
-        if (!i2c_write(slave_addr << 1))
+        bus_start(b);
+        if (!write_byte(b, slave_addr << 1))
             goto error;
-        if (!i2c_write(*data))
-            goto error;
-        if (!i2c_stop())
+        if (!write_byte(b, *data))
             goto error;
+        if (!restart && !bus_stop(b))
+            return -EIO;
     }
-    i2c_start();
-    if (!i2c_write(slave_addr << 1 | 1)) // Slave address + read
+    bus_start(b);
+    if (!write_byte(b, slave_addr << 1 | 1)) // Slave address + read
         goto error;
     while(len) {
-        *buf = i2c_read(len == 1);
+        *buf = read_byte(b, len == 1);
         buf++;
         len--;
     }
-    if (!i2c_stop())
-        goto error;
-    flag = false ; // Bus free
+    if (!bus_stop(b))
+        return -EIO;
     return 0;
 
     error:
     debug("Read Error");
-    i2c_stop();
-    flag = false ; // Bus free
+    b->stats.nacks++;
+    bus_stop(b);
     return -EIO;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+/// Bus API
+///////////////////////////////////////////////////////////////////////////////
+
+int i2c_bus_init(uint8_t bus, uint8_t scl_pin, uint8_t sda_pin, uint32_t freq)
+{
+    if (bus >= I2C_MAX_BUS || !freq)
+        return -EINVAL;
+
+    i2c_bus_t *b = &buses[bus];
+    bool force = b->force;
+    memset(b, 0, sizeof(*b));
+    b->force = force;
+    b->scl_pin = scl_pin;
+    b->sda_pin = sda_pin;
+    b->freq = freq;
+    b->stretch_us = I2C_CLK_STRETCH_US;
+
+    // Just to prevent these pins floating too much if not connected.
+    gpio_set_pullup(scl_pin, 1, 1);
+    gpio_set_pullup(sda_pin, 1, 1);
+
+    gpio_enable(scl_pin, GPIO_OUT_OPEN_DRAIN);
+    gpio_enable(sda_pin, GPIO_OUT_OPEN_DRAIN);
+
+    // I2C bus idle state.
+    gpio_write(scl_pin, 1);
+    gpio_write(sda_pin, 1);
+
+    return calibrate(b);
+}
+
+int i2c_bus_set_freq(uint8_t bus, uint32_t freq)
+{
+    i2c_bus_t *b = get_bus(bus);
+    int err;
+
+    if (!b || !freq)
+        return -EINVAL;
+    if (bus_test(b))
+        return -EBUSY;
+    b->freq = freq;
+    err = calibrate(b);
+    b->flag = false;
+
+    return err;
+}
+
+void i2c_bus_set_clock_stretch(uint8_t bus, uint32_t us)
+{
+    i2c_bus_t *b = get_bus(bus);
+
+    if (b) {
+        b->stretch_us = us;
+        b->stretch_cycles = us * b->cpu_mhz;
+    }
+}
+
+int i2c_bus_transfer(uint8_t bus, i2c_op_t *ops, uint32_t count)
+{
+    i2c_bus_t *b = get_bus(bus);
+    int res = 0;
+
+    if (!b)
+        return -EINVAL;
+    if (bus_test(b))
+        return -EBUSY;
+
+    for (uint32_t i = 0; i < count; i++) {
+        i2c_op_t *op = &ops[i];
+        const uint8_t *reg = op->has_reg ? &op->reg : NULL;
+        uint32_t start = get_ccount();
+        int err;
+
+        if (op->read)
+            err = do_read(b, op->addr, reg, op->buf, op->len, true);
+        else
+            err = do_write(b, op->addr, reg, op->buf, op->len);
+        op->result = finish(b, start, err);
+        if (op->result)
+            res = -EIO;
+    }
+    b->flag = false ; // Bus free
+
+    return res;
+}
+
+int i2c_bus_slave_write(uint8_t bus, uint8_t slave_addr, const uint8_t *data, const uint8_t *buf, uint32_t len)
+{
+    i2c_bus_t *b = get_bus(bus);
+    int err;
+
+    if (!b)
+        return -EINVAL;
+    if(bus_test(b))
+        return -EBUSY ;
+    uint32_t start = get_ccount();
+    err = finish(b, start, do_write(b, slave_addr, data, buf, len));
+    b->flag = false ; // Bus free
+    return err;
+}
+
+int i2c_bus_slave_read(uint8_t bus, uint8_t slave_addr, const uint8_t *data, uint8_t *buf, uint32_t len)
+{
+    i2c_bus_t *b = get_bus(bus);
+    int err;
+
+    if (!b)
+        return -EINVAL;
+    if(bus_test(b))
+        return -EBUSY ;
+    uint32_t start = get_ccount();
+    err = finish(b, start, do_read(b, slave_addr, data, buf, len, false));
+    b->flag = false ; // Bus free
+    return err;
+}
+
+void i2c_bus_get_stats(uint8_t bus, i2c_stats_t *stats)
+{
+    i2c_bus_t *b = get_bus(bus);
+
+    if (!b) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    taskENTER_CRITICAL();
+    *stats = b->stats;
+    taskEXIT_CRITICAL();
+}
+
+void i2c_bus_reset_stats(uint8_t bus)
+{
+    i2c_bus_t *b = get_bus(bus);
+
+    if (b) {
+        taskENTER_CRITICAL();
+        uint32_t scl_freq = b->stats.scl_freq;
+        memset(&b->stats, 0, sizeof(b->stats));
+        b->stats.scl_freq = scl_freq;
+        taskEXIT_CRITICAL();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Level 0 and Level 1 API, on bus 0
+///////////////////////////////////////////////////////////////////////////////
+
+inline bool i2c_status(void)
+{
+    return buses[0].started;
+}
+
+void i2c_init(uint8_t scl_pin, uint8_t sda_pin)
+{
+    i2c_bus_init(0, scl_pin, sda_pin, I2C_DEFAULT_FREQ);
+}
+
+void i2c_start(void)
+{
+    bus_start(&buses[0]);
+}
+
+bool i2c_stop(void)
+{
+    return bus_stop(&buses[0]);
+}
+
+bool i2c_write(uint8_t byte)
+{
+    return write_byte(&buses[0], byte);
+}
+
+uint8_t i2c_read(bool ack)
+{
+    return read_byte(&buses[0], ack);
+}
+
+void i2c_force_bus(bool state)
+{
+    buses[0].force = state ;
+}
+
+int i2c_slave_write(uint8_t slave_addr, const uint8_t *data, const uint8_t *buf, uint32_t len)
+{
+    return i2c_bus_slave_write(0, slave_addr, data, buf, len);
+}
+
+int i2c_slave_read(uint8_t slave_addr, const uint8_t *data, uint8_t *buf, uint32_t len)
+{
+    return i2c_bus_slave_read(0, slave_addr, data, buf, len);
+}
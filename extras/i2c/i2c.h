@@ -36,34 +36,153 @@ extern "C" {
 #endif
 
 
-#define I2C_FREQUENCY_400K true  // for test WIP
-
 /*
- *  Some bit can be transmit slower.
- *  Selected frequency fix the speed of a bit transmission
- *  I2C lib take the maximum frequency defined
- *  Don't change frequency when I2C transaction had begin
- */
-
-#ifdef I2C_FREQUENCY_500K
-#define I2C_CUSTOM_DELAY_160MHZ   6
-#define I2C_CUSTOM_DELAY_80MHZ    1   //Sry, maximum is 320kHz at 80MHz
-#elif defined(I2C_FREQUENCY_400K)
-#define I2C_CUSTOM_DELAY_160MHZ   10
-#define I2C_CUSTOM_DELAY_80MHZ    1   //Sry, maximum is 320kHz at 80MHz
+ * Several buses can be driven, each on its own pin pair. Bus 0 is the one
+ * used by the Level 0 and Level 1 API below, and by the sensor drivers.
+ *
+ * The SCL frequency is set in Hz per bus and calibrated at runtime: the
+ * driver measures how many CPU cycles a clock period takes without any
+ * delay and pads each half period from the cycle counter to reach the
+ * target. The measured frequency is reported by i2c_bus_get_stats(). If
+ * the target cannot be reached the bus runs as fast as it can, that is
+ * about 320kHz at 80MHz CPU clock.
+ *
+ * I2C_FREQUENCY_100K / I2C_FREQUENCY_500K select the default frequency
+ * of bus 0 as before, 400kHz otherwise.
+ */
+
+#ifndef I2C_MAX_BUS
+#define I2C_MAX_BUS         2
+#endif
+
+#ifndef I2C_DEFAULT_FREQ
+#if defined(I2C_FREQUENCY_500K)
+#define I2C_DEFAULT_FREQ    500000
+#elif defined(I2C_FREQUENCY_100K)
+#define I2C_DEFAULT_FREQ    100000
 #else
-#define I2C_CUSTOM_DELAY_160MHZ   100
-#define I2C_CUSTOM_DELAY_80MHZ    20
+#define I2C_DEFAULT_FREQ    400000
+#endif
+#endif
+
+/*
+ * Longest time a slave may hold SCL low (clock stretching) before the
+ * transaction fails with -ETIMEDOUT. Can be changed per bus with
+ * i2c_bus_set_clock_stretch().
+ */
+#ifndef I2C_CLK_STRETCH_US
+#define I2C_CLK_STRETCH_US  250
 #endif
 
 // I2C driver for ESP8266 written for use with esp-open-rtos
 // Based on https://en.wikipedia.org/wiki/I²C#Example_of_bit-banging_the_I.C2.B2C_Master_protocol
-// With calling overhead, we end up at ~320kbit/s
+
+/**
+ * Per bus counters, see i2c_bus_get_stats()
+ */
+typedef struct {
+    uint32_t transactions;  //!< Completed transactions (ops in a batch)
+    uint32_t errors;        //!< Failed transactions
+    uint32_t nacks;         //!< Address or data byte not acknowledged
+    uint32_t timeouts;      //!< Clock stretching longer than the budget
+    uint32_t arbitration;   //!< Lost arbitration, SDA held low by someone else
+    uint32_t busy;          //!< Calls rejected with -EBUSY
+    uint32_t bytes;         //!< Bytes transferred, address bytes included
+    uint32_t busy_us;       //!< Total time the bus was in use
+    uint32_t max_us;        //!< Longest single call
+    uint32_t scl_freq;      //!< Measured SCL frequency in Hz
+} i2c_stats_t;
+
+/**
+ * One transaction of a batch, see i2c_bus_transfer()
+ *
+ * A write sends the register address if has_reg is set, followed by 'len'
+ * bytes from 'buf'. A read sends the register address if has_reg is set,
+ * then a repeated start and reads 'len' bytes into 'buf'.
+ */
+typedef struct {
+    uint8_t addr;           //!< 7-bit slave address
+    bool read;
+    bool has_reg;
+    uint8_t reg;
+    uint8_t *buf;
+    uint16_t len;
+    int result;             //!< Set by i2c_bus_transfer(), 0 or -errno
+} i2c_op_t;
+
+#define I2C_WRITE_REG(_addr, _reg, _buf, _len) \
+    { .addr = (_addr), .read = false, .has_reg = true, .reg = (_reg), .buf = (_buf), .len = (_len) }
+#define I2C_READ_REG(_addr, _reg, _buf, _len) \
+    { .addr = (_addr), .read = true, .has_reg = true, .reg = (_reg), .buf = (_buf), .len = (_len) }
+
+//Bus API
+
+/**
+ * Init bitbanging I2C bus on given pins and calibrate its clock.
+ * Clocks 9 pulses with SDA released to measure the bus timing, which also
+ * frees a slave left holding SDA by an interrupted transaction.
+ * @param bus Bus number, 0..I2C_MAX_BUS-1
+ * @param scl_pin SCL pin for I2C
+ * @param sda_pin SDA pin for I2C
+ * @param freq SCL frequency in Hz, e.g. 100000, 400000 or 1000000
+ * @return Non-Zero if error occured
+ */
+int i2c_bus_init(uint8_t bus, uint8_t scl_pin, uint8_t sda_pin, uint32_t freq);
+
+/**
+ * Change the SCL frequency of a bus and calibrate it again.
+ * Also call it after changing the CPU frequency.
+ * @param bus Bus number
+ * @param freq SCL frequency in Hz
+ * @return Non-Zero if error occured
+ */
+int i2c_bus_set_freq(uint8_t bus, uint32_t freq);
+
+/**
+ * Set the clock stretching budget of a bus.
+ * @param bus Bus number
+ * @param us Longest time a slave may hold SCL low
+ */
+void i2c_bus_set_clock_stretch(uint8_t bus, uint32_t us);
+
+/**
+ * Run a list of transactions back to back, each ended with a stop
+ * condition. The bus is taken once for the whole list and a failing
+ * transaction does not stop the ones after it.
+ * @param bus Bus number
+ * @param ops Transactions, the result of each is stored in its 'result'
+ * @param count Number of transactions
+ * @return 0 if all succeeded, -EIO if any failed, -EBUSY if bus is busy
+ */
+int i2c_bus_transfer(uint8_t bus, i2c_op_t *ops, uint32_t count);
+
+/**
+ * Same as i2c_slave_write() on the given bus
+ */
+int i2c_bus_slave_write(uint8_t bus, uint8_t slave_addr, const uint8_t *data, const uint8_t *buf, uint32_t len);
+
+/**
+ * Same as i2c_slave_read() on the given bus
+ */
+int i2c_bus_slave_read(uint8_t bus, uint8_t slave_addr, const uint8_t *data, uint8_t *buf, uint32_t len);
+
+/**
+ * Get the counters of a bus.
+ * @param bus Bus number
+ * @param stats Filled with the counters
+ */
+void i2c_bus_get_stats(uint8_t bus, i2c_stats_t *stats);
+
+/**
+ * Reset the counters of a bus. The measured SCL frequency is kept.
+ * @param bus Bus number
+ */
+void i2c_bus_reset_stats(uint8_t bus);
 
 //Level 0 API
 
 /**
- * Init bitbanging I2C driver on given pins
+ * Init bitbanging I2C driver on given pins as bus 0, at I2C_DEFAULT_FREQ
  * @param scl_pin SCL pin for I2C
  * @param sda_pin SDA pin for I2C
  */
@@ -152,6 +152,23 @@ i2s_clock_div_t i2s_get_clock_div(int32_t freq)
     return div;
 }
 
+bool i2s_dma_set_bits_per_sample(uint8_t bits)
+{
+    switch (bits) {
+        case 16:
+            I2S.FIFO_CONF = SET_FIELD(I2S.FIFO_CONF, I2S_FIFO_CONF_TX_FIFO_MOD, 0);
+            I2S.CONF = SET_FIELD(I2S.CONF, I2S_CONF_BITS_MOD, 0);
+            return true;
+        case 24:
+            // 24 bits per channel, one 32-bit word per channel
+            I2S.FIFO_CONF = SET_FIELD(I2S.FIFO_CONF, I2S_FIFO_CONF_TX_FIFO_MOD, 2);
+            I2S.CONF = SET_FIELD(I2S.CONF, I2S_CONF_BITS_MOD, 8);
+            return true;
+        default:
+            return false;
+    }
+}
+
 void i2s_dma_start(dma_descriptor_t *descr)
 {
     // configure DMA descriptor
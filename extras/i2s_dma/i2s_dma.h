@@ -74,6 +74,17 @@ void i2s_dma_init(i2s_dma_isr_t isr, i2s_clock_div_t clock_div, i2s_pins_t pins)
  */
 i2s_clock_div_t i2s_get_clock_div(int32_t freq);
 
+/**
+ * Set the number of bits per channel, 16 (the default) or 24.
+ *
+ * With 16 bits each 32-bit word in the DMA buffers holds a stereo frame,
+ * with the left sample in the lower half. With 24 bits each channel takes
+ * a 32-bit word with the sample in the upper 24 bits, left channel first.
+ *
+ * @return false if the number of bits is not supported
+ */
+bool i2s_dma_set_bits_per_sample(uint8_t bits);
+
 /**
  * Start I2S transmittion.
  *
@@ -0,0 +1,9 @@
+# Component makefile for extras/i2s_stream
+
+# expected anyone using it includes it as 'i2s_stream/i2s_stream.h'
+INC_DIRS += $(i2s_stream_ROOT)..
+
+# args for passing into compile rule generation
+i2s_stream_SRC_DIR = $(i2s_stream_ROOT)
+
+$(eval $(call component_compile_rules,i2s_stream))
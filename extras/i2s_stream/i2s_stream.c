@@ -0,0 +1,350 @@
+/**
+ * Streaming audio output over I2S.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include "i2s_stream.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BLOCK_SIZE 4088
+
+/*
+ * The blocks form a ring which the DMA plays in order. Blocks tail to
+ * tail + filled - 1 are queued for the DMA, tail being the one playing.
+ * The writer fills block head = tail + filled, which is free as long as
+ * filled < block_count. The interrupt moves tail on as blocks finish and
+ * stops the DMA when nothing is left queued.
+ */
+static dma_descriptor_t *ring;
+static uint8_t *buffers;
+static i2s_stream_config_t config;
+
+static volatile uint32_t tail;
+static volatile uint32_t filled;
+static uint32_t head;
+static uint32_t head_offset;
+
+static volatile bool running;
+static volatile bool draining;
+static SemaphoreHandle_t space;
+
+static i2s_stream_stats_t stats;
+
+static void stream_isr_handler(void)
+{
+    BaseType_t woken = pdFALSE;
+
+    if (!i2s_dma_is_eof_interrupt()) {
+        i2s_dma_clear_interrupt();
+        return;
+    }
+    uint32_t last = i2s_dma_get_eof_descriptor() - ring;
+    i2s_dma_clear_interrupt();
+
+    if (!running || last >= config.block_count) {
+        return;
+    }
+
+    // Normally one block, but catch up if an interrupt was missed
+    while (filled) {
+        uint32_t i = tail;
+        tail = (tail + 1) % config.block_count;
+        filled--;
+        stats.blocks++;
+        if (i == last) {
+            break;
+        }
+    }
+
+    if (!filled) {
+        // The DMA has moved on to the block being written, or beyond
+        i2s_dma_stop();
+        running = false;
+        if (!draining) {
+            stats.underruns++;
+        }
+    }
+
+    xSemaphoreGiveFromISR(space, &woken);
+    portEND_SWITCHING_ISR(woken);
+}
+
+/* Called with interrupts disabled */
+static void start_output(void)
+{
+    running = true;
+    i2s_dma_start(&ring[tail]);
+}
+
+static void commit_block(bool start)
+{
+    taskENTER_CRITICAL();
+    head = (head + 1) % config.block_count;
+    head_offset = 0;
+    filled++;
+    if (!running && (start || filled >= config.start_blocks)) {
+        start_output();
+    }
+    taskEXIT_CRITICAL();
+}
+
+static bool wait_for_space(TickType_t timeout)
+{
+    while (filled >= config.block_count) {
+        if (!timeout || !xSemaphoreTake(space, timeout)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Sample conversion. Pairs of 16 bit samples are loaded as words where
+ * the input is word aligned.
+ */
+
+static inline uint32_t load_pair(const int16_t *src)
+{
+    return (uint16_t)src[0] | ((uint32_t)(uint16_t)src[1] << 16);
+}
+
+static void convert_stereo_16(uint32_t *dst, const int16_t *src, size_t frames)
+{
+    if (!((uintptr_t)src & 3)) {
+        memcpy(dst, src, frames * 4);
+        return;
+    }
+    for (size_t i = 0; i < frames; i++, src += 2) {
+        dst[i] = load_pair(src);
+    }
+}
+
+static void convert_mono_16(uint32_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+    if ((uintptr_t)src & 3) {
+        uint32_t s = (uint16_t)src[i];
+        dst[i++] = s | (s << 16);
+    }
+    const uint32_t *w = (const uint32_t *)(src + i);
+    for (; i + 1 < frames; i += 2) {
+        uint32_t pair = *w++;
+        dst[i] = (pair & 0xffff) | (pair << 16);
+        dst[i + 1] = (pair & 0xffff0000) | (pair >> 16);
+    }
+    if (i < frames) {
+        uint32_t s = (uint16_t)src[i];
+        dst[i] = s | (s << 16);
+    }
+}
+
+static void convert_stereo_24(uint32_t *dst, const int16_t *src, size_t frames)
+{
+    const uint32_t *w = (const uint32_t *)src;
+    bool aligned = !((uintptr_t)src & 3);
+
+    for (size_t i = 0; i < frames; i++) {
+        uint32_t frame = aligned ? w[i] : load_pair(src + i * 2);
+        *dst++ = frame << 16;
+        *dst++ = frame & 0xffff0000;
+    }
+}
+
+static void convert_mono_24(uint32_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+    if ((uintptr_t)src & 3) {
+        uint32_t s = (uint32_t)src[i++] << 16;
+        *dst++ = s;
+        *dst++ = s;
+    }
+    const uint32_t *w = (const uint32_t *)(src + i);
+    for (; i + 1 < frames; i += 2) {
+        uint32_t pair = *w++;
+        *dst++ = pair << 16;
+        *dst++ = pair << 16;
+        *dst++ = pair & 0xffff0000;
+        *dst++ = pair & 0xffff0000;
+    }
+    if (i < frames) {
+        uint32_t s = (uint32_t)src[i] << 16;
+        *dst++ = s;
+        *dst++ = s;
+    }
+}
+
+static inline uint32_t out_frame_size(void)
+{
+    return config.out_bits == 16 ? 4 : 8;
+}
+
+static void convert(uint32_t *dst, const int16_t *src, size_t frames)
+{
+    if (config.out_bits == 16) {
+        if (config.channels == 2) {
+            convert_stereo_16(dst, src, frames);
+        } else {
+            convert_mono_16(dst, src, frames);
+        }
+    } else {
+        if (config.channels == 2) {
+            convert_stereo_24(dst, src, frames);
+        } else {
+            convert_mono_24(dst, src, frames);
+        }
+    }
+}
+
+void i2s_stream_get_default_config(i2s_stream_config_t *cfg)
+{
+    cfg->sample_rate = 44100;
+    cfg->channels = 2;
+    cfg->out_bits = 16;
+    cfg->block_size = 1024;
+    cfg->block_count = 4;
+    cfg->start_blocks = 2;
+    cfg->pins.data = true;
+    cfg->pins.clock = true;
+    cfg->pins.ws = true;
+}
+
+bool i2s_stream_init(const i2s_stream_config_t *cfg)
+{
+    if ((cfg->channels != 1 && cfg->channels != 2) ||
+            (cfg->out_bits != 16 && cfg->out_bits != 24) ||
+            !cfg->block_size || cfg->block_size % 8 ||
+            cfg->block_size > MAX_BLOCK_SIZE ||
+            cfg->block_count < 2 || !cfg->start_blocks ||
+            cfg->start_blocks > cfg->block_count) {
+        return false;
+    }
+
+    i2s_stream_deinit();
+    config = *cfg;
+
+    ring = malloc(config.block_count * sizeof(dma_descriptor_t));
+    buffers = malloc(config.block_count * config.block_size);
+    space = xSemaphoreCreateBinary();
+    if (!ring || !buffers || !space) {
+        i2s_stream_deinit();
+        return false;
+    }
+
+    for (int i = 0; i < config.block_count; i++) {
+        ring[i].owner = 1;
+        ring[i].eof = 1;
+        ring[i].sub_sof = 0;
+        ring[i].unused = 0;
+        ring[i].buf_ptr = buffers + i * config.block_size;
+        ring[i].datalen = config.block_size;
+        ring[i].blocksize = config.block_size;
+        ring[i].next_link_ptr = &ring[(i + 1) % config.block_count];
+    }
+
+    tail = head = head_offset = filled = 0;
+    running = draining = false;
+    memset(&stats, 0, sizeof(stats));
+
+    i2s_dma_init(stream_isr_handler,
+            i2s_get_clock_div(config.sample_rate * 2 * config.out_bits),
+            config.pins);
+    i2s_dma_set_bits_per_sample(config.out_bits);
+
+    return true;
+}
+
+void i2s_stream_deinit(void)
+{
+    if (running) {
+        taskENTER_CRITICAL();
+        i2s_dma_stop();
+        running = false;
+        taskEXIT_CRITICAL();
+    }
+    free(ring);
+    ring = NULL;
+    free(buffers);
+    buffers = NULL;
+    if (space) {
+        vSemaphoreDelete(space);
+        space = NULL;
+    }
+}
+
+size_t i2s_stream_write(const int16_t *samples, size_t frames,
+        TickType_t timeout)
+{
+    size_t written = 0;
+    uint32_t frame_size = out_frame_size();
+
+    if (!ring) {
+        return 0;
+    }
+
+    while (written < frames) {
+        if (!head_offset && !wait_for_space(timeout)) {
+            break;
+        }
+
+        size_t n = (config.block_size - head_offset) / frame_size;
+        if (n > frames - written) {
+            n = frames - written;
+        }
+        convert((uint32_t *)(buffers + head * config.block_size + head_offset),
+                samples + written * config.channels, n);
+        head_offset += n * frame_size;
+        written += n;
+
+        if (head_offset == config.block_size) {
+            commit_block(false);
+        }
+    }
+
+    return written;
+}
+
+bool i2s_stream_flush(TickType_t timeout)
+{
+    if (!ring) {
+        return false;
+    }
+
+    draining = true;
+    if (head_offset) {
+        memset(buffers + head * config.block_size + head_offset, 0,
+                config.block_size - head_offset);
+        commit_block(true);
+    } else {
+        taskENTER_CRITICAL();
+        if (filled && !running) {
+            start_output();
+        }
+        taskEXIT_CRITICAL();
+    }
+
+    bool ok = true;
+    while (filled) {
+        if (!timeout || !xSemaphoreTake(space, timeout)) {
+            ok = false;
+            break;
+        }
+    }
+    draining = false;
+
+    return ok;
+}
+
+void i2s_stream_get_stats(i2s_stream_stats_t *s)
+{
+    taskENTER_CRITICAL();
+    *s = stats;
+    taskEXIT_CRITICAL();
+}
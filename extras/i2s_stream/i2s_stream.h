@@ -0,0 +1,91 @@
+/**
+ * Streaming audio output over I2S, built on extras/i2s_dma.
+ *
+ * Samples are written with i2s_stream_write(), which converts them to the
+ * output format straight into a ring of DMA blocks. The DMA interrupt hands
+ * each block back once it has been played. If the writer falls behind and
+ * the ring runs empty, output is stopped and an underrun is counted. Output
+ * starts again once enough blocks are queued, so stale data is never
+ * replayed.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#ifndef __I2S_STREAM_H__
+#define __I2S_STREAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <FreeRTOS.h>
+#include "i2s_dma/i2s_dma.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t sample_rate;   ///< Frames per second
+    uint8_t channels;       ///< Channels of the written samples, 1 or 2
+    uint8_t out_bits;       ///< Bits per channel on the bus, 16 or 24
+    uint16_t block_size;    ///< Bytes per DMA block, multiple of 8, max 4088
+    uint8_t block_count;    ///< Number of DMA blocks in the ring, at least 2
+    uint8_t start_blocks;   ///< Blocks to queue before output (re)starts
+    i2s_pins_t pins;        ///< I2S pins to enable
+} i2s_stream_config_t;
+
+typedef struct {
+    uint32_t blocks;        ///< Blocks played
+    uint32_t underruns;     ///< Times the ring ran empty while playing
+} i2s_stream_stats_t;
+
+/**
+ * Fill in the default configuration: 44100Hz 16 bit stereo in and out, 4
+ * blocks of 1024 bytes, output starting after 2 blocks, all pins enabled.
+ */
+void i2s_stream_get_default_config(i2s_stream_config_t *config);
+
+/**
+ * Allocate the ring and set up I2S. Output starts with the first write.
+ *
+ * @return false on a bad configuration or if out of memory
+ */
+bool i2s_stream_init(const i2s_stream_config_t *config);
+
+/**
+ * Stop output and free the ring.
+ */
+void i2s_stream_deinit(void);
+
+/**
+ * Write 16 bit signed samples, interleaved if stereo.
+ *
+ * @param samples Samples to write, must be 2-byte aligned
+ * @param frames Number of frames (one sample per channel)
+ * @param timeout Ticks to wait for space in the ring, 0 to fail at once
+ *     when it is full
+ *
+ * @return Number of frames written, less than frames on timeout
+ */
+size_t i2s_stream_write(const int16_t *samples, size_t frames,
+        TickType_t timeout);
+
+/**
+ * Pad the last partial block with silence and wait until everything
+ * written has been played. Output stops afterwards without counting an
+ * underrun.
+ *
+ * @return false on timeout
+ */
+bool i2s_stream_flush(TickType_t timeout);
+
+/**
+ * Get the block and underrun counters.
+ */
+void i2s_stream_get_stats(i2s_stream_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __I2S_STREAM_H__ */
@@ -8,3 +8,6 @@ onewire_INC_DIR =
 onewire_SRC_DIR = $(onewire_ROOT)
 
 $(eval $(call component_compile_rules,onewire))
+
+# onewire.c uses the CRC routines from extras/crc
+include $(ROOT)extras/crc/component.mk
@@ -15,6 +15,8 @@
  *******************************************************************************/
 #include <espressif/esp_common.h>
 #include <lwip/arch.h>
+#include <stdlib.h>
+#include <string.h>
 #include "MQTTClient.h"
 
 static void new_message_data(mqtt_message_data_t* md, mqtt_string_t* aTopicName, mqtt_message_t* aMessgage) {
@@ -23,8 +25,58 @@ static void new_message_data(mqtt_message_data_t* md, mqtt_string_t* aTopicName,
 }
 
 
+static mqtt_inflight_t* find_inflight(mqtt_client_t* c, unsigned short id)
+{
+    int i;
+
+    for (i = 0; i < c->inflight_window; ++i)
+    {
+        if (c->inflight[i].id == id)
+            return &c->inflight[i];
+    }
+    return NULL;
+}
+
+
 static int get_next_packet_id(mqtt_client_t *c) {
-    return c->next_packetid = (c->next_packetid == MQTT_MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    // skip ids still waiting for an ack, there are never more than inflight_window
+    do
+        c->next_packetid = (c->next_packetid == MQTT_MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    while (c->inflight_count && find_inflight(c, c->next_packetid));
+    return c->next_packetid;
+}
+
+
+static void release_inflight(mqtt_client_t* c, mqtt_inflight_t* e)
+{
+    free(e->packet);
+    memset(e, 0, sizeof(*e));
+    --(c->inflight_count);
+}
+
+
+static void complete_inflight(mqtt_client_t* c, mqtt_inflight_t* e, int rc)
+{
+    unsigned short id = e->id;
+    mqtt_publish_cb_t cb = e->cb;
+    void* arg = e->arg;
+
+    // free the slot first so the callback sees the window with room in it
+    release_inflight(c, e);
+    if (cb)
+        cb(c, id, rc, arg);
+}
+
+
+static void fail_inflight(mqtt_client_t* c, int rc)
+{
+    int i;
+
+    for (i = 0; i < c->inflight_window && c->inflight_count; ++i)
+    {
+        if (c->inflight[i].id)
+            complete_inflight(c, &c->inflight[i], rc);
+    }
 }
 
 
@@ -81,8 +133,26 @@ exit:
 }
 
 
+// mqttread may return less than asked for, keep reading until len bytes are in
+static int read_fully(mqtt_client_t* c, unsigned char* buf, int len, mqtt_timer_t* timer)
+{
+    int rcvd = 0;
+
+    while (rcvd < len)
+    {
+        int rc = c->ipstack->mqttread(c->ipstack, buf + rcvd, len - rcvd, mqtt_timer_left_ms(timer));
+        if (rc <= 0)
+            break;
+        rcvd += rc;
+    }
+    return rcvd;
+}
+
+
 // Return packet type. If no packet avilable, return FAILURE, or READ_ERROR if timeout
-static int read_packet(mqtt_client_t* c, mqtt_timer_t* timer)
+// Waits at most wait_ms for a packet to start, and until timer expires for the rest of it
+// In streaming mode a PUBLISH too big for readbuf is left on the socket after its fixed header
+static int read_packet(mqtt_client_t* c, mqtt_timer_t* timer, int wait_ms)
 {
     int rc = MQTT_FAILURE;
     mqtt_header_t header = {0};
@@ -90,86 +160,61 @@ static int read_packet(mqtt_client_t* c, mqtt_timer_t* timer)
     int rem_len = 0;
 
     /* 1. read the header byte.  This has the packet type in it */
-    if (c->ipstack->mqttread(c->ipstack, c->readbuf, 1, mqtt_timer_left_ms(timer)) != 1)
+    if (c->ipstack->mqttread(c->ipstack, c->readbuf, 1, wait_ms) != 1)
         goto exit;
     len = 1;
     /* 2. read the remaining length.  This is variable in itself */
     len += decode_packet(c, &rem_len, mqtt_timer_left_ms(timer));
-    if (len <= 1 || len + rem_len > c->readbuf_size) /* if packet is too big to fit in our readbuf, abort */
+    header.byte = c->readbuf[0];
+    if (len <= 1)
     {
         rc = MQTT_READ_ERROR;
         goto exit;
     }
+    if (len + rem_len > c->readbuf_size) /* if packet is too big to fit in our readbuf, abort */
+    {
+        if (c->streaming && header.bits.type == MQTTPACKET_PUBLISH)
+        {
+            // cycle() reads the rest while handing it to the handlers
+            mqtt_packet_encode(c->readbuf + 1, rem_len);
+            rc = MQTTPACKET_PUBLISH;
+        }
+        else
+            rc = MQTT_READ_ERROR;
+        goto exit;
+    }
     mqtt_packet_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, mqtt_timer_left_ms(timer)) != rem_len))
+    if (rem_len > 0 && read_fully(c, c->readbuf + len, rem_len, timer) != rem_len)
     {
         rc = MQTT_READ_ERROR;
         goto exit;
     }
-    header.byte = c->readbuf[0];
     rc = header.bits.type;
 exit:
     return rc;
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-static char is_topic_matched(char* topicFilter, mqtt_string_t* topicName)
+static void call_handler(mqtt_message_handler_t handler, void* arg)
 {
-    char* curf = topicFilter;
-    char* curn = topicName->lenstring.data;
-    char* curn_end = curn + topicName->lenstring.len;
-
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
+    handler((mqtt_message_data_t*)arg);
 }
 
 
 static int deliver_message(mqtt_client_t* c, mqtt_string_t* topicName, mqtt_message_t* message)
 {
-    int i;
     int rc = MQTT_FAILURE;
+    mqtt_message_data_t md;
 
-    // we have to find the right message handler - indexed by topic
-    for (i = 0; i < MQTT_MAX_MESSAGE_HANDLERS; ++i)
-    {
-        if (c->messageHandlers[i].topicFilter != 0 && (mqtt_packet_equals(topicName, (char*)c->messageHandlers[i].topicFilter) ||
-                is_topic_matched((char*)c->messageHandlers[i].topicFilter, topicName)))
-        {
-            if (c->messageHandlers[i].fp != NULL)
-            {
-                mqtt_message_data_t md;
-                new_message_data(&md, topicName, message);
-                c->messageHandlers[i].fp(&md);
-                rc = MQTT_SUCCESS;
-            }
-        }
-    }
+    new_message_data(&md, topicName, message);
+    // we have to find the right message handlers - indexed by topic level
+    if (mqtt_topic_trie_match(&c->subscriptions, topicName->lenstring.data, topicName->lenstring.len,
+            call_handler, &md) > 0)
+        rc = MQTT_SUCCESS;
 
     if (rc == MQTT_FAILURE && c->defaultMessageHandler != NULL)
     {
-        mqtt_message_data_t md;
-        new_message_data(&md, topicName, message);
         c->defaultMessageHandler(&md);
         rc = MQTT_SUCCESS;
     }
@@ -178,6 +223,59 @@ static int deliver_message(mqtt_client_t* c, mqtt_string_t* topicName, mqtt_mess
 }
 
 
+// Deliver a PUBLISH that does not fit in readbuf. Its topic and packet id are
+// read in behind the fixed header, and the payload goes to the handlers in
+// pieces as it comes off the socket, each read into the rest of readbuf.
+// 'timer' is restarted whenever data arrives.
+static int stream_publish(mqtt_client_t* c, int hdr_len, int rem_len, mqtt_string_t* topicName,
+        mqtt_message_t* msg, mqtt_timer_t* timer)
+{
+    mqtt_header_t header;
+    unsigned char* cur = c->readbuf + hdr_len;
+    unsigned char* end = c->readbuf + c->readbuf_size;
+    int var_len;
+    size_t offset = 0;
+
+    header.byte = c->readbuf[0];
+    msg->dup = header.bits.dup;
+    msg->qos = (enum mqtt_qos)header.bits.qos;
+    msg->retained = header.bits.retain;
+    msg->id = 0;
+
+    mqtt_timer_init(timer);
+    mqtt_timer_countdown_ms(timer, c->command_timeout_ms);
+    if (end - cur < 2 || read_fully(c, cur, 2, timer) != 2)
+        return MQTT_READ_ERROR;
+    var_len = 2 + ((cur[0] << 8) | cur[1]) + (msg->qos != MQTT_QOS0 ? 2 : 0);
+    // the topic has to fit with room to spare for the payload
+    if (var_len > rem_len || var_len >= end - cur ||
+            read_fully(c, cur + 2, var_len - 2, timer) != var_len - 2)
+        return MQTT_READ_ERROR;
+    if (!mqtt_read_str_len(topicName, &cur, cur + var_len))
+        return MQTT_READ_ERROR;
+    if (msg->qos != MQTT_QOS0)
+        msg->id = mqtt_read_int(&cur);
+
+    msg->totallen = rem_len - var_len;
+    msg->payload = cur;
+    do
+    {
+        int n = end - cur;
+        if (n > msg->totallen - offset)
+            n = msg->totallen - offset;
+        mqtt_timer_countdown_ms(timer, c->command_timeout_ms);
+        if (n > 0 && (n = c->ipstack->mqttread(c->ipstack, cur, n, mqtt_timer_left_ms(timer))) <= 0)
+            return MQTT_READ_ERROR;
+        msg->payloadlen = n;
+        msg->offset = offset;
+        deliver_message(c, topicName, msg);
+        offset += n;
+    } while (offset < msg->totallen);
+
+    return MQTT_SUCCESS;
+}
+
+
 static int keepalive(mqtt_client_t* c)
 {
     int rc = MQTT_SUCCESS;
@@ -219,10 +317,59 @@ exit:
 }
 
 
+// send unacknowledged publishes again, or give up on them
+static void retry_inflight(mqtt_client_t* c)
+{
+    int i, len;
+
+    for (i = 0; i < c->inflight_window; ++i)
+    {
+        mqtt_inflight_t* e = &c->inflight[i];
+        mqtt_timer_t timer;
+
+        if (e->id == 0 || !mqtt_timer_expired(&e->timer))
+            continue;
+        if (e->retries >= MQTT_MAX_RETRIES)
+        {
+            complete_inflight(c, e, MQTT_FAILURE);
+            continue;
+        }
+        ++(e->retries);
+        mqtt_timer_countdown_ms(&e->timer, c->command_timeout_ms);
+
+        if (e->packet)
+        {
+            mqtt_header_t header;
+            header.byte = e->packet[0];
+            header.bits.dup = 1;
+            e->packet[0] = header.byte;
+            memcpy(c->buf, e->packet, e->len);
+            len = e->len;
+        }
+        else if ((len = mqtt_serialize_ack(c->buf, c->buf_size, MQTTPACKET_PUBREL, 0, e->id)) <= 0)
+            continue;
+
+        mqtt_timer_init(&timer);
+        mqtt_timer_countdown_ms(&timer, c->command_timeout_ms);
+        send_packet(c, len, &timer);
+    }
+}
+
+
 static int cycle(mqtt_client_t* c, mqtt_timer_t* timer)
 {
+    int i;
+    int wait_ms = mqtt_timer_left_ms(timer);
+
+    // don't sleep past the next retransmission
+    for (i = 0; i < c->inflight_window && c->inflight_count; ++i)
+    {
+        if (c->inflight[i].id && mqtt_timer_left_ms(&c->inflight[i].timer) < wait_ms)
+            wait_ms = mqtt_timer_left_ms(&c->inflight[i].timer);
+    }
+
     // read the socket, see what work is due
-    int packet_type = read_packet(c, timer);
+    int packet_type = read_packet(c, timer, wait_ms);
 
     int len = 0,
         rc = MQTT_SUCCESS;
@@ -230,17 +377,52 @@ static int cycle(mqtt_client_t* c, mqtt_timer_t* timer)
     switch (packet_type)
     {
         case MQTTPACKET_CONNACK:
-        case MQTTPACKET_PUBACK:
         case MQTTPACKET_SUBACK:
             break;
+        case MQTTPACKET_PUBACK:
+        case MQTTPACKET_PUBCOMP:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            mqtt_inflight_t* e;
+            if (mqtt_deserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+                rc = MQTT_FAILURE;
+            else if (mypacketid && (e = find_inflight(c, mypacketid)) != NULL)
+            {
+                // We still can receive from broker, treat as recoverable
+                c->fail_count = 0;
+                complete_inflight(c, e, MQTT_SUCCESS);
+            }
+            break;
+        }
         case MQTTPACKET_PUBLISH:
         {
             mqtt_string_t topicName;
             mqtt_message_t msg;
-            if (mqtt_deserialize_publish((unsigned char*)&msg.dup, (int*)&msg.qos, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
-               (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
-                goto exit;
-            deliver_message(c, &topicName, &msg);
+            mqtt_timer_t stream_timer;
+            mqtt_timer_t* ack_timer = timer;
+            int rem_len;
+            int hdr_len = 1 + mqtt_packet_decode_buf(c->readbuf + 1, &rem_len);
+            if (hdr_len + rem_len > c->readbuf_size)
+            {
+                // the stream may take longer than 'timer', the ack gets the time left after it
+                if (stream_publish(c, hdr_len, rem_len, &topicName, &msg, &stream_timer) != MQTT_SUCCESS)
+                {
+                    c->isconnected = 0; // the rest of the payload is lost, so is the connection
+                    rc = MQTT_DISCONNECTED;
+                    goto exit;
+                }
+                ack_timer = &stream_timer;
+            }
+            else
+            {
+                if (mqtt_deserialize_publish((unsigned char*)&msg.dup, (int*)&msg.qos, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+                   (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
+                    goto exit;
+                msg.offset = 0;
+                msg.totallen = msg.payloadlen;
+                deliver_message(c, &topicName, &msg);
+            }
             if (msg.qos != MQTT_QOS0)
             {
                 if (msg.qos == MQTT_QOS1)
@@ -250,7 +432,7 @@ static int cycle(mqtt_client_t* c, mqtt_timer_t* timer)
                 if (len <= 0)
                     rc = MQTT_FAILURE;
                 else
-                    rc = send_packet(c, len, timer);
+                    rc = send_packet(c, len, ack_timer);
                 if (rc == MQTT_FAILURE)
                     goto exit; // there was a problem
             }
@@ -260,6 +442,7 @@ static int cycle(mqtt_client_t* c, mqtt_timer_t* timer)
         {
             unsigned short mypacketid;
             unsigned char dup, type;
+            mqtt_inflight_t* e;
             if (mqtt_deserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
                 rc = MQTT_FAILURE;
             else if ((len = mqtt_serialize_ack(c->buf, c->buf_size, MQTTPACKET_PUBREL, 0, mypacketid)) <= 0)
@@ -268,10 +451,17 @@ static int cycle(mqtt_client_t* c, mqtt_timer_t* timer)
                 rc = MQTT_FAILURE; // there was a problem
             if (rc == MQTT_FAILURE)
                 goto exit; // there was a problem
+            if (mypacketid && (e = find_inflight(c, mypacketid)) != NULL)
+            {
+                // the broker has the message now, only the PUBREL may need resending
+                free(e->packet);
+                e->packet = NULL;
+                e->state = MQTTPACKET_PUBCOMP;
+                e->retries = 0;
+                mqtt_timer_countdown_ms(&e->timer, c->command_timeout_ms);
+            }
             break;
         }
-        case MQTTPACKET_PUBCOMP:
-            break;
         case MQTTPACKET_PINGRESP:
         {
             c->ping_outstanding = 0;
@@ -287,7 +477,11 @@ static int cycle(mqtt_client_t* c, mqtt_timer_t* timer)
     }
     if (c->isconnected)
         rc = keepalive(c);
+    if (rc == MQTT_SUCCESS && c->isconnected && c->inflight_count)
+        retry_inflight(c);
 exit:
+    if (rc == MQTT_DISCONNECTED)
+        fail_inflight(c, MQTT_DISCONNECTED);
     if (rc == MQTT_SUCCESS)
         rc = packet_type;
     return rc;
@@ -296,11 +490,9 @@ exit:
 
 void  mqtt_client_new(mqtt_client_t* c, mqtt_network_t* network, unsigned int command_timeout_ms, unsigned char* buf, size_t buf_size, unsigned char* readbuf, size_t readbuf_size)
 {
-    int i;
     c->ipstack = network;
 
-    for (i = 0; i < MQTT_MAX_MESSAGE_HANDLERS; ++i)
-        c->messageHandlers[i].topicFilter = 0;
+    mqtt_topic_trie_init(&c->subscriptions, c->subscription_nodes, MQTT_SUBSCRIPTION_NODES);
     c->command_timeout_ms = command_timeout_ms;
     c->buf = buf;
     c->buf_size = buf_size;
@@ -310,7 +502,53 @@ void  mqtt_client_new(mqtt_client_t* c, mqtt_network_t* network, unsigned int co
     c->ping_outstanding = 0;
     c->fail_count = 0;
     c->defaultMessageHandler = NULL;
+    c->streaming = 0;
     mqtt_timer_init(&(c->ping_timer));
+    c->inflight_window = 1;
+    c->inflight_count = 0;
+    c->inflight = &c->inflight_slot;
+    memset(c->inflight, 0, sizeof(*c->inflight));
+}
+
+
+int  mqtt_set_subscription_table(mqtt_client_t* c, mqtt_topic_node_t* nodes, unsigned int count)
+{
+    if (count < 2)
+        return MQTT_FAILURE;
+    mqtt_topic_trie_init(&c->subscriptions, nodes, count);
+    return MQTT_SUCCESS;
+}
+
+
+void  mqtt_set_streaming(mqtt_client_t* c, int enable)
+{
+    c->streaming = enable;
+}
+
+
+int  mqtt_set_inflight_window(mqtt_client_t* c, unsigned int window)
+{
+    mqtt_inflight_t* table = &c->inflight_slot;
+    int i, n = 0;
+
+    if (window < 1 || window > MQTT_MAX_INFLIGHT || window < c->inflight_count)
+        return MQTT_FAILURE;
+    if (window > 1 && (table = calloc(window, sizeof(*table))) == NULL)
+        return MQTT_FAILURE;
+
+    // move the publishes in flight over to the new table
+    for (i = 0; i < c->inflight_window; ++i)
+    {
+        if (c->inflight[i].id)
+            table[n++] = c->inflight[i];
+    }
+    if (window == 1 && n == 0)
+        memset(table, 0, sizeof(*table));
+    if (c->inflight != &c->inflight_slot)
+        free(c->inflight);
+    c->inflight = table;
+    c->inflight_window = window;
+    return MQTT_SUCCESS;
 }
 
 
@@ -406,6 +644,10 @@ int  mqtt_subscribe(mqtt_client_t* c, const char* topic, enum mqtt_qos qos, mqtt
     mqtt_timer_countdown_ms(&timer, c->command_timeout_ms);
     if (!c->isconnected)
         goto exit;
+    // make sure the handler can be added before subscribing at the broker
+    if ((rc = mqtt_topic_trie_check(&c->subscriptions, topic)) != MQTT_SUCCESS)
+        goto exit;
+    rc = MQTT_FAILURE;
 
     len = mqtt_serialize_subscribe(c->buf, c->buf_size, 0, get_next_packet_id(c), 1, &topicStr, (int*)&qos);
     if (len <= 0)
@@ -422,19 +664,7 @@ int  mqtt_subscribe(mqtt_client_t* c, const char* topic, enum mqtt_qos qos, mqtt
         if (mqtt_deserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
             rc = grantedQoS; // 0, 1, 2 or 0x80
         if (rc != 0x80)
-        {
-            int i;
-            for (i = 0; i < MQTT_MAX_MESSAGE_HANDLERS; ++i)
-            {
-                if (c->messageHandlers[i].topicFilter == 0)
-                {
-                    c->messageHandlers[i].topicFilter = topic;
-                    c->messageHandlers[i].fp = handler;
-                    rc = 0;
-                    break;
-                }
-            }
-        }
+            rc = mqtt_topic_trie_insert(&c->subscriptions, topic, handler);
     }
     else
         rc = MQTT_FAILURE;
@@ -467,7 +697,10 @@ int  mqtt_unsubscribe(mqtt_client_t* c, const char* topicFilter)
     {
         unsigned short mypacketid;  // should be the same as the packetid above
         if (mqtt_deserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
+        {
+            mqtt_topic_trie_remove(&c->subscriptions, topicFilter);
             rc = 0;
+        }
     }
     else
         rc = MQTT_FAILURE;
@@ -477,13 +710,15 @@ exit:
 }
 
 
-int  mqtt_publish(mqtt_client_t* c, const char* topic, mqtt_message_t* message)
+int  mqtt_publish_async(mqtt_client_t* c, const char* topic, mqtt_message_t* message, mqtt_publish_cb_t cb, void* arg)
 {
     int rc = MQTT_FAILURE;
     mqtt_timer_t timer;
     mqtt_string_t topicStr = mqtt_string_initializer;
     topicStr.cstring = (char *)topic;
     int len = 0;
+    int i;
+    mqtt_inflight_t* e = NULL;
 
     mqtt_timer_init(&timer);
     mqtt_timer_countdown_ms(&timer, c->command_timeout_ms);
@@ -492,56 +727,121 @@ int  mqtt_publish(mqtt_client_t* c, const char* topic, mqtt_message_t* message)
         goto exit;
 
     if (message->qos == MQTT_QOS1 || message->qos == MQTT_QOS2)
+    {
+        // wait until a message in the window is acked or runs out of retries
+        while (c->inflight_count >= c->inflight_window)
+        {
+            if (!c->isconnected || cycle(c, &timer) == MQTT_DISCONNECTED)
+                goto exit;
+            if (mqtt_timer_expired(&timer))
+                mqtt_timer_countdown_ms(&timer, c->command_timeout_ms);
+        }
+        for (i = 0; i < c->inflight_window; ++i)
+        {
+            if (c->inflight[i].id == 0)
+            {
+                e = &c->inflight[i];
+                break;
+            }
+        }
         message->id = get_next_packet_id(c);
+    }
 
-    len = mqtt_serialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id, 
+    len = mqtt_serialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
               topicStr, (unsigned char*)message->payload, message->payloadlen);
     if (len <= 0)
         goto exit;
-    if ((rc = send_packet(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
+
+    if (e)
     {
-        goto exit; // there was a problem
+        // keep a copy to send again if the ack does not arrive
+        if ((e->packet = malloc(len)) == NULL)
+            goto exit;
+        memcpy(e->packet, c->buf, len);
+        e->len = len;
+        e->id = message->id;
+        e->state = (message->qos == MQTT_QOS1) ? MQTTPACKET_PUBACK : MQTTPACKET_PUBREC;
+        e->retries = 0;
+        e->cb = cb;
+        e->arg = arg;
+        mqtt_timer_init(&e->timer);
+        mqtt_timer_countdown_ms(&e->timer, c->command_timeout_ms);
+        ++(c->inflight_count);
     }
 
-    if (message->qos == MQTT_QOS1)
+    if ((rc = send_packet(c, len, &timer)) != MQTT_SUCCESS)
     {
-        if (waitfor(c, MQTTPACKET_PUBACK, &timer) == MQTTPACKET_PUBACK)
-        {
-            // We still can receive from broker, treat as recoverable
-            c->fail_count = 0;
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (mqtt_deserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
-            else
-                rc = MQTT_SUCCESS;
-        }
-        else
-        {
-            rc = MQTT_FAILURE;
-        }
+        if (e)
+            release_inflight(c, e);
+        goto exit; // there was a problem
+    }
+
+    if (!e && cb)
+        cb(c, message->id, MQTT_SUCCESS, arg);
+
+exit:
+    return rc;
+}
+
+
+#define PUBLISH_PENDING 1
+
+static void publish_done(mqtt_client_t* c, unsigned short id, int rc, void* arg)
+{
+    *(int*)arg = rc;
+}
+
+
+int  mqtt_publish(mqtt_client_t* c, const char* topic, mqtt_message_t* message)
+{
+    int rc = MQTT_FAILURE;
+    int result = PUBLISH_PENDING;
+    mqtt_timer_t timer;
+    mqtt_inflight_t* e;
 
+    if ((rc = mqtt_publish_async(c, topic, message, publish_done, &result)) != MQTT_SUCCESS)
+        goto exit;
+
+    // acks for other messages in the window are handled on the way
+    mqtt_timer_init(&timer);
+    mqtt_timer_countdown_ms(&timer, c->command_timeout_ms);
+    while (result == PUBLISH_PENDING && !mqtt_timer_expired(&timer))
+        cycle(c, &timer);
+
+    rc = result;
+    if (rc == PUBLISH_PENDING)
+    {
+        // timed out, forget about the message like a failed waitfor() did
+        if ((e = find_inflight(c, message->id)) != NULL)
+            release_inflight(c, e);
+        rc = MQTT_FAILURE;
     }
-    else if (message->qos == MQTT_QOS2)
+
+exit:
+    return rc;
+}
+
+
+int  mqtt_flush(mqtt_client_t* c, int timeout_ms)
+{
+    int rc = MQTT_SUCCESS;
+    mqtt_timer_t timer;
+
+    mqtt_timer_init(&timer);
+    mqtt_timer_countdown_ms(&timer, timeout_ms);
+    while (c->inflight_count)
     {
-        if (waitfor(c, MQTTPACKET_PUBCOMP, &timer) == MQTTPACKET_PUBCOMP)
+        if (mqtt_timer_expired(&timer))
         {
-            // We still can receive from broker, treat as recoverable
-            c->fail_count = 0;
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (mqtt_deserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
-            else
-                rc = MQTT_SUCCESS;
+            rc = MQTT_FAILURE;
+            break;
         }
-        else
+        if (cycle(c, &timer) == MQTT_DISCONNECTED)
         {
-            rc = MQTT_FAILURE;
+            rc = MQTT_DISCONNECTED;
+            break;
         }
     }
-
-exit:
     return rc;
 }
 
@@ -559,6 +859,7 @@ int  mqtt_disconnect(mqtt_client_t* c)
         rc = send_packet(c, len, &timer);            // send the disconnect packet
 
     c->isconnected = 0;
+    fail_inflight(c, MQTT_DISCONNECTED);
     return rc;
 }
 
@@ -22,8 +22,53 @@
 
 #define MQTT_MAX_PACKET_ID 65535
 #define MQTT_MAX_MESSAGE_HANDLERS 5
+
+/* RAM use.
+ *
+ * An mqtt_client_t holds the subscription table built into it
+ * (MQTT_SUBSCRIPTION_NODES nodes of 28 bytes on the ESP8266, 308 bytes by
+ * default) and one in-flight slot of 24 bytes, about 410 bytes in all. Keep
+ * it in static storage rather than on a task's stack.
+ *
+ * More or longer filters need a bigger table, passed in with
+ * mqtt_set_subscription_table(). An in-flight window above 1 allocates
+ * window * 24 bytes from the heap, see mqtt_set_inflight_window(). Each
+ * QoS1/QoS2 publish in flight also holds a heap copy of its packet.
+ */
+
+/* Topic levels per filter that the built-in subscription table is sized
+ * for, so that MQTT_MAX_MESSAGE_HANDLERS filters always fit. "/topic" and
+ * "dev/cmd" are two levels each.
+ */
+#ifndef MQTT_MAX_FILTER_LEVELS
+#define MQTT_MAX_FILTER_LEVELS 2
+#endif
+
+/* Size of the subscription table built into the client, in topic levels. A
+ * larger one can be set with mqtt_set_subscription_table().
+ */
+#ifndef MQTT_SUBSCRIPTION_NODES
+#define MQTT_SUBSCRIPTION_NODES (MQTT_MAX_MESSAGE_HANDLERS * MQTT_MAX_FILTER_LEVELS + 1)
+#endif
 #define MQTT_MAX_FAIL_ALLOWED  2
 
+/* Largest in-flight window mqtt_set_inflight_window() accepts, i.e. number
+ * of QoS1/QoS2 publishes that can await acknowledgement at the same time.
+ * Each one holds a heap copy of its PUBLISH packet until the broker has
+ * received it.
+ */
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 16
+#endif
+
+/* Number of times an unacknowledged publish is sent again with the DUP flag
+ * set, command_timeout_ms apart, before its completion callback reports
+ * MQTT_FAILURE.
+ */
+#ifndef MQTT_MAX_RETRIES
+#define MQTT_MAX_RETRIES 3
+#endif
+
 enum mqtt_qos {
 	MQTT_QOS0,
 	MQTT_QOS1,
@@ -47,6 +92,8 @@ typedef struct mqtt_message
     unsigned short id;
     void *payload;
     size_t payloadlen;
+    size_t offset;      // of 'payload' in the whole message, when received
+    size_t totallen;    // length of the whole message, when received
 } mqtt_message_t;
 
 typedef struct mqtt_message_data
@@ -57,6 +104,73 @@ typedef struct mqtt_message_data
 
 typedef void (*mqtt_message_handler_t)(mqtt_message_data_t*);
 
+/* Subscriptions are kept in a trie with one node per topic level, so
+ * matching an incoming topic takes one hash lookup per level (plus one more
+ * walk for each '+' level on the way) however many filters there are.
+ * Children of a node are found through a hash table whose buckets are
+ * spread over the nodes themselves, so the table is a single array.
+ *
+ * A filter needs one node for each of its levels that it does not share with
+ * another filter, and node 0 is the root: "dev/+/cmd" and "dev/+/cfg"
+ * together take 5 nodes. The levels point into the filter strings, which
+ * must stay valid while subscribed. A level shared by several filters is
+ * moved over to another one when the filter it points into is removed.
+ */
+typedef struct mqtt_topic_node
+{
+    const char* level;
+    unsigned short len;
+    unsigned short parent;
+    unsigned short next;        // next node in the same hash bucket, or free
+    unsigned short bucket;      // first node in the hash bucket of this index
+    unsigned short plus;        // '+' child
+    unsigned short hash;        // '#' child
+    unsigned short refs;        // filters through this node
+    mqtt_message_handler_t handler; // for the filter ending here
+    const char* filter;         // the filter ending here
+} mqtt_topic_node_t;
+
+typedef struct mqtt_topic_trie
+{
+    mqtt_topic_node_t* nodes;
+    unsigned short count;
+    unsigned short free;        // first unused node
+    unsigned short free_count;
+} mqtt_topic_trie_t;
+
+typedef void (*mqtt_topic_match_cb_t)(mqtt_message_handler_t handler, void* arg);
+
+void mqtt_topic_trie_init(mqtt_topic_trie_t* t, mqtt_topic_node_t* nodes, unsigned int count);
+/* Add a filter, or replace its handler if it is there already */
+int mqtt_topic_trie_insert(mqtt_topic_trie_t* t, const char* filter, mqtt_message_handler_t handler);
+/* MQTT_SUCCESS if inserting 'filter' would succeed, or the error it would fail with */
+int mqtt_topic_trie_check(mqtt_topic_trie_t* t, const char* filter);
+int mqtt_topic_trie_remove(mqtt_topic_trie_t* t, const char* filter);
+/* Call 'cb' for every filter matching 'topic', returns the number of matches */
+int mqtt_topic_trie_match(mqtt_topic_trie_t* t, const char* topic, int len, mqtt_topic_match_cb_t cb, void* arg);
+
+typedef struct mqtt_client mqtt_client_t;
+
+/* Called once a publish has completed: rc is MQTT_SUCCESS when the PUBACK
+ * (QoS1) or PUBCOMP (QoS2) arrived, MQTT_FAILURE when the retries ran out and
+ * MQTT_DISCONNECTED when the connection was lost first. It runs from inside
+ * the client (mqtt_yield, mqtt_publish*, ...) so it must not block or call
+ * back into the client.
+ */
+typedef void (*mqtt_publish_cb_t)(mqtt_client_t* c, unsigned short id, int rc, void* arg);
+
+typedef struct mqtt_inflight
+{
+    unsigned short id;          // packet id, 0 if the slot is free
+    unsigned char state;        // ack expected next: PUBACK, PUBREC or PUBCOMP
+    unsigned char retries;
+    unsigned char *packet;      // PUBLISH to retransmit, freed once received
+    int len;
+    mqtt_timer_t timer;         // retransmit when expired
+    mqtt_publish_cb_t cb;
+    void *arg;
+} mqtt_inflight_t;
+
 struct mqtt_client
 {
     unsigned int next_packetid;
@@ -69,19 +183,20 @@ struct mqtt_client
     int fail_count;
     int isconnected;
 
-    struct MessageHandlers
-    {
-        const char* topicFilter;
-        void (*fp) (mqtt_message_data_t*);
-    } messageHandlers[MQTT_MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
+    mqtt_topic_trie_t subscriptions;
+    mqtt_topic_node_t subscription_nodes[MQTT_SUBSCRIPTION_NODES];
 
     void (*defaultMessageHandler) (mqtt_message_data_t*);
+    int streaming;
 
     mqtt_network_t* ipstack;
     mqtt_timer_t ping_timer;
-};
 
-typedef struct mqtt_client mqtt_client_t;
+    unsigned int inflight_window;
+    unsigned int inflight_count;
+    mqtt_inflight_t* inflight;          // inflight_window slots
+    mqtt_inflight_t inflight_slot;      // the table for a window of 1
+};
 
 int mqtt_connect(mqtt_client_t* c, mqtt_packet_connect_data_t* options);
 int mqtt_publish(mqtt_client_t* c, const char* topic, mqtt_message_t* message);
@@ -90,6 +205,60 @@ int mqtt_unsubscribe(mqtt_client_t* c, const char* topic);
 int mqtt_disconnect(mqtt_client_t* c);
 int mqtt_yield(mqtt_client_t* c, int timeout_ms);
 
+/* Keep the subscriptions in 'nodes' instead of the table built into the
+ * client, see mqtt_topic_node_t for how many are needed. Existing
+ * subscriptions are forgotten, so call this before subscribing.
+ */
+int mqtt_set_subscription_table(mqtt_client_t* c, mqtt_topic_node_t* nodes, unsigned int count);
+
+/* Streaming receive.
+ *
+ * Normally a received PUBLISH has to fit in readbuf whole, and a bigger one
+ * drops the connection. With streaming enabled it is delivered in pieces
+ * instead: the topic and packet id are kept at the start of readbuf and the
+ * payload is read into the rest of it as it comes off the socket, so the
+ * handlers are called once per read with 'offset' and 'payloadlen' giving
+ * the piece and 'totallen' the size of the whole message. A 4 KB readbuf
+ * can receive payloads of any size this way, e.g. a firmware image.
+ *
+ * Messages that fit are still delivered in one call with offset 0 and
+ * totallen == payloadlen, so a handler written for streaming works for
+ * both. A message is complete when offset + payloadlen == totallen. If the
+ * connection is lost part way the handlers are not called again for it,
+ * and the client returns MQTT_DISCONNECTED; QoS1/QoS2 messages are only
+ * acknowledged after the last piece, so the broker sends them again after
+ * reconnecting. No read waits longer than command_timeout_ms for data.
+ */
+void mqtt_set_streaming(mqtt_client_t* c, int enable);
+
+/* Pipelined publishing.
+ *
+ * mqtt_publish() waits a full broker round trip for every QoS1/QoS2 message.
+ * mqtt_publish_async() returns as soon as the PUBLISH is sent and reports the
+ * outcome through 'cb' later, so up to 'window' messages can be on the way
+ * at once. Acks are matched by packet id in any order while the client runs
+ * (mqtt_yield, mqtt_flush or any other call that reads from the broker), and
+ * messages still unacknowledged after command_timeout_ms are sent again with
+ * DUP set.
+ *
+ * The window defaults to 1, which uses a slot inside the client. A larger
+ * window (up to MQTT_MAX_INFLIGHT) allocates its table from the heap, and
+ * setting the window back to 1 frees it again; do that before calling
+ * mqtt_client_new() on the client again. The window cannot be made smaller
+ * than the number of publishes in flight, and mqtt_set_inflight_window()
+ * returns MQTT_FAILURE if it cannot allocate the table.
+ *
+ * When the window is full mqtt_publish_async() runs the
+ * client until a slot frees up, which takes at most
+ * (MQTT_MAX_RETRIES + 1) * command_timeout_ms. Topic and payload are copied,
+ * so they can be reused as soon as the call returns. message->id is set to
+ * the packet id passed to 'cb'. For QoS0 'cb' is called right away.
+ */
+int mqtt_set_inflight_window(mqtt_client_t* c, unsigned int window);
+int mqtt_publish_async(mqtt_client_t* c, const char* topic, mqtt_message_t* message, mqtt_publish_cb_t cb, void* arg);
+/* Run the client until all in-flight publishes have completed */
+int mqtt_flush(mqtt_client_t* c, int timeout_ms);
+
 void mqtt_client_new(mqtt_client_t*, mqtt_network_t*, unsigned int, unsigned char*, size_t, unsigned char*, size_t);
 
 #define mqtt_client_default {0, 0, 0, 0, NULL, NULL, 0, 0, 0}
@@ -0,0 +1,123 @@
+/**
+ * MQTT transport on the lwIP netconn API, see MQTTNetconn.h.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include <lwip/api.h>
+#include <string.h>
+
+#include "MQTTNetconn.h"
+
+/* A timeout of 0 makes netconn calls wait forever, the client means "don't wait" */
+static inline int netconn_timeout(int timeout_ms)
+{
+    return timeout_ms > 0 ? timeout_ms : 1;
+}
+
+int  mqtt_netconn_read(mqtt_network_t* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    mqtt_netconn_t* nc = (mqtt_netconn_t*)n;
+    int rcvd = 0;
+
+    if (!nc->conn)
+        return -1;
+
+    while (rcvd < len)
+    {
+        uint16_t copied;
+
+        if (!nc->rx)
+        {
+            err_t err;
+
+            // only wait for the first segment, then return what there is
+            if (rcvd)
+                break;
+            netconn_set_recvtimeout(nc->conn, netconn_timeout(timeout_ms));
+            err = netconn_recv(nc->conn, &nc->rx);
+            if (err == ERR_TIMEOUT)
+                return 0;
+            if (err != ERR_OK)
+                return -1;
+            nc->rx_offset = 0;
+        }
+
+        copied = netbuf_copy_partial(nc->rx, buffer + rcvd, len - rcvd, nc->rx_offset);
+        rcvd += copied;
+        nc->rx_offset += copied;
+        if (nc->rx_offset >= netbuf_len(nc->rx))
+        {
+            netbuf_delete(nc->rx);
+            nc->rx = NULL;
+        }
+    }
+    return rcvd;
+}
+
+
+int  mqtt_netconn_write(mqtt_network_t* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    mqtt_netconn_t* nc = (mqtt_netconn_t*)n;
+    size_t written = 0;
+    err_t err;
+
+    if (!nc->conn)
+        return -1;
+
+    netconn_set_sendtimeout(nc->conn, netconn_timeout(timeout_ms));
+    err = netconn_write_partly(nc->conn, buffer, len, NETCONN_COPY, &written);
+    if (err != ERR_OK && written == 0)
+        return -1;
+    return written;
+}
+
+
+void  mqtt_netconn_new(mqtt_netconn_t* n)
+{
+    memset(n, 0, sizeof(*n));
+    n->network.my_socket = -1;
+    n->network.mqttread = mqtt_netconn_read;
+    n->network.mqttwrite = mqtt_netconn_write;
+}
+
+
+int  mqtt_netconn_connect(mqtt_netconn_t* n, const char* host, int port)
+{
+    ip_addr_t addr;
+    err_t err;
+
+    err = netconn_gethostbyname(host, &addr);
+    if (err != ERR_OK)
+        return err;
+
+    n->conn = netconn_new(NETCONN_TCP);
+    if (!n->conn)
+        return ERR_MEM;
+
+    err = netconn_connect(n->conn, &addr, port);
+    if (err != ERR_OK)
+    {
+        netconn_delete(n->conn);
+        n->conn = NULL;
+        return err;
+    }
+    return 0;
+}
+
+
+int  mqtt_netconn_disconnect(mqtt_netconn_t* n)
+{
+    if (n->rx)
+    {
+        netbuf_delete(n->rx);
+        n->rx = NULL;
+    }
+    if (n->conn)
+    {
+        netconn_close(n->conn);
+        netconn_delete(n->conn);
+        n->conn = NULL;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * MQTT transport on the lwIP netconn API.
+ *
+ * An alternative to mqtt_network_new()/mqtt_network_connect() from
+ * MQTTESP8266.c, which go through the socket layer and call select() before
+ * every recv() and send():
+ *
+ *     mqtt_netconn_t network;
+ *
+ *     mqtt_netconn_new(&network);
+ *     if (mqtt_netconn_connect(&network, MQTT_HOST, MQTT_PORT) == 0) {
+ *         mqtt_client_new(&client, &network.network, ...);
+ *         ...
+ *         mqtt_netconn_disconnect(&network);
+ *     }
+ *
+ * Reads block on the connection's receive mailbox with a receive timeout,
+ * so the task running mqtt_yield() sleeps until a segment arrives from the
+ * broker, or the timeout passes, and never polls. The data is copied from the
+ * received pbufs straight into the client's buffer. A segment holding
+ * several packets is kept and handed out over the next reads. Writes copy the
+ * serialized packet into TCP pbufs in the tcpip thread, and block only while
+ * the send buffer is full, until acks from the broker make room.
+ *
+ * Compared with the socket transport this saves the select() call with its
+ * fd_sets and select_cb on the stack for every read and write, the semaphore
+ * each select() waits on, and the socket table entry. It needs
+ * LWIP_SO_RCVTIMEO and LWIP_SO_SNDTIMEO, which lwipopts.h enables.
+ * examples/mqtt_transport_bench measures both transports on the device,
+ * tests/host/mqtt runs this one against a simulated netconn layer.
+ */
+#ifndef __MQTT_NETCONN_H_
+#define __MQTT_NETCONN_H_
+
+#include <stdint.h>
+#include <lwip/api.h>
+
+#include "MQTTESP8266.h"
+
+typedef struct mqtt_netconn
+{
+    mqtt_network_t network;     // pass this to mqtt_client_new(), must be first
+    struct netconn *conn;
+    struct netbuf *rx;          // received data not read yet
+    uint16_t rx_offset;         // of the next unread byte in rx
+} mqtt_netconn_t;
+
+void mqtt_netconn_new(mqtt_netconn_t* n);
+/* Returns 0 once connected, or an lwIP error code */
+int mqtt_netconn_connect(mqtt_netconn_t* n, const char* host, int port);
+int mqtt_netconn_disconnect(mqtt_netconn_t* n);
+
+int mqtt_netconn_read(mqtt_network_t* n, unsigned char* buffer, int len, int timeout_ms);
+int mqtt_netconn_write(mqtt_network_t* n, unsigned char* buffer, int len, int timeout_ms);
+
+#endif /* __MQTT_NETCONN_H_ */
@@ -0,0 +1,477 @@
+/**
+ * Persistent store-and-forward publish queue, see MQTTQueue.h.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include <spiflash.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MQTTQueue.h"
+
+#define SECTOR_SIZE SPI_FLASH_SECTOR_SIZE
+#define SECTOR_MAGIC 0x3151514d    // "MQQ1"
+#define SECTOR_HEADER 8
+#define RECORD_HEADER 8
+
+/* Record state word, only ever programmed from one value to the next */
+#define RECORD_WRITING 0xffffffff
+#define RECORD_QUEUED 0x0000ffff
+#define RECORD_DONE 0x00000000
+
+/* Record info word: topic length, QoS, retained flag and payload length */
+#define INFO_EMPTY 0xffffffff
+#define INFO(topic_len, qos, retained, payload_len) \
+    ((topic_len) | ((qos) << 8) | ((retained) ? 1 << 10 : 0) | ((uint32_t)(payload_len) << 16))
+#define INFO_TOPIC_LEN(info) ((info) & 0xff)
+#define INFO_QOS(info) (((info) >> 8) & 3)
+#define INFO_RETAINED(info) (((info) >> 10) & 1)
+#define INFO_PAYLOAD_LEN(info) ((info) >> 16)
+
+enum entry_state
+{
+    ENTRY_QUEUED,
+    ENTRY_SENDING,
+    ENTRY_DONE
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+} sector_header_t;
+
+typedef struct
+{
+    uint32_t info;
+    uint32_t state;
+} record_header_t;
+
+
+static inline uint32_t sector_addr(mqtt_queue_t* q, uint16_t sector)
+{
+    return q->addr + (uint32_t)sector * SECTOR_SIZE;
+}
+
+
+static inline uint16_t next_sector(mqtt_queue_t* q, uint16_t sector)
+{
+    return (sector + 1 == q->sectors) ? 0 : sector + 1;
+}
+
+
+static inline uint32_t record_size(uint32_t len)
+{
+    return RECORD_HEADER + ((len + 3) & ~3);
+}
+
+
+static inline mqtt_queue_entry_t* entry(mqtt_queue_t* q, int i)
+{
+    return &q->index[(q->index_first + i) % MQTT_QUEUE_INDEX_LEN];
+}
+
+
+// Read the record header at 'offset', false if there is no (sane) record
+static int read_record(mqtt_queue_t* q, uint16_t sector, uint32_t offset, record_header_t* header)
+{
+    if (offset + RECORD_HEADER > SECTOR_SIZE ||
+            !spiflash_read(sector_addr(q, sector) + offset, (uint8_t*)header, sizeof(*header)))
+        return 0;
+    if (header->info == INFO_EMPTY || INFO_QOS(header->info) > MQTT_QOS2)
+        return 0;
+    return offset + record_size(INFO_TOPIC_LEN(header->info) + INFO_PAYLOAD_LEN(header->info)) <= SECTOR_SIZE;
+}
+
+
+static int read_sector_header(mqtt_queue_t* q, uint16_t sector, uint32_t* seq)
+{
+    sector_header_t header;
+
+    if (!spiflash_read(sector_addr(q, sector), (uint8_t*)&header, sizeof(header)))
+        return 0;
+    *seq = header.seq;
+    return header.magic == SECTOR_MAGIC;
+}
+
+
+static int start_sector(mqtt_queue_t* q, uint16_t sector)
+{
+    sector_header_t header = { SECTOR_MAGIC, q->seq + 1 };
+
+    if (!spiflash_erase_sector(sector_addr(q, sector)) ||
+            !spiflash_write(sector_addr(q, sector), (uint8_t*)&header, sizeof(header)))
+        return 0;
+    q->seq = header.seq;
+    q->head = sector;
+    q->head_offset = SECTOR_HEADER;
+    return 1;
+}
+
+
+// Index undelivered records following the last indexed one
+static void refill_index(mqtt_queue_t* q)
+{
+    record_header_t header;
+
+    while (q->index_len < MQTT_QUEUE_INDEX_LEN)
+    {
+        if (q->scan == q->head && q->scan_offset >= q->head_offset)
+            break;
+        if (!read_record(q, q->scan, q->scan_offset, &header))
+        {
+            // end of the sector, or a record that was cut short by a reset
+            if (q->scan == q->head)
+            {
+                q->scan_offset = q->head_offset;
+                break;
+            }
+            q->scan = next_sector(q, q->scan);
+            q->scan_offset = SECTOR_HEADER;
+            continue;
+        }
+        if (header.state == RECORD_QUEUED)
+        {
+            mqtt_queue_entry_t* e = entry(q, q->index_len++);
+            e->addr = sector_addr(q, q->scan) + q->scan_offset;
+            e->len = INFO_TOPIC_LEN(header.info) + INFO_PAYLOAD_LEN(header.info);
+            e->id = 0;
+            e->state = ENTRY_QUEUED;
+        }
+        q->scan_offset += record_size(INFO_TOPIC_LEN(header.info) + INFO_PAYLOAD_LEN(header.info));
+    }
+}
+
+
+// Forget delivered records at the start of the index and the sectors holding only those
+static void release_delivered(mqtt_queue_t* q)
+{
+    uint16_t first;
+
+    while (q->index_len && entry(q, 0)->state == ENTRY_DONE)
+    {
+        q->index_first = (q->index_first + 1) % MQTT_QUEUE_INDEX_LEN;
+        --(q->index_len);
+    }
+    refill_index(q);
+
+    first = q->index_len ? (entry(q, 0)->addr - q->addr) / SECTOR_SIZE : q->scan;
+    while (q->tail != first && q->tail != q->head)
+        q->tail = next_sector(q, q->tail);
+}
+
+
+// Make room by giving up on the messages in the oldest sector
+static void drop_tail(mqtt_queue_t* q)
+{
+    record_header_t header;
+    uint32_t offset = SECTOR_HEADER;
+    uint32_t start = sector_addr(q, q->tail);
+
+    while (read_record(q, q->tail, offset, &header))
+    {
+        if (header.state == RECORD_QUEUED)
+        {
+            --(q->count);
+            q->bytes -= INFO_TOPIC_LEN(header.info) + INFO_PAYLOAD_LEN(header.info);
+            ++(q->dropped);
+        }
+        offset += record_size(INFO_TOPIC_LEN(header.info) + INFO_PAYLOAD_LEN(header.info));
+    }
+
+    // the index is in flash order, so the dropped ones are at its start
+    while (q->index_len && entry(q, 0)->addr >= start && entry(q, 0)->addr < start + SECTOR_SIZE)
+    {
+        q->index_first = (q->index_first + 1) % MQTT_QUEUE_INDEX_LEN;
+        --(q->index_len);
+    }
+    if (q->scan == q->tail)
+    {
+        q->scan = next_sector(q, q->tail);
+        q->scan_offset = SECTOR_HEADER;
+    }
+    q->tail = next_sector(q, q->tail);
+}
+
+
+static void queue_lock(mqtt_queue_t* q)
+{
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+}
+
+
+static void queue_unlock(mqtt_queue_t* q)
+{
+    xSemaphoreGive(q->lock);
+}
+
+
+int mqtt_queue_init(mqtt_queue_t* q, uint32_t addr, uint32_t size)
+{
+    record_header_t header;
+    uint32_t seq, prev_seq, offset;
+    uint16_t s, prev;
+    int found = 0;
+
+    if ((addr | size) % SECTOR_SIZE || size < 2 * SECTOR_SIZE || size / SECTOR_SIZE > UINT16_MAX)
+        return MQTT_FAILURE;
+
+    memset(q, 0, sizeof(*q));
+    q->addr = addr;
+    q->sectors = size / SECTOR_SIZE;
+    if ((q->lock = xSemaphoreCreateMutex()) == NULL)
+        return MQTT_FAILURE;
+
+    // the head is the newest sector, the tail the oldest one in sequence before it
+    for (s = 0; s < q->sectors; ++s)
+    {
+        if (read_sector_header(q, s, &seq) && (!found || (int32_t)(seq - q->seq) > 0))
+        {
+            q->head = s;
+            q->seq = seq;
+            found = 1;
+        }
+    }
+    if (!found)
+    {
+        if (!start_sector(q, 0))
+            return MQTT_FAILURE;
+        q->tail = q->scan = 0;
+        q->scan_offset = SECTOR_HEADER;
+        return MQTT_SUCCESS;
+    }
+
+    q->tail = q->head;
+    seq = q->seq;
+    for (;;)
+    {
+        prev = (q->tail == 0) ? q->sectors - 1 : q->tail - 1;
+        if (prev == q->head || !read_sector_header(q, prev, &prev_seq) || prev_seq != seq - 1)
+            break;
+        q->tail = prev;
+        seq = prev_seq;
+    }
+
+    // count what is left to deliver and find the end of the log
+    s = q->tail;
+    for (;;)
+    {
+        offset = SECTOR_HEADER;
+        while (read_record(q, s, offset, &header))
+        {
+            if (header.state == RECORD_QUEUED)
+            {
+                ++(q->count);
+                q->bytes += INFO_TOPIC_LEN(header.info) + INFO_PAYLOAD_LEN(header.info);
+            }
+            offset += record_size(INFO_TOPIC_LEN(header.info) + INFO_PAYLOAD_LEN(header.info));
+        }
+        if (s == q->head)
+            break;
+        s = next_sector(q, s);
+    }
+    // after a cut short record, start appending in the next sector
+    if (offset + RECORD_HEADER <= SECTOR_SIZE &&
+            spiflash_read(sector_addr(q, s) + offset, (uint8_t*)&header, sizeof(header)) &&
+            header.info != INFO_EMPTY)
+        offset = SECTOR_SIZE;
+    q->head_offset = offset;
+
+    q->scan = q->tail;
+    q->scan_offset = SECTOR_HEADER;
+    release_delivered(q);
+
+    return MQTT_SUCCESS;
+}
+
+
+int mqtt_queue_push(mqtt_queue_t* q, const char* topic, mqtt_message_t* message)
+{
+    int rc = MQTT_FAILURE;
+    size_t topic_len = strlen(topic);
+    uint32_t len = topic_len + message->payloadlen;
+    uint32_t addr;
+    record_header_t header;
+
+    if (topic_len > 0xff || record_size(len) > SECTOR_SIZE - SECTOR_HEADER)
+        return MQTT_BUFFER_OVERFLOW;
+
+    queue_lock(q);
+
+    if (q->head_offset + record_size(len) > SECTOR_SIZE)
+    {
+        uint16_t next = next_sector(q, q->head);
+        if (next == q->tail)
+            drop_tail(q);
+        if (!start_sector(q, next))
+            goto exit;
+    }
+
+    addr = sector_addr(q, q->head) + q->head_offset;
+    header.info = INFO(topic_len, message->qos, message->retained, message->payloadlen);
+    header.state = RECORD_QUEUED;
+
+    // the record only counts once its state has been written
+    if (!spiflash_write(addr, (uint8_t*)&header.info, sizeof(header.info)) ||
+            !spiflash_write(addr + RECORD_HEADER, (uint8_t*)topic, topic_len) ||
+            (message->payloadlen && !spiflash_write(addr + RECORD_HEADER + topic_len,
+                (uint8_t*)message->payload, message->payloadlen)) ||
+            !spiflash_write(addr + sizeof(header.info), (uint8_t*)&header.state, sizeof(header.state)))
+    {
+        // don't write over whatever made it to flash
+        q->head_offset = SECTOR_SIZE;
+        goto exit;
+    }
+
+    q->head_offset += record_size(len);
+    ++(q->count);
+    q->bytes += len;
+    refill_index(q);
+    rc = MQTT_SUCCESS;
+
+exit:
+    queue_unlock(q);
+    return rc;
+}
+
+
+static void queue_sent(mqtt_client_t* c, unsigned short id, int rc, void* arg)
+{
+    mqtt_queue_t* q = arg;
+    uint32_t done = RECORD_DONE;
+    int i;
+
+    queue_lock(q);
+    for (i = 0; i < q->index_len; ++i)
+    {
+        mqtt_queue_entry_t* e = entry(q, i);
+        if (e->state != ENTRY_SENDING || e->id != id)
+            continue;
+        if (rc != MQTT_SUCCESS)
+        {
+            // stays queued, sent again by the next drain
+            e->state = ENTRY_QUEUED;
+            break;
+        }
+        spiflash_write(e->addr + sizeof(uint32_t), (uint8_t*)&done, sizeof(done));
+        e->state = ENTRY_DONE;
+        --(q->count);
+        q->bytes -= e->len;
+        release_delivered(q);
+        break;
+    }
+    queue_unlock(q);
+}
+
+
+int mqtt_queue_drain(mqtt_queue_t* q, mqtt_client_t* c, int max)
+{
+    int started = 0;
+    int i, rc;
+
+    if (!c->isconnected)
+        return MQTT_DISCONNECTED;
+
+    queue_lock(q);
+    while (started < max && c->isconnected)
+    {
+        mqtt_queue_entry_t* e = NULL;
+        record_header_t header;
+        mqtt_message_t message;
+        uint32_t addr;
+        char* buf;
+
+        for (i = 0; i < q->index_len && !e; ++i)
+        {
+            if (entry(q, i)->state == ENTRY_QUEUED)
+                e = entry(q, i);
+        }
+        if (!e)
+            break;
+
+        // topic and payload with a terminating zero in between
+        addr = e->addr;
+        if ((buf = malloc(e->len + 1)) == NULL)
+            break;
+        if (!spiflash_read(addr, (uint8_t*)&header, sizeof(header)) ||
+                !spiflash_read(addr + RECORD_HEADER, (uint8_t*)buf, INFO_TOPIC_LEN(header.info)) ||
+                !spiflash_read(addr + RECORD_HEADER + INFO_TOPIC_LEN(header.info),
+                    (uint8_t*)buf + INFO_TOPIC_LEN(header.info) + 1, INFO_PAYLOAD_LEN(header.info)))
+        {
+            free(buf);
+            break;
+        }
+        buf[INFO_TOPIC_LEN(header.info)] = '\0';
+        message.qos = INFO_QOS(header.info);
+        message.retained = INFO_RETAINED(header.info);
+        message.dup = 0;
+        message.id = 0;
+        message.payload = buf + INFO_TOPIC_LEN(header.info) + 1;
+        message.payloadlen = INFO_PAYLOAD_LEN(header.info);
+        e->state = ENTRY_SENDING;
+        e->id = 0;
+
+        // acks for earlier messages may come in while this waits for the window
+        queue_unlock(q);
+        rc = mqtt_publish_async(c, buf, &message, queue_sent, q);
+        queue_lock(q);
+        free(buf);
+
+        // the index may have moved on meanwhile
+        for (i = 0, e = NULL; i < q->index_len && !e; ++i)
+        {
+            if (entry(q, i)->addr == addr && entry(q, i)->state == ENTRY_SENDING)
+                e = entry(q, i);
+        }
+        if (rc != MQTT_SUCCESS)
+        {
+            if (e)
+                e->state = ENTRY_QUEUED;
+            break;
+        }
+        if (e)
+            e->id = message.id;
+        ++started;
+    }
+    queue_unlock(q);
+
+    return c->isconnected ? started : MQTT_DISCONNECTED;
+}
+
+
+void mqtt_queue_get_stats(mqtt_queue_t* q, mqtt_queue_stats_t* stats)
+{
+    uint16_t s;
+
+    queue_lock(q);
+    stats->count = q->count;
+    stats->bytes = q->bytes;
+    stats->dropped = q->dropped;
+    stats->free = SECTOR_SIZE - q->head_offset;
+    for (s = next_sector(q, q->head); s != q->tail; s = next_sector(q, s))
+        stats->free += SECTOR_SIZE - SECTOR_HEADER;
+    queue_unlock(q);
+}
+
+
+int mqtt_queue_clear(mqtt_queue_t* q)
+{
+    int rc = MQTT_SUCCESS;
+    uint16_t s;
+
+    queue_lock(q);
+    for (s = 0; s < q->sectors; ++s)
+    {
+        if (!spiflash_erase_sector(sector_addr(q, s)))
+            rc = MQTT_FAILURE;
+    }
+    q->count = q->bytes = 0;
+    q->index_len = 0;
+    if (rc == MQTT_SUCCESS && !start_sector(q, 0))
+        rc = MQTT_FAILURE;
+    q->tail = q->scan = q->head;
+    q->scan_offset = SECTOR_HEADER;
+    queue_unlock(q);
+
+    return rc;
+}
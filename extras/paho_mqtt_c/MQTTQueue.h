@@ -0,0 +1,116 @@
+/**
+ * Persistent store-and-forward publish queue for the paho MQTT client.
+ *
+ * Messages are appended to a log in a region of raw flash sectors, so they
+ * survive a dropped broker connection as well as a reboot, and are published
+ * from there whenever the client is connected:
+ *
+ *     mqtt_queue_init(&queue, QUEUE_ADDR, QUEUE_SIZE);
+ *     ...
+ *     mqtt_queue_push(&queue, "sensors/temp", &message);    // any task
+ *     ...
+ *     if (mqtt_connect(&client, &data) == MQTT_SUCCESS)
+ *         while (mqtt_queue_drain(&queue, &client, 16) >= 0 &&
+ *                mqtt_yield(&client, 100) != MQTT_DISCONNECTED)
+ *             ;
+ *
+ * A message is only marked as sent once the broker has acknowledged it
+ * (immediately for QoS0), so messages in flight when the connection drops
+ * are sent again after the next connect. Draining uses mqtt_publish_async(),
+ * so a backlog goes out as fast as the in-flight window allows.
+ *
+ * Flash layout: each sector starts with a header holding a sequence number,
+ * and the sectors are used as a ring, oldest first. Every record is an 8 byte
+ * header (lengths, QoS and a state word) followed by topic and payload,
+ * padded to 4 bytes, and never spans sectors. The state word is programmed
+ * twice without erasing: once when the record is complete, and once when it
+ * has been delivered. A sector is reused once every message in it has been
+ * delivered. When the ring is full the oldest sector is dropped to make room.
+ *
+ * Only an index of the next MQTT_QUEUE_INDEX_LEN undelivered records is kept
+ * in RAM, the rest is found by reading the record headers from flash as the
+ * index empties, so the RAM used does not depend on the queue length.
+ *
+ * Each sector is erased once for every (sector size / record size) messages,
+ * so e.g. 64 byte messages once a second through a 16 sector region erase
+ * each sector roughly once an hour.
+ *
+ * The queue functions may be called from any task, but draining must be done
+ * from the task that runs the client.
+ */
+#ifndef __MQTT_QUEUE_H_
+#define __MQTT_QUEUE_H_
+
+#include <stdint.h>
+#include <FreeRTOS.h>
+#include <semphr.h>
+
+#include "MQTTClient.h"
+
+/* Number of undelivered records indexed in RAM, and so the most that can be
+ * in flight from one queue.
+ */
+#ifndef MQTT_QUEUE_INDEX_LEN
+#define MQTT_QUEUE_INDEX_LEN 16
+#endif
+
+typedef struct mqtt_queue_entry
+{
+    uint32_t addr;              // flash address of the record
+    uint16_t len;               // topic and payload length
+    uint16_t id;                // packet id while being sent
+    uint8_t state;
+} mqtt_queue_entry_t;
+
+typedef struct mqtt_queue_stats
+{
+    uint32_t count;             // messages waiting to be delivered
+    uint32_t bytes;             // topic and payload bytes of those
+    uint32_t free;              // flash left before old messages are dropped
+    uint32_t dropped;           // messages dropped to make room since init
+} mqtt_queue_stats_t;
+
+typedef struct mqtt_queue
+{
+    uint32_t addr;
+    uint16_t sectors;
+    uint16_t tail;              // oldest sector in use
+    uint16_t head;              // sector being appended to
+    uint16_t scan;              // sector of the next record to index
+    uint32_t head_offset;
+    uint32_t scan_offset;
+    uint32_t seq;               // sequence number of the head sector
+
+    uint32_t count;
+    uint32_t bytes;
+    uint32_t dropped;
+
+    mqtt_queue_entry_t index[MQTT_QUEUE_INDEX_LEN];
+    uint8_t index_first;
+    uint8_t index_len;
+
+    SemaphoreHandle_t lock;
+} mqtt_queue_t;
+
+/* Open the queue in 'size' bytes of flash from 'addr', both sector aligned
+ * and at least two sectors, formatting it if it holds no queue yet. Any
+ * messages left from before a reboot are kept.
+ */
+int mqtt_queue_init(mqtt_queue_t* q, uint32_t addr, uint32_t size);
+
+/* Append a message. The payload must fit in a sector together with the
+ * topic and the record header, and the topic can be up to 255 bytes.
+ */
+int mqtt_queue_push(mqtt_queue_t* q, const char* topic, mqtt_message_t* message);
+
+/* Start publishing up to 'max' queued messages. Returns the number started,
+ * or MQTT_DISCONNECTED if the client is not connected.
+ */
+int mqtt_queue_drain(mqtt_queue_t* q, mqtt_client_t* c, int max);
+
+void mqtt_queue_get_stats(mqtt_queue_t* q, mqtt_queue_stats_t* stats);
+
+/* Drop all queued messages and erase the flash region */
+int mqtt_queue_clear(mqtt_queue_t* q);
+
+#endif
@@ -0,0 +1,342 @@
+/**
+ * Topic level trie for dispatching incoming publishes to subscriptions,
+ * see mqtt_topic_node_t in MQTTClient.h.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include <string.h>
+#include "MQTTClient.h"
+
+#define ROOT 0
+
+
+static unsigned int level_hash(unsigned short parent, const char* level, int len)
+{
+    // FNV-1a
+    unsigned int h = 2166136261u ^ parent;
+    int i;
+
+    for (i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)level[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+static unsigned short find_child(mqtt_topic_trie_t* t, unsigned short parent, const char* level, int len)
+{
+    mqtt_topic_node_t* nodes = t->nodes;
+    unsigned short i = nodes[level_hash(parent, level, len) % t->count].bucket;
+
+    for (; i; i = nodes[i].next)
+    {
+        if (nodes[i].parent == parent && nodes[i].len == len && memcmp(nodes[i].level, level, len) == 0)
+            return i;
+    }
+    return 0;
+}
+
+
+static inline int is_wildcard(const char* level, int len, char c)
+{
+    return len == 1 && level[0] == c;
+}
+
+
+// Child for a level of a filter, wildcards included
+static unsigned short filter_child(mqtt_topic_trie_t* t, unsigned short parent, const char* level, int len)
+{
+    if (is_wildcard(level, len, '+'))
+        return t->nodes[parent].plus;
+    if (is_wildcard(level, len, '#'))
+        return t->nodes[parent].hash;
+    return find_child(t, parent, level, len);
+}
+
+
+static unsigned short add_child(mqtt_topic_trie_t* t, unsigned short parent, const char* level, int len)
+{
+    mqtt_topic_node_t* nodes = t->nodes;
+    unsigned short i = t->free;
+    mqtt_topic_node_t* n = &nodes[i];
+
+    t->free = n->next;
+    --(t->free_count);
+
+    n->level = level;
+    n->len = len;
+    n->parent = parent;
+    n->next = 0;
+    n->plus = 0;
+    n->hash = 0;
+    n->refs = 0;
+    n->handler = NULL;
+    n->filter = NULL;
+
+    if (is_wildcard(level, len, '+'))
+        nodes[parent].plus = i;
+    else if (is_wildcard(level, len, '#'))
+        nodes[parent].hash = i;
+    else
+    {
+        mqtt_topic_node_t* b = &nodes[level_hash(parent, level, len) % t->count];
+        n->next = b->bucket;
+        b->bucket = i;
+    }
+    return i;
+}
+
+
+static void remove_child(mqtt_topic_trie_t* t, unsigned short i)
+{
+    mqtt_topic_node_t* nodes = t->nodes;
+    mqtt_topic_node_t* n = &nodes[i];
+    mqtt_topic_node_t* parent = &nodes[n->parent];
+
+    if (parent->plus == i)
+        parent->plus = 0;
+    else if (parent->hash == i)
+        parent->hash = 0;
+    else
+    {
+        unsigned short* link = &nodes[level_hash(n->parent, n->level, n->len) % t->count].bucket;
+        while (*link != i)
+            link = &nodes[*link].next;
+        *link = n->next;
+    }
+
+    n->next = t->free;
+    t->free = i;
+    ++(t->free_count);
+}
+
+
+// Split off the level at 'p', returns where the next one starts or NULL after the last
+static const char* next_level(const char* p, const char* end, int* len)
+{
+    const char* sep = memchr(p, '/', end - p);
+
+    if (!sep)
+    {
+        *len = end - p;
+        return NULL;
+    }
+    *len = sep - p;
+    return sep + 1;
+}
+
+
+// Levels are shared by all filters through a node but point into one of
+// them. Before filter 'old' goes, point the level of node 'i' into another
+// filter ending below it, there is one as long as the node is in use.
+static void repoint_level(mqtt_topic_trie_t* t, unsigned short i, const char* old, size_t old_len)
+{
+    mqtt_topic_node_t* nodes = t->nodes;
+    unsigned short j, k;
+    int depth = 0;
+
+    if (nodes[i].level < old || nodes[i].level >= old + old_len)
+        return;
+
+    for (k = i; k != ROOT; k = nodes[k].parent)
+        ++depth;
+    for (j = 1; j < t->count; ++j)
+    {
+        const char* p = nodes[j].filter;
+
+        if (!p || p == old)
+            continue;
+        for (k = j; k != ROOT && k != i; k = nodes[k].parent)
+            ;
+        if (k != i)
+            continue;
+        // the same level of that filter
+        while (--depth)
+            p = strchr(p, '/') + 1;
+        nodes[i].level = p;
+        return;
+    }
+}
+
+
+// Validate a filter and count the nodes it still needs, 'last' is set to
+// the deepest node it has already
+static int check_filter(mqtt_topic_trie_t* t, const char* filter, unsigned short* last)
+{
+    const char* end = filter + strlen(filter);
+    const char* p = filter;
+    unsigned short i = ROOT, child;
+    int len, missing = 0;
+
+    while (p)
+    {
+        const char* level = p;
+        p = next_level(p, end, &len);
+        if ((memchr(level, '+', len) && len != 1) || (memchr(level, '#', len) && (len != 1 || p)))
+            return MQTT_FAILURE;
+        if (missing || (child = filter_child(t, i, level, len)) == 0)
+            ++missing;
+        else
+            i = child;
+    }
+    *last = i;
+    return missing;
+}
+
+
+void mqtt_topic_trie_init(mqtt_topic_trie_t* t, mqtt_topic_node_t* nodes, unsigned int count)
+{
+    unsigned int i;
+
+    if (count > 0xffff)
+        count = 0xffff;
+    memset(nodes, 0, count * sizeof(*nodes));
+    t->nodes = nodes;
+    t->count = count;
+    t->free = (count > 1) ? 1 : 0;
+    t->free_count = (count > 1) ? count - 1 : 0;
+    for (i = 1; i + 1 < count; ++i)
+        nodes[i].next = i + 1;
+}
+
+
+int mqtt_topic_trie_check(mqtt_topic_trie_t* t, const char* filter)
+{
+    unsigned short last;
+    int missing;
+
+    if (!t->count)
+        return MQTT_BUFFER_OVERFLOW;
+    if ((missing = check_filter(t, filter, &last)) < 0)
+        return missing;
+    return (missing > t->free_count) ? MQTT_BUFFER_OVERFLOW : MQTT_SUCCESS;
+}
+
+
+int mqtt_topic_trie_insert(mqtt_topic_trie_t* t, const char* filter, mqtt_message_handler_t handler)
+{
+    const char* end = filter + strlen(filter);
+    const char* p;
+    unsigned short i, child;
+    int len, missing;
+
+    if (!t->count)
+        return MQTT_BUFFER_OVERFLOW;
+
+    if ((missing = check_filter(t, filter, &i)) < 0)
+        return missing;
+    if (!missing && t->nodes[i].handler)
+    {
+        const char* old = t->nodes[i].filter;
+
+        t->nodes[i].handler = handler;
+        t->nodes[i].filter = filter;
+        // the levels may point into the string this one replaces
+        if (old != filter)
+        {
+            size_t old_len = strlen(old);
+            for (; i != ROOT; i = t->nodes[i].parent)
+                repoint_level(t, i, old, old_len);
+        }
+        return MQTT_SUCCESS;
+    }
+    if (missing > t->free_count)
+        return MQTT_BUFFER_OVERFLOW;
+
+    for (i = ROOT, p = filter; p; )
+    {
+        const char* level = p;
+        p = next_level(p, end, &len);
+        if ((child = filter_child(t, i, level, len)) == 0)
+            child = add_child(t, i, level, len);
+        i = child;
+        ++(t->nodes[i].refs);
+    }
+    t->nodes[i].handler = handler;
+    t->nodes[i].filter = filter;
+    return MQTT_SUCCESS;
+}
+
+
+int mqtt_topic_trie_remove(mqtt_topic_trie_t* t, const char* filter)
+{
+    const char* end = filter + strlen(filter);
+    const char* p = filter;
+    const char* old;
+    size_t old_len;
+    unsigned short i = ROOT;
+    int len;
+
+    if (!t->count)
+        return MQTT_FAILURE;
+
+    while (p)
+    {
+        const char* level = p;
+        p = next_level(p, end, &len);
+        if ((i = filter_child(t, i, level, len)) == 0)
+            return MQTT_FAILURE;
+    }
+    if (!t->nodes[i].handler)
+        return MQTT_FAILURE;
+
+    old = t->nodes[i].filter;
+    old_len = strlen(old);
+    t->nodes[i].handler = NULL;
+    t->nodes[i].filter = NULL;
+    while (i != ROOT)
+    {
+        unsigned short parent = t->nodes[i].parent;
+        if (--(t->nodes[i].refs) == 0)
+            remove_child(t, i);
+        else
+            repoint_level(t, i, old, old_len);
+        i = parent;
+    }
+    return MQTT_SUCCESS;
+}
+
+
+static int match(mqtt_topic_trie_t* t, unsigned short i, const char* p, const char* end,
+        mqtt_topic_match_cb_t cb, void* arg)
+{
+    mqtt_topic_node_t* n = &t->nodes[i];
+    int matches = 0;
+    unsigned short child;
+    const char* level = p;
+    int len;
+
+    // '#' matches its parent level too, "a/#" receives "a"
+    if (n->hash && t->nodes[n->hash].handler)
+    {
+        cb(t->nodes[n->hash].handler, arg);
+        ++matches;
+    }
+    if (!p)
+    {
+        if (n->handler)
+        {
+            cb(n->handler, arg);
+            ++matches;
+        }
+        return matches;
+    }
+
+    p = next_level(p, end, &len);
+    if ((child = find_child(t, i, level, len)) != 0)
+        matches += match(t, child, p, end, cb, arg);
+    if (n->plus)
+        matches += match(t, n->plus, p, end, cb, arg);
+    return matches;
+}
+
+
+int mqtt_topic_trie_match(mqtt_topic_trie_t* t, const char* topic, int len, mqtt_topic_match_cb_t cb, void* arg)
+{
+    if (!t->count)
+        return 0;
+    return match(t, ROOT, topic, topic + len, cb, arg);
+}
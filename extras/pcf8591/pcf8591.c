@@ -5,7 +5,9 @@
 #include "pcf8591.h"
 
 /**
- * CAUTION: PLEASE SET I2C_FREQUENCY_400K IS 'false' IN 'i2c.h' FILE
+ * CAUTION: the PCF8591 is a 100kHz device. Run its bus at 100kHz with
+ * i2c_bus_set_freq(0, 100000) after i2c_init(), or build with
+ * I2C_DEFAULT_FREQ=100000.
  */
 
 #define PCF8591_CTRL_REG_READ 0x03
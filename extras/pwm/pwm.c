@@ -7,35 +7,56 @@
  */
 #include "pwm.h"
 
+#include <stdio.h>
 #include <espressif/esp_common.h>
 #include <espressif/sdk_private.h>
 #include <FreeRTOS.h>
+#include <task.h>
 #include <esp8266.h>
 
+/* One event at the period start plus a rising and falling edge per pin */
+#define MAX_PWM_EVENTS  (2 * MAX_PWM_PINS + 1)
+
 typedef struct PWMPinDefinition
 {
     uint8_t pin;
-    uint8_t divider;
+    uint16_t duty;
+    uint16_t phase;
 } PWMPin;
 
-typedef enum {
-    PERIOD_ON   = 0,
-    PERIOD_OFF  = 1
-} pwm_step_t;
+/* Pins to switch at one point of the period, and the number of timer ticks
+ * until the next event.
+ */
+typedef struct PWMEventDefinition
+{
+    uint32_t set;
+    uint32_t clear;
+    uint32_t delay;
+} PWMEvent;
 
+typedef struct PWMTableDefinition
+{
+    uint8_t count;
+    PWMEvent events[MAX_PWM_EVENTS];
+} PWMTable;
 
 typedef struct pwmInfoDefinition
 {
     uint8_t running;
 
     uint16_t freq;
-    uint16_t dutyCycle;
 
     /* private */
     uint32_t _maxLoad;
-    uint32_t _onLoad;
-    uint32_t _offLoad;
-    pwm_step_t _step;
+    uint32_t _minGap;
+
+    /* The ISR plays _tables[_active]. A new table is built in the other one
+     * and swapped in by the ISR at the end of a period if _pending is set.
+     */
+    PWMTable _tables[2];
+    volatile uint8_t _active;
+    volatile bool _pending;
+    uint8_t _event;
 
     uint16_t usedPins;
     PWMPin pins[8];
@@ -45,25 +66,152 @@ static PWMInfo pwmInfo;
 
 static void frc1_interrupt_handler(void)
 {
-    uint8_t i = 0;
-    bool out = true;
-    uint32_t load = pwmInfo._onLoad;
-    pwm_step_t step = PERIOD_ON;
+    PWMTable *table = &pwmInfo._tables[pwmInfo._active];
+    PWMEvent *event = &table->events[pwmInfo._event];
 
-    if (pwmInfo._step == PERIOD_ON)
+    GPIO.OUT_SET = event->set;
+    GPIO.OUT_CLEAR = event->clear;
+    timer_set_load(FRC1, event->delay);
+
+    if (++pwmInfo._event >= table->count)
     {
-        out = false;
-        load = pwmInfo._offLoad;
-        step = PERIOD_OFF;
+        pwmInfo._event = 0;
+        if (pwmInfo._pending)
+        {
+            pwmInfo._active ^= 1;
+            pwmInfo._pending = false;
+        }
     }
+}
+
+/* Merge pin changes into an event, the later change wins for each pin */
+static inline void merge_event(PWMEvent *event, uint32_t set, uint32_t clear)
+{
+    event->set = (event->set & ~clear) | set;
+    event->clear = (event->clear & ~set) | clear;
+}
 
-    for (; i < pwmInfo.usedPins; ++i)
+static void build_table(PWMTable *table)
+{
+    struct {
+        uint32_t time;
+        uint32_t set;
+        uint32_t clear;
+    } edges[2 * MAX_PWM_PINS], edge;
+    uint32_t times[MAX_PWM_EVENTS];
+    uint32_t max = pwmInfo._maxLoad;
+    PWMEvent *events = table->events;
+    uint8_t nedges = 0;
+    uint8_t count = 1;
+    uint8_t i, j;
+
+    events[0].set = 0;
+    events[0].clear = 0;
+    times[0] = 0;
+
+    for (i = 0; i < pwmInfo.usedPins; ++i)
+    {
+        uint32_t mask = BIT(pwmInfo.pins[i].pin);
+        uint32_t on, len, off;
+
+        len = max ? (uint64_t)pwmInfo.pins[i].duty * max / UINT16_MAX : 0;
+        if (len == 0 || len >= max)
+        {
+            // 0% and 100% duty cycle are special cases: constant output.
+            if (pwmInfo.pins[i].duty == UINT16_MAX)
+                events[0].set |= mask;
+            else
+                events[0].clear |= mask;
+            continue;
+        }
+
+        on = (uint64_t)pwmInfo.pins[i].phase * max / UINT16_MAX;
+        if (on >= max)
+            on -= max;
+        off = on + len;
+        if (off >= max)
+            off -= max;
+
+        // High at the period start if the pulse starts there or wraps into it
+        if (on == 0 || (off < on && off != 0))
+            events[0].set |= mask;
+        else
+            events[0].clear |= mask;
+
+        if (on != 0)
+        {
+            edges[nedges].time = on;
+            edges[nedges].set = mask;
+            edges[nedges].clear = 0;
+            nedges++;
+        }
+        if (off != 0)
+        {
+            edges[nedges].time = off;
+            edges[nedges].set = 0;
+            edges[nedges].clear = mask;
+            nedges++;
+        }
+    }
+
+    /* Sort by time. There are at most 16 edges so insertion sort will do. */
+    for (i = 1; i < nedges; ++i)
+    {
+        edge = edges[i];
+        for (j = i; j > 0 && edges[j - 1].time > edge.time; --j)
+            edges[j] = edges[j - 1];
+        edges[j] = edge;
+    }
+
+    /* Edges too close to the previous event are applied together with it */
+    for (i = 0; i < nedges; ++i)
     {
-        gpio_write(pwmInfo.pins[i].pin, out);
+        if (edges[i].time - times[count - 1] < pwmInfo._minGap)
+        {
+            merge_event(&events[count - 1], edges[i].set, edges[i].clear);
+            continue;
+        }
+        times[count] = edges[i].time;
+        events[count].set = edges[i].set;
+        events[count].clear = edges[i].clear;
+        count++;
     }
+    /* Edges too close to the end of the period are left to the first event,
+     * which drives every pin to its level at the start of the next period.
+     */
+    while (count > 1 && max - times[count - 1] < pwmInfo._minGap)
+    {
+        count--;
+    }
+
+    for (i = 0; i + 1 < count; ++i)
+        events[i].delay = times[i + 1] - times[i];
+    events[count - 1].delay = max ? max - times[count - 1] : timer_max_load(FRC1);
 
-    timer_set_load(FRC1, load);
-    pwmInfo._step = step;
+    table->count = count;
+}
+
+/* Rebuild the edge table after a change to the channel settings. */
+static void update_table(void)
+{
+    uint8_t next;
+
+    if (!pwmInfo.running)
+    {
+        build_table(&pwmInfo._tables[pwmInfo._active]);
+        return;
+    }
+
+    /* With _pending clear the ISR keeps playing the active table, so the
+     * other one can be rewritten even if it had been queued already.
+     */
+    taskENTER_CRITICAL();
+    pwmInfo._pending = false;
+    next = pwmInfo._active ^ 1;
+    taskEXIT_CRITICAL();
+
+    build_table(&pwmInfo._tables[next]);
+    pwmInfo._pending = true;
 }
 
 void pwm_init(uint8_t npins, const uint8_t* pins)
@@ -75,49 +223,64 @@ void pwm_init(uint8_t npins, const uint8_t* pins)
         return;
     }
 
+    uint8_t i = 0;
+    for (; i < npins; ++i)
+    {
+        if (pins[i] >= 16)
+        {
+            printf("Incorrect PWM pin (%d)\n", pins[i]);
+            return;
+        }
+    }
+
+    /* Stop timers and mask interrupts */
+    pwm_stop();
+
     /* Initialize */
     pwmInfo._maxLoad = 0;
-    pwmInfo._onLoad = 0;
-    pwmInfo._offLoad = 0;
-    pwmInfo._step = PERIOD_ON;
+    pwmInfo._minGap = 1;
+    pwmInfo._active = 0;
+    pwmInfo._pending = false;
+    pwmInfo._event = 0;
 
     /* Save pins information */
     pwmInfo.usedPins = npins;
 
-    uint8_t i = 0;
-    for (; i < npins; ++i)
+    for (i = 0; i < npins; ++i)
     {
         pwmInfo.pins[i].pin = pins[i];
+        pwmInfo.pins[i].duty = 0;
+        pwmInfo.pins[i].phase = 0;
 
         /* configure GPIOs */
         gpio_enable(pins[i], GPIO_OUTPUT);
     }
 
-    /* Stop timers and mask interrupts */
-    pwm_stop();
-
     /* set up ISRs */
     _xt_isr_attach(INUM_TIMER_FRC1, frc1_interrupt_handler);
-
-    /* Flag not running */
-    pwmInfo.running = 0;
 }
 
 void pwm_set_freq(uint16_t freq)
 {
+    bool running = pwmInfo.running;
+
     pwmInfo.freq = freq;
 
     /* Stop now to avoid load being used */
-    if (pwmInfo.running)
+    if (running)
     {
         pwm_stop();
-        pwmInfo.running = 1;
     }
 
     timer_set_frequency(FRC1, freq);
     pwmInfo._maxLoad = timer_get_load(FRC1);
+    pwmInfo._minGap = (uint64_t)pwmInfo._maxLoad * freq * PWM_MIN_GAP_US / 1000000;
+    if (pwmInfo._minGap == 0)
+    {
+        pwmInfo._minGap = 1;
+    }
 
-    if (pwmInfo.running)
+    if (running)
     {
         pwm_start();
     }
@@ -125,24 +288,60 @@ void pwm_set_freq(uint16_t freq)
 
 void pwm_set_duty(uint16_t duty)
 {
-    bool output;
+    for (uint8_t i = 0; i < pwmInfo.usedPins; ++i)
+    {
+        pwmInfo.pins[i].duty = duty;
+    }
+    update_table();
+}
+
+void pwm_set_duties(const uint16_t *duty)
+{
+    for (uint8_t i = 0; i < pwmInfo.usedPins; ++i)
+    {
+        pwmInfo.pins[i].duty = duty[i];
+    }
+    update_table();
+}
 
-    pwmInfo.dutyCycle = duty;
-    if (duty > 0 && duty < UINT16_MAX) {
-        pwm_restart();
+void pwm_set_channel(uint8_t channel, uint16_t duty, uint16_t phase)
+{
+    if (channel >= pwmInfo.usedPins)
+    {
         return;
     }
+    pwmInfo.pins[channel].duty = duty;
+    pwmInfo.pins[channel].phase = phase;
+    update_table();
+}
 
-    // 0% and 100% duty cycle are special cases: constant output.
-    pwm_stop();
-    pwmInfo.running = 1;
-    output = (duty == UINT16_MAX);
-    for (uint8_t i = 0; i < pwmInfo.usedPins; ++i)
+void pwm_set_channel_duty(uint8_t channel, uint16_t duty)
+{
+    if (channel < pwmInfo.usedPins)
+    {
+        pwm_set_channel(channel, duty, pwmInfo.pins[channel].phase);
+    }
+}
+
+void pwm_set_channel_phase(uint8_t channel, uint16_t phase)
+{
+    if (channel < pwmInfo.usedPins)
     {
-        gpio_write(pwmInfo.pins[i].pin, output);
+        pwm_set_channel(channel, pwmInfo.pins[channel].duty, phase);
     }
 }
 
+uint8_t pwm_get_events()
+{
+    uint8_t table = pwmInfo._active;
+
+    if (pwmInfo._pending)
+    {
+        table ^= 1;
+    }
+    return pwmInfo._tables[table].count;
+}
+
 void pwm_restart()
 {
     if (pwmInfo.running)
@@ -154,18 +353,19 @@ void pwm_restart()
 
 void pwm_start()
 {
-    pwmInfo._onLoad = pwmInfo.dutyCycle * pwmInfo._maxLoad / UINT16_MAX;
-    pwmInfo._offLoad = pwmInfo._maxLoad - pwmInfo._onLoad;
-    pwmInfo._step = PERIOD_ON;
+    PWMTable *table;
 
-    // Trigger ON
-    uint8_t i = 0;
-    for (; i < pwmInfo.usedPins; ++i)
-    {
-        gpio_write(pwmInfo.pins[i].pin, true);
-    }
+    /* The timer is stopped, so the ISR won't touch the tables */
+    pwmInfo._pending = false;
+    table = &pwmInfo._tables[pwmInfo._active];
+    build_table(table);
+
+    // Trigger the period start
+    GPIO.OUT_SET = table->events[0].set;
+    GPIO.OUT_CLEAR = table->events[0].clear;
+    pwmInfo._event = table->count > 1 ? 1 : 0;
 
-    timer_set_load(FRC1, pwmInfo._onLoad);
+    timer_set_load(FRC1, table->events[0].delay);
     timer_set_reload(FRC1, false);
     timer_set_interrupts(FRC1, true);
     timer_set_run(FRC1, true);
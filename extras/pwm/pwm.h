@@ -1,4 +1,29 @@
 /* Implementation of PWM support for the Espressif SDK.
+ *
+ * Up to MAX_PWM_PINS channels share one period (set with pwm_set_freq) but
+ * each channel has its own duty cycle and phase offset. Duty and phase are
+ * both fractions of the period scaled to 0..UINT16_MAX.
+ *
+ * The edges of all channels are precomputed into a table sorted by time.
+ * The FRC1 interrupt runs once per distinct edge time, and changes all pins
+ * that switch at that time with a single write to GPIO.OUT_SET and one to
+ * GPIO.OUT_CLEAR, so channels switching together stay in step.
+ *
+ * ISR load: the interrupt fires at most 2 * npins + 1 times per period (one
+ * event at the period start plus one per rising and falling edge), and fewer
+ * when edges coincide or a channel is at 0% or 100%. pwm_get_events()
+ * returns the current count. Each interrupt costs a few microseconds, so
+ * e.g. four RGBW channels at 1 kHz with distinct duties need 9 interrupts
+ * per millisecond. Edges closer together than PWM_MIN_GAP_US are merged
+ * into one interrupt, which limits the duty resolution near coinciding
+ * edges to that gap.
+ *
+ * Changes to duty, phase or pin set take effect at the next period
+ * boundary: the new table is built by the caller and the ISR swaps it in
+ * when it wraps, so no period is ever output with a mix of old and new
+ * settings.
+ *
+ * GPIO16 is not part of the GPIO output registers and cannot be used.
  *
  * Part of esp-open-rtos
  * Copyright (C) 2015 Guillem Pascual Ginovart (https://github.com/gpascualg)
@@ -12,14 +37,40 @@
 
 #define MAX_PWM_PINS    8
 
+/* Edges closer together than this (in microseconds) are applied by the same
+ * interrupt. It should not be shorter than the interrupt latency or the
+ * timer would be reloaded with a delay that has already passed.
+ */
+#ifndef PWM_MIN_GAP_US
+#define PWM_MIN_GAP_US  5
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void pwm_init(uint8_t npins, const uint8_t* pins);
 void pwm_set_freq(uint16_t freq);
+
+/* Set the same duty cycle on all channels. Phases are left unchanged. */
 void pwm_set_duty(uint16_t duty);
 
+/* Set duty cycle and phase offset of one channel, the index into the pins
+ * array passed to pwm_init. A channel with a phase offset goes high that
+ * far into the period and wraps around into the next one if needed.
+ */
+void pwm_set_channel(uint8_t channel, uint16_t duty, uint16_t phase);
+void pwm_set_channel_duty(uint8_t channel, uint16_t duty);
+void pwm_set_channel_phase(uint8_t channel, uint16_t phase);
+
+/* Set the duty cycles of all channels at once, so they take effect in the
+ * same period. 'duty' holds one value per channel.
+ */
+void pwm_set_duties(const uint16_t *duty);
+
+/* Number of timer interrupts per period with the current settings. */
+uint8_t pwm_get_events();
+
 void pwm_restart();
 void pwm_start();
 void pwm_stop();
@@ -4,4 +4,7 @@ INC_DIRS += $(sdio_ROOT)..
 # args for passing into compile rule generation
 sdio_SRC_DIR = $(sdio_ROOT)
 
-$(eval $(call component_compile_rules,sdio))
\ No newline at end of file
+$(eval $(call component_compile_rules,sdio))
+
+# the CRC7/CRC16 routines come from extras/crc
+include $(ROOT)extras/crc/component.mk
@@ -8,6 +8,8 @@
 #include <esp/gpio.h>
 #include <esp/spi.h>
 #include <espressif/esp_common.h>
+#include <string.h>
+#include <crc/crc.h>
 #include "sdio.h"
 
 #define BUS 1
@@ -102,37 +104,6 @@
 #define ACMD41 0x29 // SD_SEND_OP_COMD - Sends host capacity support information
                     // and activates the card's initialization process
 
-static uint8_t crc7(const uint8_t* data, uint8_t n)
-{
-    uint8_t crc = 0;
-    for (uint8_t i = 0; i < n; i++)
-    {
-        uint8_t d = data[i];
-        for (uint8_t j = 0; j < 8; j++)
-        {
-            crc <<= 1;
-            if ((d & 0x80) ^ (crc & 0x80))
-                crc ^= 0x09;
-            d <<= 1;
-        }
-    }
-    return (crc << 1) | 1;
-}
-
-static uint16_t crc_ccitt(const uint8_t *data, size_t n)
-{
-    uint16_t crc = 0;
-    for (size_t i = 0; i < n; i++)
-    {
-        crc = (uint8_t)(crc >> 8) | (crc << 8);
-        crc ^= data[i];
-        crc ^= (uint8_t)(crc & 0xff) >> 4;
-        crc ^= crc << 12;
-        crc ^= (crc & 0xff) << 5;
-    }
-    return crc;
-}
-
 #define spi_cs_low(card)  do { gpio_write(card->cs_pin, false); } while(0)
 #define spi_cs_high(card) do { gpio_write(card->cs_pin, true); } while(0)
 #define spi_read_byte()   (spi_transfer_8(BUS, 0xff))
@@ -148,10 +119,16 @@ inline static uint16_t spi_write_word(uint16_t word)
     return (spi_transfer_8(BUS, word >> 8) << 8) | spi_transfer_8(BUS, word);
 }
 
+/*
+ * Read in bursts of the 64 byte SPI hardware buffer. The buffer is used for
+ * both directions, so 0xff has to be sent for each burst anyway: filling the
+ * destination with 0xff and transferring it in place does that without an
+ * extra buffer.
+ */
 inline static void spi_read_bytes(uint8_t *dst, size_t size)
 {
-    for (uint8_t *offs = dst; offs < dst + size; offs ++)
-        *offs = spi_read_byte();
+    memset(dst, 0xff, size);
+    spi_transfer(BUS, dst, dst, size, SPI_8BIT);
 }
 
 static bool wait()
@@ -174,7 +151,7 @@ static uint8_t command(sdio_card_t *card, uint8_t cmd, uint32_t arg)
         arg
     };
     if (card->crc_enabled)
-        buf[5] = crc7(buf, 5);
+        buf[5] = (crc7(buf, 5, 0) << 1) | 1;
     else
         buf[5] = cmd == CMD0 ? 0x95 : 0x87;
 
@@ -228,8 +205,10 @@ static sdio_error_t read_data(sdio_card_t *card, uint8_t *dst, size_t size)
 
     spi_read_bytes(dst, size);
 
-    uint16_t crc = spi_read_word();
-    if (card->crc_enabled && crc_ccitt(dst, size) != crc)
+    uint8_t crc_buf[2];
+    spi_read_bytes(crc_buf, 2);
+    uint16_t crc = ((uint16_t)crc_buf[0] << 8) | crc_buf[1];
+    if (card->crc_enabled && crc16_ccitt(dst, size, 0) != crc)
         return set_error(card, SDIO_ERR_CRC);
 
     return SDIO_ERR_NONE;
@@ -248,7 +227,7 @@ static sdio_error_t write_data_block(sdio_card_t *card, uint8_t token, uint8_t *
         return set_error(card, SDIO_ERR_TIMEOUT);
     spi_transfer_8(BUS, token);
     spi_transfer(BUS, src, NULL, SDIO_BLOCK_SIZE, SPI_8BIT);
-    spi_write_word(card->crc_enabled ? crc_ccitt(src, SDIO_BLOCK_SIZE) : 0xffff);
+    spi_write_word(card->crc_enabled ? crc16_ccitt(src, SDIO_BLOCK_SIZE, 0) : 0xffff);
 
     if ((spi_read_byte() & WRITE_RES_MASK) != WRITE_RES_OK)
         return set_error(card, SDIO_ERR_IO);
@@ -1,6 +1,8 @@
 /*
  * Hardware SPI driver for MMC/SD/SDHC cards
  *
+ * Requires extras/crc for the command and data block CRCs.
+ *
  * Part of esp-open-rtos
  * Copyright (C) 2016 Ruslan V. Uss <unclerus@gmail.com>
  * BSD Licensed as described in the file LICENSE
@@ -0,0 +1,9 @@
+# Component makefile for extras/sensor_sched
+
+# expected anyone using it includes it as 'sensor_sched/sensor_sched.h'
+INC_DIRS += $(sensor_sched_ROOT)..
+
+# args for passing into compile rule generation
+sensor_sched_SRC_DIR = $(sensor_sched_ROOT)
+
+$(eval $(call component_compile_rules,sensor_sched))
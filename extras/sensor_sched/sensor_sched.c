@@ -0,0 +1,268 @@
+/**
+ * Sensor sampling scheduler.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include "sensor_sched.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <queue.h>
+#include <espressif/esp_common.h>
+#include <string.h>
+
+typedef enum {
+    STATE_FREE,
+    STATE_IDLE,
+    STATE_CONVERTING,
+} sensor_state_t;
+
+typedef struct {
+    sensor_sched_config_t config;
+    volatile sensor_state_t state;
+    uint32_t next_start;    // scheduled start of the next conversion
+    uint32_t started;       // actual start of the current conversion
+    uint32_t ready_at;      // when to check for the result
+    sensor_sched_stats_t stats;
+    uint64_t latency_sum;
+    uint64_t jitter_sum;
+} sensor_t;
+
+static sensor_t sensors[SENSOR_SCHED_MAX_SENSORS];
+static QueueHandle_t queue;
+static TaskHandle_t task;
+
+/* Timestamps wrap every 71 minutes, compare them by difference */
+static inline bool reached(uint32_t time, uint32_t now)
+{
+    return (int32_t)(now - time) >= 0;
+}
+
+static void deliver(uint8_t id, sensor_t *s, sensor_sample_t *sample)
+{
+    uint32_t latency = sdk_system_get_time() - s->started;
+
+    sample->sensor = id;
+    sample->time_us = s->started;
+
+    taskENTER_CRITICAL();
+    s->stats.samples++;
+    if (!sample->count) {
+        s->stats.errors++;
+    }
+    s->latency_sum += latency;
+    if (latency > s->stats.max_latency_us) {
+        s->stats.max_latency_us = latency;
+    }
+    taskEXIT_CRITICAL();
+
+    if (xQueueSend(queue, sample, 0) != pdTRUE) {
+        taskENTER_CRITICAL();
+        s->stats.dropped++;
+        taskEXIT_CRITICAL();
+    }
+
+    // Next conversion, skipping periods that were missed entirely
+    s->next_start += s->config.period_ms * 1000;
+    if (reached(s->next_start, s->started)) {
+        s->next_start = s->started + s->config.period_ms * 1000;
+    }
+    s->state = STATE_IDLE;
+}
+
+static void start_conversion(uint8_t id, sensor_t *s, uint32_t now)
+{
+    uint32_t jitter = now - s->next_start;
+    sensor_sample_t sample = { 0 };
+
+    taskENTER_CRITICAL();
+    s->jitter_sum += jitter;
+    if (jitter > s->stats.max_jitter_us) {
+        s->stats.max_jitter_us = jitter;
+    }
+    taskEXIT_CRITICAL();
+
+    s->started = now;
+    if (s->config.start && !s->config.start(s->config.ctx)) {
+        deliver(id, s, &sample);
+        return;
+    }
+    s->ready_at = now + s->config.latency_ms * 1000;
+    s->state = STATE_CONVERTING;
+}
+
+static void read_result(uint8_t id, sensor_t *s)
+{
+    sensor_sample_t sample = { 0 };
+    int count = s->config.read(s->config.ctx, sample.value);
+
+    if (count > SENSOR_SCHED_MAX_VALUES) {
+        count = SENSOR_SCHED_MAX_VALUES;
+    }
+    sample.count = count > 0 ? count : 0;
+    deliver(id, s, &sample);
+}
+
+/**
+ * Run everything that is due and return the time until the next event.
+ */
+static uint32_t run_due(void)
+{
+    uint32_t now = sdk_system_get_time();
+    uint32_t wait = UINT32_MAX;
+    uint8_t i;
+
+    // Start all conversions that are due first, so they run in parallel
+    for (i = 0; i < SENSOR_SCHED_MAX_SENSORS; i++) {
+        if (sensors[i].state == STATE_IDLE && reached(sensors[i].next_start, now)) {
+            start_conversion(i, &sensors[i], now);
+        }
+    }
+
+    // Then read back the finished ones, earliest first
+    for (;;) {
+        sensor_t *next = NULL;
+        uint8_t next_id = 0;
+
+        now = sdk_system_get_time();
+        for (i = 0; i < SENSOR_SCHED_MAX_SENSORS; i++) {
+            sensor_t *s = &sensors[i];
+            if (s->state == STATE_CONVERTING && reached(s->ready_at, now) &&
+                    (!next || (int32_t)(s->ready_at - next->ready_at) < 0)) {
+                next = s;
+                next_id = i;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        if (next->config.ready && !next->config.ready(next->config.ctx)) {
+            next->ready_at = now + SENSOR_SCHED_POLL_MS * 1000;
+            continue;
+        }
+        read_result(next_id, next);
+    }
+
+    for (i = 0; i < SENSOR_SCHED_MAX_SENSORS; i++) {
+        sensor_t *s = &sensors[i];
+        uint32_t at;
+
+        if (s->state == STATE_IDLE) {
+            at = s->next_start;
+        } else if (s->state == STATE_CONVERTING) {
+            at = s->ready_at;
+        } else {
+            continue;
+        }
+        if (reached(at, now)) {
+            return 0;
+        }
+        if (at - now < wait) {
+            wait = at - now;
+        }
+    }
+
+    return wait;
+}
+
+static void sensor_sched_task(void *pvParameters)
+{
+    for (;;) {
+        uint32_t wait = run_due();
+        TickType_t ticks = portMAX_DELAY;
+
+        if (wait != UINT32_MAX) {
+            // Round up so the event is due when we wake up
+            ticks = (wait + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+        }
+        if (ticks) {
+            // Woken early when a sensor is added
+            ulTaskNotifyTake(pdTRUE, ticks);
+        }
+    }
+}
+
+bool sensor_sched_init(void)
+{
+    if (queue) {
+        return true;
+    }
+
+    queue = xQueueCreate(SENSOR_SCHED_QUEUE_LEN, sizeof(sensor_sample_t));
+    if (!queue) {
+        return false;
+    }
+    if (xTaskCreate(sensor_sched_task, "sensor_sched", 384, NULL,
+                SENSOR_SCHED_TASK_PRIO, &task) != pdPASS) {
+        vQueueDelete(queue);
+        queue = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+int sensor_sched_add(const sensor_sched_config_t *config)
+{
+    if (!queue || !config || !config->read || !config->period_ms) {
+        return -1;
+    }
+
+    for (int i = 0; i < SENSOR_SCHED_MAX_SENSORS; i++) {
+        sensor_t *s = &sensors[i];
+        if (s->state != STATE_FREE) {
+            continue;
+        }
+        memset(s, 0, sizeof(*s));
+        s->config = *config;
+        s->next_start = sdk_system_get_time();
+        // Enable last, the scheduler task may be looking at the slot
+        s->state = STATE_IDLE;
+        xTaskNotifyGive(task);
+        return i;
+    }
+
+    return -1;
+}
+
+bool sensor_sched_receive(sensor_sample_t *sample, TickType_t timeout)
+{
+    if (!queue) {
+        return false;
+    }
+
+    return xQueueReceive(queue, sample, timeout) == pdTRUE;
+}
+
+bool sensor_sched_get_stats(uint8_t sensor, sensor_sched_stats_t *stats)
+{
+    if (sensor >= SENSOR_SCHED_MAX_SENSORS || sensors[sensor].state == STATE_FREE) {
+        return false;
+    }
+
+    sensor_t *s = &sensors[sensor];
+    taskENTER_CRITICAL();
+    *stats = s->stats;
+    if (s->stats.samples) {
+        stats->latency_us = s->latency_sum / s->stats.samples;
+        stats->jitter_us = s->jitter_sum / s->stats.samples;
+    }
+    taskEXIT_CRITICAL();
+
+    return true;
+}
+
+void sensor_sched_reset_stats(uint8_t sensor)
+{
+    if (sensor >= SENSOR_SCHED_MAX_SENSORS) {
+        return;
+    }
+
+    sensor_t *s = &sensors[sensor];
+    taskENTER_CRITICAL();
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->latency_sum = 0;
+    s->jitter_sum = 0;
+    taskEXIT_CRITICAL();
+}
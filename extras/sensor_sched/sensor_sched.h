@@ -0,0 +1,148 @@
+/**
+ * Sensor sampling scheduler.
+ *
+ * Sensors are registered with a sampling period, a conversion time and a
+ * few callbacks wrapping the calls of their driver. A single task does all
+ * the bus accesses: it starts the conversions of all sensors that are due
+ * one after the other so they convert in parallel, then reads each result
+ * back as soon as its conversion time has passed, earliest first. Samples
+ * are delivered with a timestamp through a queue.
+ *
+ * Since all callbacks run in the scheduler task, sensors sharing an I2C bus
+ * or a onewire pin never contend for it, as long as nothing else uses the
+ * bus while the scheduler runs.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#ifndef __SENSOR_SCHED_H__
+#define __SENSOR_SCHED_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <FreeRTOS.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of sensors that can be registered */
+#ifndef SENSOR_SCHED_MAX_SENSORS
+#define SENSOR_SCHED_MAX_SENSORS        8
+#endif
+
+/** Number of values in a sample */
+#ifndef SENSOR_SCHED_MAX_VALUES
+#define SENSOR_SCHED_MAX_VALUES         4
+#endif
+
+/** Number of samples queued before new ones are dropped */
+#ifndef SENSOR_SCHED_QUEUE_LEN
+#define SENSOR_SCHED_QUEUE_LEN          16
+#endif
+
+/** Priority of the scheduler task */
+#ifndef SENSOR_SCHED_TASK_PRIO
+#define SENSOR_SCHED_TASK_PRIO          3
+#endif
+
+/** How often a sensor with a ready callback is polled past its conversion time */
+#ifndef SENSOR_SCHED_POLL_MS
+#define SENSOR_SCHED_POLL_MS            10
+#endif
+
+/**
+ * Sensor description, the callbacks are called from the scheduler task.
+ */
+typedef struct {
+    const char *name;
+    /** Time between samples */
+    uint32_t period_ms;
+    /** Time from starting a conversion until the result can be read */
+    uint32_t latency_ms;
+    /**
+     * Start a conversion, NULL for sensors converting continuously.
+     * @return false on error, a failed sample is delivered
+     */
+    bool (*start)(void *ctx);
+    /**
+     * Check if the conversion is done, NULL to rely on latency_ms only.
+     * Called once latency_ms has passed, then every SENSOR_SCHED_POLL_MS.
+     */
+    bool (*ready)(void *ctx);
+    /**
+     * Read the result.
+     * @param values Room for SENSOR_SCHED_MAX_VALUES values
+     * @return Number of values stored, or negative on error
+     */
+    int (*read)(void *ctx, float *values);
+    /** Passed to the callbacks */
+    void *ctx;
+} sensor_sched_config_t;
+
+typedef struct {
+    /** Sensor id returned by sensor_sched_add */
+    uint8_t sensor;
+    /** Number of values, 0 if the sample failed */
+    uint8_t count;
+    /** Time the conversion was started, sdk_system_get_time() */
+    uint32_t time_us;
+    float value[SENSOR_SCHED_MAX_VALUES];
+} sensor_sample_t;
+
+typedef struct {
+    uint32_t samples;
+    /** Failed start or read callbacks */
+    uint32_t errors;
+    /** Samples lost because the queue was full */
+    uint32_t dropped;
+    /** Time from starting a conversion to having read the result */
+    uint32_t latency_us;
+    uint32_t max_latency_us;
+    /** How late conversions were started compared to their schedule */
+    uint32_t jitter_us;
+    uint32_t max_jitter_us;
+} sensor_sched_stats_t;
+
+/**
+ * Start the scheduler task.
+ *
+ * @return true if success, false if out of memory
+ */
+bool sensor_sched_init(void);
+
+/**
+ * Register a sensor. Its first conversion is started right away.
+ *
+ * @param config Sensor description, copied
+ * @return Sensor id, or -1 if all slots are taken or config is invalid
+ */
+int sensor_sched_add(const sensor_sched_config_t *config);
+
+/**
+ * Wait for the next sample of any sensor.
+ *
+ * @param sample Filled with the sample
+ * @param timeout Ticks to wait
+ * @return true if a sample was received
+ */
+bool sensor_sched_receive(sensor_sample_t *sample, TickType_t timeout);
+
+/**
+ * Get the counters of a sensor. latency_us and jitter_us are averages
+ * since the last reset.
+ *
+ * @return false if there is no such sensor
+ */
+bool sensor_sched_get_stats(uint8_t sensor, sensor_sched_stats_t *stats);
+
+/**
+ * Reset the counters of a sensor.
+ */
+void sensor_sched_reset_stats(uint8_t sensor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SENSOR_SCHED_H__ */
@@ -20,7 +20,11 @@
 #include "softuart.h"
 #include <stdint.h>
 #include <esp/gpio.h>
+#include <esp/timer.h>
+#include <esp/interrupts.h>
 #include <espressif/esp_common.h>
+#include <FreeRTOS.h>
+#include <task.h>
 #include <stdio.h>
 
 //#define SOFTUART_DEBUG
@@ -31,12 +35,22 @@
 #define debug(fmt, ...)
 #endif
 
+// Start bit, 8 data bits and stop bit
+#define FRAME_BITS 10
+
+// Shortest timer load, in FRC1 ticks (80 MHz)
+#define MIN_TIMER_LOAD 80
+
 typedef struct
 {
     char receive_buffer[SOFTUART_MAX_RX_BUFF];
     uint8_t receive_buffer_tail;
     uint8_t receive_buffer_head;
-    uint8_t buffer_overflow;
+    uint32_t overflows;
+    uint32_t framing_errors;
+    char transmit_buffer[SOFTUART_MAX_TX_BUFF];
+    uint8_t transmit_buffer_tail;
+    uint8_t transmit_buffer_head;
 } softuart_buffer_t;
 
 typedef struct
@@ -44,11 +58,36 @@ typedef struct
     uint8_t rx_pin, tx_pin;
     uint32_t baudrate;
     volatile softuart_buffer_t buffer;
-    uint16_t bit_time;
+    uint32_t bit_cycles; // CPU cycles per bit
+
+    // RX decoder, runs in the GPIO interrupt
+    bool rx_busy;
+    bool rx_level;       // line level since the last edge
+    uint8_t rx_bit;      // next bit to sample, 8 is the stop bit
+    uint8_t rx_data;
+    uint32_t rx_start;   // cycle count of the start bit edge
+
+    // TX shifter, runs in the FRC1 interrupt
+    volatile bool tx_busy;
+    uint8_t tx_bit;      // next bit to send, FRAME_BITS when the frame is done
+    uint16_t tx_frame;
+    uint32_t tx_start;   // cycle count when the start bit was sent
+    uint32_t tx_next;    // cycle count when the next bit is due
+    TaskHandle_t tx_waiter; // task waiting for buffer room or for the line to go idle
 } softuart_t;
 
 static softuart_t uarts[SOFTUART_MAX_UARTS] = { { 0 } };
 
+// CPU cycles per FRC1 tick
+static uint8_t cycles_per_tick = 1;
+
+static inline uint32_t get_ccount(void)
+{
+    uint32_t ccount;
+    __asm__ volatile("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+}
+
 inline static int8_t find_uart_by_rx(uint8_t rx_pin)
 {
     for (uint8_t i = 0; i < SOFTUART_MAX_UARTS; i++)
@@ -57,63 +96,170 @@ inline static int8_t find_uart_by_rx(uint8_t rx_pin)
     return -1;
 }
 
-// GPIO interrupt handler
-static void handle_rx(uint8_t gpio_num)
+// Sample all bits whose center is before 'now' with the current line level
+static void IRAM rx_sample(softuart_t *uart, uint32_t now)
 {
+    while (uart->rx_busy)
+    {
+        uint32_t center = uart->rx_start + uart->bit_cycles * (uart->rx_bit + 1) + uart->bit_cycles / 2;
+        if ((int32_t)(now - center) < 0)
+            return;
+
+        if (uart->rx_bit < 8)
+        {
+            // Shift d to the right, if high set msb of 8bit to 1
+            uart->rx_data >>= 1;
+            if (uart->rx_level)
+                uart->rx_data |= 0x80;
+            uart->rx_bit++;
+            continue;
+        }
+
+        // Stop bit
+        uart->rx_busy = false;
+        if (!uart->rx_level)
+        {
+            uart->buffer.framing_errors++;
+            return;
+        }
+
+        // Store byte in buffer
+        // If buffer full, count the overflow and drop it
+        uint8_t next = (uart->buffer.receive_buffer_tail + 1) % SOFTUART_MAX_RX_BUFF;
+        if (next != uart->buffer.receive_buffer_head)
+        {
+            // save new data in buffer: tail points to where byte goes
+            uart->buffer.receive_buffer[uart->buffer.receive_buffer_tail] = uart->rx_data; // save new byte
+            uart->buffer.receive_buffer_tail = next;
+        }
+        else
+        {
+            uart->buffer.overflows++;
+        }
+    }
+}
+
+// GPIO interrupt handler, called on both edges of the RX line
+static void IRAM handle_rx(uint8_t gpio_num)
+{
+    uint32_t now = get_ccount();
+
     // find uart
     int8_t uart_no = find_uart_by_rx(gpio_num);
     if (uart_no < 0) return;
 
     softuart_t *uart = uarts + uart_no;
+    bool level = gpio_read(gpio_num);
+
+    // Bits before this edge had the previous level
+    rx_sample(uart, now);
+
+    if (uart->rx_busy)
+    {
+        uart->rx_level = level;
+    }
+    else if (!level)
+    {
+        // Start bit
+        uart->rx_busy = true;
+        uart->rx_level = false;
+        uart->rx_bit = 0;
+        uart->rx_data = 0;
+        uart->rx_start = now;
+    }
+}
 
-    // Disable interrupt
-    gpio_set_interrupt(gpio_num, GPIO_INTTYPE_NONE, handle_rx);
+// Complete a char whose last edge was a while ago. Called with interrupts
+// disabled. Stays half a bit behind so an edge whose interrupt is still
+// pending is not sampled with the old level.
+static void rx_poll(softuart_t *uart)
+{
+    rx_sample(uart, get_ccount() - uart->bit_cycles / 2);
+}
 
-    // Wait till start bit is half over so we can sample the next one in the center
-    sdk_os_delay_us(uart->bit_time / 2);
+// Wake the task waiting in softuart_put() or softuart_flush()
+static void IRAM tx_wake(softuart_t *uart, BaseType_t *woken)
+{
+    TaskHandle_t waiter = uart->tx_waiter;
 
-    // Now sample bits
-    uint8_t d = 0;
-    uint32_t start_time = 0x7FFFFFFF & sdk_system_get_time();
+    if (!waiter) return;
+    uart->tx_waiter = NULL;
+    vTaskNotifyGiveFromISR(waiter, woken);
+}
 
-    for (uint8_t i = 0; i < 8; i++)
+// Send the next bit of a uart, or start its next frame
+static void IRAM tx_bit(softuart_t *uart, BaseType_t *woken)
+{
+    if (uart->tx_bit == FRAME_BITS)
     {
-        while ((0x7FFFFFFF & sdk_system_get_time()) < (start_time + (uart->bit_time * (i + 1))))
-        {
-            // If system timer overflow, escape from while loop
-            if ((0x7FFFFFFF & sdk_system_get_time()) < start_time)
-                break;
-        }
-        // Shift d to the right
-        d >>= 1;
-
-        // Read bit
-        if (gpio_read(uart->rx_pin))
+        // Previous stop bit is done
+        if (uart->buffer.transmit_buffer_head == uart->buffer.transmit_buffer_tail)
         {
-            // If high, set msb of 8bit to 1
-            d |= 0x80;
+            uart->tx_busy = false;
+            tx_wake(uart, woken);
+            return;
         }
+        uint8_t c = uart->buffer.transmit_buffer[uart->buffer.transmit_buffer_head];
+        uart->buffer.transmit_buffer_head = (uart->buffer.transmit_buffer_head + 1) % SOFTUART_MAX_TX_BUFF;
+        // A writer waiting for room is woken once half the buffer is free
+        if ((uint8_t)(uart->buffer.transmit_buffer_tail - uart->buffer.transmit_buffer_head)
+                % SOFTUART_MAX_TX_BUFF <= SOFTUART_MAX_TX_BUFF / 2)
+            tx_wake(uart, woken);
+        uart->tx_frame = (1 << (FRAME_BITS - 1)) | (c << 1);
+        uart->tx_start = uart->tx_next;
+        uart->tx_bit = 0;
     }
 
-    // Store byte in buffer
-    // If buffer full, set the overflow flag and return
-    uint8_t next = (uart->buffer.receive_buffer_tail + 1) % SOFTUART_MAX_RX_BUFF;
-    if (next != uart->buffer.receive_buffer_head)
+    gpio_write(uart->tx_pin, uart->tx_frame & BIT(uart->tx_bit));
+    uart->tx_bit++;
+    uart->tx_next = uart->tx_start + uart->bit_cycles * uart->tx_bit;
+}
+
+// Send all bits that are due and program FRC1 for the next one. Called from
+// the timer interrupt or with interrupts disabled.
+static void IRAM tx_run(BaseType_t *woken)
+{
+    uint32_t now = get_ccount();
+    int32_t wait = INT32_MAX;
+    bool busy = false;
+
+    for (uint8_t i = 0; i < SOFTUART_MAX_UARTS; i++)
     {
-        // save new data in buffer: tail points to where byte goes
-        uart->buffer.receive_buffer[uart->buffer.receive_buffer_tail] = d; // save new byte
-        uart->buffer.receive_buffer_tail = next;
+        softuart_t *uart = uarts + i;
+        if (!uart->tx_busy) continue;
+
+        // Bits due within an eighth of a bit time are sent now
+        if ((int32_t)(uart->tx_next - now) <= (int32_t)(uart->bit_cycles / 8))
+            tx_bit(uart, woken);
+        if (!uart->tx_busy) continue;
+
+        busy = true;
+        if ((int32_t)(uart->tx_next - now) < wait)
+            wait = uart->tx_next - now;
     }
-    else
+
+    if (!busy)
     {
-        uart->buffer.buffer_overflow = 1;
+        timer_set_run(FRC1, false);
+        return;
     }
 
-    // Wait for stop bit
-    sdk_os_delay_us(uart->bit_time);
+    uint32_t load = wait > 0 ? wait / cycles_per_tick : 0;
+    if (load < MIN_TIMER_LOAD)
+        load = MIN_TIMER_LOAD;
+    if (load > TIMER_FRC1_MAX_LOAD)
+        load = TIMER_FRC1_MAX_LOAD;
+    timer_set_load(FRC1, load);
+    timer_set_run(FRC1, true);
+}
+
+// FRC1 interrupt handler
+static void IRAM handle_tx(void)
+{
+    BaseType_t woken = pdFALSE;
 
-    // Done, reenable interrupt
-    gpio_set_interrupt(uart->rx_pin, GPIO_INTTYPE_EDGE_NEG, handle_rx);
+    tx_run(&woken);
+    portEND_SWITCHING_ISR(woken);
 }
 
 static bool check_uart_no(uint8_t uart_no)
@@ -142,6 +288,14 @@ static bool check_uart_enabled(uint8_t uart_no)
 /// Public
 ///////////////////////////////////////////////////////////////////////////////
 
+static bool any_uart_open(void)
+{
+    for (uint8_t i = 0; i < SOFTUART_MAX_UARTS; i++)
+        if (uarts[i].baudrate) return true;
+
+    return false;
+}
+
 bool softuart_open(uint8_t uart_no, uint32_t baudrate, uint8_t rx_pin, uint8_t tx_pin)
 {
     // do some checks
@@ -151,6 +305,11 @@ bool softuart_open(uint8_t uart_no, uint32_t baudrate, uint8_t rx_pin, uint8_t t
         debug("Invalid baudrate");
         return false;
     }
+    if (rx_pin >= 16)
+    {
+        debug("No edge interrupts on GPIO%d", rx_pin);
+        return false;
+    }
     for (uint8_t i = 0; i < SOFTUART_MAX_UARTS; i++)
         if (uarts[i].baudrate && i != uart_no
             && (uarts[i].rx_pin == rx_pin || uarts[i].tx_pin == tx_pin || uarts[i].rx_pin == tx_pin || uarts[i].tx_pin == rx_pin))
@@ -162,14 +321,37 @@ bool softuart_open(uint8_t uart_no, uint32_t baudrate, uint8_t rx_pin, uint8_t t
     softuart_close(uart_no);
 
     softuart_t *uart = uarts + uart_no;
+    uint32_t cpu_hz = sdk_system_get_cpu_freq() * 1000000;
+
+    // Calculate bit time in CPU cycles, rounded
+    uart->bit_cycles = (cpu_hz + baudrate / 2) / baudrate;
+    if (uart->bit_cycles < 8 * MIN_TIMER_LOAD)
+    {
+        debug("Baudrate %d too high", baudrate);
+        return false;
+    }
 
-    uart->baudrate = baudrate;
     uart->rx_pin = rx_pin;
     uart->tx_pin = tx_pin;
-
-    // Calculate bit_time
-    uart->bit_time = (1000000 / baudrate);
-    if (((100000000 / baudrate) - (100 * uart->bit_time)) > 50) uart->bit_time++;
+    uart->buffer.receive_buffer_head = uart->buffer.receive_buffer_tail = 0;
+    uart->buffer.transmit_buffer_head = uart->buffer.transmit_buffer_tail = 0;
+    uart->buffer.overflows = uart->buffer.framing_errors = 0;
+    uart->rx_busy = false;
+    uart->tx_busy = false;
+    uart->tx_waiter = NULL;
+
+    if (!any_uart_open())
+    {
+        // First uart, set up the bit timer
+        cycles_per_tick = cpu_hz / 80000000;
+        timer_set_interrupts(FRC1, false);
+        timer_set_run(FRC1, false);
+        timer_set_divider(FRC1, TIMER_CLKDIV_1);
+        timer_set_reload(FRC1, false);
+        _xt_isr_attach(INUM_TIMER_FRC1, handle_tx);
+        timer_set_interrupts(FRC1, true);
+    }
+    uart->baudrate = baudrate;
 
     // Setup Rx
     gpio_enable(rx_pin, GPIO_INPUT);
@@ -180,10 +362,8 @@ bool softuart_open(uint8_t uart_no, uint32_t baudrate, uint8_t rx_pin, uint8_t t
     gpio_set_pullup(tx_pin, true, false);
     gpio_write(tx_pin, 1);
 
-    // Setup the interrupt handler to get the start bit
-    gpio_set_interrupt(rx_pin, GPIO_INTTYPE_EDGE_NEG, handle_rx);
-
-    sdk_os_delay_us(1000); // TODO: not sure if it really needed
+    // Setup the interrupt handler to timestamp the edges
+    gpio_set_interrupt(rx_pin, GPIO_INTTYPE_EDGE_ANY, handle_rx);
 
     return true;
 }
@@ -197,8 +377,25 @@ bool softuart_close(uint8_t uart_no)
 
     // Remove interrupt
     gpio_set_interrupt(uart->rx_pin, GPIO_INTTYPE_NONE, NULL);
+
+    // Drop pending output
+    taskENTER_CRITICAL();
+    uart->tx_busy = false;
+    gpio_write(uart->tx_pin, 1);
     // Mark as unused
     uart->baudrate = 0;
+    if (uart->tx_waiter)
+    {
+        xTaskNotifyGive(uart->tx_waiter);
+        uart->tx_waiter = NULL;
+    }
+    taskEXIT_CRITICAL();
+
+    if (!any_uart_open())
+    {
+        timer_set_interrupts(FRC1, false);
+        timer_set_run(FRC1, false);
+    }
 
     return true;
 }
@@ -209,26 +406,31 @@ bool softuart_put(uint8_t uart_no, char c)
     if (!check_uart_enabled(uart_no)) return false;
     softuart_t *uart = uarts + uart_no;
 
-    uint32_t start_time = 0x7FFFFFFF & sdk_system_get_time();
-    gpio_write(uart->tx_pin, 0);
+    uint8_t next = (uart->buffer.transmit_buffer_tail + 1) % SOFTUART_MAX_TX_BUFF;
 
-    for (uint8_t i = 0; i <= 8; i++)
+    taskENTER_CRITICAL();
+    // Sleep until the timer interrupt has made room in the buffer
+    while (next == uart->buffer.transmit_buffer_head)
     {
-        while ((0x7FFFFFFF & sdk_system_get_time()) < (start_time + (uart->bit_time * (i + 1))))
-        {
-            if ((0x7FFFFFFF & sdk_system_get_time()) < start_time)
-                break;
-        }
-        gpio_write(uart->tx_pin, c & (1 << i));
+        uart->tx_waiter = xTaskGetCurrentTaskHandle();
+        taskEXIT_CRITICAL();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!uart->baudrate) return false;
+        taskENTER_CRITICAL();
     }
-
-    while ((0x7FFFFFFF & sdk_system_get_time()) < (start_time + (uart->bit_time * 9)))
+    uart->buffer.transmit_buffer[uart->buffer.transmit_buffer_tail] = c;
+    uart->buffer.transmit_buffer_tail = next;
+    if (!uart->tx_busy)
     {
-        if ((0x7FFFFFFF & sdk_system_get_time()) < start_time)
-            break;
+        // Idle line, send the start bit right away
+        BaseType_t woken = pdFALSE;
+
+        uart->tx_busy = true;
+        uart->tx_bit = FRAME_BITS;
+        uart->tx_next = get_ccount();
+        tx_run(&woken);
     }
-    gpio_write(uart->tx_pin, 1);
-    sdk_os_delay_us(uart->bit_time * 6);
+    taskEXIT_CRITICAL();
 
     return true;
 }
@@ -244,12 +446,35 @@ bool softuart_puts(uint8_t uart_no, const char *s)
     return true;
 }
 
+bool softuart_flush(uint8_t uart_no)
+{
+    if (!check_uart_no(uart_no)) return false;
+    if (!check_uart_enabled(uart_no)) return false;
+    softuart_t *uart = uarts + uart_no;
+
+    taskENTER_CRITICAL();
+    while (uart->tx_busy)
+    {
+        uart->tx_waiter = xTaskGetCurrentTaskHandle();
+        taskEXIT_CRITICAL();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        taskENTER_CRITICAL();
+    }
+    taskEXIT_CRITICAL();
+
+    return true;
+}
+
 bool softuart_available(uint8_t uart_no)
 {
     if (!check_uart_no(uart_no)) return false;
     if (!check_uart_enabled(uart_no)) return false;
     softuart_t *uart = uarts + uart_no;
 
+    taskENTER_CRITICAL();
+    rx_poll(uart);
+    taskEXIT_CRITICAL();
+
     return (uart->buffer.receive_buffer_tail + SOFTUART_MAX_RX_BUFF - uart->buffer.receive_buffer_head) % SOFTUART_MAX_RX_BUFF;
 }
 
@@ -259,6 +484,10 @@ uint8_t softuart_read(uint8_t uart_no)
     if (!check_uart_enabled(uart_no)) return 0;
     softuart_t *uart = uarts + uart_no;
 
+    taskENTER_CRITICAL();
+    rx_poll(uart);
+    taskEXIT_CRITICAL();
+
     // Empty buffer?
     if (uart->buffer.receive_buffer_head == uart->buffer.receive_buffer_tail) return 0;
 
@@ -268,3 +497,20 @@ uint8_t softuart_read(uint8_t uart_no)
     return d;
 }
 
+bool softuart_get_errors(uint8_t uart_no, uint32_t *overflows, uint32_t *framing_errors)
+{
+    if (!check_uart_no(uart_no)) return false;
+    if (!check_uart_enabled(uart_no)) return false;
+    softuart_t *uart = uarts + uart_no;
+
+    taskENTER_CRITICAL();
+    if (overflows)
+        *overflows = uart->buffer.overflows;
+    if (framing_errors)
+        *framing_errors = uart->buffer.framing_errors;
+    uart->buffer.overflows = 0;
+    uart->buffer.framing_errors = 0;
+    taskEXIT_CRITICAL();
+
+    return true;
+}
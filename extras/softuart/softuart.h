@@ -5,11 +5,30 @@
  * Copyright (C) 2016 Bernhard Guillon <Bernhard.Guillon@web.de>
  *
  * This code is based on Softuart from here [1] and reworked to
- * fit into esp-open-rtos. For now only the RX part is ported.
- * Also the configuration of the pin is for now hardcoded.
+ * fit into esp-open-rtos.
  *
  * it fits my needs to read the GY-GPS6MV2 module with 9600 8n1
  *
+ * Neither direction busy-waits in an interrupt handler:
+ *
+ * - RX takes a GPIO interrupt on every edge of the RX line and records the
+ *   CPU cycle counter. The bits between two edges are filled in from the
+ *   time that passed, so each interrupt only takes a few microseconds. A
+ *   character ending in high bits has no edge after its last data bit, it
+ *   is completed by the next start bit or when softuart_available() or
+ *   softuart_read() see that its stop bit time has passed.
+ * - TX queues characters in a buffer and shifts them out bit by bit from
+ *   the FRC1 timer interrupt, one interrupt per bit (less if bits of
+ *   several uarts are due together).
+ *
+ * FRC1 is shared by all software uarts, so this driver cannot be used
+ * together with anything else that uses FRC1, such as extras/pwm.
+ *
+ * The highest usable baud rate is limited by interrupt latency: edges must
+ * be seen within a fraction of a bit time and two edges closer together
+ * than the GPIO interrupt latency are lost. Changing the CPU frequency
+ * after softuart_open() breaks the timing.
+ *
  * Original Copyright:
  * Copyright (c) 2015 plieningerweb
  *
@@ -36,6 +55,10 @@ extern "C"
     #define SOFTUART_MAX_RX_BUFF 64 //!< Must be power of two: 2, 4, 8, 16 etc.
 #endif
 
+#ifndef SOFTUART_MAX_TX_BUFF
+    #define SOFTUART_MAX_TX_BUFF 64 //!< Must be power of two: 2, 4, 8, 16 etc.
+#endif
+
 /**
  * Initialize software uart and setup interrupt handler
  * @param uart_no Software uart index, 0..SOFTUART_MAX_UARTS
@@ -55,6 +78,11 @@ bool softuart_close(uint8_t uart_no);
 
 /**
  * Put char to software uart
+ *
+ * The char is queued for sending by the timer interrupt. This call only
+ * waits if the TX buffer is full, sleeping until the interrupt has sent
+ * half of it. Only one task at a time can wait in softuart_put() or
+ * softuart_flush() on a uart.
  * @param uart_no Software uart index, 0..SOFTUART_MAX_UARTS
  * @param c Char
  * @return true if no errors occured otherwise false
@@ -69,6 +97,13 @@ bool softuart_put(uint8_t uart_no, char c);
  */
 bool softuart_puts(uint8_t uart_no, const char *s);
 
+/**
+ * Wait until all queued chars have been sent, sleeping meanwhile
+ * @param uart_no Software uart index, 0..SOFTUART_MAX_UARTS
+ * @return true if no errors occured otherwise false
+ */
+bool softuart_flush(uint8_t uart_no);
+
 /**
  * Check if data is available
  * @param uart_no Software uart index, 0..SOFTUART_MAX_UARTS
@@ -86,6 +121,16 @@ bool softuart_available(uint8_t uart_no);
  */
 uint8_t softuart_read(uint8_t uart_no);
 
+/**
+ * Get the number of received chars dropped because of a full RX buffer
+ * and the number of chars with an invalid stop bit, and reset both.
+ * @param uart_no Software uart index, 0..SOFTUART_MAX_UARTS
+ * @param overflows Dropped chars, may be NULL
+ * @param framing_errors Chars with an invalid stop bit, may be NULL
+ * @return true if no errors occured otherwise false
+ */
+bool softuart_get_errors(uint8_t uart_no, uint32_t *overflows, uint32_t *framing_errors);
+
 #ifdef __cplusplus
 }
 #endif
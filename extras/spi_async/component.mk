@@ -0,0 +1,9 @@
+# Component makefile for extras/spi_async
+
+# expected anyone using it includes it as 'spi_async/spi_async.h'
+INC_DIRS += $(spi_async_ROOT)..
+
+# args for passing into compile rule generation
+spi_async_SRC_DIR = $(spi_async_ROOT)
+
+$(eval $(call component_compile_rules,spi_async))
@@ -0,0 +1,248 @@
+/**
+ * Interrupt driven transfer queue for the HSPI bus.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include "spi_async.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <queue.h>
+#include <esp/gpio.h>
+#include <esp/iomux_regs.h>
+#include <esp/dport_regs.h>
+#include <esp/interrupts.h>
+
+#define BUS 1
+
+#define BUF_SIZE 64
+
+static QueueHandle_t queue;
+
+/* Transaction on the bus, NULL when idle */
+static spi_async_trans_t *volatile current;
+
+void spi_async_device_init(spi_async_device_t *dev, uint8_t cs_pin,
+        const spi_settings_t *s)
+{
+    bool cpha = (uint8_t)s->mode & 1;
+    bool cpol = (uint8_t)s->mode & 2;
+    if (cpol)
+        cpha = !cpha;  // see spi_set_mode()
+
+    dev->cs_pin = cs_pin;
+    dev->cpol = cpol;
+    dev->endianness = s->endianness;
+
+    // Chip select is a GPIO, so no hardware CS setup/hold
+    dev->user0 = SPI_USER0_MOSI | SPI_USER0_CLOCK_IN_EDGE | SPI_USER0_DUPLEX;
+    if (cpha)
+        dev->user0 |= SPI_USER0_CLOCK_OUT_EDGE;
+    if (s->endianness == SPI_BIG_ENDIAN)
+        dev->user0 |= SPI_USER0_WR_BYTE_ORDER | SPI_USER0_RD_BYTE_ORDER;
+
+    dev->ctrl0 = s->msb ? 0 : SPI_CTRL0_WR_BIT_ORDER | SPI_CTRL0_RD_BIT_ORDER;
+
+    // see spi_set_frequency_div()
+    uint32_t predivider = (s->freq_divider & 0xffff) - 1;
+    uint32_t count = (s->freq_divider >> 16) - 1;
+    dev->sys_clock = !count && !predivider;
+    dev->clock = dev->sys_clock
+        ? SPI_CLOCK_EQU_SYS_CLOCK
+        : VAL2FIELD_M(SPI_CLOCK_DIV_PRE, predivider) |
+          VAL2FIELD_M(SPI_CLOCK_COUNT_NUM, count) |
+          VAL2FIELD_M(SPI_CLOCK_COUNT_HIGH, count / 2) |
+          VAL2FIELD_M(SPI_CLOCK_COUNT_LOW, count);
+
+    gpio_enable(cs_pin, GPIO_OUTPUT);
+    gpio_write(cs_pin, true);
+}
+
+static void apply_settings(const spi_async_device_t *dev)
+{
+    SPI(BUS).USER0 = dev->user0;
+    SPI(BUS).CTRL0 = (SPI(BUS).CTRL0 &
+            ~(SPI_CTRL0_WR_BIT_ORDER | SPI_CTRL0_RD_BIT_ORDER)) | dev->ctrl0;
+    if (dev->cpol)
+        SPI(BUS).PIN |= SPI_PIN_IDLE_EDGE;
+    else
+        SPI(BUS).PIN &= ~SPI_PIN_IDLE_EDGE;
+    if (dev->sys_clock)
+        IOMUX.CONF |= IOMUX_CONF_SPI1_CLOCK_EQU_SYS_CLOCK;
+    else
+        IOMUX.CONF &= ~IOMUX_CONF_SPI1_CLOCK_EQU_SYS_CLOCK;
+    SPI(BUS).CLOCK = dev->clock;
+}
+
+/* Same as the buffer preparation in spi_transfer() */
+static inline uint32_t swap(uint32_t w, const spi_async_trans_t *t)
+{
+    if (t->dev->endianness == SPI_LITTLE_ENDIAN || t->word_size == SPI_32BIT)
+        return w;
+    if (t->word_size == SPI_16BIT)
+        return (w << 16) | (w >> 16);
+    return (w << 24) | ((w << 8) & 0x00ff0000) | ((w >> 8) & 0x0000ff00) | (w >> 24);
+}
+
+static inline size_t chunk_size(const spi_async_trans_t *t)
+{
+    size_t left = t->len * t->word_size - t->done;
+    return left > BUF_SIZE ? BUF_SIZE : left;
+}
+
+/* Fill the hardware buffer with the next chunk and start it */
+static void start_chunk(spi_async_trans_t *t)
+{
+    size_t n = chunk_size(t);
+    uint32_t bits = (n << 3) - 1;
+
+    SPI(BUS).USER1 = SET_FIELD(SPI(BUS).USER1, SPI_USER1_MISO_BITLEN, bits);
+    SPI(BUS).USER1 = SET_FIELD(SPI(BUS).USER1, SPI_USER1_MOSI_BITLEN, bits);
+
+    // Buffer registers only allow 32-bit access, and out may be unaligned
+    const uint8_t *src = (const uint8_t *)t->out + t->done;
+    for (size_t i = 0; i < (n + 3) / 4; i++) {
+        uint32_t w = 0xffffffff;
+        if (t->out) {
+            w = 0;
+            for (size_t j = 0; j < 4 && i * 4 + j < n; j++)
+                w |= (uint32_t)src[i * 4 + j] << (j * 8);
+        }
+        SPI(BUS).W[i] = swap(w, t);
+    }
+
+    SPI(BUS).CMD |= SPI_CMD_USR;
+}
+
+/* Copy the received chunk out of the hardware buffer */
+static void finish_chunk(spi_async_trans_t *t)
+{
+    size_t n = chunk_size(t);
+
+    if (t->in) {
+        uint8_t *dst = (uint8_t *)t->in + t->done;
+        for (size_t i = 0; i < (n + 3) / 4; i++) {
+            uint32_t w = swap(SPI(BUS).W[i], t);
+            for (size_t j = 0; j < 4 && i * 4 + j < n; j++)
+                dst[i * 4 + j] = w >> (j * 8);
+        }
+    }
+    t->done += n;
+}
+
+static void start_trans(spi_async_trans_t *t)
+{
+    current = t;
+    t->done = 0;
+    apply_settings(t->dev);
+    gpio_write(t->dev->cs_pin, false);
+    start_chunk(t);
+}
+
+static void spi_async_isr(void)
+{
+    if (!(DPORT.SPI_INT_STATUS & DPORT_SPI_INT_STATUS_SPI1))
+        return;
+    SPI(BUS).SLAVE0 &= ~SPI_SLAVE0_TRANS_DONE;
+
+    spi_async_trans_t *t = current;
+    if (!t)
+        return;
+
+    finish_chunk(t);
+    if (t->done < t->len * t->word_size) {
+        start_chunk(t);
+        return;
+    }
+
+    BaseType_t woken = pdFALSE;
+
+    gpio_write(t->dev->cs_pin, true);
+    // The transaction may be gone once the callback or waiter has run
+    TaskHandle_t waiter = t->waiter;
+    if (t->cb)
+        t->cb(t);
+    if (waiter)
+        vTaskNotifyGiveFromISR(waiter, &woken);
+
+    if (xQueueReceiveFromISR(queue, &t, &woken))
+        start_trans(t);
+    else
+        current = NULL;
+
+    portEND_SWITCHING_ISR(woken);
+}
+
+bool spi_async_init(void)
+{
+    if (queue)
+        return true;
+
+    queue = xQueueCreate(SPI_ASYNC_QUEUE_LEN, sizeof(spi_async_trans_t *));
+    if (!queue)
+        return false;
+
+    // Sets up the pins, the settings are replaced per transaction
+    spi_init(BUS, SPI_MODE0, SPI_FREQ_DIV_1M, true, SPI_LITTLE_ENDIAN, true);
+
+    _xt_isr_attach(INUM_SPI, spi_async_isr);
+    SPI(BUS).SLAVE0 = (SPI(BUS).SLAVE0 & ~SPI_SLAVE0_TRANS_DONE) |
+        SPI_SLAVE0_TRANS_DONE_EN;
+    _xt_isr_unmask(BIT(INUM_SPI));
+
+    return true;
+}
+
+static bool queue_trans(spi_async_trans_t *trans, TickType_t timeout)
+{
+    if (!queue || !trans->dev)
+        return false;
+
+    if (!trans->len) {
+        if (trans->cb)
+            trans->cb(trans);
+        return true;
+    }
+
+    if (!xQueueSend(queue, &trans, timeout))
+        return false;
+
+    // Kick the bus if it's idle, otherwise the interrupt picks it up
+    taskENTER_CRITICAL();
+    if (!current) {
+        spi_async_trans_t *t;
+        if (xQueueReceive(queue, &t, 0))
+            start_trans(t);
+    }
+    taskEXIT_CRITICAL();
+
+    return true;
+}
+
+bool spi_async_queue(spi_async_trans_t *trans, TickType_t timeout)
+{
+    trans->waiter = NULL;
+    return queue_trans(trans, timeout);
+}
+
+size_t spi_async_transfer(spi_async_device_t *dev, const void *out_data,
+        void *in_data, size_t len, spi_word_size_t word_size)
+{
+    spi_async_trans_t trans = {
+        .dev = dev,
+        .out = out_data,
+        .in = in_data,
+        .len = len,
+        .word_size = word_size,
+        .waiter = xTaskGetCurrentTaskHandle(),
+    };
+
+    if (!len)
+        return 0;
+    if (!queue_trans(&trans, portMAX_DELAY))
+        return 0;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    return len;
+}
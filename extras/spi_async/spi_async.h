@@ -0,0 +1,128 @@
+/**
+ * Interrupt driven transfer queue for the HSPI bus (bus 1).
+ *
+ * Transactions are queued and carried out one after another. The SPI
+ * interrupt refills the 64 byte hardware buffer between chunks, so the
+ * calling task sleeps or does other work while a long transfer is in
+ * flight instead of spinning in spi_transfer().
+ *
+ * Each device has its own chip select GPIO and bus settings, which are
+ * applied at the start of each of its transactions. This lets several
+ * drivers share HSPI without a lock of their own. While the queue is in
+ * use, all traffic on HSPI must go through it: don't call spi_transfer()
+ * and friends on bus 1 at the same time.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#ifndef __SPI_ASYNC_H__
+#define __SPI_ASYNC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <esp/spi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of transactions that can be queued before the callers block */
+#ifndef SPI_ASYNC_QUEUE_LEN
+#define SPI_ASYNC_QUEUE_LEN 8
+#endif
+
+/**
+ * A device on the bus. Set up with spi_async_device_init(), the fields are
+ * private.
+ */
+typedef struct {
+    uint8_t cs_pin;
+    uint32_t user0;
+    uint32_t ctrl0;
+    uint32_t clock;
+    bool cpol;
+    bool sys_clock;
+    spi_endianness_t endianness;
+} spi_async_device_t;
+
+struct spi_async_trans;
+
+/**
+ * Completion callback. Called from the SPI interrupt once the chip select
+ * has been released, so it must be short and may only use the FromISR
+ * FreeRTOS functions. The transaction can be freed from here, but not
+ * queued again.
+ */
+typedef void (*spi_async_cb_t)(struct spi_async_trans *trans);
+
+/**
+ * A transaction. The structure and both buffers must stay valid until the
+ * transaction has completed.
+ */
+typedef struct spi_async_trans {
+    spi_async_device_t *dev;    ///< Device to talk to
+    const void *out;            ///< Data to send, or NULL to send 0xff
+    void *in;                   ///< Receive buffer, or NULL to drop the data
+    size_t len;                 ///< Length in words
+    spi_word_size_t word_size;  ///< Size of the word
+    spi_async_cb_t cb;          ///< Completion callback, can be NULL
+    void *arg;                  ///< For the use of the callback
+
+    /* private */
+    size_t done;
+    TaskHandle_t waiter;
+} spi_async_trans_t;
+
+/**
+ * Set up HSPI (MISO = GPIO 12, MOSI = GPIO 13, SCK = GPIO 14) and the
+ * queue. Chip selects are driven by the device GPIOs.
+ *
+ * @return true if success, false if out of memory
+ */
+bool spi_async_init(void);
+
+/**
+ * Set up a device and its chip select pin, which is driven high.
+ *
+ * @param dev Device to set up
+ * @param cs_pin GPIO used as chip select (active low)
+ * @param s Bus mode, frequency, bit and byte order to use for this device.
+ *     minimal_pins is ignored.
+ */
+void spi_async_device_init(spi_async_device_t *dev, uint8_t cs_pin,
+        const spi_settings_t *s);
+
+/**
+ * Queue a transaction. Returns at once, trans->cb is called when it is
+ * done.
+ *
+ * @param trans Transaction to queue
+ * @param timeout Ticks to wait for a free slot if the queue is full
+ *
+ * @return true if queued, false if the queue stayed full or not initialized
+ */
+bool spi_async_queue(spi_async_trans_t *trans, TickType_t timeout);
+
+/**
+ * Queue a transfer and sleep until it is done. Like spi_transfer() but
+ * other tasks run meanwhile. Uses the task notification of the caller.
+ *
+ * @param dev Device to talk to
+ * @param out_data Data to send, or NULL to send 0xff
+ * @param in_data Receive buffer, or NULL to drop the data
+ * @param len Buffer size in words
+ * @param word_size Size of the word
+ *
+ * @return Transmitted/received words count, 0 if not initialized
+ */
+size_t spi_async_transfer(spi_async_device_t *dev, const void *out_data,
+        void *in_data, size_t len, spi_word_size_t word_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SPI_ASYNC_H__ */
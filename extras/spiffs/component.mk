@@ -8,6 +8,13 @@ SPIFFS_SIZE ?= 0x100000
 SPIFFS_LOG_PAGE_SIZE ?= 256
 SPIFFS_LOG_BLOCK_SIZE ?= 8192
 
+# Protect the file system with a mutex so it can be used from several tasks
+SPIFFS_LOCKING ?= 1
+
+# Collect cache and GC statistics and take GC heuristics from the
+# configuration passed to esp_spiffs_init_config
+SPIFFS_RUNTIME_CONFIG ?= 1
+
 
 spiffs_CFLAGS += -DSPIFFS_SINGLETON=$(SPIFFS_SINGLETON)
 ifeq ($(SPIFFS_SINGLETON),1)
@@ -18,6 +25,8 @@ endif
 
 spiffs_CFLAGS += -DSPIFFS_LOG_PAGE_SIZE=$(SPIFFS_LOG_PAGE_SIZE)
 spiffs_CFLAGS += -DSPIFFS_LOG_BLOCK_SIZE=$(SPIFFS_LOG_BLOCK_SIZE)
+spiffs_CFLAGS += -DSPIFFS_LOCKING=$(SPIFFS_LOCKING)
+spiffs_CFLAGS += -DSPIFFS_RUNTIME_CONFIG=$(SPIFFS_RUNTIME_CONFIG)
 
 # Main program needs SPIFFS definitions because it includes spiffs_config.h
 PROGRAM_CFLAGS += $(spiffs_CFLAGS)
@@ -11,6 +11,9 @@
 #include <stdbool.h>
 #include <esp/uart.h>
 #include <fcntl.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
 
 spiffs fs;
 
@@ -25,17 +28,68 @@ static fs_buf_t fds_buf = {0};
 static fs_buf_t cache_buf = {0};
 
 /**
- * Number of file descriptors opened at the same time
+ * Default number of file descriptors opened at the same time
  */
+#ifndef ESP_SPIFFS_FD_NUMBER
 #define ESP_SPIFFS_FD_NUMBER       5
+#endif
 
+/**
+ * Default number of logical pages in the cache
+ */
+#ifndef ESP_SPIFFS_CACHE_PAGES
 #define ESP_SPIFFS_CACHE_PAGES     5
+#endif
+
+#if SPIFFS_RUNTIME_CONFIG
+/**
+ * Default garbage collection heuristics, see spiffs_config.h
+ */
+#define ESP_SPIFFS_GC_HEUR_W_DELET      5
+#define ESP_SPIFFS_GC_HEUR_W_USED       -1
+#define ESP_SPIFFS_GC_HEUR_W_ERASE_AGE  50
+
+struct esp_spiffs_gc_heur esp_spiffs_gc_heur = {
+    .w_deleted = ESP_SPIFFS_GC_HEUR_W_DELET,
+    .w_used = ESP_SPIFFS_GC_HEUR_W_USED,
+    .w_erase_age = ESP_SPIFFS_GC_HEUR_W_ERASE_AGE,
+};
+#else
+#define ESP_SPIFFS_GC_HEUR_W_DELET      SPIFFS_GC_HEUR_W_DELET
+#define ESP_SPIFFS_GC_HEUR_W_USED       SPIFFS_GC_HEUR_W_USED
+#define ESP_SPIFFS_GC_HEUR_W_ERASE_AGE  SPIFFS_GC_HEUR_W_ERASE_AGE
+#endif
+
+static struct {
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+    uint32_t bytes_erased;
+} flash_stats;
+
+#if SPIFFS_LOCKING
+static SemaphoreHandle_t fs_lock = NULL;
+
+void esp_spiffs_lock(struct spiffs_t *fs)
+{
+    if (fs_lock) {
+        xSemaphoreTake(fs_lock, portMAX_DELAY);
+    }
+}
+
+void esp_spiffs_unlock(struct spiffs_t *fs)
+{
+    if (fs_lock) {
+        xSemaphoreGive(fs_lock);
+    }
+}
+#endif
 
 static s32_t esp_spiffs_read(u32_t addr, u32_t size, u8_t *dst)
 {
     if (!spiflash_read(addr, dst, size)) {
         return SPIFFS_ERR_INTERNAL;
     }
+    flash_stats.bytes_read += size;
 
     return SPIFFS_OK;
 }
@@ -45,6 +99,7 @@ static s32_t esp_spiffs_write(u32_t addr, u32_t size, u8_t *src)
     if (!spiflash_write(addr, src, size)) {
         return SPIFFS_ERR_INTERNAL;
     }
+    flash_stats.bytes_written += size;
 
     return SPIFFS_OK;
 }
@@ -57,17 +112,47 @@ static s32_t esp_spiffs_erase(u32_t addr, u32_t size)
         if (!spiflash_erase_sector(addr + (SPI_FLASH_SECTOR_SIZE * i))) {
             return SPIFFS_ERR_INTERNAL;
         }
+        flash_stats.bytes_erased += SPI_FLASH_SECTOR_SIZE;
     }
 
     return SPIFFS_OK;
 }
 
+void esp_spiffs_get_default_config(esp_spiffs_config_t *cfg)
+{
+    cfg->fd_number = ESP_SPIFFS_FD_NUMBER;
+    cfg->cache_pages = ESP_SPIFFS_CACHE_PAGES;
+    cfg->gc_heur_w_deleted = ESP_SPIFFS_GC_HEUR_W_DELET;
+    cfg->gc_heur_w_used = ESP_SPIFFS_GC_HEUR_W_USED;
+    cfg->gc_heur_w_erase_age = ESP_SPIFFS_GC_HEUR_W_ERASE_AGE;
+}
+
 #if SPIFFS_SINGLETON == 1
-void esp_spiffs_init()
+bool esp_spiffs_init()
+{
+    return esp_spiffs_init_config(NULL);
+}
+
+bool esp_spiffs_init_config(const esp_spiffs_config_t *cfg)
 {
+    // The mounted file system is using the buffers
+    if (SPIFFS_mounted(&fs)) {
+        return false;
+    }
 #else
-void esp_spiffs_init(uint32_t addr, uint32_t size)
+bool esp_spiffs_init(uint32_t addr, uint32_t size)
+{
+    return esp_spiffs_init_config(addr, size, NULL);
+}
+
+bool esp_spiffs_init_config(uint32_t addr, uint32_t size,
+                            const esp_spiffs_config_t *cfg)
 {
+    // The mounted file system is using the buffers and fs.cfg
+    if (SPIFFS_mounted(&fs)) {
+        return false;
+    }
+
     config.phys_addr = addr;
     config.phys_size = size;
 
@@ -78,13 +163,49 @@ void esp_spiffs_init(uint32_t addr, uint32_t size)
     // Initialize fs.cfg so the following helper functions work correctly
     memcpy(&fs.cfg, &config, sizeof(spiffs_config));
 #endif
-    work_buf.size = 2 * SPIFFS_LOG_PAGE_SIZE;
-    fds_buf.size = SPIFFS_buffer_bytes_for_filedescs(&fs, ESP_SPIFFS_FD_NUMBER);
-    cache_buf.size= SPIFFS_buffer_bytes_for_cache(&fs, ESP_SPIFFS_CACHE_PAGES);
+    esp_spiffs_config_t defaults;
+    if (!cfg) {
+        esp_spiffs_get_default_config(&defaults);
+        cfg = &defaults;
+    }
 
-    work_buf.buf = malloc(work_buf.size);
-    fds_buf.buf = malloc(fds_buf.size);
-    cache_buf.buf = malloc(cache_buf.size);
+#if SPIFFS_LOCKING
+    if (!fs_lock) {
+        fs_lock = xSemaphoreCreateMutex();
+        if (!fs_lock) {
+            return false;
+        }
+    }
+#endif
+
+    fs_buf_t work = { .size = 2 * SPIFFS_LOG_PAGE_SIZE };
+    fs_buf_t fds = { .size = SPIFFS_buffer_bytes_for_filedescs(&fs, cfg->fd_number) };
+    fs_buf_t cache = { .size = SPIFFS_buffer_bytes_for_cache(&fs, cfg->cache_pages) };
+
+    work.buf = malloc(work.size);
+    fds.buf = malloc(fds.size);
+    cache.buf = malloc(cache.size);
+    if (!work.buf || !fds.buf || !cache.buf) {
+        // Keep the buffers of any earlier init
+        free(work.buf);
+        free(fds.buf);
+        free(cache.buf);
+        return false;
+    }
+
+    // Allow changing the configuration by calling init again
+    free(work_buf.buf);
+    free(fds_buf.buf);
+    free(cache_buf.buf);
+    work_buf = work;
+    fds_buf = fds;
+    cache_buf = cache;
+
+#if SPIFFS_RUNTIME_CONFIG
+    esp_spiffs_gc_heur.w_deleted = cfg->gc_heur_w_deleted;
+    esp_spiffs_gc_heur.w_used = cfg->gc_heur_w_used;
+    esp_spiffs_gc_heur.w_erase_age = cfg->gc_heur_w_erase_age;
+#endif
 
     config.hal_read_f = esp_spiffs_read;
     config.hal_write_f = esp_spiffs_write;
@@ -92,6 +213,7 @@ void esp_spiffs_init(uint32_t addr, uint32_t size)
 
     config.fh_ix_offset = 3;
 
+    return true;
 }
 
 void esp_spiffs_deinit()
@@ -104,6 +226,13 @@ void esp_spiffs_deinit()
 
     free(cache_buf.buf);
     cache_buf.buf = 0;
+
+#if SPIFFS_LOCKING
+    if (fs_lock) {
+        vSemaphoreDelete(fs_lock);
+        fs_lock = NULL;
+    }
+#endif
 }
 
 int32_t esp_spiffs_mount()
@@ -118,11 +247,49 @@ int32_t esp_spiffs_mount()
     if (err != SPIFFS_OK) {
         printf("Error spiffs mount: %d\n", err);
     }
+    esp_spiffs_reset_stats();
 
     return err;
 }
 
+void esp_spiffs_get_stats(esp_spiffs_stats_t *stats)
+{
+    SPIFFS_LOCK(&fs);
+#if SPIFFS_CACHE_STATS
+    stats->cache_hits = fs.cache_hits;
+    stats->cache_misses = fs.cache_misses;
+#else
+    stats->cache_hits = 0;
+    stats->cache_misses = 0;
+#endif
+#if SPIFFS_GC_STATS
+    stats->gc_runs = fs.stats_gc_runs;
+#else
+    stats->gc_runs = 0;
+#endif
+    stats->bytes_read = flash_stats.bytes_read;
+    stats->bytes_written = flash_stats.bytes_written;
+    stats->bytes_erased = flash_stats.bytes_erased;
+    SPIFFS_UNLOCK(&fs);
+}
+
+void esp_spiffs_reset_stats()
+{
+    SPIFFS_LOCK(&fs);
+#if SPIFFS_CACHE_STATS
+    fs.cache_hits = 0;
+    fs.cache_misses = 0;
+#endif
+#if SPIFFS_GC_STATS
+    fs.stats_gc_runs = 0;
+#endif
+    memset(&flash_stats, 0, sizeof(flash_stats));
+    SPIFFS_UNLOCK(&fs);
+}
+
 // This implementation replaces implementation in core/newlib_syscals.c
+// A single SPIFFS_write holds the file system lock for the whole write, so
+// O_APPEND writes from different tasks are never interleaved.
 long _write_filesystem_r(struct _reent *r, int fd, const char *ptr, int len )
 {
     return SPIFFS_write(&fs, (spiffs_file)fd, (char*)ptr, len);
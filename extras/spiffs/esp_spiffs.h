@@ -8,17 +8,62 @@
 #ifndef __ESP_SPIFFS_H__
 #define __ESP_SPIFFS_H__
 
+#include <stdbool.h>
 #include "spiffs.h"
 
 extern spiffs fs;
 
+/**
+ * Run-time configuration of SPIFFS buffers and garbage collection.
+ *
+ * Use esp_spiffs_get_default_config to fill in the defaults and then change
+ * the fields of interest.
+ */
+typedef struct {
+    uint32_t fd_number;       ///< Number of files that can be open at once
+    uint32_t cache_pages;     ///< Number of logical pages kept in RAM cache
+    int32_t gc_heur_w_deleted;    ///< GC block score weight of deleted pages
+    int32_t gc_heur_w_used;       ///< GC block score weight of used pages
+    int32_t gc_heur_w_erase_age;  ///< GC block score weight of erase age
+} esp_spiffs_config_t;
+
+/**
+ * File system statistics since mount or the last esp_spiffs_reset_stats.
+ */
+typedef struct {
+    uint32_t cache_hits;      ///< Page reads served from the cache
+    uint32_t cache_misses;    ///< Page reads that went to flash
+    uint32_t gc_runs;         ///< Garbage collection runs
+    uint32_t bytes_read;      ///< Bytes read from flash
+    uint32_t bytes_written;   ///< Bytes written to flash
+    uint32_t bytes_erased;    ///< Bytes erased in flash
+} esp_spiffs_stats_t;
+
+/**
+ * Fill the configuration with the values used by esp_spiffs_init.
+ */
+void esp_spiffs_get_default_config(esp_spiffs_config_t *config);
+
 #if SPIFFS_SINGLETON == 1
 /**
  * Prepare for SPIFFS mount.
  *
  * The function allocates all the necessary buffers.
+ *
+ * @return false if the file system is mounted or out of memory.
+ */
+bool esp_spiffs_init();
+
+/**
+ * Prepare for SPIFFS mount with the given buffer and GC configuration.
+ *
+ * Can be called again to change the configuration, but only while the file
+ * system is unmounted. If it fails the buffers of an earlier call are kept.
+ *
+ * @param config Configuration, or NULL for the defaults.
+ * @return false if the file system is mounted or out of memory.
  */
-void esp_spiffs_init();
+bool esp_spiffs_init_config(const esp_spiffs_config_t *config);
 #else
 /**
  * Prepare for SPIFFS mount.
@@ -27,8 +72,23 @@ void esp_spiffs_init();
  *
  * @param addr Base address for spiffs in flash memory.
  * @param size File sistem size.
+ * @return false if the file system is mounted or out of memory.
+ */
+bool esp_spiffs_init(uint32_t addr, uint32_t size);
+
+/**
+ * Prepare for SPIFFS mount with the given buffer and GC configuration.
+ *
+ * Can be called again to change the configuration, but only while the file
+ * system is unmounted. If it fails the buffers of an earlier call are kept.
+ *
+ * @param addr Base address for spiffs in flash memory.
+ * @param size File sistem size.
+ * @param config Configuration, or NULL for the defaults.
+ * @return false if the file system is mounted or out of memory.
  */
-void esp_spiffs_init(uint32_t addr, uint32_t size);
+bool esp_spiffs_init_config(uint32_t addr, uint32_t size,
+                            const esp_spiffs_config_t *config);
 #endif
 
 
@@ -49,4 +109,17 @@ void esp_spiffs_deinit();
  */
 int32_t esp_spiffs_mount();
 
+/**
+ * Get cache, garbage collection and flash access statistics.
+ *
+ * Cache and GC counters are only available when the component is built with
+ * SPIFFS_RUNTIME_CONFIG=1 (the default), otherwise they read as zero.
+ */
+void esp_spiffs_get_stats(esp_spiffs_stats_t *stats);
+
+/**
+ * Reset all statistics counters to zero.
+ */
+void esp_spiffs_reset_stats();
+
 #endif  // __ESP_SPIFFS_H__
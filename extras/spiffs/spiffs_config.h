@@ -51,6 +51,27 @@ typedef unsigned char u8_t;
 #define SPIFFS_BUFFER_HELP              1
 #endif
 
+// On the ESP8266 cache and GC statistics are always collected and the GC
+// heuristics below are read from esp_spiffs_gc_heur, which is set by
+// esp_spiffs_init_config.  Host tools are built without SPIFFS_RUNTIME_CONFIG.
+#ifndef SPIFFS_RUNTIME_CONFIG
+#define SPIFFS_RUNTIME_CONFIG 0
+#endif
+#if SPIFFS_RUNTIME_CONFIG
+struct esp_spiffs_gc_heur {
+    int32_t w_deleted;
+    int32_t w_used;
+    int32_t w_erase_age;
+};
+extern struct esp_spiffs_gc_heur esp_spiffs_gc_heur;
+
+#define SPIFFS_CACHE_STATS              1
+#define SPIFFS_GC_STATS                 1
+#define SPIFFS_GC_HEUR_W_DELET          (esp_spiffs_gc_heur.w_deleted)
+#define SPIFFS_GC_HEUR_W_USED           (esp_spiffs_gc_heur.w_used)
+#define SPIFFS_GC_HEUR_W_ERASE_AGE      (esp_spiffs_gc_heur.w_erase_age)
+#endif
+
 // Enables/disable memory read caching of nucleus file system operations.
 // If enabled, memory area must be provided for cache in SPIFFS_mount.
 #ifndef  SPIFFS_CACHE
@@ -142,13 +163,33 @@ typedef unsigned char u8_t;
 // SPIFFS_LOCK and SPIFFS_UNLOCK protects spiffs from reentrancy on api level
 // These should be defined on a multithreaded system
 
+// On the ESP8266 these take a FreeRTOS mutex (see esp_spiffs.c), so several
+// tasks can use the file system at once.  Host tools such as mkspiffs are
+// single threaded and are built without SPIFFS_LOCKING.
+#ifndef SPIFFS_LOCKING
+#define SPIFFS_LOCKING 0
+#endif
+#if SPIFFS_LOCKING
+struct spiffs_t;
+void esp_spiffs_lock(struct spiffs_t *fs);
+void esp_spiffs_unlock(struct spiffs_t *fs);
+#endif
+
 // define this to enter a mutex if you're running on a multithreaded system
 #ifndef SPIFFS_LOCK
-#define SPIFFS_LOCK(fs)        // vPortEnterCritical()
+#if SPIFFS_LOCKING
+#define SPIFFS_LOCK(fs)        esp_spiffs_lock(fs)
+#else
+#define SPIFFS_LOCK(fs)
+#endif
 #endif
 // define this to exit a mutex if you're running on a multithreaded system
 #ifndef SPIFFS_UNLOCK
-#define SPIFFS_UNLOCK(fs)      // vPortExitCritical()
+#if SPIFFS_LOCKING
+#define SPIFFS_UNLOCK(fs)      esp_spiffs_unlock(fs)
+#else
+#define SPIFFS_UNLOCK(fs)
+#endif
 #endif
 
 // Enable if only one spiffs instance with constant configuration will exist
@@ -0,0 +1,9 @@
+# Component makefile for extras/spiflash_async
+
+# expected anyone using it includes it as 'spiflash_async/spiflash_async.h'
+INC_DIRS += $(spiflash_async_ROOT)..
+
+# args for passing into compile rule generation
+spiflash_async_SRC_DIR = $(spiflash_async_ROOT)
+
+$(eval $(call component_compile_rules,spiflash_async))
@@ -0,0 +1,276 @@
+/**
+ * Asynchronous SPI flash write and erase service.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include "spiflash_async.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <queue.h>
+#include <semphr.h>
+#include <spiflash.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_SIZE 256
+
+/* Completion callbacks waiting for the page buffer to be written */
+#define MAX_PENDING 8
+
+typedef enum {
+    REQ_WRITE,
+    REQ_ERASE,
+    REQ_SYNC,
+} req_type_t;
+
+typedef struct {
+    SemaphoreHandle_t done;
+    bool result;
+} sync_t;
+
+typedef struct {
+    req_type_t type;
+    uint32_t addr;
+    uint32_t size;
+    uint8_t *data;
+    spiflash_async_cb_t cb;
+    void *arg;
+} request_t;
+
+typedef struct {
+    spiflash_async_cb_t cb;
+    void *arg;
+    bool ok;
+} pending_t;
+
+/* Page being filled by adjacent writes. Only used by the background task. */
+static struct {
+    uint32_t addr;
+    uint32_t start;
+    uint32_t len;
+    uint8_t buf[PAGE_SIZE] __attribute__((aligned(4)));
+    pending_t pending[MAX_PENDING];
+    int num_pending;
+} page;
+
+static QueueHandle_t queue;
+static bool failed;
+
+/**
+ * Write out the page buffer and run the callbacks waiting for it.
+ */
+static bool flush_page(void)
+{
+    bool ok = true;
+
+    if (page.len) {
+        ok = spiflash_write(page.addr + page.start, page.buf + page.start,
+                page.len);
+        if (!ok) {
+            failed = true;
+        }
+        page.len = 0;
+    }
+    for (int i = 0; i < page.num_pending; i++) {
+        page.pending[i].cb(page.pending[i].ok && ok, page.pending[i].arg);
+    }
+    page.num_pending = 0;
+
+    return ok;
+}
+
+static void do_write(request_t *req)
+{
+    uint32_t addr = req->addr;
+    uint32_t offset = 0;
+    bool ok = true;
+
+    while (offset < req->size) {
+        uint32_t page_addr = addr & ~(PAGE_SIZE - 1);
+        uint32_t in_page = addr - page_addr;
+        uint32_t n = PAGE_SIZE - in_page;
+        if (n > req->size - offset) {
+            n = req->size - offset;
+        }
+
+        if (page.len && (page.addr != page_addr ||
+                    page.start + page.len != in_page)) {
+            // Not adjacent to the buffered data
+            flush_page();
+        }
+
+        if (!page.len && n == PAGE_SIZE) {
+            // Whole page, no need to go through the buffer
+            if (!spiflash_write(addr, req->data + offset, n)) {
+                failed = true;
+                ok = false;
+            }
+        } else {
+            if (!page.len) {
+                page.addr = page_addr;
+                page.start = in_page;
+            }
+            memcpy(page.buf + in_page, req->data + offset, n);
+            page.len += n;
+            if (page.start + page.len == PAGE_SIZE &&
+                    offset + n < req->size) {
+                ok = flush_page() && ok;
+            }
+        }
+
+        addr += n;
+        offset += n;
+    }
+
+    if (page.len && page.start + page.len == PAGE_SIZE) {
+        // Last piece completed the page
+        ok = flush_page() && ok;
+    }
+
+    if (!req->cb) {
+        return;
+    }
+    if (page.len) {
+        // The tail of the write is still buffered
+        page.pending[page.num_pending].cb = req->cb;
+        page.pending[page.num_pending].arg = req->arg;
+        page.pending[page.num_pending].ok = ok;
+        if (++page.num_pending == MAX_PENDING) {
+            flush_page();
+        }
+    } else {
+        req->cb(ok, req->arg);
+    }
+}
+
+static void spiflash_async_task(void *pvParameters)
+{
+    request_t req;
+
+    for (;;) {
+        TickType_t wait = page.len ? SPIFLASH_ASYNC_FLUSH_MS / portTICK_PERIOD_MS
+                                   : portMAX_DELAY;
+        if (!xQueueReceive(queue, &req, wait)) {
+            flush_page();
+            continue;
+        }
+
+        switch (req.type) {
+        case REQ_WRITE:
+            do_write(&req);
+            free(req.data);
+            break;
+        case REQ_ERASE: {
+            flush_page();
+            bool ok = spiflash_erase_sector(req.addr);
+            if (!ok) {
+                failed = true;
+            }
+            if (req.cb) {
+                req.cb(ok, req.arg);
+            }
+            break;
+        }
+        case REQ_SYNC: {
+            sync_t *sync = (sync_t *)req.arg;
+            flush_page();
+            sync->result = !failed;
+            failed = false;
+            xSemaphoreGive(sync->done);
+            break;
+        }
+        }
+    }
+}
+
+bool spiflash_async_init(void)
+{
+    if (queue) {
+        return true;
+    }
+
+    queue = xQueueCreate(SPIFLASH_ASYNC_QUEUE_LEN, sizeof(request_t));
+    if (!queue) {
+        return false;
+    }
+    if (xTaskCreate(spiflash_async_task, "spiflash_async", 512, NULL,
+                SPIFLASH_ASYNC_TASK_PRIO, NULL) != pdPASS) {
+        vQueueDelete(queue);
+        queue = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+bool spiflash_async_write(uint32_t addr, const uint8_t *buf, uint32_t size,
+        spiflash_async_cb_t cb, void *arg)
+{
+    request_t req = {
+        .type = REQ_WRITE,
+        .addr = addr,
+        .size = size,
+        .cb = cb,
+        .arg = arg,
+    };
+
+    if (!queue || !buf) {
+        return false;
+    }
+
+    if (size) {
+        req.data = malloc(size);
+        if (!req.data) {
+            return false;
+        }
+        memcpy(req.data, buf, size);
+    }
+
+    xQueueSend(queue, &req, portMAX_DELAY);
+
+    return true;
+}
+
+bool spiflash_async_erase(uint32_t addr, spiflash_async_cb_t cb, void *arg)
+{
+    request_t req = {
+        .type = REQ_ERASE,
+        .addr = addr,
+        .cb = cb,
+        .arg = arg,
+    };
+
+    if (!queue || (addr & (SPI_FLASH_SECTOR_SIZE - 1))) {
+        return false;
+    }
+
+    xQueueSend(queue, &req, portMAX_DELAY);
+
+    return true;
+}
+
+bool spiflash_async_sync(void)
+{
+    sync_t sync;
+    request_t req = {
+        .type = REQ_SYNC,
+        .arg = &sync,
+    };
+
+    if (!queue) {
+        return false;
+    }
+
+    sync.done = xSemaphoreCreateBinary();
+    if (!sync.done) {
+        return false;
+    }
+
+    xQueueSend(queue, &req, portMAX_DELAY);
+    xSemaphoreTake(sync.done, portMAX_DELAY);
+    vSemaphoreDelete(sync.done);
+
+    return sync.result;
+}
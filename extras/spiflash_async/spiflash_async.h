@@ -0,0 +1,94 @@
+/**
+ * Asynchronous SPI flash write and erase service.
+ *
+ * Write and erase requests are queued and carried out by a background task,
+ * so the caller does not block for the flash program/erase time. Adjacent
+ * writes are merged into full page programs, which cuts the number of
+ * times the cache has to be disabled when streaming small records (logs,
+ * OTA chunks) to flash.
+ *
+ * Requests are carried out in the order they were queued. Data that was
+ * queued for writing is not visible to spiflash_read until its completion
+ * callback has run or spiflash_async_sync has returned.
+ *
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#ifndef __SPIFLASH_ASYNC_H__
+#define __SPIFLASH_ASYNC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of requests that can be queued before the callers block */
+#ifndef SPIFLASH_ASYNC_QUEUE_LEN
+#define SPIFLASH_ASYNC_QUEUE_LEN        16
+#endif
+
+/** Priority of the background task */
+#ifndef SPIFLASH_ASYNC_TASK_PRIO
+#define SPIFLASH_ASYNC_TASK_PRIO        2
+#endif
+
+/** A partially filled page is written out after being idle for this long */
+#ifndef SPIFLASH_ASYNC_FLUSH_MS
+#define SPIFLASH_ASYNC_FLUSH_MS         50
+#endif
+
+/**
+ * Completion callback, called from the background task once the request
+ * has been carried out.
+ *
+ * @param success true if the flash operation succeeded
+ * @param arg The argument passed when the request was queued
+ */
+typedef void (*spiflash_async_cb_t)(bool success, void *arg);
+
+/**
+ * Start the background task.
+ *
+ * @return true if success, false if out of memory
+ */
+bool spiflash_async_init(void);
+
+/**
+ * Queue a write. The data is copied, so buf can be reused at once.
+ *
+ * @param addr Flash address to write to, doesn't have to be aligned
+ * @param buf Data to write
+ * @param size Number of bytes to write
+ * @param cb Called when the data is in flash, can be NULL
+ * @param arg Passed to cb
+ *
+ * @return true if queued, false if out of memory or not initialized
+ */
+bool spiflash_async_write(uint32_t addr, const uint8_t *buf, uint32_t size,
+        spiflash_async_cb_t cb, void *arg);
+
+/**
+ * Queue a sector erase, e.g. to erase ahead of a stream of writes.
+ *
+ * @param addr Address of the sector, must be sector aligned
+ * @param cb Called when the sector has been erased, can be NULL
+ * @param arg Passed to cb
+ *
+ * @return true if queued, false on a bad address or if not initialized
+ */
+bool spiflash_async_erase(uint32_t addr, spiflash_async_cb_t cb, void *arg);
+
+/**
+ * Wait until all requests queued before this call have been carried out.
+ *
+ * @return true if all requests since the previous sync succeeded
+ */
+bool spiflash_async_sync(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SPIFLASH_ASYNC_H__ */
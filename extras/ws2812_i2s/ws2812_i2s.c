@@ -24,6 +24,9 @@
 #include "ws2812_i2s.h"
 #include "i2s_dma/i2s_dma.h"
 
+#include <FreeRTOS.h>
+#include <task.h>
+#include <espressif/esp_system.h>
 #include <string.h>
 #include <malloc.h>
 
@@ -60,15 +63,30 @@ volatile uint32_t dma_isr_counter = 0;
 
 static volatile bool i2s_dma_processing = false;
 
+// Task waiting in ws2812_i2s_update() for the previous frame to finish
+static TaskHandle_t waiting_task;
+
+static void wake_waiting_task(BaseType_t *woken)
+{
+    if (waiting_task) {
+        vTaskNotifyGiveFromISR(waiting_task, woken);
+        waiting_task = NULL;
+    }
+}
+
 static void dma_isr_handler(void)
 {
+    BaseType_t woken = pdFALSE;
+
     if (i2s_dma_is_eof_interrupt()) {
 #ifdef WS2812_I2S_DEBUG
         dma_isr_counter++;
 #endif
         i2s_dma_processing = false;
+        wake_waiting_task(&woken);
     }
     i2s_dma_clear_interrupt();
+    portEND_SWITCHING_ISR(woken);
 }
 
 /**
@@ -117,7 +135,18 @@ static inline void init_descriptors_list(uint8_t *buf, uint32_t total_dma_data_s
     }
 }
 
-void ws2812_i2s_init(uint32_t pixels_number)
+static void init_i2s(i2s_dma_isr_t isr)
+{
+    i2s_clock_div_t clock_div = i2s_get_clock_div(3333333);
+    i2s_pins_t i2s_pins = {.data = true, .clock = false, .ws = false};
+
+    debug("i2s clock dividers, bclk=%d, clkm=%d\n",
+            clock_div.bclk_div, clock_div.clkm_div);
+
+    i2s_dma_init(isr, clock_div, i2s_pins);
+}
+
+bool ws2812_i2s_init(uint32_t pixels_number)
 {
     dma_buffer_size = pixels_number * DMA_PIXEL_SIZE;
     dma_block_list_size = dma_buffer_size / MAX_DMA_BLOCK_SIZE;
@@ -135,17 +164,19 @@ void ws2812_i2s_init(uint32_t pixels_number)
 
     debug("allocating %d bytes for DMA buffer\n", dma_buffer_size);
     dma_buffer = malloc(dma_buffer_size);
+    if (!dma_block_list || !dma_buffer) {
+        free(dma_block_list);
+        free(dma_buffer);
+        dma_block_list = NULL;
+        dma_buffer = NULL;
+        return false;
+    }
     memset(dma_buffer, 0xFA, dma_buffer_size);
 
     init_descriptors_list(dma_buffer, dma_buffer_size);
 
-    i2s_clock_div_t clock_div = i2s_get_clock_div(3333333);
-    i2s_pins_t i2s_pins = {.data = true, .clock = false, .ws = false};
-
-    debug("i2s clock dividers, bclk=%d, clkm=%d\n",
-            clock_div.bclk_div, clock_div.clkm_div);
-
-    i2s_dma_init(dma_isr_handler, clock_div, i2s_pins);
+    init_i2s(dma_isr_handler);
+    return true;
 }
 
 const IRAM_DATA int16_t bitpatterns[16] =
@@ -156,25 +187,355 @@ const IRAM_DATA int16_t bitpatterns[16] =
     0b1110111010001000, 0b1110111010001110, 0b1110111011101000, 0b1110111011101110,
 };
 
-void ws2812_i2s_update(ws2812_pixel_t *pixels)
+static inline void encode_pixels(uint16_t *dst, const ws2812_pixel_t *pixels,
+        uint32_t n)
 {
-    while (i2s_dma_processing) {};
-
-    uint16_t *p_dma_buf = dma_buffer;
-
-    for (uint32_t i = 0; i < (dma_buffer_size / DMA_PIXEL_SIZE); i++) {
+    for (uint32_t i = 0; i < n; i++) {
         // green
-        *p_dma_buf++ =  bitpatterns[pixels[i].green & 0x0F];
-        *p_dma_buf++ =  bitpatterns[pixels[i].green >> 4];
+        *dst++ =  bitpatterns[pixels[i].green & 0x0F];
+        *dst++ =  bitpatterns[pixels[i].green >> 4];
 
         // red
-        *p_dma_buf++ =  bitpatterns[pixels[i].red & 0x0F];
-        *p_dma_buf++ =  bitpatterns[pixels[i].red >> 4];
+        *dst++ =  bitpatterns[pixels[i].red & 0x0F];
+        *dst++ =  bitpatterns[pixels[i].red >> 4];
 
         // blue
-        *p_dma_buf++ =  bitpatterns[pixels[i].blue & 0x0F];
-        *p_dma_buf++ =  bitpatterns[pixels[i].blue >> 4];
+        *dst++ =  bitpatterns[pixels[i].blue & 0x0F];
+        *dst++ =  bitpatterns[pixels[i].blue >> 4];
+    }
+}
+
+/*
+ * Streaming mode.
+ *
+ * The descriptors form a ring and each block raises the EOF interrupt when
+ * it has been sent. The interrupt then encodes the next piece of the frame
+ * into that block, which is sent WS2812_I2S_RING_BLOCKS - 1 blocks later.
+ * Each frame is followed by a block of zeroes, longer than the 50us reset
+ * time, and the frame is reported done when that block has been sent.
+ * Once the ring holds nothing but zeroes the DMA is stopped.
+ *
+ * A block is only refilled by the interrupt for the block before it in the
+ * ring, so if interrupts stop for longer than the ring lasts the DMA sends
+ * blocks again that have not been refilled. That is detected from the time
+ * between interrupts; the output is then stopped and restarted with a reset
+ * block followed by the whole frame.
+ */
+
+#define BLOCK_SIZE  (WS2812_I2S_BLOCK_PIXELS * DMA_PIXEL_SIZE)
+
+// Time to send a block: 24 bits of 4 I2S bits each at 3.333MHz per pixel
+#define BLOCK_US    (WS2812_I2S_BLOCK_PIXELS * 288 / 10)
+
+// Longest gap between EOF interrupts before a block may be sent stale
+#define MAX_ISR_GAP_US  ((WS2812_I2S_RING_BLOCKS - 1) * BLOCK_US)
+
+typedef enum {
+    BLOCK_IDLE,     // zeroes, nothing to do
+    BLOCK_DATA,     // pixels
+    BLOCK_RESET,    // zeroes ending a frame
+} block_type_t;
+
+static bool stream_mode;
+static ws2812_i2s_done_cb_t done_cb;
+
+static struct {
+    block_type_t type;
+    const ws2812_pixel_t *pixels;   // frame ended by a reset block
+    uint32_t time;                  // update time of that frame
+} blocks[WS2812_I2S_RING_BLOCKS];
+
+static dma_descriptor_t ring[WS2812_I2S_RING_BLOCKS];
+static uint32_t done_block;         // next block expected to be sent
+static uint32_t idle_blocks;        // idle blocks in a row in the ring
+static volatile bool running;
+
+static const ws2812_pixel_t *frame; // frame being encoded
+static uint32_t frame_time;
+static uint32_t next_pixel;
+static bool frame_ended;            // reset block still to be encoded
+
+static const ws2812_pixel_t *pending;
+static uint32_t pending_time;
+
+static volatile uint32_t frames_queued;
+static ws2812_i2s_stats_t stats;
+static uint32_t last_done_time;
+static uint32_t last_isr_time;      // last EOF interrupt, or DMA start
+
+static void fill_block(uint32_t i)
+{
+    uint16_t *dst = ring[i].buf_ptr;
+
+    if (frame_ended) {
+        memset(dst, 0, BLOCK_SIZE);
+        blocks[i].type = BLOCK_RESET;
+        blocks[i].pixels = frame;
+        blocks[i].time = frame_time;
+        frame = NULL;
+        frame_ended = false;
+        idle_blocks = 0;
+        return;
+    }
+
+    if (!frame && pending) {
+        frame = pending;
+        frame_time = pending_time;
+        pending = NULL;
+        next_pixel = 0;
+    }
+
+    if (!frame) {
+        if (blocks[i].type == BLOCK_DATA) {
+            memset(dst, 0, BLOCK_SIZE);
+        }
+        blocks[i].type = BLOCK_IDLE;
+        idle_blocks++;
+        return;
+    }
+
+    uint32_t n = dma_buffer_size / DMA_PIXEL_SIZE - next_pixel;
+    if (n > WS2812_I2S_BLOCK_PIXELS) {
+        n = WS2812_I2S_BLOCK_PIXELS;
+    }
+    encode_pixels(dst, frame + next_pixel, n);
+    if (n < WS2812_I2S_BLOCK_PIXELS) {
+        memset(dst + n * DMA_PIXEL_SIZE / 2, 0,
+                (WS2812_I2S_BLOCK_PIXELS - n) * DMA_PIXEL_SIZE);
+    }
+    next_pixel += n;
+    frame_ended = next_pixel == dma_buffer_size / DMA_PIXEL_SIZE;
+    blocks[i].type = BLOCK_DATA;
+    idle_blocks = 0;
+}
+
+static void block_done(uint32_t i, BaseType_t *woken)
+{
+    if (blocks[i].type == BLOCK_RESET) {
+        uint32_t now = sdk_system_get_time();
+
+        stats.frames++;
+        stats.latency_us = now - blocks[i].time;
+        if (stats.latency_us > stats.max_latency_us) {
+            stats.max_latency_us = stats.latency_us;
+        }
+        stats.frame_us = now - last_done_time;
+        last_done_time = now;
+        frames_queued--;
+        if (!frames_queued) {
+            wake_waiting_task(woken);
+        }
+        if (done_cb) {
+            done_cb(blocks[i].pixels);
+        }
+    }
+}
+
+/**
+ * Fill the whole ring, starting with a reset block, and start the DMA.
+ */
+static void start_ring(void)
+{
+    memset(ring[0].buf_ptr, 0, BLOCK_SIZE);
+    blocks[0].type = BLOCK_IDLE;
+    idle_blocks = 1;
+    for (int i = 1; i < WS2812_I2S_RING_BLOCKS; i++) {
+        fill_block(i);
     }
+    done_block = 0;
+    last_isr_time = sdk_system_get_time();
+    running = true;
+    i2s_dma_start(ring);
+}
+
+/**
+ * The interrupt came too late and stale blocks may have been sent, so the
+ * strip holds a mix of old and new pixels. Send the newest frame again from
+ * the start. Older frames still waiting for their reset block are superseded
+ * by it and reported done, without being counted as sent. If the ring only
+ * held zeroes nothing went wrong, and the DMA is simply restarted.
+ */
+static void stream_underrun(BaseType_t *woken)
+{
+    const ws2812_pixel_t *newest = NULL;
+    uint32_t newest_time = 0;
+
+    i2s_dma_stop();
+
+    for (int n = 0; n < WS2812_I2S_RING_BLOCKS; n++) {
+        uint32_t i = (done_block + n) % WS2812_I2S_RING_BLOCKS;
+
+        if (blocks[i].type != BLOCK_RESET) {
+            continue;
+        }
+        if (newest) {
+            frames_queued--;
+            if (done_cb) {
+                done_cb(newest);
+            }
+        }
+        newest = blocks[i].pixels;
+        newest_time = blocks[i].time;
+    }
+    if (frame) {
+        if (newest) {
+            frames_queued--;
+            if (done_cb) {
+                done_cb(newest);
+            }
+        }
+        newest = frame;
+        newest_time = frame_time;
+    }
+
+    for (int i = 0; i < WS2812_I2S_RING_BLOCKS; i++) {
+        blocks[i].type = BLOCK_IDLE;
+    }
+    memset(dma_buffer, 0, BLOCK_SIZE * WS2812_I2S_RING_BLOCKS);
+    frame = newest;
+    frame_time = newest_time;
+    next_pixel = 0;
+    frame_ended = false;
+
+    if (frame) {
+        stats.underruns++;
+    }
+    if (frame || pending) {
+        start_ring();
+    } else {
+        running = false;
+        wake_waiting_task(woken);
+    }
+}
+
+static void stream_isr_handler(void)
+{
+    BaseType_t woken = pdFALSE;
+
+    if (!i2s_dma_is_eof_interrupt()) {
+        i2s_dma_clear_interrupt();
+        return;
+    }
+    uint32_t last = i2s_dma_get_eof_descriptor() - ring;
+    uint32_t now = sdk_system_get_time();
+    i2s_dma_clear_interrupt();
+
+    if (!running || last >= WS2812_I2S_RING_BLOCKS) {
+        return;
+    }
+
+    if (now - last_isr_time > MAX_ISR_GAP_US) {
+        stream_underrun(&woken);
+        portEND_SWITCHING_ISR(woken);
+        return;
+    }
+    last_isr_time = now;
+
+    // Normally one block, but catch up if an interrupt was missed
+    for (;;) {
+        uint32_t i = done_block;
+        done_block = (done_block + 1) % WS2812_I2S_RING_BLOCKS;
+
+        block_done(i, &woken);
+        if (idle_blocks >= WS2812_I2S_RING_BLOCKS && !frame && !pending) {
+            // Only zeroes left in the ring
+            i2s_dma_stop();
+            running = false;
+            break;
+        }
+        fill_block(i);
+
+        if (i == last) {
+            break;
+        }
+    }
+    portEND_SWITCHING_ISR(woken);
+}
+
+bool ws2812_i2s_init_stream(uint32_t pixels_number, ws2812_i2s_done_cb_t cb)
+{
+    debug("allocating %d bytes for DMA ring\n",
+            BLOCK_SIZE * WS2812_I2S_RING_BLOCKS);
+    dma_buffer = malloc(BLOCK_SIZE * WS2812_I2S_RING_BLOCKS);
+    if (!dma_buffer) {
+        return false;
+    }
+    memset(dma_buffer, 0, BLOCK_SIZE * WS2812_I2S_RING_BLOCKS);
+
+    dma_buffer_size = pixels_number * DMA_PIXEL_SIZE;
+    stream_mode = true;
+    done_cb = cb;
+
+    for (int i = 0; i < WS2812_I2S_RING_BLOCKS; i++) {
+        ring[i].owner = 1;
+        ring[i].eof = 1;
+        ring[i].sub_sof = 0;
+        ring[i].unused = 0;
+        ring[i].buf_ptr = (uint8_t *)dma_buffer + i * BLOCK_SIZE;
+        ring[i].datalen = BLOCK_SIZE;
+        ring[i].blocksize = BLOCK_SIZE;
+        ring[i].next_link_ptr = &ring[(i + 1) % WS2812_I2S_RING_BLOCKS];
+        blocks[i].type = BLOCK_IDLE;
+    }
+
+    init_i2s(stream_isr_handler);
+    return true;
+}
+
+void ws2812_i2s_update_async(const ws2812_pixel_t *pixels)
+{
+    taskENTER_CRITICAL();
+    if (pending) {
+        stats.dropped++;
+    } else {
+        frames_queued++;
+    }
+    pending = pixels;
+    pending_time = sdk_system_get_time();
+
+    if (!running) {
+        start_ring();
+    }
+    taskEXIT_CRITICAL();
+}
+
+bool ws2812_i2s_busy(void)
+{
+    return frames_queued != 0;
+}
+
+void ws2812_i2s_get_stats(ws2812_i2s_stats_t *s)
+{
+    taskENTER_CRITICAL();
+    *s = stats;
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * Sleep until the DMA interrupt reports that nothing is left to send.
+ */
+static void wait_idle(void)
+{
+    taskENTER_CRITICAL();
+    while (stream_mode ? frames_queued != 0 : i2s_dma_processing) {
+        waiting_task = xTaskGetCurrentTaskHandle();
+        taskEXIT_CRITICAL();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        taskENTER_CRITICAL();
+    }
+    taskEXIT_CRITICAL();
+}
+
+void ws2812_i2s_update(ws2812_pixel_t *pixels)
+{
+    wait_idle();
+
+    if (stream_mode) {
+        ws2812_i2s_update_async(pixels);
+        return;
+    }
+
+    encode_pixels(dma_buffer, pixels, dma_buffer_size / DMA_PIXEL_SIZE);
 
     i2s_dma_processing = true;
     i2s_dma_start(dma_block_list);
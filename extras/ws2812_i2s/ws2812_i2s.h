@@ -31,29 +31,119 @@
 extern "C" {
 #endif
 
+/**
+ * Streaming mode: number of DMA blocks in the ring.
+ *
+ * The DMA interrupt refills each block once it has been sent, so the ring
+ * sets how late that interrupt may be: up to (WS2812_I2S_RING_BLOCKS - 2)
+ * blocks of WS2812_I2S_BLOCK_PIXELS * 28.8us, about 1.8ms with the defaults.
+ * Anything that keeps interrupts off for longer (flash erase, Wi-Fi) makes
+ * the output run into blocks that have not been refilled. The driver then
+ * counts an underrun and sends the frame again from the start.
+ */
+#ifndef WS2812_I2S_RING_BLOCKS
+#define WS2812_I2S_RING_BLOCKS      4
+#endif
+
+/**
+ * Streaming mode: number of pixels encoded into each DMA block. A block takes
+ * about 30us per pixel to send, which is how long the interrupt has to encode
+ * the next one.
+ */
+#ifndef WS2812_I2S_BLOCK_PIXELS
+#define WS2812_I2S_BLOCK_PIXELS     32
+#endif
+
 typedef struct {
     uint8_t red;
     uint8_t green;
     uint8_t blue;
 } ws2812_pixel_t;
 
+/**
+ * Frame done callback for the streaming mode.
+ *
+ * It is called from the DMA interrupt once the frame has been sent and
+ * latched, or after an underrun once a newer frame has replaced it, so it
+ * must be short and can only use the FromISR FreeRTOS functions.
+ *
+ * @param pixels The pixel array of the frame, which can be reused now.
+ */
+typedef void (*ws2812_i2s_done_cb_t)(const ws2812_pixel_t *pixels);
+
+/**
+ * Frame statistics for the streaming mode.
+ */
+typedef struct {
+    uint32_t frames;            ///< Frames sent
+    uint32_t dropped;           ///< Frames replaced by a newer one before being sent
+    uint32_t underruns;         ///< Frames restarted because the ring ran out of data
+    uint32_t latency_us;        ///< Update call to frame latched, last frame
+    uint32_t max_latency_us;    ///< Update call to frame latched, worst case
+    uint32_t frame_us;          ///< Time between the last two frames, 1/fps
+} ws2812_i2s_stats_t;
+
 /**
  * Initialize i2s and dma subsystems to work with ws2812 led strip.
  *
  * Please note that each pixel will take 12 bytes of RAM.
  *
  * @param pixels_number Number of pixels in the strip.
+ * @return false if the DMA buffer could not be allocated.
  */
-void ws2812_i2s_init(uint32_t pixels_number);
+bool ws2812_i2s_init(uint32_t pixels_number);
+
+/**
+ * Initialize i2s and dma subsystems in streaming mode.
+ *
+ * Instead of encoding the whole strip up front, the pixels are encoded from
+ * the DMA interrupt into a small ring of blocks just ahead of the output.
+ * The ring takes WS2812_I2S_RING_BLOCKS * WS2812_I2S_BLOCK_PIXELS * 12 bytes
+ * (1.5KB by default) whatever the length of the strip.
+ *
+ * @param pixels_number Number of pixels in the strip.
+ * @param cb Called when a frame has been sent, can be NULL.
+ * @return false if the DMA ring could not be allocated.
+ */
+bool ws2812_i2s_init_stream(uint32_t pixels_number, ws2812_i2s_done_cb_t cb);
 
 /**
  * Update ws2812 pixels.
  *
+ * Sleeps until the previous frame has finished, then starts sending this
+ * one.
+ * In buffered mode the pixels are encoded before returning and the array
+ * can be reused at once. In streaming mode the array is read while the
+ * frame is sent and must not change until the frame is done.
+ *
  * @param pixels Array of 'pixels_number' pixels. The array must contain all
  * the pixels.
  */
 void ws2812_i2s_update(ws2812_pixel_t *pixels);
 
+/**
+ * Queue a frame without waiting (streaming mode only).
+ *
+ * The frame is sent after the one in progress, if any. A frame queued
+ * earlier that has not started yet is replaced and counted as dropped, its
+ * callback is not called. Use two pixel arrays and switch between them in
+ * the done callback to render one frame while the other is sent.
+ *
+ * @param pixels Array of 'pixels_number' pixels, read while the frame is
+ * sent.
+ */
+void ws2812_i2s_update_async(const ws2812_pixel_t *pixels);
+
+/**
+ * Check if frames are queued or being sent (streaming mode only).
+ */
+bool ws2812_i2s_busy(void);
+
+/**
+ * Get the frame statistics (streaming mode only).
+ */
+void ws2812_i2s_get_stats(ws2812_i2s_stats_t *stats);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -5,6 +5,11 @@
 #include "task.h"
 #include "esp8266.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "semphr.h"
 
 #include "esp_spiffs.h"
 #include "spiffs.h"
@@ -14,6 +19,7 @@
 #include "testcase.h"
 
 DEFINE_SOLO_TESTCASE(05_spiffs)
+DEFINE_SOLO_TESTCASE(05_spiffs_multitask)
 
 static fs_time_t get_current_time()
 {
@@ -22,7 +28,7 @@ static fs_time_t get_current_time()
 
 static void test_task(void *pvParameters)
 {
-    esp_spiffs_init();
+    TEST_ASSERT_TRUE_MESSAGE(esp_spiffs_init(), "Init failed");
     esp_spiffs_mount();
     SPIFFS_unmount(&fs);  // FS must be unmounted before formating
     if (SPIFFS_format(&fs) == SPIFFS_OK) {
@@ -31,6 +37,7 @@ static void test_task(void *pvParameters)
         printf("Format failed\n");
     }
     esp_spiffs_mount();
+    TEST_ASSERT_FALSE_MESSAGE(esp_spiffs_init(), "Buffers replaced while mounted");
 
     TEST_ASSERT_TRUE_MESSAGE(fs_load_test_run(100), "Load test failed");
 
@@ -41,6 +48,16 @@ static void test_task(void *pvParameters)
     } else {
         TEST_FAIL();
     }
+
+    esp_spiffs_stats_t stats;
+    esp_spiffs_get_stats(&stats);
+    printf("Cache hits: %u, misses: %u, GC runs: %u\n",
+            stats.cache_hits, stats.cache_misses, stats.gc_runs);
+    printf("Flash read: %u, written: %u, erased: %u bytes\n",
+            stats.bytes_read, stats.bytes_written, stats.bytes_erased);
+    TEST_ASSERT_TRUE_MESSAGE(stats.bytes_written > 0, "Write statistics missing");
+    TEST_ASSERT_TRUE_MESSAGE(stats.cache_hits + stats.cache_misses > 0,
+            "Cache statistics missing");
     TEST_PASS();
 }
 
@@ -48,3 +65,149 @@ static void a_05_spiffs(void)
 {
     xTaskCreate(test_task, "test_task", 1024, NULL, 2, NULL);
 }
+
+/* Several tasks use the file system at the same time.  Each one writes and
+ * verifies its own file and appends records to a shared file, which is
+ * checked once all tasks are done.  The records span several pages, so a
+ * write() that another task could interleave with would split them. */
+
+#define MT_TASKS        4
+#define MT_ROUNDS       20
+#define MT_FILE_SIZE    1500
+#define MT_RECORD_SIZE  (2 * SPIFFS_LOG_PAGE_SIZE + 100)
+#define MT_SHARED_FILE  "shared.bin"
+
+typedef struct {
+    uint8_t task;
+    uint8_t round;
+    uint8_t data[MT_RECORD_SIZE - 2];
+} mt_record_t;
+
+static void mt_fill_record(mt_record_t *rec, int task, int round)
+{
+    rec->task = task;
+    rec->round = round;
+    for (int i = 0; i < sizeof(rec->data); i++) {
+        rec->data[i] = (uint8_t)(i * 13 + task * 31 + round);
+    }
+}
+
+static bool mt_check_record(const mt_record_t *rec)
+{
+    for (int i = 0; i < sizeof(rec->data); i++) {
+        if (rec->data[i] != (uint8_t)(i * 13 + rec->task * 31 + rec->round)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static SemaphoreHandle_t mt_done;
+static volatile int mt_errors;
+
+static void mt_fill(uint8_t *buf, int task, int round)
+{
+    for (int i = 0; i < MT_FILE_SIZE; i++) {
+        buf[i] = (uint8_t)(i * 7 + task * 31 + round);
+    }
+}
+
+static bool mt_round(int task, int round, uint8_t *buf, uint8_t *expect)
+{
+    char name[16];
+    int fd;
+
+    snprintf(name, sizeof(name), "task%d.bin", task);
+    mt_fill(expect, task, round);
+
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0);
+    if (fd < 0) return false;
+    if (write(fd, expect, MT_FILE_SIZE) != MT_FILE_SIZE) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    fd = open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    memset(buf, 0, MT_FILE_SIZE);
+    if (read(fd, buf, MT_FILE_SIZE) != MT_FILE_SIZE) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    if (memcmp(buf, expect, MT_FILE_SIZE)) return false;
+
+    mt_record_t *rec = (mt_record_t *)buf;
+    mt_fill_record(rec, task, round);
+    fd = open(MT_SHARED_FILE, O_WRONLY | O_CREAT | O_APPEND, 0);
+    if (fd < 0) return false;
+    if (write(fd, rec, sizeof(*rec)) != sizeof(*rec)) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static void mt_worker(void *pvParameters)
+{
+    int task = (int)pvParameters;
+    uint8_t *buf = malloc(MT_FILE_SIZE);
+    uint8_t *expect = malloc(MT_FILE_SIZE);
+
+    for (int round = 0; round < MT_ROUNDS; round++) {
+        if (!buf || !expect || !mt_round(task, round, buf, expect)) {
+            printf("task %d failed in round %d\n", task, round);
+            mt_errors++;
+            break;
+        }
+    }
+    free(buf);
+    free(expect);
+    xSemaphoreGive(mt_done);
+    vTaskDelete(NULL);
+}
+
+static void multitask_test_task(void *pvParameters)
+{
+    static mt_record_t rec;
+    int counts[MT_TASKS] = {0};
+    int fd;
+
+    esp_spiffs_init();
+    esp_spiffs_mount();
+    SPIFFS_unmount(&fs);  // FS must be unmounted before formating
+    TEST_ASSERT_EQUAL_INT_MESSAGE(SPIFFS_OK, SPIFFS_format(&fs), "Format failed");
+    esp_spiffs_mount();
+
+    mt_done = xSemaphoreCreateCounting(MT_TASKS, 0);
+    for (int i = 0; i < MT_TASKS; i++) {
+        xTaskCreate(mt_worker, "mt_worker", 512, (void *)i, 2 + (i & 1), NULL);
+    }
+    for (int i = 0; i < MT_TASKS; i++) {
+        xSemaphoreTake(mt_done, portMAX_DELAY);
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, mt_errors, "Worker task failed");
+
+    fd = open(MT_SHARED_FILE, O_RDONLY, 0);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "Shared file missing");
+    while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        TEST_ASSERT_TRUE_MESSAGE(rec.task < MT_TASKS, "Corrupt shared record");
+        TEST_ASSERT_TRUE_MESSAGE(mt_check_record(&rec),
+                "Shared record interleaved with another task's");
+        // Records from one task must appear in order
+        TEST_ASSERT_EQUAL_INT(counts[rec.task], rec.round);
+        counts[rec.task]++;
+    }
+    close(fd);
+    for (int i = 0; i < MT_TASKS; i++) {
+        TEST_ASSERT_EQUAL_INT(MT_ROUNDS, counts[i]);
+    }
+    TEST_PASS();
+}
+
+static void a_05_spiffs_multitask(void)
+{
+    xTaskCreate(multitask_test_task, "test_task", 1024, NULL, 2, NULL);
+}
@@ -0,0 +1,220 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Checks extras/crc against the standard check values and against the
+ * bitwise implementations previously used by the sdio and onewire drivers,
+ * then reports the host time per byte of each.  The ratio is only a rough
+ * guide to the gain on the ESP8266, where the tables are read from flash.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <crc/crc.h>
+
+#define BUF_SIZE 4096
+
+/* Reference implementations */
+
+static uint8_t ref_crc7(const uint8_t *data, size_t n, uint8_t crc) {
+    for (size_t i = 0; i < n; i++) {
+        uint8_t d = data[i];
+        for (int j = 0; j < 8; j++) {
+            crc <<= 1;
+            if ((d & 0x80) ^ (crc & 0x80))
+                crc ^= 0x09;
+            d <<= 1;
+        }
+    }
+    return crc & 0x7f;
+}
+
+static uint8_t ref_crc8_maxim(const uint8_t *data, size_t len, uint8_t crc) {
+    while (len--) {
+        uint8_t inbyte = *data++;
+        for (int i = 8; i; i--) {
+            uint8_t mix = (crc ^ inbyte) & 0x01;
+            crc >>= 1;
+            if (mix) crc ^= 0x8C;
+            inbyte >>= 1;
+        }
+    }
+    return crc;
+}
+
+static uint16_t ref_crc16_ccitt(const uint8_t *data, size_t n, uint16_t crc) {
+    for (size_t i = 0; i < n; i++) {
+        crc = (uint8_t)(crc >> 8) | (crc << 8);
+        crc ^= data[i];
+        crc ^= (uint8_t)(crc & 0xff) >> 4;
+        crc ^= crc << 12;
+        crc ^= (crc & 0xff) << 5;
+    }
+    return crc;
+}
+
+static uint16_t ref_crc16_ibm(const uint8_t *input, size_t len, uint16_t crc) {
+    static const uint8_t oddparity[16] =
+        { 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0 };
+
+    for (size_t i = 0; i < len; i++) {
+        uint16_t cdata = input[i];
+        cdata = (cdata ^ crc) & 0xff;
+        crc >>= 8;
+        if (oddparity[cdata & 0x0F] ^ oddparity[cdata >> 4])
+            crc ^= 0xC001;
+        cdata <<= 6;
+        crc ^= cdata;
+        cdata <<= 1;
+        crc ^= cdata;
+    }
+    return crc;
+}
+
+static uint32_t ref_crc32(const uint8_t *data, size_t len, uint32_t crc) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+/* Wrappers with a common signature */
+
+typedef uint32_t (*crc_fn_t)(const uint8_t *data, size_t len, uint32_t crc);
+
+#define WRAP(name) \
+    static uint32_t w_##name(const uint8_t *data, size_t len, uint32_t crc) { \
+        return name(data, len, crc); \
+    }
+
+WRAP(crc7)
+WRAP(crc8_maxim)
+WRAP(crc16_ccitt)
+WRAP(crc16_ibm)
+WRAP(crc32)
+WRAP(ref_crc7)
+WRAP(ref_crc8_maxim)
+WRAP(ref_crc16_ccitt)
+WRAP(ref_crc16_ibm)
+WRAP(ref_crc32)
+
+typedef struct {
+    const char *name;
+    crc_fn_t fn;
+    crc_fn_t ref;
+    uint32_t check;
+    uint32_t mask;
+} crc_test_t;
+
+static const crc_test_t tests[] = {
+    {"crc7",        w_crc7,        w_ref_crc7,        0x75,       0x7f},
+    {"crc8_maxim",  w_crc8_maxim,  w_ref_crc8_maxim,  0xa1,       0xff},
+    {"crc16_ccitt", w_crc16_ccitt, w_ref_crc16_ccitt, 0x31c3,     0xffff},
+    {"crc16_ibm",   w_crc16_ibm,   w_ref_crc16_ibm,   0xbb3d,     0xffff},
+    {"crc32",       w_crc32,       w_ref_crc32,       0xcbf43926, 0xffffffff},
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool check(const crc_test_t *t, const uint8_t *buf, int iterations) {
+    const uint8_t *digits = (const uint8_t *)"123456789";
+    uint32_t crc;
+
+    crc = t->fn(digits, 9, 0);
+    if (crc != t->check) {
+        printf("%s: check value %08x, expected %08x\n", t->name, crc, t->check);
+        return false;
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        // Random offsets and lengths to cover the unaligned head and tail
+        size_t offset = rand() % 8;
+        size_t len = rand() % (BUF_SIZE - offset);
+        size_t split = len ? rand() % len : 0;
+        uint32_t iv = rand() & t->mask;
+        uint32_t expected = t->ref(buf + offset, len, iv);
+
+        crc = t->fn(buf + offset, len, iv);
+        if (crc != expected) {
+            printf("%s: offset %zu len %zu: %08x, expected %08x\n",
+                    t->name, offset, len, crc, expected);
+            return false;
+        }
+        // Chaining over two buffers must give the same result
+        crc = t->fn(buf + offset, split, iv);
+        crc = t->fn(buf + offset + split, len - split, crc);
+        if (crc != expected) {
+            printf("%s: offset %zu len %zu split %zu: %08x, expected %08x\n",
+                    t->name, offset, len, split, crc, expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double bench(crc_fn_t fn, const uint8_t *buf, int rounds) {
+    volatile uint32_t crc = 0;
+    double start = now_ns();
+
+    for (int i = 0; i < rounds; i++) {
+        crc = fn(buf, BUF_SIZE, crc);
+    }
+    return (now_ns() - start) / ((double)rounds * BUF_SIZE);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-n iterations] [-r rounds] [-S seed]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    static uint8_t buf[BUF_SIZE];
+    int iterations = 1000;
+    int rounds = 200;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:S:h")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'S': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+    for (int i = 0; i < BUF_SIZE; i++) {
+        buf[i] = rand();
+    }
+
+    printf("crc test: CRC32_SLICE_BY_4=%d, %d iterations\n",
+            CRC32_SLICE_BY_4, iterations);
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        if (!check(&tests[i], buf, iterations)) return 1;
+    }
+    printf("all results match\n\n");
+
+    printf("%-12s %12s %12s %8s\n", "crc", "table ns/B", "bitwise ns/B", "speedup");
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        double t = bench(tests[i].fn, buf, rounds);
+        double r = bench(tests[i].ref, buf, rounds);
+        printf("%-12s %12.2f %12.2f %7.1fx\n", tests[i].name, t, r, r / t);
+    }
+    return 0;
+}
@@ -0,0 +1 @@
+function reload() { location.reload(); }
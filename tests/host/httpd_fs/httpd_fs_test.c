@@ -0,0 +1,275 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for the flash file system of extras/httpd (HTTPD_FS_FLASH).
+ *
+ * The images are built from files/ by mkfsblob.py and written into a
+ * simulated flash, of which one megabyte is mapped like the cache maps the
+ * megabyte of the running rboot ROM slot.  Checks that every file is served
+ * byte-exact with the HTTP header mkfsblob.py put in front of it, that names
+ * only match exactly, that images outside the mapped megabyte are refused
+ * rather than read from the wrong part of flash, and that damaged images are
+ * not mounted.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+
+#define FLASH_SIZE  (4 * 1024 * 1024)
+#define MB          0x100000
+#define FS_ADDR     0xC0000
+#define MAX_FILE    4096
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+uint8_t rboot_megabyte;
+uintptr_t fake_flash_map;
+
+static uint32_t flash_words[FLASH_SIZE / 4];
+static uint8_t *const flash = (uint8_t *)flash_words;
+
+/* Images built by the Makefile */
+static uint8_t image[MAX_FILE * 4], image_noheaders[MAX_FILE * 4];
+static size_t image_len, image_noheaders_len;
+
+/* Files in files/ and the status line mkfsblob.py gives them */
+static const struct {
+    const char *name;
+    const char *status;     // NULL if served without a header
+} files[] = {
+    {"/index.html", "200 OK"},
+    {"/404.html", "404 File not found"},
+    {"/css/style.css", "200 OK"},
+    {"/test.js", "200 OK"},
+    {"/data/readings.json", "200 OK"},
+    {"/robots.plain", NULL},
+};
+
+static size_t load(const char *path, uint8_t *buf, size_t size)
+{
+    FILE *f = fopen(path, "rb");
+    size_t len;
+
+    if (!f) {
+        return 0;
+    }
+    len = fread(buf, 1, size, f);
+    fclose(f);
+    return len;
+}
+
+/* Map the megabyte of flash the firmware would run from */
+static void map_megabyte(uint8_t mb)
+{
+    rboot_megabyte = mb;
+    fake_flash_map = (uintptr_t)(flash + mb * MB);
+}
+
+static void write_image(uint32_t addr, const uint8_t *data, size_t len)
+{
+    memset(flash, 0xff, FLASH_SIZE);
+    memcpy(flash + addr, data, len);
+}
+
+/* Read the whole file with fs_read in small pieces */
+static bool read_file(const char *name, char *buf, int *len, struct fs_file *file)
+{
+    int n;
+
+    CHECK(fs_open(file, name) == ERR_OK, "%s not found", name);
+    // httpd sends the data straight from file->data, start from the
+    // beginning to go through fs_read instead
+    file->index = 0;
+    *len = 0;
+    while ((n = fs_read(file, buf + *len, 7)) != FS_READ_EOF) {
+        CHECK(n > 0 && n <= 7, "read returned %d", n);
+        *len += n;
+        CHECK(fs_bytes_left(file) == file->len - *len, "wrong bytes left");
+    }
+    fs_close(file);
+    buf[*len] = 0;
+    CHECK(*len == file->len, "read %d of %d bytes", *len, file->len);
+    return true;
+}
+
+/* Check every file against files/, with or without the HTTP headers */
+static bool check_files(bool headers)
+{
+    static char expected[MAX_FILE], served[MAX_FILE * 2];
+    char path[64], header[128];
+    struct fs_file file;
+    int len, header_len;
+
+    for (int i = 0; i < ARRAY_SIZE(files); i++) {
+        snprintf(path, sizeof(path), "files%s", files[i].name);
+        size_t expected_len = load(path, (uint8_t *)expected, sizeof(expected));
+        CHECK(expected_len > 0, "can't read %s", path);
+        if (!read_file(files[i].name, served, &len, &file)) {
+            return false;
+        }
+
+        header_len = 0;
+        if (headers && files[i].status) {
+            header_len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n", files[i].status);
+            CHECK(file.http_header_included, "%s: no header flag", files[i].name);
+            CHECK(len > header_len && !memcmp(served, header, header_len),
+                    "%s: wrong status line", files[i].name);
+            char *end = strstr(served, "\r\n\r\n");
+            CHECK(end, "%s: header not terminated", files[i].name);
+            header_len = end + 4 - served;
+        } else {
+            CHECK(!file.http_header_included, "%s: header flag set", files[i].name);
+        }
+        CHECK(len - header_len == expected_len &&
+                !memcmp(served + header_len, expected, expected_len),
+                "%s: wrong contents", files[i].name);
+    }
+    return true;
+}
+
+static bool test_serve(void)
+{
+    map_megabyte(0);
+    write_image(FS_ADDR, image, image_len);
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_OK, "mount failed");
+    if (!check_files(true)) {
+        return false;
+    }
+
+    write_image(FS_ADDR, image_noheaders, image_noheaders_len);
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_OK, "mount failed");
+    if (!check_files(false)) {
+        return false;
+    }
+    fs_flash_unmount();
+    return true;
+}
+
+static bool test_names(void)
+{
+    static const char *const missing[] = {
+        "", "/", "/index.htm", "/index.html2", "/INDEX.html", "/test.j",
+        "/test.js/", "css/style.css", "/css", "/404.html\n",
+    };
+    struct fs_file file;
+
+    map_megabyte(0);
+    write_image(FS_ADDR, image, image_len);
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_OK, "mount failed");
+    for (int i = 0; i < ARRAY_SIZE(missing); i++) {
+        CHECK(fs_open(&file, missing[i]) == ERR_VAL, "\"%s\" found", missing[i]);
+    }
+    CHECK(fs_open(&file, "/test.js") == ERR_OK, "/test.js not found");
+    fs_close(&file);
+
+    fs_flash_unmount();
+    CHECK(fs_open(&file, "/test.js") == ERR_VAL, "found after unmount");
+    return true;
+}
+
+static bool test_ota_slot(void)
+{
+    // Firmware in slot 1 runs with the second megabyte mapped, an image in
+    // the first one cannot be reached
+    map_megabyte(1);
+    write_image(FS_ADDR, image, image_len);
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_ARG, "image outside the mapped megabyte mounted");
+    CHECK(fs_flash_mount(MB + FS_ADDR) == ERR_VAL, "mounted erased flash");
+
+    // Its own copy, at the same offset in its megabyte
+    write_image(MB + FS_ADDR, image, image_len);
+    CHECK(fs_flash_mount(((uint32_t)rboot_megabyte << 20) + FS_ADDR) == ERR_OK,
+            "mount failed");
+    if (!check_files(true)) {
+        return false;
+    }
+
+    map_megabyte(2);
+    CHECK(fs_flash_mount(MB + FS_ADDR) == ERR_ARG, "image below the mapped megabyte mounted");
+    map_megabyte(0);
+    CHECK(fs_flash_mount(MB + FS_ADDR) == ERR_ARG, "image above the mapped megabyte mounted");
+
+    // Images must end inside the mapped megabyte too
+    map_megabyte(1);
+    write_image(2 * MB - 16, image, 16);
+    CHECK(fs_flash_mount(2 * MB - 16) == ERR_VAL, "image past the mapped megabyte mounted");
+    CHECK(fs_flash_mount(2 * MB - 12) == ERR_ARG, "header past the mapped megabyte");
+    return true;
+}
+
+static bool test_damaged(void)
+{
+    struct fs_flash_header *hdr = (struct fs_flash_header *)(flash + FS_ADDR);
+    struct fs_flash_entry *e = (struct fs_flash_entry *)(hdr + 1);
+    struct fs_file file;
+
+    map_megabyte(0);
+    write_image(FS_ADDR, image, image_len);
+    CHECK(fs_flash_mount(FS_ADDR + 2) == ERR_ARG, "unaligned image mounted");
+
+    hdr->magic ^= 1;
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_VAL, "bad magic mounted");
+    CHECK(fs_open(&file, "/index.html") == ERR_VAL, "file served after a failed mount");
+
+    write_image(FS_ADDR, image, image_len);
+    hdr->num_files = hdr->size;
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_VAL, "too many files mounted");
+
+    write_image(FS_ADDR, image, image_len);
+    e[1].data_len = hdr->size;
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_VAL, "file past the end mounted");
+
+    write_image(FS_ADDR, image, image_len);
+    e[2].name_offset += 2;
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_VAL, "unaligned name mounted");
+
+    write_image(FS_ADDR, image, image_len);
+    hdr->size = MB;
+    CHECK(fs_flash_mount(FS_ADDR) == ERR_VAL, "image past the mapped megabyte mounted");
+    return true;
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(void);
+} tests[] = {
+    {"serve", test_serve},
+    {"names", test_names},
+    {"ota_slot", test_ota_slot},
+    {"damaged", test_damaged},
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    image_len = load("fs.bin", image, sizeof(image));
+    image_noheaders_len = load("fs_noheaders.bin", image_noheaders, sizeof(image_noheaders));
+    if (!image_len || !image_noheaders_len) {
+        printf("can't read the images, run make first\n");
+        return 1;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        bool ok = tests[i].fn();
+        printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,14 @@
+/* Host stand-in for the flash mapping used by httpd's fs.c */
+#ifndef _HOST_ESP_ROM_H_
+#define _HOST_ESP_ROM_H_
+
+#include <stdint.h>
+
+/* Megabyte of the simulated flash the test has mapped */
+extern uint8_t rboot_megabyte;
+
+/* Host address of that megabyte, in place of 0x40200000 */
+extern uintptr_t fake_flash_map;
+#define FS_FLASH_MAP_BASE fake_flash_map
+
+#endif /* _HOST_ESP_ROM_H_ */
@@ -0,0 +1,10 @@
+/* Host stand-in for the lwIP helpers used by httpd's fs.c */
+#ifndef _HOST_LWIP_DEF_H_
+#define _HOST_LWIP_DEF_H_
+
+#include <string.h>
+
+#define MEMCPY(dst, src, len) memcpy(dst, src, len)
+#define LWIP_UNUSED_ARG(x) (void)x
+
+#endif /* _HOST_LWIP_DEF_H_ */
@@ -0,0 +1,11 @@
+/* Host stand-in for lwIP error codes, same values as lwip/err.h */
+#ifndef _HOST_LWIP_ERR_H_
+#define _HOST_LWIP_ERR_H_
+
+typedef signed char err_t;
+
+#define ERR_OK    0
+#define ERR_VAL  -6
+#define ERR_ARG  -14
+
+#endif /* _HOST_LWIP_ERR_H_ */
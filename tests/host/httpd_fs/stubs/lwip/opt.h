@@ -0,0 +1,11 @@
+/* Host stand-in for the lwIP types used by httpd's fs.c */
+#ifndef _HOST_LWIP_OPT_H_
+#define _HOST_LWIP_OPT_H_
+
+#include <stdint.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+
+#endif /* _HOST_LWIP_OPT_H_ */
@@ -0,0 +1,102 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Fake I2S DMA for host testing.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <semphr.h>
+#include <i2s_dma/i2s_dma.h>
+
+#include "fake_dma.h"
+
+fake_dma_capture_t fake_dma_capture;
+uint8_t fake_dma_bits;
+bool fake_dma_irq_off;
+
+static i2s_dma_isr_t isr;
+static dma_descriptor_t *current;
+static dma_descriptor_t *eof;
+static bool running;
+static bool pending_eof;
+
+void i2s_dma_init(i2s_dma_isr_t handler, i2s_clock_div_t clock_div, i2s_pins_t pins) {
+    isr = handler;
+}
+
+i2s_clock_div_t i2s_get_clock_div(int32_t freq) {
+    i2s_clock_div_t div = {1, 1};
+    return div;
+}
+
+bool i2s_dma_set_bits_per_sample(uint8_t bits) {
+    fake_dma_bits = bits;
+    return bits == 16 || bits == 24;
+}
+
+void i2s_dma_start(dma_descriptor_t *descr) {
+    current = descr;
+    running = true;
+}
+
+void i2s_dma_stop() {
+    running = false;
+}
+
+void i2s_dma_clear_interrupt() {
+    pending_eof = false;
+}
+
+bool i2s_dma_is_eof_interrupt() {
+    return pending_eof;
+}
+
+dma_descriptor_t *i2s_dma_get_eof_descriptor() {
+    return eof;
+}
+
+static void capture(const void *buf, size_t bytes) {
+    fake_dma_capture_t *c = &fake_dma_capture;
+    size_t words = bytes / 4;
+
+    if (c->len + words > c->size) {
+        c->size = (c->len + words) * 2;
+        c->words = realloc(c->words, c->size * sizeof(uint32_t));
+    }
+    memcpy(c->words + c->len, buf, bytes);
+    c->len += words;
+}
+
+bool fake_dma_step(void) {
+    if (!running) return false;
+
+    capture(current->buf_ptr, current->datalen);
+    eof = current;
+    current = current->next_link_ptr;
+    if (eof->eof) {
+        pending_eof = true;
+        if (!fake_dma_irq_off) isr();
+    }
+    return true;
+}
+
+void fake_dma_irq_on(void) {
+    fake_dma_irq_off = false;
+    if (pending_eof) isr();
+}
+
+bool fake_dma_running(void) {
+    return running;
+}
+
+void fake_dma_reset(void) {
+    running = false;
+    fake_dma_capture.len = 0;
+}
+
+/* The writer is waiting for a block: let the DMA play one */
+int xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    return fake_dma_step();
+}
@@ -0,0 +1,38 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Fake I2S DMA for host testing.  It follows the descriptor list like the
+ * hardware does, one block per step, appending each block to a capture
+ * buffer and raising the EOF "interrupt" after it.  While interrupts are
+ * off the DMA carries on, and only the latest EOF is seen once they are
+ * back on.
+ */
+#ifndef _FAKE_DMA_H_
+#define _FAKE_DMA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint32_t *words;
+    size_t len;
+    size_t size;
+} fake_dma_capture_t;
+
+extern fake_dma_capture_t fake_dma_capture;
+extern uint8_t fake_dma_bits;
+extern bool fake_dma_irq_off;
+
+/* Play one block. Returns false if the DMA is stopped. */
+bool fake_dma_step(void);
+
+bool fake_dma_running(void);
+
+/* Turn the interrupt back on, raising any EOF that came while it was off */
+void fake_dma_irq_on(void);
+
+void fake_dma_reset(void);
+
+#endif /* _FAKE_DMA_H_ */
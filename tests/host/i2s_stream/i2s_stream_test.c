@@ -0,0 +1,252 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for extras/i2s_stream against a fake DMA consumer.
+ *
+ * Checks the sample conversion for every input/output format, blocking and
+ * non-blocking writes, underrun recovery and flushing by comparing what the
+ * fake DMA played with the expected output.  Then reports the host time per
+ * frame for each format.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <i2s_stream/i2s_stream.h>
+
+#include "fake_dma.h"
+
+#define MAX_FRAMES 20000
+
+static int16_t samples[MAX_FRAMES * 2 + 1];
+static uint32_t expected[MAX_FRAMES * 2 + 4096];
+static size_t expected_len;
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+static bool setup(uint8_t channels, uint8_t out_bits, uint16_t block_size,
+        uint8_t block_count, uint8_t start_blocks) {
+    i2s_stream_config_t config;
+
+    i2s_stream_get_default_config(&config);
+    config.channels = channels;
+    config.out_bits = out_bits;
+    config.block_size = block_size;
+    config.block_count = block_count;
+    config.start_blocks = start_blocks;
+    fake_dma_reset();
+    expected_len = 0;
+    return i2s_stream_init(&config);
+}
+
+/* Straightforward per-sample reference of the output format */
+static void expect(const int16_t *src, size_t frames, uint8_t channels,
+        uint8_t out_bits) {
+    for (size_t i = 0; i < frames; i++) {
+        uint16_t l = src[i * channels];
+        uint16_t r = src[i * channels + channels - 1];
+        if (out_bits == 16) {
+            expected[expected_len++] = l | ((uint32_t)r << 16);
+        } else {
+            expected[expected_len++] = (uint32_t)l << 16;
+            expected[expected_len++] = (uint32_t)r << 16;
+        }
+    }
+}
+
+static void expect_silence_to_block(uint16_t block_size) {
+    while (expected_len % (block_size / 4)) {
+        expected[expected_len++] = 0;
+    }
+}
+
+static bool check_output(void) {
+    CHECK(fake_dma_capture.len == expected_len, "played %zu words, expected %zu",
+            fake_dma_capture.len, expected_len);
+    for (size_t i = 0; i < expected_len; i++) {
+        CHECK(fake_dma_capture.words[i] == expected[i],
+                "word %zu is %08x, expected %08x",
+                i, fake_dma_capture.words[i], expected[i]);
+    }
+    return true;
+}
+
+static bool test_formats(void) {
+    static const uint8_t channels[] = {1, 2};
+    static const uint8_t bits[] = {16, 24};
+
+    for (int c = 0; c < ARRAY_SIZE(channels); c++) {
+        for (int b = 0; b < ARRAY_SIZE(bits); b++) {
+            // Odd sized writes from odd offsets cover the unaligned paths
+            for (int offset = 0; offset < 2; offset++) {
+                const int16_t *src = samples + offset;
+                size_t frames = 1001;
+                i2s_stream_stats_t stats;
+
+                CHECK(setup(channels[c], bits[b], 512, 4, 2), "init failed");
+                CHECK(fake_dma_bits == bits[b], "bus set to %d bits", fake_dma_bits);
+                for (size_t done = 0; done < frames;) {
+                    size_t n = 1 + rand() % 97;
+                    if (n > frames - done) n = frames - done;
+                    CHECK(i2s_stream_write(src + done * channels[c], n, portMAX_DELAY) == n,
+                            "short write");
+                    done += n;
+                }
+                CHECK(i2s_stream_flush(portMAX_DELAY), "flush failed");
+                CHECK(!fake_dma_running(), "DMA still running after flush");
+
+                expect(src, frames, channels[c], bits[b]);
+                expect_silence_to_block(512);
+                if (!check_output()) {
+                    printf("channels %d, bits %d, offset %d\n", channels[c], bits[b], offset);
+                    return false;
+                }
+                i2s_stream_get_stats(&stats);
+                CHECK(stats.underruns == 0, "%u underruns", stats.underruns);
+                CHECK(stats.blocks * 128 == expected_len, "%u blocks played", stats.blocks);
+            }
+        }
+    }
+    return true;
+}
+
+static bool test_non_blocking(void) {
+    CHECK(setup(2, 16, 256, 4, 2), "init failed");
+
+    // Nothing plays without waiting, so the write stops with the ring full
+    size_t n = i2s_stream_write(samples, MAX_FRAMES, 0);
+    CHECK(n == 4 * 64, "wrote %zu frames", n);
+    CHECK(fake_dma_running(), "output not started");
+    CHECK(i2s_stream_write(samples, 1, 0) == 0, "write to a full ring");
+
+    // One block played makes room for one more
+    fake_dma_step();
+    CHECK(i2s_stream_write(samples + n * 2, MAX_FRAMES, 0) == 64, "no room made");
+
+    CHECK(i2s_stream_flush(portMAX_DELAY), "flush failed");
+    expect(samples, n + 64, 2, 16);
+    return check_output();
+}
+
+static bool test_start_threshold(void) {
+    CHECK(setup(2, 16, 256, 4, 3), "init failed");
+
+    CHECK(i2s_stream_write(samples, 2 * 64, 0) == 2 * 64, "short write");
+    CHECK(!fake_dma_running(), "started before start_blocks were queued");
+    CHECK(i2s_stream_write(samples, 64, 0) == 64, "short write");
+    CHECK(fake_dma_running(), "not started with start_blocks queued");
+    return true;
+}
+
+static bool test_underrun(void) {
+    i2s_stream_stats_t stats;
+
+    CHECK(setup(2, 16, 256, 4, 2), "init failed");
+
+    CHECK(i2s_stream_write(samples, 2 * 64 + 10, 0) == 2 * 64 + 10, "short write");
+    expect(samples, 2 * 64, 2, 16);
+    while (fake_dma_step()) {}
+
+    // Stopped after the two full blocks, the partial one was not played
+    i2s_stream_get_stats(&stats);
+    CHECK(stats.underruns == 1, "%u underruns", stats.underruns);
+    CHECK(stats.blocks == 2, "%u blocks played", stats.blocks);
+    if (!check_output()) return false;
+
+    // Writing on restarts output with the partial block, in order
+    CHECK(i2s_stream_write(samples + 2 * (2 * 64 + 10), 3 * 64, portMAX_DELAY) == 3 * 64,
+            "short write");
+    CHECK(fake_dma_running(), "not restarted");
+    CHECK(i2s_stream_flush(portMAX_DELAY), "flush failed");
+    expect(samples + 2 * 2 * 64, 10 + 3 * 64, 2, 16);
+    expect_silence_to_block(256);
+    if (!check_output()) return false;
+
+    i2s_stream_get_stats(&stats);
+    CHECK(stats.underruns == 1, "flush counted as underrun");
+    return true;
+}
+
+static bool test_bad_config(void) {
+    i2s_stream_config_t config;
+
+    i2s_stream_get_default_config(&config);
+    config.block_size = 1004;
+    CHECK(!i2s_stream_init(&config), "block size not a multiple of 8 accepted");
+    i2s_stream_get_default_config(&config);
+    config.start_blocks = config.block_count + 1;
+    CHECK(!i2s_stream_init(&config), "start_blocks > block_count accepted");
+    i2s_stream_get_default_config(&config);
+    config.out_bits = 32;
+    CHECK(!i2s_stream_init(&config), "32 bit output accepted");
+    return true;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(uint8_t channels, uint8_t out_bits, int rounds) {
+    setup(channels, out_bits, 4088 / 8 * 8, 4, 2);
+    double start = now_ns();
+    for (int i = 0; i < rounds; i++) {
+        i2s_stream_write(samples, MAX_FRAMES, portMAX_DELAY);
+        // Keep the capture buffer from growing without bound
+        fake_dma_capture.len = 0;
+    }
+    double elapsed = now_ns() - start;
+    printf("%-7s -> %2d bit %10.2f\n", channels == 1 ? "mono" : "stereo",
+            out_bits, elapsed / ((double)rounds * MAX_FRAMES));
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-r rounds] [-S seed]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 50;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:S:h")) != -1) {
+        switch (opt) {
+        case 'r': rounds = atoi(optarg); break;
+        case 'S': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+    for (int i = 0; i < ARRAY_SIZE(samples); i++) {
+        samples[i] = rand();
+    }
+
+    if (!test_formats() || !test_non_blocking() || !test_start_threshold() ||
+            !test_underrun() || !test_bad_config()) {
+        return 1;
+    }
+    printf("i2s_stream tests passed\n\n");
+
+    printf("%-17s %10s\n", "format", "ns/frame");
+    bench(1, 16, rounds);
+    bench(2, 16, rounds);
+    bench(1, 24, rounds);
+    bench(2, 24, rounds);
+    return 0;
+}
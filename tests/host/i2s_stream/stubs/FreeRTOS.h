@@ -0,0 +1,21 @@
+/* Minimal FreeRTOS stand-in for building i2s_stream on the host.
+ *
+ * The host test is single threaded. Waiting on a semaphore lets the fake
+ * DMA play a block instead, see fake_dma.c.
+ */
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+#include <stdint.h>
+
+typedef long BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+
+#define portMAX_DELAY 0xffffffffUL
+
+#define portEND_SWITCHING_ISR(x) (void)(x)
+
+#endif /* _HOST_FREERTOS_H_ */
@@ -0,0 +1,22 @@
+#ifndef _HOST_SEMPHR_H_
+#define _HOST_SEMPHR_H_
+
+#include "FreeRTOS.h"
+
+typedef void *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return (SemaphoreHandle_t)1;
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t sem) {
+}
+
+static inline int xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken) {
+    return 1;
+}
+
+/* Implemented by the fake DMA */
+int xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+
+#endif /* _HOST_SEMPHR_H_ */
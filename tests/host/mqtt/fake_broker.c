@@ -0,0 +1,354 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Simulated MQTT broker, see fake_broker.h.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "fake_broker.h"
+
+#define MAX_PACKET   1024
+#define MAX_ANSWERS  256
+#define ANSWER_LEN   8
+#define SEGMENT_LEN  1460
+
+/* Large packets from fake_broker_publish() are kept on the heap and arrive
+ * one TCP segment at a time at link speed, starting at 'due'.
+ */
+typedef struct {
+    uint64_t due;
+    uint32_t len;
+    uint8_t *heap;
+    uint8_t data[ANSWER_LEN];
+} answer_t;
+
+fake_broker_stats_t fake_broker_stats;
+
+static fake_broker_config_t config;
+static uint64_t now;
+static bool disconnected;
+
+/* Bytes from the client, until they make up a whole packet */
+static uint8_t in[MAX_PACKET];
+static int in_len;
+
+/* Answers on their way to the client, sorted by arrival time */
+static answer_t answers[MAX_ANSWERS];
+static int num_answers;
+
+/* Bytes of answers[0] read already */
+static uint32_t out_pos;
+
+/* Last packet id used by fake_broker_publish() */
+static uint16_t publish_id;
+
+/* Ids whose first ack was lost already */
+static uint8_t dropped[65536 / 8];
+
+TickType_t xTaskGetTickCount(void)
+{
+    return now / 1000;
+}
+
+char mqtt_timer_expired(mqtt_timer_t *timer)
+{
+    int32_t left = timer->end_time - xTaskGetTickCount();
+    return (left < 0);
+}
+
+void mqtt_timer_countdown_ms(mqtt_timer_t *timer, unsigned int timeout)
+{
+    timer->end_time = xTaskGetTickCount() + timeout / portTICK_PERIOD_MS;
+}
+
+void mqtt_timer_countdown(mqtt_timer_t *timer, unsigned int timeout)
+{
+    mqtt_timer_countdown_ms(timer, timeout * 1000);
+}
+
+int mqtt_timer_left_ms(mqtt_timer_t *timer)
+{
+    int32_t left = timer->end_time - xTaskGetTickCount();
+    return (left < 0) ? 0 : left / portTICK_PERIOD_MS;
+}
+
+void mqtt_timer_init(mqtt_timer_t *timer)
+{
+    timer->end_time = 0;
+}
+
+static void link_delay(int bytes)
+{
+    if (config.link_kbps) {
+        now += (uint64_t)bytes * 8000 / config.link_kbps;
+    }
+}
+
+static void queue_answer(const answer_t *a)
+{
+    int i;
+
+    if (num_answers == MAX_ANSWERS) {
+        abort();
+    }
+    for (i = num_answers; i > 0 && answers[i - 1].due > a->due; i--) {
+        answers[i] = answers[i - 1];
+    }
+    answers[i] = *a;
+    num_answers++;
+}
+
+static void answer(uint8_t type, const uint8_t *data, uint8_t len)
+{
+    answer_t a = {0};
+
+    a.due = now + config.rtt_us;
+    if (config.jitter_us) {
+        a.due += rand() % config.jitter_us;
+    }
+    a.data[0] = type;
+    a.data[1] = len;
+    memcpy(a.data + 2, data, len);
+    a.len = len + 2;
+    queue_answer(&a);
+}
+
+/* Time at which the first 'bytes' of an answer have arrived */
+static uint64_t arrival(const answer_t *a, uint32_t bytes)
+{
+    if (!a->heap || !config.link_kbps) {
+        return a->due;
+    }
+    return a->due + ((uint64_t)bytes * 8000 + config.link_kbps - 1) / config.link_kbps;
+}
+
+/* Bytes of answers[0] that can be read now, in whole segments */
+static uint32_t arrived(void)
+{
+    const answer_t *a = &answers[0];
+    uint32_t end = a->len;
+
+    while (end > out_pos && arrival(a, end) > now) {
+        end = end % SEGMENT_LEN ? end - end % SEGMENT_LEN : end - SEGMENT_LEN;
+    }
+    return end > out_pos ? end - out_pos : 0;
+}
+
+static void handle_publish(const uint8_t *p, int len)
+{
+    uint8_t qos = (p[0] >> 1) & 3;
+    bool dup = p[0] & 0x08;
+    int topic_len, id_len;
+    uint16_t id;
+
+    fake_broker_stats.publishes++;
+    if (dup) {
+        fake_broker_stats.dups++;
+    }
+
+    // Packet id follows the topic, skip the one byte remaining length
+    topic_len = (p[2] << 8) | p[3];
+    id_len = qos ? 2 : 0;
+    if (len < 2 + 2 + topic_len + id_len) {
+        abort();
+    }
+    if (config.on_publish) {
+        config.on_publish((const char *)p + 4, topic_len, p + 4 + topic_len + id_len,
+                len - 4 - topic_len - id_len, dup);
+    }
+    if (qos == 0 || config.silent) {
+        return;
+    }
+    id = (p[4 + topic_len] << 8) | p[5 + topic_len];
+
+    if (config.drop_every && fake_broker_stats.publishes % config.drop_every == 0 &&
+            !(dropped[id / 8] & (1 << (id % 8)))) {
+        dropped[id / 8] |= 1 << (id % 8);
+        fake_broker_stats.acks_dropped++;
+        return;
+    }
+    answer(qos == 1 ? 0x40 : 0x50, p + 4 + topic_len, 2);
+}
+
+static void handle_packet(const uint8_t *p, int len)
+{
+    static const uint8_t connack[] = {0, 0};
+
+    switch (p[0] >> 4) {
+    case 1:     // CONNECT
+        answer(0x20, connack, 2);
+        break;
+    case 3:     // PUBLISH
+        handle_publish(p, len);
+        break;
+    case 4:     // PUBACK
+        fake_broker_stats.pubacks++;
+        break;
+    case 6:     // PUBREL
+        fake_broker_stats.pubrels++;
+        if (!config.silent) {
+            answer(0x70, p + 2, 2);
+        }
+        break;
+    case 8: {   // SUBSCRIBE, grant what was asked for
+        fake_broker_stats.subscribes++;
+        uint8_t suback[3] = {p[2], p[3], p[len - 1]};
+        answer(0x90, suback, 3);
+        break;
+    }
+    case 10:    // UNSUBSCRIBE
+        answer(0xb0, p + 2, 2);
+        break;
+    case 12:    // PINGREQ
+        answer(0xd0, NULL, 0);
+        break;
+    }
+}
+
+static int fake_write(mqtt_network_t *n, unsigned char *buf, int len, int timeout_ms)
+{
+    if (disconnected) {
+        return -1;
+    }
+
+    link_delay(len);
+    fake_broker_stats.bytes_in += len;
+    if (in_len + len > MAX_PACKET) {
+        abort();
+    }
+    memcpy(in + in_len, buf, len);
+    in_len += len;
+
+    // Only short packets are sent, the remaining length is a single byte
+    while (in_len >= 2 && in_len >= 2 + in[1]) {
+        int packet_len = 2 + in[1];
+        handle_packet(in, packet_len);
+        memmove(in, in + packet_len, in_len - packet_len);
+        in_len -= packet_len;
+    }
+
+    return len;
+}
+
+static int fake_read(mqtt_network_t *n, unsigned char *buf, int len, int timeout_ms)
+{
+    int i;
+
+    if (disconnected) {
+        // Nothing ever arrives, like a peer that has gone away silently
+        now += (uint64_t)(timeout_ms > 0 ? timeout_ms : 1) * 1000;
+        return -1;
+    }
+
+    if (!num_answers || !arrived()) {
+        // A real wait takes at least until the next tick
+        uint64_t deadline = now + (uint64_t)(timeout_ms > 0 ? timeout_ms : 1) * 1000;
+        uint64_t next;
+
+        if (!num_answers) {
+            now = deadline;
+            return 0;
+        }
+        next = arrival(&answers[0], answers[0].len < out_pos + SEGMENT_LEN ?
+                answers[0].len : out_pos + SEGMENT_LEN);
+        if (next > deadline) {
+            now = deadline;
+            return 0;
+        }
+        if (next > now) {
+            now = next;
+        }
+    }
+
+    // Everything that has arrived by now can be read in one go
+    for (i = 0; i < len && num_answers; ) {
+        answer_t *a = &answers[0];
+        uint32_t n = arrived();
+
+        if (!n) {
+            break;
+        }
+        if (n > len - i) {
+            n = len - i;
+        }
+        memcpy(buf + i, (a->heap ? a->heap : a->data) + out_pos, n);
+        out_pos += n;
+        i += n;
+        if (out_pos == a->len) {
+            free(a->heap);
+            memmove(answers, answers + 1, (num_answers - 1) * sizeof(answer_t));
+            num_answers--;
+            out_pos = 0;
+        }
+    }
+    fake_broker_stats.bytes_out += i;
+
+    return i;
+}
+
+void fake_broker_init(mqtt_network_t *n, const fake_broker_config_t *cfg)
+{
+    config = *cfg;
+    now = 0;
+    disconnected = false;
+    in_len = 0;
+    while (num_answers) {
+        free(answers[--num_answers].heap);
+    }
+    out_pos = 0;
+    publish_id = 0;
+    memset(dropped, 0, sizeof(dropped));
+    memset(&fake_broker_stats, 0, sizeof(fake_broker_stats));
+
+    n->my_socket = 0;
+    n->mqttread = fake_read;
+    n->mqttwrite = fake_write;
+}
+
+uint64_t fake_broker_now_us(void)
+{
+    return now;
+}
+
+void fake_broker_disconnect(void)
+{
+    disconnected = true;
+}
+
+uint16_t fake_broker_publish(const char *topic, const uint8_t *payload, uint32_t len, uint8_t qos)
+{
+    answer_t a = {0};
+    uint32_t topic_len = strlen(topic);
+    uint32_t rem_len = 2 + topic_len + (qos ? 2 : 0) + len;
+    uint8_t *p;
+
+    a.heap = p = malloc(5 + rem_len);
+    if (!p) {
+        abort();
+    }
+    *p++ = 0x30 | (qos << 1);
+    do {
+        *p = rem_len % 128;
+        rem_len /= 128;
+        *p++ |= rem_len ? 0x80 : 0;
+    } while (rem_len);
+    *p++ = topic_len >> 8;
+    *p++ = topic_len;
+    memcpy(p, topic, topic_len);
+    p += topic_len;
+    if (qos) {
+        if (++publish_id == 0) {
+            publish_id = 1;
+        }
+        *p++ = publish_id >> 8;
+        *p++ = publish_id;
+    }
+    memcpy(p, payload, len);
+    a.len = p + len - a.heap;
+    a.due = now + config.rtt_us / 2;
+    queue_answer(&a);
+
+    return qos ? publish_id : 0;
+}
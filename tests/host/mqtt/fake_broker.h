@@ -0,0 +1,61 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Simulated MQTT broker for running extras/paho_mqtt_c on the host.
+ *
+ * Provides an mqtt_network_t whose read and write functions talk to a
+ * minimal in-process broker, and the mqtt_timer_* functions on a simulated
+ * clock.  The clock only moves when the client waits for data or sends it
+ * over the simulated link, so runs are fast and exactly repeatable, and
+ * throughput can be measured for any round trip time.
+ */
+#ifndef _FAKE_BROKER_H_
+#define _FAKE_BROKER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <paho_mqtt_c/MQTTESP8266.h>
+
+typedef struct {
+    uint32_t rtt_us;        // delay before the broker's answer arrives
+    uint32_t jitter_us;     // random extra delay per answer, reorders acks
+    uint32_t link_kbps;     // speed of the link to the broker, 0 for infinite
+    unsigned drop_every;    // lose the first ack of every n-th publish
+    bool silent;            // never answer publishes
+    /* Called for every PUBLISH received, if set */
+    void (*on_publish)(const char *topic, int topic_len, const uint8_t *payload,
+            int payload_len, bool dup);
+} fake_broker_config_t;
+
+typedef struct {
+    uint32_t publishes;     // PUBLISH packets received, including DUPs
+    uint32_t dups;          // ... of which were retransmissions
+    uint32_t pubrels;
+    uint32_t acks_dropped;
+    uint32_t subscribes;
+    uint32_t pubacks;       // PUBACKs for fake_broker_publish() messages
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+} fake_broker_stats_t;
+
+extern fake_broker_stats_t fake_broker_stats;
+
+/** Reset the broker and the clock and set up `n` to talk to it */
+void fake_broker_init(mqtt_network_t *n, const fake_broker_config_t *config);
+
+/** Simulated time since fake_broker_init() in microseconds */
+uint64_t fake_broker_now_us(void);
+
+/**
+ * Send a PUBLISH to the client. It starts to arrive half a round trip from
+ * now and comes in one TCP segment at a time at link speed, so payloads far
+ * bigger than the client's readbuf can be sent. Returns the packet id.
+ */
+uint16_t fake_broker_publish(const char *topic, const uint8_t *payload, uint32_t len, uint8_t qos);
+
+/** Make the connection fail, reads time out with an error from now on */
+void fake_broker_disconnect(void);
+
+#endif /* _FAKE_BROKER_H_ */
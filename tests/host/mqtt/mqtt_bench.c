@@ -0,0 +1,126 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Publish throughput of the paho MQTT client against the simulated broker.
+ *
+ * Sends QoS1 and QoS2 messages with in-flight windows of 1, 4 and 16 for a
+ * few broker round trip times and reports messages per second of simulated
+ * time.  The link speed is set to roughly what the ESP8266 gets over Wi-Fi,
+ * so the largest windows show where the link rather than the round trip
+ * becomes the limit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <paho_mqtt_c/MQTTClient.h>
+
+#include "fake_broker.h"
+
+#define BUF_SIZE 128
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const unsigned windows[] = {1, 4, 16};
+static const uint32_t rtts_ms[] = {5, 20, 80};
+
+static mqtt_network_t network;
+static mqtt_client_t client = mqtt_client_default;
+static unsigned char buf[BUF_SIZE], readbuf[BUF_SIZE];
+static int failures;
+
+static void publish_done(mqtt_client_t *c, unsigned short id, int rc, void *arg)
+{
+    if (rc != MQTT_SUCCESS) {
+        failures++;
+    }
+}
+
+static double run(enum mqtt_qos qos, unsigned window, uint32_t rtt_ms,
+        uint32_t link_kbps, int count)
+{
+    fake_broker_config_t config = {
+        .rtt_us = rtt_ms * 1000,
+        .jitter_us = rtt_ms * 250,
+        .link_kbps = link_kbps,
+    };
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+    char payload[32];
+    uint64_t start;
+
+    fake_broker_init(&network, &config);
+    mqtt_set_inflight_window(&client, 1);
+    mqtt_client_new(&client, &network, 5000, buf, BUF_SIZE, readbuf, BUF_SIZE);
+    data.clientID.cstring = "bench";
+    if (mqtt_connect(&client, &data) != MQTT_SUCCESS) {
+        printf("connect failed\n");
+        exit(1);
+    }
+    mqtt_set_inflight_window(&client, window);
+
+    start = fake_broker_now_us();
+    for (int i = 0; i < count; i++) {
+        mqtt_message_t message = {
+            .qos = qos,
+            .payload = payload,
+            .payloadlen = snprintf(payload, sizeof(payload), "{\"seq\":%d}", i),
+        };
+        if (mqtt_publish_async(&client, "bench/telemetry", &message, publish_done, NULL) != MQTT_SUCCESS) {
+            failures++;
+        }
+    }
+    mqtt_flush(&client, 5000);
+
+    return count * 1e6 / (fake_broker_now_us() - start);
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-n messages] [-l link_kbps]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    int count = 1000;
+    uint32_t link_kbps = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'l':
+            link_kbps = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    printf("%d messages, %u kbit/s link, msgs/s by in-flight window\n\n", count, link_kbps);
+    printf("qos  rtt_ms");
+    for (int w = 0; w < ARRAY_SIZE(windows); w++) {
+        printf("  window=%-3u", windows[w]);
+    }
+    printf("\n");
+
+    for (int qos = MQTT_QOS1; qos <= MQTT_QOS2; qos++) {
+        for (int r = 0; r < ARRAY_SIZE(rtts_ms); r++) {
+            printf("%3d  %6u", qos, rtts_ms[r]);
+            for (int w = 0; w < ARRAY_SIZE(windows); w++) {
+                printf("  %10.1f", run(qos, windows[w], rtts_ms[r], link_kbps, count));
+            }
+            printf("\n");
+        }
+    }
+
+    if (failures) {
+        printf("\n%d publishes failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
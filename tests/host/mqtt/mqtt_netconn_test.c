@@ -0,0 +1,262 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for the netconn transport in MQTTNetconn.c, running the client over
+ * a simulated netconn layer (netconn_sim.c) on top of the simulated broker.
+ *
+ * Checks pipelined publishing, a 500 KB payload streamed through netbufs
+ * that are consumed across several reads, receive timeouts and a lost
+ * connection.  Also reports how many times the client task blocks per
+ * message: the socket transport does a select() and a recv() for every read
+ * the client makes, the netconn transport only waits in netconn_recv() when
+ * nothing is left over from the last segment.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <paho_mqtt_c/MQTTClient.h>
+#include <paho_mqtt_c/MQTTNetconn.h>
+
+#include "netconn_sim.h"
+
+#define TIMEOUT_MS 1000
+#define BUF_SIZE   128
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+static mqtt_netconn_t network;
+static mqtt_client_t client = mqtt_client_default;
+static unsigned char buf[BUF_SIZE], readbuf[BUF_SIZE];
+
+/* Reads the client makes, each one a select() and a recv() on a socket */
+static uint32_t client_reads;
+
+static int counting_read(mqtt_network_t *n, unsigned char *buffer, int len, int timeout_ms)
+{
+    client_reads++;
+    return mqtt_netconn_read(n, buffer, len, timeout_ms);
+}
+
+static int completions, failures;
+
+static void publish_done(mqtt_client_t *c, unsigned short id, int rc, void *arg)
+{
+    completions++;
+    if (rc != MQTT_SUCCESS) {
+        failures++;
+    }
+}
+
+static bool setup_client(const fake_broker_config_t *config, unsigned char *rbuf, int rbuf_len,
+        int keepalive)
+{
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+
+    netconn_sim_init(config);
+    mqtt_netconn_new(&network);
+    network.network.mqttread = counting_read;
+    CHECK(mqtt_netconn_connect(&network, "broker", 1883) == 0, "netconn connect failed");
+    // Free the in-flight table of the last test before starting afresh
+    mqtt_set_inflight_window(&client, 1);
+    mqtt_client_new(&client, &network.network, TIMEOUT_MS, buf, BUF_SIZE, rbuf, rbuf_len);
+    completions = failures = 0;
+
+    data.clientID.cstring = "test";
+    data.keepAliveInterval = keepalive;
+    CHECK(mqtt_connect(&client, &data) == MQTT_SUCCESS, "connect failed");
+    client_reads = 0;
+    netconn_sim_stats.recvs = netconn_sim_stats.timeouts = 0;
+    return true;
+}
+
+static bool teardown(void)
+{
+    mqtt_netconn_disconnect(&network);
+    CHECK(network.conn == NULL && network.rx == NULL, "connection not released");
+    CHECK(netconn_sim_stats.netbufs == 0, "%u netbufs leaked", netconn_sim_stats.netbufs);
+    return true;
+}
+
+static int publish(enum mqtt_qos qos)
+{
+    mqtt_message_t message = {
+        .qos = qos,
+        .payload = "payload",
+        .payloadlen = 7,
+    };
+    return mqtt_publish_async(&client, "test/topic", &message, publish_done, NULL);
+}
+
+static bool publish_window(enum mqtt_qos qos, unsigned int window, int count)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .jitter_us = 10000};
+
+    if (!setup_client(&config, readbuf, BUF_SIZE, 10)) {
+        return false;
+    }
+    CHECK(mqtt_set_inflight_window(&client, window) == MQTT_SUCCESS, "bad window");
+    for (int i = 0; i < count; i++) {
+        CHECK(publish(qos) == MQTT_SUCCESS, "publish %d", i);
+    }
+    CHECK(mqtt_flush(&client, TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    CHECK(completions == count && failures == 0, "%d of %d publishes completed, %d failed",
+            completions, count, failures);
+    CHECK(fake_broker_stats.dups == 0, "%u retransmissions", fake_broker_stats.dups);
+    printf("  qos%d window %2u: %5.2f select()+recv()/msg on sockets, %5.2f netconn_recv()/msg\n",
+            qos, window, (double)client_reads / count, (double)netconn_sim_stats.recvs / count);
+    CHECK(netconn_sim_stats.recvs < client_reads, "netconn waits more often than reads");
+    return teardown();
+}
+
+static bool test_publish(void)
+{
+    static const unsigned int windows[] = {1, 4, 16};
+
+    for (int i = 0; i < ARRAY_SIZE(windows); i++) {
+        if (!publish_window(MQTT_QOS1, windows[i], 200) ||
+                !publish_window(MQTT_QOS2, windows[i], 200)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#define STREAM_BUF_SIZE 4096
+#define STREAM_LEN      (500 * 1024)
+
+static unsigned char stream_readbuf[STREAM_BUF_SIZE];
+static uint8_t *stream_payload;
+static size_t stream_received;
+static bool stream_error, stream_complete;
+
+static void stream_handler(mqtt_message_data_t *md)
+{
+    mqtt_message_t *m = md->message;
+
+    if (m->offset != stream_received || m->totallen != STREAM_LEN ||
+            memcmp(m->payload, stream_payload + m->offset, m->payloadlen)) {
+        stream_error = true;
+    }
+    stream_received += m->payloadlen;
+    if (m->offset + m->payloadlen == m->totallen) {
+        stream_complete = true;
+    }
+}
+
+static bool test_stream(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .link_kbps = 1000};
+
+    if (!stream_payload) {
+        stream_payload = malloc(STREAM_LEN);
+        for (int i = 0; i < STREAM_LEN; i++) {
+            stream_payload[i] = rand();
+        }
+    }
+    stream_received = 0;
+    stream_error = stream_complete = false;
+
+    if (!setup_client(&config, stream_readbuf, STREAM_BUF_SIZE, 10)) {
+        return false;
+    }
+    mqtt_set_streaming(&client, true);
+    CHECK(mqtt_subscribe(&client, "ota/#", MQTT_QOS1, stream_handler) == MQTT_SUCCESS,
+            "subscribe failed");
+
+    client_reads = 0;
+    netconn_sim_stats.recvs = 0;
+    netconn_sim_stats.bytes_copied = 0;
+    fake_broker_publish("ota/image", stream_payload, STREAM_LEN, 1);
+    for (int i = 0; i < 100 && !stream_complete; i++) {
+        CHECK(mqtt_yield(&client, 100) == MQTT_SUCCESS, "yield failed");
+    }
+    CHECK(!stream_error, "payload corrupted");
+    CHECK(stream_complete && stream_received == STREAM_LEN,
+            "%zu of %d bytes received", stream_received, STREAM_LEN);
+    // Every byte is copied once, from the netbuf into the readbuf
+    CHECK(netconn_sim_stats.bytes_copied < STREAM_LEN + 64, "%u bytes copied",
+            netconn_sim_stats.bytes_copied);
+    printf("  500 KB stream: %u client reads, %u netconn waits\n",
+            client_reads, netconn_sim_stats.recvs);
+    mqtt_yield(&client, 100);
+    CHECK(fake_broker_stats.pubacks == 1, "%u PUBACKs", fake_broker_stats.pubacks);
+    return teardown();
+}
+
+static bool test_idle(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000};
+    uint64_t start;
+
+    if (!setup_client(&config, readbuf, BUF_SIZE, 10)) {
+        return false;
+    }
+    // Nothing arrives, every wait ends in the receive timeout
+    start = fake_broker_now_us();
+    CHECK(mqtt_yield(&client, 500) == MQTT_SUCCESS, "yield failed");
+    CHECK(fake_broker_now_us() - start >= 500000, "returned after %u us",
+            (unsigned)(fake_broker_now_us() - start));
+    CHECK(netconn_sim_stats.timeouts > 0 && netconn_sim_stats.timeouts == netconn_sim_stats.recvs,
+            "%u timeouts in %u waits", netconn_sim_stats.timeouts, netconn_sim_stats.recvs);
+    // A yield with no time left must not wait forever either
+    CHECK(mqtt_yield(&client, 0) == MQTT_SUCCESS, "yield failed");
+    CHECK(client.isconnected, "disconnected");
+    return teardown();
+}
+
+static bool test_connection_lost(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000};
+    int rc = MQTT_SUCCESS;
+
+    if (!setup_client(&config, readbuf, BUF_SIZE, 1)) {
+        return false;
+    }
+    CHECK(mqtt_set_inflight_window(&client, 4) == MQTT_SUCCESS, "bad window");
+    for (int i = 0; i < 4; i++) {
+        CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish %d", i);
+    }
+    fake_broker_disconnect();
+    for (int i = 0; i < 10 && rc == MQTT_SUCCESS; i++) {
+        rc = mqtt_yield(&client, 500);
+    }
+    CHECK(rc == MQTT_DISCONNECTED, "lost connection not noticed");
+    CHECK(completions == 4 && failures == 4, "%d completions, %d failed", completions, failures);
+    return teardown();
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(void);
+} tests[] = {
+    {"publish", test_publish},
+    {"stream", test_stream},
+    {"idle", test_idle},
+    {"connection_lost", test_connection_lost},
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        bool ok = tests[i].fn();
+        printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
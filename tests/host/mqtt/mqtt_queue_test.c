@@ -0,0 +1,351 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for the MQTT offline publish queue (MQTTQueue.c) against the
+ * simulated broker and the simulated flash from host/sysparam.
+ *
+ * Checks that queued messages survive a reboot and are delivered in order
+ * once connected, that messages in flight when the connection drops are
+ * delivered after the next connect, that the oldest messages are dropped
+ * when the flash region is full, and that power cuts while appending never
+ * lose messages that were queued before.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <paho_mqtt_c/MQTTClient.h>
+#include <paho_mqtt_c/MQTTQueue.h>
+#include <spiflash.h>
+
+#include "fake_broker.h"
+#include "flash_sim.h"
+
+#define FLASH_SIZE  0x20000
+#define QUEUE_ADDR  0x10000
+#define QUEUE_SIZE  (4 * SPI_FLASH_SECTOR_SIZE)
+#define TIMEOUT_MS  1000
+#define BUF_SIZE    128
+#define MAX_SEQ     10000
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+static mqtt_network_t network;
+static mqtt_client_t client = mqtt_client_default;
+static unsigned char buf[BUF_SIZE], readbuf[BUF_SIZE];
+static mqtt_queue_t queue;
+
+/* How many times each message reached the broker, and in which order */
+static int received[MAX_SEQ];
+static int order[MAX_SEQ];
+static int num_received;
+
+static void on_publish(const char *topic, int topic_len, const uint8_t *payload,
+        int payload_len, bool dup)
+{
+    char text[32];
+    int seq;
+
+    if (payload_len >= sizeof(text)) {
+        return;
+    }
+    memcpy(text, payload, payload_len);
+    text[payload_len] = '\0';
+    if (sscanf(text, "msg %d", &seq) == 1 && seq >= 0 && seq < MAX_SEQ) {
+        received[seq]++;
+        if (num_received < MAX_SEQ) {
+            order[num_received++] = seq;
+        }
+    }
+}
+
+static bool reset(void)
+{
+    flash_sim_erase_all();
+    memset(received, 0, sizeof(received));
+    num_received = 0;
+    CHECK(mqtt_queue_init(&queue, QUEUE_ADDR, QUEUE_SIZE) == MQTT_SUCCESS, "init");
+    return true;
+}
+
+static bool connect(const fake_broker_config_t *config, unsigned int window)
+{
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+
+    fake_broker_init(&network, config);
+    // Free the in-flight table of the last test before starting afresh
+    mqtt_set_inflight_window(&client, 1);
+    mqtt_client_new(&client, &network, TIMEOUT_MS, buf, BUF_SIZE, readbuf, BUF_SIZE);
+    data.clientID.cstring = "test";
+    data.keepAliveInterval = 10;
+    CHECK(mqtt_connect(&client, &data) == MQTT_SUCCESS, "connect");
+    CHECK(mqtt_set_inflight_window(&client, window) == MQTT_SUCCESS, "window");
+    return true;
+}
+
+static int push(int seq, enum mqtt_qos qos)
+{
+    char payload[32];
+    mqtt_message_t message = {
+        .qos = qos,
+        .payload = payload,
+        .payloadlen = sprintf(payload, "msg %d", seq),
+    };
+
+    return mqtt_queue_push(&queue, "test/queue", &message);
+}
+
+/* Drain until the queue is empty or the client gives up */
+static int drain(void)
+{
+    mqtt_queue_stats_t stats;
+    int rc = MQTT_SUCCESS;
+
+    for (int i = 0; i < 10000; i++) {
+        mqtt_queue_get_stats(&queue, &stats);
+        if (!stats.count) {
+            break;
+        }
+        if ((rc = mqtt_queue_drain(&queue, &client, 8)) < 0) {
+            break;
+        }
+        if ((rc = mqtt_yield(&client, 10)) != MQTT_SUCCESS) {
+            break;
+        }
+    }
+    return rc < 0 ? rc : MQTT_SUCCESS;
+}
+
+static bool test_reboot(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .on_publish = on_publish};
+    mqtt_queue_stats_t stats;
+    int count = 300;
+    uint32_t bytes = 0;
+    char payload[32];
+
+    if (!reset()) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        CHECK(push(i, i % 3) == MQTT_SUCCESS, "push %d", i);
+        bytes += strlen("test/queue") + sprintf(payload, "msg %d", i);
+    }
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count == count, "%u queued", stats.count);
+
+    // Reboot, then connect
+    CHECK(mqtt_queue_init(&queue, QUEUE_ADDR, QUEUE_SIZE) == MQTT_SUCCESS, "reinit");
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count == count, "%u queued after reboot", stats.count);
+    CHECK(stats.bytes == bytes, "%u bytes instead of %u", stats.bytes, bytes);
+
+    if (!connect(&config, 1)) {
+        return false;
+    }
+    CHECK(drain() == MQTT_SUCCESS, "drain");
+    CHECK(mqtt_flush(&client, TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count == 0 && stats.bytes == 0, "%u left", stats.count);
+    CHECK(num_received == count, "%d received", num_received);
+    for (int i = 0; i < count; i++) {
+        CHECK(order[i] == i, "message %d received as %d", order[i], i);
+    }
+
+    // Nothing comes back after another reboot
+    CHECK(mqtt_queue_init(&queue, QUEUE_ADDR, QUEUE_SIZE) == MQTT_SUCCESS, "reinit");
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count == 0, "%u queued after delivery and reboot", stats.count);
+    return true;
+}
+
+static bool test_window(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .jitter_us = 20000, .on_publish = on_publish};
+    mqtt_queue_stats_t stats;
+    uint64_t start;
+    int count = 200;
+
+    if (!reset() || !connect(&config, 8)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        CHECK(push(i, MQTT_QOS1) == MQTT_SUCCESS, "push %d", i);
+    }
+    start = fake_broker_now_us();
+    CHECK(drain() == MQTT_SUCCESS, "drain");
+    CHECK(mqtt_flush(&client, TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    // Eight at a time, so well below the one round trip per message
+    CHECK(fake_broker_now_us() - start < count * 20000 / 4, "took %u ms",
+            (unsigned)((fake_broker_now_us() - start) / 1000));
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count == 0, "%u left", stats.count);
+    for (int i = 0; i < count; i++) {
+        CHECK(received[i] == 1, "message %d received %d times", i, received[i]);
+    }
+    return true;
+}
+
+static bool test_connection_lost(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .on_publish = on_publish};
+    mqtt_queue_stats_t stats;
+    int count = 100;
+
+    if (!reset() || !connect(&config, 8)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        CHECK(push(i, MQTT_QOS1) == MQTT_SUCCESS, "push %d", i);
+    }
+    // Some messages are in flight when the connection goes
+    CHECK(mqtt_queue_drain(&queue, &client, 30) == 30, "drain");
+    fake_broker_disconnect();
+    mqtt_disconnect(&client);
+    CHECK(mqtt_queue_drain(&queue, &client, 30) == MQTT_DISCONNECTED, "drain while disconnected");
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count > count - 30, "%u queued", stats.count);
+
+    if (!connect(&config, 8)) {
+        return false;
+    }
+    CHECK(drain() == MQTT_SUCCESS, "drain");
+    CHECK(mqtt_flush(&client, TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count == 0, "%u left", stats.count);
+    for (int i = 0; i < count; i++) {
+        CHECK(received[i] >= 1, "message %d lost", i);
+    }
+    return true;
+}
+
+static bool test_full(void)
+{
+    mqtt_queue_stats_t stats;
+    int pushed = 0;
+
+    if (!reset()) {
+        return false;
+    }
+    // Fill until the first drop
+    do {
+        CHECK(push(pushed++, MQTT_QOS1) == MQTT_SUCCESS, "push %d", pushed);
+        mqtt_queue_get_stats(&queue, &stats);
+    } while (!stats.dropped);
+    CHECK(stats.count + stats.dropped == pushed, "%u queued, %u dropped of %d",
+            stats.count, stats.dropped, pushed);
+    CHECK(stats.count >= 2 * (SPI_FLASH_SECTOR_SIZE - 8) / 20, "only %u fit", stats.count);
+
+    for (int i = 0; i < 1000; i++) {
+        CHECK(push(pushed++, MQTT_QOS1) == MQTT_SUCCESS, "push %d", pushed);
+    }
+    mqtt_queue_get_stats(&queue, &stats);
+    CHECK(stats.count + stats.dropped == pushed, "%u queued, %u dropped of %d",
+            stats.count, stats.dropped, pushed);
+
+    // The newest ones are kept, and survive a reboot
+    CHECK(mqtt_queue_init(&queue, QUEUE_ADDR, QUEUE_SIZE) == MQTT_SUCCESS, "reinit");
+    mqtt_queue_get_stats(&queue, &stats);
+    fake_broker_config_t config = {.on_publish = on_publish};
+    if (!connect(&config, 16)) {
+        return false;
+    }
+    CHECK(drain() == MQTT_SUCCESS, "drain");
+    CHECK(num_received == stats.count, "%d of %u received", num_received, stats.count);
+    CHECK(order[num_received - 1] == pushed - 1, "newest message missing");
+    for (int i = 1; i < num_received; i++) {
+        CHECK(order[i] == order[i - 1] + 1, "gap after %d", order[i - 1]);
+    }
+    return true;
+}
+
+static bool test_power_cut(void)
+{
+    mqtt_queue_stats_t stats;
+    uint32_t queued = 0;
+
+    if (!reset()) {
+        return false;
+    }
+    // Keep appending in children that lose power part way, check what is left
+    for (int run = 0; run < 200; run++) {
+        pid_t pid;
+        int wstatus;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            flash_sim_cut_after(rand() % 40);
+            for (int i = 0; i < 1000; i++) {
+                push(queued + i, MQTT_QOS1);
+            }
+            _exit(0);
+        }
+        CHECK(pid > 0 && waitpid(pid, &wstatus, 0) == pid && WIFEXITED(wstatus), "child");
+
+        CHECK(mqtt_queue_init(&queue, QUEUE_ADDR, QUEUE_SIZE) == MQTT_SUCCESS, "init after cut");
+        mqtt_queue_get_stats(&queue, &stats);
+        CHECK(stats.count >= queued, "%u queued, %u before the cut", stats.count, queued);
+        queued = stats.count;
+        if (stats.free < SPI_FLASH_SECTOR_SIZE) {
+            // Start over rather than test dropping again
+            if (!reset()) {
+                return false;
+            }
+            queued = 0;
+        }
+    }
+
+    // Whatever is queued can be delivered
+    fake_broker_config_t config = {.on_publish = on_publish};
+    mqtt_queue_get_stats(&queue, &stats);
+    if (!connect(&config, 16)) {
+        return false;
+    }
+    CHECK(drain() == MQTT_SUCCESS, "drain");
+    CHECK(num_received == stats.count, "%d of %u received", num_received, stats.count);
+    return true;
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(void);
+} tests[] = {
+    {"reboot", test_reboot},
+    {"window", test_window},
+    {"connection_lost", test_connection_lost},
+    {"full", test_full},
+    {"power_cut", test_power_cut},
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    if (!flash_sim_init(NULL, FLASH_SIZE)) {
+        printf("flash_sim_init failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        bool ok = tests[i].fn();
+        printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
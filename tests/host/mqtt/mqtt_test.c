@@ -0,0 +1,441 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for the paho MQTT client against the simulated broker.
+ *
+ * Checks that pipelined publishes complete exactly once each when acks
+ * arrive out of order, that lost acks are recovered by retransmitting with
+ * DUP set, that QoS2 publishes go through PUBREC/PUBREL/PUBCOMP, and that
+ * publishes fail cleanly when the broker stops answering or the connection
+ * drops, and that the in-flight table follows the window.  Also receives a 500 KB payload through a 4 KB readbuf in
+ * streaming mode.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <paho_mqtt_c/MQTTClient.h>
+
+#include "fake_broker.h"
+
+#define TIMEOUT_MS 1000
+#define BUF_SIZE   128
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+static mqtt_network_t network;
+static mqtt_client_t client = mqtt_client_default;
+static unsigned char buf[BUF_SIZE], readbuf[BUF_SIZE];
+
+/* Completion results by packet id */
+static int results[65536];
+static int completions;
+
+static void publish_done(mqtt_client_t *c, unsigned short id, int rc, void *arg)
+{
+    if (results[id] != 1) {
+        results[id] = 2;    // completed twice, or never published
+    } else {
+        results[id] = rc == MQTT_SUCCESS ? 0 : rc;
+    }
+    completions++;
+}
+
+static bool setup_keepalive(const fake_broker_config_t *config, unsigned int window,
+        int keepalive)
+{
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+
+    fake_broker_init(&network, config);
+    // Free the in-flight table of the last test before starting afresh
+    mqtt_set_inflight_window(&client, 1);
+    mqtt_client_new(&client, &network, TIMEOUT_MS, buf, BUF_SIZE, readbuf, BUF_SIZE);
+    memset(results, 0, sizeof(results));
+    completions = 0;
+
+    data.clientID.cstring = "test";
+    data.keepAliveInterval = keepalive;
+    CHECK(mqtt_connect(&client, &data) == MQTT_SUCCESS, "connect failed");
+    CHECK(mqtt_set_inflight_window(&client, window) == MQTT_SUCCESS, "bad window");
+    return true;
+}
+
+static bool setup(const fake_broker_config_t *config, unsigned int window)
+{
+    return setup_keepalive(config, window, 10);
+}
+
+static int publish(enum mqtt_qos qos)
+{
+    mqtt_message_t message = {
+        .qos = qos,
+        .payload = "payload",
+        .payloadlen = 7,
+    };
+    int rc = mqtt_publish_async(&client, "test/topic", &message, publish_done, NULL);
+
+    if (rc == MQTT_SUCCESS && results[message.id] == 0) {
+        results[message.id] = 1;
+    }
+    return rc;
+}
+
+/* Every publish completed once with the expected result */
+static bool check_results(int count, int expected)
+{
+    int i, n = 0;
+
+    for (i = 1; i < ARRAY_SIZE(results); i++) {
+        if (results[i] == 0 && expected != 0) {
+            continue;
+        }
+        CHECK(results[i] != 1, "id %d never completed", i);
+        CHECK(results[i] != 2, "id %d completed twice", i);
+        CHECK(results[i] == expected, "id %d: %d instead of %d", i, results[i], expected);
+        n++;
+    }
+    CHECK(completions == count, "%d completions for %d publishes", completions, count);
+    return true;
+}
+
+static bool test_blocking(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000};
+    mqtt_message_t message = {
+        .qos = MQTT_QOS1,
+        .payload = "x",
+        .payloadlen = 1,
+    };
+
+    if (!setup(&config, 1)) {
+        return false;
+    }
+    for (int i = 0; i < 10; i++) {
+        CHECK(mqtt_publish(&client, "test/topic", &message) == MQTT_SUCCESS, "publish %d", i);
+    }
+    message.qos = MQTT_QOS2;
+    CHECK(mqtt_publish(&client, "test/topic", &message) == MQTT_SUCCESS, "qos2 publish");
+    CHECK(fake_broker_stats.pubrels == 1, "%u PUBRELs", fake_broker_stats.pubrels);
+    CHECK(client.inflight_count == 0, "%u left in flight", client.inflight_count);
+    return true;
+}
+
+static bool test_out_of_order(enum mqtt_qos qos)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .jitter_us = 30000};
+    int count = 500;
+
+    if (!setup(&config, 8)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        CHECK(publish(qos) == MQTT_SUCCESS, "publish %d", i);
+        CHECK(client.inflight_count <= 8, "window exceeded");
+    }
+    CHECK(mqtt_flush(&client, TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    CHECK(fake_broker_stats.dups == 0, "%u needless retransmissions", fake_broker_stats.dups);
+    if (qos == MQTT_QOS2) {
+        CHECK(fake_broker_stats.pubrels == count, "%u PUBRELs", fake_broker_stats.pubrels);
+    }
+    return check_results(count, 0);
+}
+
+static bool test_qos1_out_of_order(void)
+{
+    return test_out_of_order(MQTT_QOS1);
+}
+
+static bool test_qos2_out_of_order(void)
+{
+    return test_out_of_order(MQTT_QOS2);
+}
+
+static bool test_lost_acks(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .drop_every = 3};
+    int count = 60;
+
+    if (!setup(&config, 4)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish %d", i);
+    }
+    CHECK(mqtt_flush(&client, 10 * TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    CHECK(fake_broker_stats.acks_dropped > 0, "no acks dropped");
+    CHECK(fake_broker_stats.dups == fake_broker_stats.acks_dropped,
+            "%u DUPs for %u lost acks", fake_broker_stats.dups, fake_broker_stats.acks_dropped);
+    return check_results(count, 0);
+}
+
+static bool test_no_answer(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .silent = true};
+    uint64_t start;
+
+    if (!setup(&config, 4)) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish %d", i);
+    }
+    // The window is full, so this waits for the others to give up
+    start = fake_broker_now_us();
+    CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish into full window");
+    CHECK(fake_broker_now_us() - start >= MQTT_MAX_RETRIES * TIMEOUT_MS * 1000,
+            "gave up after %u us", (unsigned)(fake_broker_now_us() - start));
+
+    CHECK(mqtt_flush(&client, (MQTT_MAX_RETRIES + 2) * TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    CHECK(fake_broker_stats.dups == 5 * MQTT_MAX_RETRIES, "%u DUPs", fake_broker_stats.dups);
+    return check_results(5, MQTT_FAILURE);
+}
+
+static bool test_disconnect(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000};
+
+    if (!setup(&config, 4)) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish %d", i);
+    }
+    CHECK(mqtt_disconnect(&client) == MQTT_SUCCESS, "disconnect");
+    CHECK(client.inflight_count == 0, "%u left in flight", client.inflight_count);
+    return check_results(4, MQTT_DISCONNECTED);
+}
+
+static bool test_connection_lost(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000};
+    int rc = MQTT_SUCCESS;
+
+    // Pings run out before the publishes run out of retries
+    if (!setup_keepalive(&config, 4, 1)) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish %d", i);
+    }
+    fake_broker_disconnect();
+    for (int i = 0; i < 10 && rc == MQTT_SUCCESS; i++) {
+        rc = mqtt_yield(&client, 500);
+    }
+    CHECK(rc == MQTT_DISCONNECTED, "lost connection not noticed");
+    CHECK(client.inflight_count == 0, "%u left in flight", client.inflight_count);
+    return check_results(4, MQTT_DISCONNECTED);
+}
+
+#define STREAM_BUF_SIZE 4096
+#define STREAM_LEN      (500 * 1024)
+
+static unsigned char stream_readbuf[STREAM_BUF_SIZE];
+static uint8_t *stream_payload;
+
+/* What the handler has seen of the messages sent to it */
+static struct {
+    size_t received;        // bytes of the current message
+    size_t totallen;
+    unsigned chunks;
+    unsigned complete;
+    size_t max_chunk;
+    size_t disconnect_at;   // drop the connection once this much has arrived
+    bool error;
+} stream;
+
+static void stream_handler(mqtt_message_data_t *md)
+{
+    mqtt_message_t *m = md->message;
+
+    if (m->offset == 0) {
+        stream.received = 0;
+        stream.totallen = m->totallen;
+    }
+    if (m->offset != stream.received || m->totallen != stream.totallen ||
+            m->offset + m->payloadlen > m->totallen ||
+            md->topic->lenstring.len != 9 || memcmp(md->topic->lenstring.data, "ota/image", 9) ||
+            (m->totallen == STREAM_LEN && memcmp(m->payload, stream_payload + m->offset, m->payloadlen))) {
+        stream.error = true;
+    }
+    stream.received += m->payloadlen;
+    stream.chunks++;
+    if (m->payloadlen > stream.max_chunk) {
+        stream.max_chunk = m->payloadlen;
+    }
+    if (m->offset + m->payloadlen == m->totallen) {
+        stream.complete++;
+    }
+    if (stream.disconnect_at && stream.received >= stream.disconnect_at) {
+        fake_broker_disconnect();
+    }
+}
+
+static bool setup_stream(bool streaming)
+{
+    fake_broker_config_t config = {.rtt_us = 20000, .link_kbps = 1000};
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+
+    if (!stream_payload) {
+        stream_payload = malloc(STREAM_LEN);
+        for (int i = 0; i < STREAM_LEN; i++) {
+            stream_payload[i] = rand();
+        }
+    }
+    memset(&stream, 0, sizeof(stream));
+
+    fake_broker_init(&network, &config);
+    mqtt_set_inflight_window(&client, 1);
+    mqtt_client_new(&client, &network, TIMEOUT_MS, buf, BUF_SIZE,
+            stream_readbuf, STREAM_BUF_SIZE);
+    mqtt_set_streaming(&client, streaming);
+    data.clientID.cstring = "test";
+    CHECK(mqtt_connect(&client, &data) == MQTT_SUCCESS, "connect failed");
+    CHECK(mqtt_subscribe(&client, "ota/#", MQTT_QOS1, stream_handler) == MQTT_SUCCESS,
+            "subscribe failed");
+    return true;
+}
+
+static bool test_stream(void)
+{
+    if (!setup_stream(true)) {
+        return false;
+    }
+
+    fake_broker_publish("ota/image", stream_payload, STREAM_LEN, 1);
+    for (int i = 0; i < 100 && !stream.complete; i++) {
+        CHECK(mqtt_yield(&client, 100) == MQTT_SUCCESS, "yield failed");
+    }
+    CHECK(!stream.error, "payload corrupted");
+    CHECK(stream.complete == 1 && stream.received == STREAM_LEN,
+            "%zu of %d bytes received", stream.received, STREAM_LEN);
+    CHECK(stream.chunks > STREAM_LEN / STREAM_BUF_SIZE, "only %u chunks", stream.chunks);
+    CHECK(stream.max_chunk < STREAM_BUF_SIZE, "%zu byte chunk", stream.max_chunk);
+    mqtt_yield(&client, 100);
+    CHECK(fake_broker_stats.pubacks == 1, "%u PUBACKs", fake_broker_stats.pubacks);
+
+    // Messages that fit are delivered whole, as before
+    unsigned chunks = stream.chunks;
+    fake_broker_publish("ota/image", (const uint8_t *)"small", 5, 0);
+    mqtt_yield(&client, 100);
+    CHECK(!stream.error && stream.complete == 2, "small message not delivered");
+    CHECK(stream.chunks == chunks + 1 && stream.received == 5, "small message split");
+    CHECK(client.isconnected, "disconnected");
+    return true;
+}
+
+static bool test_stream_lost(void)
+{
+    if (!setup_stream(true)) {
+        return false;
+    }
+
+    stream.disconnect_at = STREAM_LEN / 4;
+    fake_broker_publish("ota/image", stream_payload, STREAM_LEN, 1);
+    int rc = MQTT_SUCCESS;
+    for (int i = 0; i < 100 && rc == MQTT_SUCCESS; i++) {
+        rc = mqtt_yield(&client, 100);
+    }
+    CHECK(rc == MQTT_DISCONNECTED, "yield returned %d", rc);
+    CHECK(!stream.error && !stream.complete, "incomplete message completed");
+    CHECK(stream.received >= STREAM_LEN / 4 && stream.received < STREAM_LEN,
+            "%zu bytes received", stream.received);
+    CHECK(fake_broker_stats.pubacks == 0, "incomplete message acknowledged");
+    CHECK(!client.isconnected, "still connected");
+    return true;
+}
+
+static bool test_no_streaming(void)
+{
+    if (!setup_stream(false)) {
+        return false;
+    }
+
+    fake_broker_publish("ota/image", stream_payload, STREAM_BUF_SIZE, 1);
+    CHECK(mqtt_yield(&client, 1000) == MQTT_DISCONNECTED, "oversized message accepted");
+    CHECK(stream.chunks == 0, "handler called");
+    return true;
+}
+
+static bool test_window_resize(void)
+{
+    fake_broker_config_t config = {.rtt_us = 20000};
+    int count = 0;
+
+    if (!setup(&config, 1)) {
+        return false;
+    }
+    CHECK(client.inflight == &client.inflight_slot, "window of 1 not built in");
+    CHECK(mqtt_set_inflight_window(&client, 0) == MQTT_FAILURE, "window 0");
+    CHECK(mqtt_set_inflight_window(&client, MQTT_MAX_INFLIGHT + 1) == MQTT_FAILURE, "window too big");
+
+    CHECK(mqtt_set_inflight_window(&client, 4) == MQTT_SUCCESS, "window 4");
+    CHECK(client.inflight != &client.inflight_slot, "no table for window 4");
+    for (; count < 3; count++) {
+        CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish %d", count);
+    }
+    CHECK(client.inflight_count == 3, "%u in flight", client.inflight_count);
+
+    // Not below what is in flight, but it can grow and shrink around it
+    CHECK(mqtt_set_inflight_window(&client, 2) == MQTT_FAILURE, "shrunk below in flight");
+    CHECK(mqtt_set_inflight_window(&client, 16) == MQTT_SUCCESS, "window 16");
+    CHECK(mqtt_set_inflight_window(&client, 3) == MQTT_SUCCESS, "window 3");
+    CHECK(client.inflight_count == 3, "%u in flight after resizing", client.inflight_count);
+    for (; count < 50; count++) {
+        CHECK(publish(MQTT_QOS2) == MQTT_SUCCESS, "publish %d", count);
+    }
+    CHECK(mqtt_flush(&client, TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    if (!check_results(count, 0)) {
+        return false;
+    }
+
+    // Back to the slot in the client, with one moved over to it
+    CHECK(publish(MQTT_QOS1) == MQTT_SUCCESS, "publish");
+    count++;
+    CHECK(mqtt_set_inflight_window(&client, 1) == MQTT_SUCCESS, "window 1");
+    CHECK(client.inflight == &client.inflight_slot && client.inflight_slot.id,
+            "publish not moved to the built-in slot");
+    CHECK(mqtt_flush(&client, TIMEOUT_MS) == MQTT_SUCCESS, "flush");
+    return check_results(count, 0);
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(void);
+} tests[] = {
+    {"blocking", test_blocking},
+    {"qos1_out_of_order", test_qos1_out_of_order},
+    {"qos2_out_of_order", test_qos2_out_of_order},
+    {"lost_acks", test_lost_acks},
+    {"no_answer", test_no_answer},
+    {"disconnect", test_disconnect},
+    {"connection_lost", test_connection_lost},
+    {"stream", test_stream},
+    {"stream_lost", test_stream_lost},
+    {"no_streaming", test_no_streaming},
+    {"window_resize", test_window_resize},
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        bool ok = tests[i].fn();
+        printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Dispatch cost of the subscription trie against the linear scan it
+ * replaced.
+ *
+ * 100 filters of the kind a gateway subscribes to (one set per device plus
+ * a few wildcard catch-alls) are matched against a mix of topics.  The
+ * linear scan is the old deliver_message loop: every filter is compared
+ * with every incoming topic.  Times are host nanoseconds per dispatch, so
+ * only the ratio between the two is meaningful for the ESP8266.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <paho_mqtt_c/MQTTClient.h>
+
+#define NUM_FILTERS 100
+#define NUM_NODES   512
+#define ROUNDS      200000
+
+static char filters[NUM_FILTERS][32];
+static char topics[64][32];
+static int num_topics;
+
+static mqtt_topic_node_t nodes[NUM_NODES];
+static mqtt_topic_trie_t trie;
+
+static volatile int delivered;
+
+/* The old matcher from MQTTClient.c */
+static char is_topic_matched(char* topicFilter, mqtt_string_t* topicName)
+{
+    char* curf = topicFilter;
+    char* curn = topicName->lenstring.data;
+    char* curn_end = curn + topicName->lenstring.len;
+
+    while (*curf && curn < curn_end)
+    {
+        if (*curn == '/' && *curf != '/')
+            break;
+        if (*curf != '+' && *curf != '#' && *curf != *curn)
+            break;
+        if (*curf == '+')
+        {   // skip until we meet the next separator, or end of string
+            char* nextpos = curn + 1;
+            while (nextpos < curn_end && *nextpos != '/')
+                nextpos = ++curn + 1;
+        }
+        else if (*curf == '#')
+            curn = curn_end - 1;    // skip until end of string
+        curf++;
+        curn++;
+    };
+
+    return (curn == curn_end) && (*curf == '\0');
+}
+
+static int linear_dispatch(mqtt_string_t *topic)
+{
+    int n = 0;
+
+    for (int i = 0; i < NUM_FILTERS; i++) {
+        if (mqtt_packet_equals(topic, filters[i]) || is_topic_matched(filters[i], topic)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void count_match(mqtt_message_handler_t handler, void *arg)
+{
+    delivered++;
+}
+
+static void handler(mqtt_message_data_t *md)
+{
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void setup(void)
+{
+    int n = 0;
+
+    // 24 devices with four filters each, and four catch-alls
+    for (int dev = 0; dev < 24; dev++) {
+        sprintf(filters[n++], "site/dev%02d/cmd/+", dev);
+        sprintf(filters[n++], "site/dev%02d/config", dev);
+        sprintf(filters[n++], "site/dev%02d/ota/#", dev);
+        sprintf(filters[n++], "site/dev%02d/+/ping", dev);
+    }
+    strcpy(filters[n++], "site/+/alarm");
+    strcpy(filters[n++], "site/broadcast/#");
+    strcpy(filters[n++], "$SYS/broker/uptime");
+    strcpy(filters[n++], "time/utc");
+
+    for (int dev = 0; dev < 24; dev += 3) {
+        sprintf(topics[num_topics++], "site/dev%02d/cmd/relay", dev);
+        sprintf(topics[num_topics++], "site/dev%02d/config", dev);
+        sprintf(topics[num_topics++], "site/dev%02d/ota/chunk/17", dev);
+        sprintf(topics[num_topics++], "site/dev%02d/alarm", dev);
+    }
+    strcpy(topics[num_topics++], "site/broadcast/reboot");
+    strcpy(topics[num_topics++], "time/utc");
+    strcpy(topics[num_topics++], "site/unknown/telemetry");
+    strcpy(topics[num_topics++], "other/topic");
+
+    mqtt_topic_trie_init(&trie, nodes, NUM_NODES);
+    for (int i = 0; i < NUM_FILTERS; i++) {
+        if (mqtt_topic_trie_insert(&trie, filters[i], handler) != MQTT_SUCCESS) {
+            printf("insert '%s' failed\n", filters[i]);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    mqtt_string_t names[64];
+    double start, linear, trie_ns;
+    int expected = 0, got = 0;
+
+    setup();
+    for (int i = 0; i < num_topics; i++) {
+        names[i].cstring = NULL;
+        names[i].lenstring.data = topics[i];
+        names[i].lenstring.len = strlen(topics[i]);
+    }
+
+    // Both have to agree before their speed means anything
+    for (int i = 0; i < num_topics; i++) {
+        int l = linear_dispatch(&names[i]);
+        int t = mqtt_topic_trie_match(&trie, topics[i], names[i].lenstring.len, count_match, NULL);
+        if (l != t) {
+            printf("'%s': linear scan matches %d filters, trie %d\n", topics[i], l, t);
+            return 1;
+        }
+    }
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        mqtt_string_t *name = &names[r % num_topics];
+        expected += linear_dispatch(name);
+    }
+    linear = (now_ns() - start) / ROUNDS;
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        mqtt_string_t *name = &names[r % num_topics];
+        got += mqtt_topic_trie_match(&trie, name->lenstring.data, name->lenstring.len, count_match, NULL);
+    }
+    trie_ns = (now_ns() - start) / ROUNDS;
+
+    if (got != expected) {
+        printf("dispatched %d messages, expected %d\n", got, expected);
+        return 1;
+    }
+
+    printf("%d filters, %d topics\n", NUM_FILTERS, num_topics);
+    printf("nodes used     %u of %u (%u bytes)\n", NUM_NODES - 1 - trie.free_count,
+            NUM_NODES, (unsigned)((NUM_NODES - 1 - trie.free_count) * sizeof(mqtt_topic_node_t)));
+    printf("linear scan    %8.1f ns/dispatch\n", linear);
+    printf("trie           %8.1f ns/dispatch\n", trie_ns);
+    printf("speedup        %8.1fx\n", linear / trie_ns);
+
+    return 0;
+}
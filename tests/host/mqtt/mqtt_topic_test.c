@@ -0,0 +1,345 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for the subscription trie (MQTTTopicTrie.c).
+ *
+ * Random sets of filters with '+' and '#' wildcards are matched against
+ * random topics, and the result is compared with a straightforward level by
+ * level matcher while filters are added and removed.  Also checks that a
+ * full table is left untouched, and that subscribing and unsubscribing
+ * through the client keep the trie in step.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <paho_mqtt_c/MQTTClient.h>
+
+#include "fake_broker.h"
+
+#define MAX_FILTERS 100
+#define MAX_NODES   512
+#define FILTER_LEN  32
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+static const char *filter_levels[] = {"a", "b", "cc", "", "+", "+", "#"};
+static const char *topic_levels[] = {"a", "b", "cc", "", "d"};
+
+static mqtt_topic_node_t nodes[MAX_NODES];
+static mqtt_topic_trie_t trie;
+
+static char filters[MAX_FILTERS][FILTER_LEN];
+static bool subscribed[MAX_FILTERS];
+static int matched[MAX_FILTERS];
+
+/* The trie keeps pointers into the filters it was given. Each one gets its
+ * own copy, wiped when it is removed, so a level left pointing into a
+ * removed filter shows up as a wrong match.
+ */
+static char *copies[MAX_FILTERS];
+
+static const char *copy_filter(int i)
+{
+    copies[i] = strdup(filters[i]);
+    return copies[i];
+}
+
+static void drop_copy(int i)
+{
+    memset(copies[i], '?', strlen(copies[i]));
+    free(copies[i]);
+    copies[i] = NULL;
+}
+
+/* Filters are told apart by their handler, which is only used as a tag */
+#define TAG(i) ((mqtt_message_handler_t)(uintptr_t)((i) + 1))
+
+static void record_match(mqtt_message_handler_t handler, void *arg)
+{
+    matched[(uintptr_t)handler - 1]++;
+}
+
+/* Level by level reference matcher */
+static bool reference_match(const char *filter, const char *topic)
+{
+    for (;;) {
+        const char *f_end = strchr(filter, '/');
+        const char *t_end = strchr(topic, '/');
+        size_t f_len = f_end ? f_end - filter : strlen(filter);
+        size_t t_len = t_end ? t_end - topic : strlen(topic);
+
+        if (f_len == 1 && filter[0] == '#') {
+            return true;
+        }
+        if (!(f_len == 1 && filter[0] == '+') &&
+                (f_len != t_len || memcmp(filter, topic, f_len))) {
+            return false;
+        }
+        if (!t_end) {
+            // "a/#" matches "a" as well
+            return !f_end || strcmp(f_end + 1, "#") == 0;
+        }
+        if (!f_end) {
+            return false;
+        }
+        filter = f_end + 1;
+        topic = t_end + 1;
+    }
+}
+
+static void random_name(char *buf, const char **levels, int num_levels, bool filter)
+{
+    int depth = 1 + rand() % 4;
+
+    buf[0] = '\0';
+    for (int i = 0; i < depth; i++) {
+        const char *level = levels[rand() % num_levels];
+        if (filter && level[0] == '#' && i + 1 < depth) {
+            level = "+";
+        }
+        if (i) {
+            strcat(buf, "/");
+        }
+        strcat(buf, level);
+    }
+}
+
+static bool check_topics(int rounds)
+{
+    char topic[FILTER_LEN];
+
+    for (int r = 0; r < rounds; r++) {
+        int expected = 0, n;
+
+        random_name(topic, topic_levels, ARRAY_SIZE(topic_levels), false);
+        memset(matched, 0, sizeof(matched));
+        n = mqtt_topic_trie_match(&trie, topic, strlen(topic), record_match, NULL);
+        for (int i = 0; i < MAX_FILTERS; i++) {
+            bool m = subscribed[i] && reference_match(filters[i], topic);
+            CHECK(matched[i] == m, "'%s' %s '%s'", filters[i],
+                    m ? "does not match" : "matches", topic);
+            expected += m;
+        }
+        CHECK(n == expected, "%d matches reported for %d", n, expected);
+    }
+    return true;
+}
+
+static bool test_random(void)
+{
+    for (int run = 0; run < 50; run++) {
+        mqtt_topic_trie_init(&trie, nodes, MAX_NODES);
+        memset(subscribed, 0, sizeof(subscribed));
+
+        // Distinct random filters
+        for (int i = 0; i < MAX_FILTERS; i++) {
+            bool dup;
+            do {
+                random_name(filters[i], filter_levels, ARRAY_SIZE(filter_levels), true);
+                dup = false;
+                for (int j = 0; j < i; j++) {
+                    dup |= strcmp(filters[i], filters[j]) == 0;
+                }
+            } while (dup);
+            CHECK(mqtt_topic_trie_insert(&trie, copy_filter(i), TAG(i)) == MQTT_SUCCESS,
+                    "insert '%s'", filters[i]);
+            subscribed[i] = true;
+        }
+        if (!check_topics(200)) {
+            return false;
+        }
+
+        // Remove and add back at random
+        for (int i = 0; i < 200; i++) {
+            int f = rand() % MAX_FILTERS;
+            if (subscribed[f]) {
+                CHECK(mqtt_topic_trie_remove(&trie, filters[f]) == MQTT_SUCCESS, "remove '%s'", filters[f]);
+                drop_copy(f);
+                CHECK(mqtt_topic_trie_remove(&trie, filters[f]) == MQTT_FAILURE, "removed twice");
+            } else {
+                CHECK(mqtt_topic_trie_insert(&trie, copy_filter(f), TAG(f)) == MQTT_SUCCESS, "insert '%s'", filters[f]);
+            }
+            subscribed[f] = !subscribed[f];
+            if (!check_topics(5)) {
+                return false;
+            }
+        }
+
+        // Every node comes back
+        for (int i = 0; i < MAX_FILTERS; i++) {
+            if (subscribed[i]) {
+                CHECK(mqtt_topic_trie_remove(&trie, filters[i]) == MQTT_SUCCESS, "remove '%s'", filters[i]);
+                drop_copy(i);
+            }
+        }
+        CHECK(trie.free_count == MAX_NODES - 1, "%u nodes leaked", MAX_NODES - 1 - trie.free_count);
+    }
+    return true;
+}
+
+static bool test_full(void)
+{
+    mqtt_topic_trie_init(&trie, nodes, 6);
+
+    CHECK(mqtt_topic_trie_insert(&trie, "dev/+/cmd", TAG(0)) == MQTT_SUCCESS, "insert");
+    CHECK(mqtt_topic_trie_insert(&trie, "dev/+/cfg", TAG(1)) == MQTT_SUCCESS, "insert");
+    CHECK(trie.free_count == 1, "%u nodes free", trie.free_count);
+    CHECK(mqtt_topic_trie_insert(&trie, "other/x", TAG(2)) == MQTT_BUFFER_OVERFLOW, "overfilled");
+    CHECK(trie.free_count == 1, "failed insert used nodes");
+    CHECK(mqtt_topic_trie_insert(&trie, "dev/#", TAG(2)) == MQTT_SUCCESS, "insert");
+    CHECK(mqtt_topic_trie_insert(&trie, "dev/+/cmd", TAG(3)) == MQTT_SUCCESS, "replace");
+    CHECK(mqtt_topic_trie_insert(&trie, "dev/#/x", TAG(4)) == MQTT_FAILURE, "bad filter");
+    CHECK(mqtt_topic_trie_insert(&trie, "dev/a+", TAG(4)) == MQTT_FAILURE, "bad filter");
+
+    memset(matched, 0, sizeof(matched));
+    CHECK(mqtt_topic_trie_match(&trie, "dev/7/cmd", 9, record_match, NULL) == 2, "matches");
+    CHECK(matched[3] == 1 && matched[2] == 1 && matched[0] == 0, "wrong handlers");
+    return true;
+}
+
+static bool test_shared_levels(void)
+{
+    mqtt_topic_trie_init(&trie, nodes, MAX_NODES);
+
+    // "dev" is created by the first filter and shared with the second
+    strcpy(filters[0], "dev/a");
+    strcpy(filters[1], "dev/b");
+    CHECK(mqtt_topic_trie_insert(&trie, copy_filter(0), TAG(0)) == MQTT_SUCCESS, "insert");
+    CHECK(mqtt_topic_trie_insert(&trie, copy_filter(1), TAG(1)) == MQTT_SUCCESS, "insert");
+    CHECK(mqtt_topic_trie_remove(&trie, "dev/a") == MQTT_SUCCESS, "remove");
+    drop_copy(0);
+    memset(matched, 0, sizeof(matched));
+    CHECK(mqtt_topic_trie_match(&trie, "dev/b", 5, record_match, NULL) == 1 && matched[1] == 1,
+            "shared level lost with the filter that created it");
+
+    // Subscribing again with a new copy of the same filter
+    const char *old = copies[1];
+    CHECK(mqtt_topic_trie_insert(&trie, copy_filter(1), TAG(2)) == MQTT_SUCCESS, "replace");
+    memset((char *)old, '?', 5);
+    free((char *)old);
+    memset(matched, 0, sizeof(matched));
+    CHECK(mqtt_topic_trie_match(&trie, "dev/b", 5, record_match, NULL) == 1 && matched[2] == 1,
+            "levels left in the replaced filter");
+    CHECK(mqtt_topic_trie_remove(&trie, "dev/b") == MQTT_SUCCESS, "remove");
+    drop_copy(1);
+    CHECK(trie.free_count == MAX_NODES - 1, "nodes leaked");
+    return true;
+}
+
+static void handler_a(mqtt_message_data_t *md) {}
+static void handler_b(mqtt_message_data_t *md) {}
+
+static mqtt_message_handler_t called[4];
+static int num_called;
+
+static void record_handler(mqtt_message_handler_t handler, void *arg)
+{
+    if (num_called < ARRAY_SIZE(called)) {
+        called[num_called++] = handler;
+    }
+}
+
+static bool test_client(void)
+{
+    static mqtt_network_t network;
+    static mqtt_client_t client = mqtt_client_default;
+    static unsigned char buf[128], readbuf[128];
+    static mqtt_topic_node_t table[64];
+    fake_broker_config_t config = {.rtt_us = 10000};
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+
+    fake_broker_init(&network, &config);
+    mqtt_client_new(&client, &network, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+    CHECK(mqtt_set_subscription_table(&client, table, ARRAY_SIZE(table)) == MQTT_SUCCESS, "table");
+    data.clientID.cstring = "test";
+    CHECK(mqtt_connect(&client, &data) == MQTT_SUCCESS, "connect");
+
+    // More subscriptions than the old fixed table of 5
+    char filters[20][16];
+    for (int i = 0; i < 20; i++) {
+        sprintf(filters[i], "dev/%d/cmd", i);
+        CHECK(mqtt_subscribe(&client, filters[i], MQTT_QOS1, handler_a) == 0, "subscribe %d", i);
+    }
+    CHECK(mqtt_subscribe(&client, "dev/+/cmd", MQTT_QOS1, handler_b) == 0, "subscribe");
+
+    num_called = 0;
+    mqtt_topic_trie_match(&client.subscriptions, "dev/12/cmd", 10, record_handler, NULL);
+    CHECK(num_called == 2, "%d handlers", num_called);
+
+    CHECK(mqtt_unsubscribe(&client, "dev/12/cmd") == 0, "unsubscribe");
+    num_called = 0;
+    mqtt_topic_trie_match(&client.subscriptions, "dev/12/cmd", 10, record_handler, NULL);
+    CHECK(num_called == 1 && called[0] == handler_b, "handler left after unsubscribe");
+    return true;
+}
+
+static bool test_default_table(void)
+{
+    static mqtt_network_t network;
+    static mqtt_client_t client = mqtt_client_default;
+    static unsigned char buf[128], readbuf[128];
+    fake_broker_config_t config = {.rtt_us = 10000};
+    mqtt_packet_connect_data_t data = mqtt_packet_connect_data_initializer;
+    char filters[MQTT_MAX_MESSAGE_HANDLERS][32];
+
+    fake_broker_init(&network, &config);
+    mqtt_client_new(&client, &network, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+    data.clientID.cstring = "test";
+    CHECK(mqtt_connect(&client, &data) == MQTT_SUCCESS, "connect");
+
+    // As many filters as the old table held, none sharing a level
+    for (int i = 0; i < MQTT_MAX_MESSAGE_HANDLERS; i++) {
+        sprintf(filters[i], "d%d", i);
+        for (int l = 1; l < MQTT_MAX_FILTER_LEVELS; l++) {
+            strcat(filters[i], "/x");
+        }
+        CHECK(mqtt_subscribe(&client, filters[i], MQTT_QOS1, handler_a) == 0, "subscribe '%s'", filters[i]);
+    }
+
+    // One more does not fit, and is not subscribed at the broker either
+    CHECK(mqtt_subscribe(&client, "more", MQTT_QOS1, handler_a) == MQTT_BUFFER_OVERFLOW, "overfilled");
+    CHECK(fake_broker_stats.subscribes == MQTT_MAX_MESSAGE_HANDLERS, "%u SUBSCRIBEs sent",
+            fake_broker_stats.subscribes);
+    CHECK(mqtt_subscribe(&client, "bad/#/filter", MQTT_QOS1, handler_a) == MQTT_FAILURE, "bad filter");
+    CHECK(fake_broker_stats.subscribes == MQTT_MAX_MESSAGE_HANDLERS, "bad filter sent");
+    return true;
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(void);
+} tests[] = {
+    {"random", test_random},
+    {"full", test_full},
+    {"shared_levels", test_shared_levels},
+    {"default_table", test_default_table},
+    {"client", test_client},
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    srand(1);
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        bool ok = tests[i].fn();
+        printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
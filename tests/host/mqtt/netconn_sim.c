@@ -0,0 +1,147 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Simulated lwIP netconn layer, see netconn_sim.h.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <lwip/api.h>
+
+#include "netconn_sim.h"
+
+#define SEGMENT_LEN 1460
+
+struct netconn {
+    int recv_timeout;
+    int send_timeout;
+    bool closed;
+};
+
+struct netbuf {
+    u16_t len;
+    uint8_t data[SEGMENT_LEN];
+};
+
+netconn_sim_stats_t netconn_sim_stats;
+
+/* The broker end of the connection */
+static mqtt_network_t wire;
+
+void netconn_sim_init(const fake_broker_config_t *config)
+{
+    fake_broker_init(&wire, config);
+    memset(&netconn_sim_stats, 0, sizeof(netconn_sim_stats));
+}
+
+struct netconn *netconn_new(enum netconn_type type)
+{
+    return calloc(1, sizeof(struct netconn));
+}
+
+err_t netconn_delete(struct netconn *conn)
+{
+    free(conn);
+    return ERR_OK;
+}
+
+err_t netconn_close(struct netconn *conn)
+{
+    conn->closed = true;
+    return ERR_OK;
+}
+
+err_t netconn_connect(struct netconn *conn, const ip_addr_t *addr, u16_t port)
+{
+    return ERR_OK;
+}
+
+err_t netconn_gethostbyname(const char *name, ip_addr_t *addr)
+{
+    *addr = 0x0100007f;
+    return ERR_OK;
+}
+
+void netconn_set_recvtimeout(struct netconn *conn, int timeout)
+{
+    conn->recv_timeout = timeout;
+}
+
+void netconn_set_sendtimeout(struct netconn *conn, int timeout)
+{
+    conn->send_timeout = timeout;
+}
+
+err_t netconn_recv(struct netconn *conn, struct netbuf **new_buf)
+{
+    struct netbuf *buf;
+    int rc;
+
+    netconn_sim_stats.recvs++;
+    *new_buf = NULL;
+    if (conn->closed) {
+        return ERR_CLSD;
+    }
+    if (conn->recv_timeout <= 0) {
+        abort();    // would block forever
+    }
+
+    buf = malloc(sizeof(*buf));
+    rc = wire.mqttread(&wire, buf->data, SEGMENT_LEN, conn->recv_timeout);
+    if (rc <= 0) {
+        free(buf);
+        if (rc == 0) {
+            netconn_sim_stats.timeouts++;
+            return ERR_TIMEOUT;
+        }
+        return ERR_CLSD;
+    }
+    buf->len = rc;
+    netconn_sim_stats.netbufs++;
+    *new_buf = buf;
+    return ERR_OK;
+}
+
+err_t netconn_write_partly(struct netconn *conn, const void *dataptr, size_t size,
+        u8_t apiflags, size_t *bytes_written)
+{
+    int rc;
+
+    netconn_sim_stats.writes++;
+    *bytes_written = 0;
+    if (conn->closed || !(apiflags & NETCONN_COPY)) {
+        return ERR_CONN;
+    }
+    rc = wire.mqttwrite(&wire, (unsigned char *)dataptr, size, conn->send_timeout);
+    if (rc < 0) {
+        return ERR_CONN;
+    }
+    *bytes_written = rc;
+    return ERR_OK;
+}
+
+u16_t netbuf_len(struct netbuf *buf)
+{
+    return buf->len;
+}
+
+u16_t netbuf_copy_partial(struct netbuf *buf, void *dataptr, u16_t len, u16_t offset)
+{
+    if (offset >= buf->len) {
+        return 0;
+    }
+    if (len > buf->len - offset) {
+        len = buf->len - offset;
+    }
+    memcpy(dataptr, buf->data + offset, len);
+    netconn_sim_stats.bytes_copied += len;
+    return len;
+}
+
+void netbuf_delete(struct netbuf *buf)
+{
+    netconn_sim_stats.netbufs--;
+    free(buf);
+}
@@ -0,0 +1,32 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * lwIP netconn calls used by MQTTNetconn.c, on top of the simulated broker.
+ *
+ * netconn_recv() hands out what the broker has sent as netbufs of up to one
+ * TCP segment, waiting for it on the simulated clock up to the receive
+ * timeout, and netconn_write_partly() passes data on to the broker.  Counts
+ * how often the client task would block and how many bytes are copied.
+ */
+#ifndef _NETCONN_SIM_H_
+#define _NETCONN_SIM_H_
+
+#include <stdint.h>
+
+#include "fake_broker.h"
+
+typedef struct {
+    uint32_t recvs;         // netconn_recv() calls, each one a task wakeup
+    uint32_t timeouts;      // ... of which timed out
+    uint32_t writes;        // netconn_write_partly() calls
+    uint32_t netbufs;       // netbufs handed out and not deleted yet
+    uint32_t bytes_copied;  // from netbufs into the client
+} netconn_sim_stats_t;
+
+extern netconn_sim_stats_t netconn_sim_stats;
+
+/** Reset the broker, the clock and the counters */
+void netconn_sim_init(const fake_broker_config_t *config);
+
+#endif /* _NETCONN_SIM_H_ */
@@ -0,0 +1,18 @@
+/* Minimal FreeRTOS stand-in for building the MQTT client on the host.
+ *
+ * Ticks are milliseconds of the simulated clock in fake_broker.c.
+ */
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+
+#define portMAX_DELAY 0xffffffffUL
+#define portTICK_PERIOD_MS 1
+
+TickType_t xTaskGetTickCount(void);
+
+#endif /* _HOST_FREERTOS_H_ */
@@ -0,0 +1,3 @@
+/* Host stand-in, the MQTT client only needs the standard headers */
+#include <stdint.h>
+#include <stdio.h>
@@ -0,0 +1,41 @@
+/* Host stand-in for the netconn API used by MQTTNetconn.c, see netconn_sim.c */
+#ifndef _LWIP_API_H_
+#define _LWIP_API_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int8_t err_t;
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t ip_addr_t;
+
+#define ERR_OK       0
+#define ERR_MEM     -1
+#define ERR_TIMEOUT -3
+#define ERR_CONN    -11
+#define ERR_CLSD    -15
+
+enum netconn_type { NETCONN_TCP = 0x10 };
+
+#define NETCONN_COPY 0x01
+
+struct netconn;
+struct netbuf;
+
+struct netconn *netconn_new(enum netconn_type type);
+err_t netconn_delete(struct netconn *conn);
+err_t netconn_close(struct netconn *conn);
+err_t netconn_connect(struct netconn *conn, const ip_addr_t *addr, u16_t port);
+err_t netconn_gethostbyname(const char *name, ip_addr_t *addr);
+err_t netconn_recv(struct netconn *conn, struct netbuf **new_buf);
+err_t netconn_write_partly(struct netconn *conn, const void *dataptr, size_t size,
+        u8_t apiflags, size_t *bytes_written);
+void netconn_set_recvtimeout(struct netconn *conn, int timeout);
+void netconn_set_sendtimeout(struct netconn *conn, int timeout);
+
+u16_t netbuf_len(struct netbuf *buf);
+u16_t netbuf_copy_partial(struct netbuf *buf, void *dataptr, u16_t len, u16_t offset);
+void netbuf_delete(struct netbuf *buf);
+
+#endif /* _LWIP_API_H_ */
@@ -0,0 +1 @@
+/* Host stand-in, nothing from lwIP is used by the MQTT client itself */
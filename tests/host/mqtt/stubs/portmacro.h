@@ -0,0 +1 @@
+/* Nothing needed on the host, FreeRTOS.h has the tick type */
@@ -0,0 +1,20 @@
+#ifndef _HOST_SEMPHR_H_
+#define _HOST_SEMPHR_H_
+
+#include "FreeRTOS.h"
+
+typedef void *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return (SemaphoreHandle_t)1;
+}
+
+static inline int xSemaphoreTake(SemaphoreHandle_t sem, uint32_t ticks) {
+    return 1;
+}
+
+static inline int xSemaphoreGive(SemaphoreHandle_t sem) {
+    return 1;
+}
+
+#endif /* _HOST_SEMPHR_H_ */
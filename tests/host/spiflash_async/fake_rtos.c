@@ -0,0 +1,246 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Coroutine based FreeRTOS stand-in, see fake_rtos.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ucontext.h>
+
+#include <task.h>
+#include <queue.h>
+#include <semphr.h>
+
+#include "fake_rtos.h"
+
+#define TASK_STACK_SIZE (256 * 1024)
+
+struct fake_queue {
+    uint8_t *items;
+    UBaseType_t item_size;
+    UBaseType_t length;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+struct fake_semaphore {
+    bool given;
+};
+
+static TickType_t now;
+
+static struct {
+    bool created;
+    bool started;
+    bool in_task;
+    ucontext_t context;
+    ucontext_t caller;
+    uint8_t *stack;
+    TaskFunction_t fn;
+    void *params;
+    QueueHandle_t waiting_on;   // queue the task is blocked on
+    bool forever;               // ... with no timeout
+    TickType_t deadline;        // ... or until then
+} task;
+
+static void deadlock(const char *what)
+{
+    printf("deadlock: %s\n", what);
+    abort();
+}
+
+static void task_entry(void)
+{
+    task.fn(task.params);
+    printf("task returned\n");
+    abort();
+}
+
+/* Has the task got something to do at the current time */
+static bool task_ready(void)
+{
+    if (!task.created) {
+        return false;
+    }
+    if (!task.started) {
+        return true;
+    }
+    return task.waiting_on->count || (!task.forever && task.deadline <= now);
+}
+
+/* Run the task until it blocks again */
+static void run_task(void)
+{
+    task.started = true;
+    task.in_task = true;
+    swapcontext(&task.caller, &task.context);
+    task.in_task = false;
+}
+
+/*
+ * Let time pass until `until` (or for ever), running the task when it is
+ * ready, until `done` returns true. Returns false if time ran out first.
+ */
+static bool wait_until(bool (*done)(void *), void *arg, bool forever, TickType_t until)
+{
+    while (!done(arg)) {
+        if (task_ready()) {
+            run_task();
+        } else if (task.created && !task.forever && (forever || task.deadline <= until)) {
+            now = task.deadline;
+            run_task();
+        } else if (forever) {
+            return false;
+        } else {
+            now = until;
+            return false;
+        }
+    }
+    return true;
+}
+
+TickType_t fake_rtos_now(void)
+{
+    return now;
+}
+
+static bool never(void *arg)
+{
+    return false;
+}
+
+void fake_rtos_delay(uint32_t ms)
+{
+    wait_until(never, NULL, false, now + ms / portTICK_PERIOD_MS);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint16_t stack_depth,
+        void *params, UBaseType_t priority, TaskHandle_t *handle)
+{
+    if (task.created) {
+        printf("only one task supported\n");
+        abort();
+    }
+    task.stack = malloc(TASK_STACK_SIZE);
+    getcontext(&task.context);
+    task.context.uc_stack.ss_sp = task.stack;
+    task.context.uc_stack.ss_size = TASK_STACK_SIZE;
+    task.context.uc_link = NULL;
+    makecontext(&task.context, task_entry, 0);
+    task.fn = fn;
+    task.params = params;
+    task.created = true;
+    if (handle) {
+        *handle = &task;
+    }
+    return pdPASS;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    QueueHandle_t queue = calloc(1, sizeof(*queue));
+
+    queue->items = malloc(length * item_size);
+    queue->item_size = item_size;
+    queue->length = length;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    free(queue->items);
+    free(queue);
+}
+
+static bool queue_not_full(void *arg)
+{
+    QueueHandle_t queue = arg;
+
+    return queue->count < queue->length;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    UBaseType_t tail;
+
+    if (task.in_task) {
+        printf("xQueueSend from the task not supported\n");
+        abort();
+    }
+    if (!wait_until(queue_not_full, queue, ticks == portMAX_DELAY, now + ticks)) {
+        if (ticks == portMAX_DELAY) {
+            deadlock("queue full");
+        }
+        return pdFALSE;
+    }
+    tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    if (!queue->count && ticks) {
+        if (!task.in_task) {
+            printf("xQueueReceive only supported in the task\n");
+            abort();
+        }
+        task.waiting_on = queue;
+        task.forever = ticks == portMAX_DELAY;
+        task.deadline = now + ticks;
+        swapcontext(&task.context, &task.caller);
+    }
+    if (!queue->count) {
+        return pdFALSE;
+    }
+    memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    return pdTRUE;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return calloc(1, sizeof(struct fake_semaphore));
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    free(sem);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    if (sem->given) {
+        return pdFALSE;
+    }
+    sem->given = true;
+    return pdTRUE;
+}
+
+static bool semaphore_given(void *arg)
+{
+    SemaphoreHandle_t sem = arg;
+
+    return sem->given;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    if (task.in_task) {
+        printf("xSemaphoreTake from the task not supported\n");
+        abort();
+    }
+    if (!wait_until(semaphore_given, sem, ticks == portMAX_DELAY, now + ticks)) {
+        if (ticks == portMAX_DELAY) {
+            deadlock("semaphore never given");
+        }
+        return pdFALSE;
+    }
+    sem->given = false;
+    return pdTRUE;
+}
@@ -0,0 +1,24 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Just enough of FreeRTOS to run one background task on the host.
+ *
+ * The task created with xTaskCreate() runs as a coroutine of the test on a
+ * simulated clock.  It only gets to run when the test waits: on a semaphore,
+ * on a full queue, or in fake_rtos_delay().  It then runs until it waits on
+ * an empty queue itself, so requests queued by the test pile up as they
+ * would behind a busy flash task.
+ */
+#ifndef _FAKE_RTOS_H_
+#define _FAKE_RTOS_H_
+
+#include <FreeRTOS.h>
+
+/** Simulated time in ticks */
+TickType_t fake_rtos_now(void);
+
+/** Let `ms` pass, running the task whenever it has something to do */
+void fake_rtos_delay(uint32_t ms);
+
+#endif /* _FAKE_RTOS_H_ */
@@ -0,0 +1,332 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for extras/spiflash_async against the simulated flash from
+ * host/sysparam, with the background task run by fake_rtos.c.
+ *
+ * Checks that adjacent small writes are merged into one program per page
+ * and land byte-exact, that a partly filled page is written out after
+ * SPIFLASH_ASYNC_FLUSH_MS, that erases and writes are carried out in the
+ * order they were queued, that failures reach the callbacks and
+ * spiflash_async_sync(), and that callbacks always run in request order and
+ * only once their data is in flash.  Finishes with a random mix of writes,
+ * erases, syncs and idle time compared against a reference image.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <spiflash.h>
+#include <spiflash_async/spiflash_async.h>
+
+#include "flash_sim.h"
+#include "fake_rtos.h"
+
+#define FLASH_SIZE  (64 * 1024)
+#define PAGE_SIZE   256
+#define MAX_REQUESTS 4096
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+/* What the flash should hold once everything queued has been carried out */
+static uint8_t reference[FLASH_SIZE];
+
+/* Requests queued with a callback, in order */
+static struct {
+    uint32_t addr;
+    uint32_t size;      // 0 for an erase
+    uint8_t data[PAGE_SIZE * 2];
+    bool expect_ok;
+} requests[MAX_REQUESTS];
+static int num_requests;
+
+/* Callbacks seen so far, and the first thing that was wrong with them */
+static int completed;
+static char error[128];
+
+static void completion(bool success, void *arg)
+{
+    int id = (intptr_t)arg;
+    uint8_t flash[PAGE_SIZE * 2];
+
+    if (error[0]) {
+        return;
+    }
+    if (id != completed) {
+        snprintf(error, sizeof(error), "callback %d ran as number %d", id, completed);
+        return;
+    }
+    completed++;
+    if (success != requests[id].expect_ok) {
+        snprintf(error, sizeof(error), "request %d: success %d", id, success);
+        return;
+    }
+    if (!success) {
+        return;
+    }
+
+    // Later writes can only clear more bits, anything cleared by this
+    // request must already be clear
+    spiflash_read(requests[id].addr, flash, requests[id].size ? requests[id].size : PAGE_SIZE);
+    for (uint32_t i = 0; i < requests[id].size; i++) {
+        if (flash[i] & ~requests[id].data[i]) {
+            snprintf(error, sizeof(error), "request %d: byte %u not written yet", id, i);
+            return;
+        }
+    }
+    if (!requests[id].size) {
+        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+            if (flash[i] != 0xff) {
+                snprintf(error, sizeof(error), "request %d: sector not erased", id);
+                return;
+            }
+        }
+    }
+}
+
+static void reset(void)
+{
+    flash_sim_erase_all();
+    flash_sim_reset_stats();
+    memset(reference, 0xff, sizeof(reference));
+    num_requests = completed = 0;
+    error[0] = 0;
+}
+
+static bool queue_write(uint32_t addr, const uint8_t *data, uint32_t size, bool with_cb)
+{
+    int id = num_requests;
+
+    if (with_cb) {
+        requests[id].addr = addr;
+        requests[id].size = size;
+        memcpy(requests[id].data, data, size);
+        requests[id].expect_ok = addr + size <= FLASH_SIZE;
+        num_requests++;
+    }
+    for (uint32_t i = 0; i < size && addr + i < FLASH_SIZE; i++) {
+        reference[addr + i] &= data[i];
+    }
+    return spiflash_async_write(addr, data, size, with_cb ? completion : NULL,
+            (void *)(intptr_t)id);
+}
+
+static bool queue_erase(uint32_t addr)
+{
+    int id = num_requests++;
+
+    requests[id].addr = addr;
+    requests[id].size = 0;
+    requests[id].expect_ok = true;
+    memset(reference + addr, 0xff, SPI_FLASH_SECTOR_SIZE);
+    return spiflash_async_erase(addr, completion, (void *)(intptr_t)id);
+}
+
+static void random_data(uint8_t *data, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = rand();
+    }
+}
+
+static bool check_flash(void)
+{
+    static uint8_t flash[FLASH_SIZE];
+
+    spiflash_read(0, flash, FLASH_SIZE);
+    for (uint32_t i = 0; i < FLASH_SIZE; i++) {
+        CHECK(flash[i] == reference[i], "flash 0x%05x is %02x, expected %02x",
+                i, flash[i], reference[i]);
+    }
+    return true;
+}
+
+static bool check_all_completed(void)
+{
+    CHECK(!error[0], "%s", error);
+    CHECK(completed == num_requests, "%d of %d callbacks ran", completed, num_requests);
+    return check_flash();
+}
+
+static bool test_coalesce(void)
+{
+    uint8_t data[PAGE_SIZE * 2];
+    uint32_t addr;
+
+    reset();
+    // 16 byte records without callbacks fill each page before it is written
+    for (addr = 0; addr < 4096; addr += 16) {
+        random_data(data, 16);
+        CHECK(queue_write(addr, data, 16, false), "write 0x%x", addr);
+    }
+    CHECK(spiflash_async_sync(), "sync failed");
+    CHECK(flash_sim_stats.writes == 4096 / PAGE_SIZE, "%u page programs for %d pages",
+            flash_sim_stats.writes, 4096 / PAGE_SIZE);
+    if (!check_flash()) {
+        return false;
+    }
+
+    // Odd sizes from an odd address, each with a callback. Pages are also
+    // written out once MAX_PENDING callbacks are waiting for them.
+    flash_sim_reset_stats();
+    addr = 4096 + 7;
+    for (int i = 0; i < 200; i++) {
+        uint32_t size = 1 + rand() % (i < 100 ? 32 : sizeof(data) - 1);
+        random_data(data, size);
+        CHECK(queue_write(addr, data, size, true), "write 0x%x", addr);
+        addr += size;
+    }
+    CHECK(spiflash_async_sync(), "sync failed");
+    uint32_t pages = (addr - 1) / PAGE_SIZE - 4096 / PAGE_SIZE + 1;
+    CHECK(flash_sim_stats.writes <= pages + 200 / 8, "%u page programs for %u pages",
+            flash_sim_stats.writes, pages);
+    printf("  %u page programs for 200 writes over %u pages\n", flash_sim_stats.writes, pages);
+    return check_all_completed();
+}
+
+static bool test_idle_flush(void)
+{
+    uint8_t data[10];
+    uint8_t flash[10];
+
+    reset();
+    random_data(data, sizeof(data));
+    CHECK(queue_write(0x2000, data, sizeof(data), true), "write");
+    fake_rtos_delay(0);
+    CHECK(completed == 0 && flash_sim_stats.writes == 0, "partial page written at once");
+
+    fake_rtos_delay(SPIFLASH_ASYNC_FLUSH_MS - portTICK_PERIOD_MS);
+    CHECK(completed == 0, "partial page written after %u ms",
+            SPIFLASH_ASYNC_FLUSH_MS - portTICK_PERIOD_MS);
+    fake_rtos_delay(2 * portTICK_PERIOD_MS);
+    CHECK(completed == 1 && flash_sim_stats.writes == 1, "partial page not written when idle");
+    spiflash_read(0x2000, flash, sizeof(flash));
+    CHECK(!memcmp(flash, data, sizeof(data)), "wrong data in flash");
+    return check_all_completed();
+}
+
+static bool test_erase_order(void)
+{
+    uint8_t first[100], second[100];
+
+    reset();
+    // If the buffered first write reached flash after the erase, the
+    // result would be first & second
+    random_data(first, sizeof(first));
+    random_data(second, sizeof(second));
+    CHECK(queue_write(0x3010, first, sizeof(first), true), "write");
+    CHECK(queue_erase(0x3000), "erase");
+    CHECK(queue_write(0x3010, second, sizeof(second), true), "write");
+    CHECK(spiflash_async_sync(), "sync failed");
+    CHECK(flash_sim_sector_erases(0x3000) == 1, "sector erased %u times",
+            flash_sim_sector_erases(0x3000));
+    return check_all_completed();
+}
+
+static bool test_failure(void)
+{
+    uint8_t data[20];
+
+    reset();
+    CHECK(!spiflash_async_erase(0x3001, NULL, NULL), "unaligned erase queued");
+
+    // The second half of this runs off the end of the chip
+    random_data(data, sizeof(data));
+    CHECK(queue_write(FLASH_SIZE - 10, data, sizeof(data), true), "write");
+    requests[num_requests - 1].expect_ok = false;
+    CHECK(queue_write(0, data, sizeof(data), true), "write");
+    CHECK(!spiflash_async_sync(), "sync succeeded");
+    CHECK(spiflash_async_sync(), "failure reported twice");
+    return check_all_completed();
+}
+
+static bool test_random(void)
+{
+    uint8_t data[PAGE_SIZE * 2];
+    uint32_t addr = 0;
+
+    reset();
+    for (int i = 0; i < 3000; i++) {
+        int op = rand() % 100;
+
+        if (op < 2) {
+            CHECK(queue_erase((rand() % (FLASH_SIZE / SPI_FLASH_SECTOR_SIZE)) * SPI_FLASH_SECTOR_SIZE),
+                    "erase");
+        } else if (op < 4) {
+            CHECK(spiflash_async_sync(), "sync failed");
+            CHECK(!error[0], "%s", error);
+            CHECK(completed == num_requests, "%d of %d callbacks ran after sync",
+                    completed, num_requests);
+        } else if (op < 8) {
+            fake_rtos_delay(rand() % (2 * SPIFLASH_ASYNC_FLUSH_MS));
+        } else {
+            uint32_t size = 1 + rand() % (op < 50 ? 32 : sizeof(data) - 1);
+
+            // Mostly carry on where the last write ended, as a log would
+            if (op % 4 == 0 || addr + size > FLASH_SIZE) {
+                addr = rand() % (FLASH_SIZE - size);
+            }
+            random_data(data, size);
+            CHECK(queue_write(addr, data, size, rand() % 2), "write 0x%x", addr);
+            addr += size;
+        }
+    }
+    CHECK(spiflash_async_sync(), "sync failed");
+    return check_all_completed();
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(void);
+} tests[] = {
+    {"coalesce", test_coalesce},
+    {"idle_flush", test_idle_flush},
+    {"erase_order", test_erase_order},
+    {"failure", test_failure},
+    {"random", test_random},
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    int opt;
+    unsigned seed = 1;
+
+    while ((opt = getopt(argc, argv, "S:")) != -1) {
+        switch (opt) {
+        case 'S':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-S seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+
+    if (!flash_sim_init(NULL, FLASH_SIZE) || !spiflash_async_init()) {
+        printf("init failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        bool ok = tests[i].fn();
+        printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
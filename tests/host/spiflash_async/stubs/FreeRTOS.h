@@ -0,0 +1,23 @@
+/* Minimal FreeRTOS stand-in for building spiflash_async on the host.
+ *
+ * The background task runs as a coroutine on a simulated clock, see
+ * fake_rtos.c.
+ */
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+#include <stdint.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY      0xffffffffUL
+#define portTICK_PERIOD_MS 10
+
+#endif /* _HOST_FREERTOS_H_ */
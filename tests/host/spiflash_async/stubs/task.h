@@ -0,0 +1,13 @@
+#ifndef _HOST_TASK_H_
+#define _HOST_TASK_H_
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+/* Only one task can be created, implemented by fake_rtos.c */
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint16_t stack_depth,
+        void *params, UBaseType_t priority, TaskHandle_t *handle);
+
+#endif /* _HOST_TASK_H_ */
@@ -0,0 +1,136 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spiflash.h"
+#include "flashchip.h"
+#include "flash_sim.h"
+
+sdk_flashchip_t sdk_flashchip = {
+    .device_id = 0x1640ef,
+    .chip_size = 0,
+    .block_size = 65536,
+    .sector_size = SPI_FLASH_SECTOR_SIZE,
+    .page_size = 256,
+    .status_mask = 0xffff,
+};
+
+flash_sim_stats_t flash_sim_stats;
+
+static uint8_t *flash;
+static uint32_t *sector_erases;
+static long cut_countdown = -1;
+
+bool flash_sim_init(const char *path, uint32_t size) {
+    int fd = -1;
+    struct stat st;
+    bool erase = true;
+
+    if (path) {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            perror(path);
+            return false;
+        }
+        if (fstat(fd, &st) == 0 && st.st_size == size) {
+            erase = false;
+        } else if (ftruncate(fd, size) != 0) {
+            perror(path);
+            close(fd);
+            return false;
+        }
+        flash = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        flash = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (flash == MAP_FAILED) {
+        perror("mmap");
+        flash = NULL;
+        return false;
+    }
+    sector_erases = mmap(NULL, size / SPI_FLASH_SECTOR_SIZE * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sector_erases == MAP_FAILED) {
+        perror("mmap");
+        sector_erases = NULL;
+        return false;
+    }
+
+    sdk_flashchip.chip_size = size;
+    if (erase) flash_sim_erase_all();
+    flash_sim_reset_stats();
+    return true;
+}
+
+void flash_sim_erase_all(void) {
+    memset(flash, 0xff, sdk_flashchip.chip_size);
+}
+
+void flash_sim_reset_stats(void) {
+    memset(&flash_sim_stats, 0, sizeof(flash_sim_stats));
+}
+
+uint32_t flash_sim_sector_erases(uint32_t addr) {
+    return sector_erases[addr / SPI_FLASH_SECTOR_SIZE];
+}
+
+void flash_sim_cut_after(long ops) {
+    cut_countdown = ops;
+}
+
+/* Returns the number of bytes of an operation of `size` bytes which should
+ * actually be carried out before the power goes away, or `size` if the power
+ * stays on.
+ */
+static uint32_t power_budget(uint32_t size) {
+    if (cut_countdown < 0) return size;
+    if (cut_countdown-- > 0) return size;
+    return size ? rand() % size : 0;
+}
+
+static void power_cut(void) {
+    _exit(FLASH_SIM_CUT_EXIT);
+}
+
+bool spiflash_read(uint32_t addr, uint8_t *buf, uint32_t size) {
+    if (addr + size > sdk_flashchip.chip_size) return false;
+    flash_sim_stats.reads++;
+    flash_sim_stats.bytes_read += size;
+    memcpy(buf, flash + addr, size);
+    return true;
+}
+
+bool spiflash_write(uint32_t addr, uint8_t *buf, uint32_t size) {
+    uint32_t count = power_budget(size);
+    uint32_t i;
+
+    if (addr + size > sdk_flashchip.chip_size) return false;
+    flash_sim_stats.writes++;
+    flash_sim_stats.bytes_written += size;
+    // Programming can only clear bits
+    for (i = 0; i < count; i++) {
+        flash[addr + i] &= buf[i];
+    }
+    if (count != size) power_cut();
+    return true;
+}
+
+bool spiflash_erase_sector(uint32_t addr) {
+    uint32_t count = power_budget(SPI_FLASH_SECTOR_SIZE);
+
+    if (addr % SPI_FLASH_SECTOR_SIZE) return false;
+    if (addr + SPI_FLASH_SECTOR_SIZE > sdk_flashchip.chip_size) return false;
+    flash_sim_stats.erases++;
+    sector_erases[addr / SPI_FLASH_SECTOR_SIZE]++;
+    memset(flash + addr, 0xff, count);
+    if (count != SPI_FLASH_SECTOR_SIZE) power_cut();
+    return true;
+}
@@ -0,0 +1,58 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Simulated SPI flash for running flash-based code (e.g. sysparam) on the
+ * host.  Provides spiflash_read(), spiflash_write(), spiflash_erase_sector()
+ * and sdk_flashchip, backed by a file or by anonymous shared memory.
+ */
+#ifndef _FLASH_SIM_H_
+#define _FLASH_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Exit status of a process which was stopped by a simulated power cut */
+#define FLASH_SIM_CUT_EXIT 99
+
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t erases;
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+} flash_sim_stats_t;
+
+extern flash_sim_stats_t flash_sim_stats;
+
+/** Set up the simulated flash.
+ *
+ *  If `path` is not NULL, the flash contents are stored in (and persist in)
+ *  that file, which is created and erased if it does not exist yet.
+ *  Otherwise, erased anonymous memory is used.  Either way the mapping is
+ *  shared, so changes made by a fork()ed child are seen by its parent.
+ *
+ *  @return true if successful
+ */
+bool flash_sim_init(const char *path, uint32_t size);
+
+/** Erase the whole simulated flash (without counting it in the stats) */
+void flash_sim_erase_all(void);
+
+/** Zero all of the counters in flash_sim_stats */
+void flash_sim_reset_stats(void);
+
+/** Number of times the sector containing `addr` has been erased (including
+ *  erases interrupted by a power cut, and by fork()ed children)
+ */
+uint32_t flash_sim_sector_erases(uint32_t addr);
+
+/** Simulate a power cut.
+ *
+ *  After `ops` more write/erase operations complete, the next one will only
+ *  be partially carried out and the process will then _exit() with
+ *  FLASH_SIM_CUT_EXIT.  Pass a negative value to cancel.
+ */
+void flash_sim_cut_after(long ops);
+
+#endif /* _FLASH_SIM_H_ */
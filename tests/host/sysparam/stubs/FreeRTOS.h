@@ -0,0 +1,12 @@
+/* Minimal FreeRTOS stand-in for building sysparam on the host.
+ *
+ * The host tools are single threaded, so there is nothing to lock.
+ */
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+#include <stdint.h>
+
+#define portMAX_DELAY 0xffffffffUL
+
+#endif /* _HOST_FREERTOS_H_ */
@@ -0,0 +1,12 @@
+#ifndef _HOST_TASK_H_
+#define _HOST_TASK_H_
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+
+static inline TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return (TaskHandle_t)1;
+}
+
+#endif /* _HOST_TASK_H_ */
@@ -0,0 +1,164 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Benchmark for sysparam running against the simulated flash.
+ *
+ * For a range of key counts and levels of fragmentation (the number of times
+ * each value has been overwritten since the area was created), this measures
+ * get, set and iterate operations and reports the host time per operation
+ * along with the flash operations per operation.  On real hardware the flash
+ * numbers are what matter: every read is a separate SPI transaction with the
+ * cache disabled.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <sysparam.h>
+#include <spiflash.h>
+
+#include "flash_sim.h"
+
+#define FLASH_SIZE 0x40000
+#define AREA_BASE  0x10000
+#define VALUE_LEN  16
+
+static const int key_counts[] = {8, 16, 32, 64, 100};
+static const int overwrites[] = {0, 4, 16};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef enum {
+    OP_GET,
+    OP_SET,
+    OP_ITERATE,
+} op_type_t;
+
+static const char *op_names[] = {"get", "set", "iterate"};
+
+static void key_name(int i, char *buf) {
+    sprintf(buf, "bench.key%03d", i);
+}
+
+static sysparam_status_t set_key(int i, unsigned version) {
+    char key[16];
+    char value[VALUE_LEN + 1];
+
+    key_name(i, key);
+    snprintf(value, sizeof(value), "%08x%08x", i, version);
+    return sysparam_set_string(key, value);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool run_op(op_type_t type, int num_keys, unsigned version) {
+    sysparam_iter_t iter;
+    sysparam_status_t status;
+    char key[16];
+    uint8_t *value;
+    size_t len;
+    bool binary;
+    int i = rand() % num_keys;
+
+    switch (type) {
+    case OP_GET:
+        key_name(i, key);
+        if (sysparam_get_data(key, &value, &len, &binary) != SYSPARAM_OK) return false;
+        free(value);
+        return true;
+    case OP_SET:
+        return set_key(i, version) == SYSPARAM_OK;
+    case OP_ITERATE:
+        if (sysparam_iter_start(&iter) != SYSPARAM_OK) return false;
+        while ((status = sysparam_iter_next(&iter)) == SYSPARAM_OK) {}
+        sysparam_iter_end(&iter);
+        return status == SYSPARAM_NOTFOUND;
+    }
+    return false;
+}
+
+static bool bench(int num_sectors, int num_keys, int overwrite, op_type_t type, int count) {
+    unsigned version = 0;
+    double start, elapsed;
+    int i, j;
+
+    flash_sim_erase_all();
+    if (sysparam_create_area(AREA_BASE, num_sectors, true) != SYSPARAM_OK ||
+            sysparam_init(AREA_BASE, 0) != SYSPARAM_OK) {
+        printf("could not create sysparam area\n");
+        return false;
+    }
+    for (j = 0; j <= overwrite; j++) {
+        version++;
+        for (i = 0; i < num_keys; i++) {
+            if (set_key(i, version) != SYSPARAM_OK) {
+                printf("could not set up %d keys\n", num_keys);
+                return false;
+            }
+        }
+    }
+
+    flash_sim_reset_stats();
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        if (!run_op(type, num_keys, ++version)) {
+            printf("%s failed\n", op_names[type]);
+            return false;
+        }
+    }
+    elapsed = now_ns() - start;
+
+    printf("%5d %6d  %-8s %10.0f %10.1f %10.1f %10.2f %10.4f\n",
+            num_keys, overwrite, op_names[type], elapsed / count,
+            (double)flash_sim_stats.reads / count,
+            (double)flash_sim_stats.bytes_read / count,
+            (double)flash_sim_stats.writes / count,
+            (double)flash_sim_stats.erases / count);
+    return true;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-n count] [-s sectors] [-S seed]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int count = 1000;
+    int num_sectors = 8;
+    unsigned seed = 1;
+    int k, f, type;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:S:h")) != -1) {
+        switch (opt) {
+        case 'n': count = atoi(optarg); break;
+        case 's': num_sectors = atoi(optarg); break;
+        case 'S': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+    if (!flash_sim_init(NULL, FLASH_SIZE)) return 1;
+
+    printf("sysparam benchmark: %d sectors, index size %d, %d ops per test\n",
+            num_sectors, SYSPARAM_INDEX_SIZE, count);
+    printf("%5s %6s  %-8s %10s %10s %10s %10s %10s\n",
+            "keys", "overw", "op", "ns/op", "reads/op", "rbytes/op", "writes/op", "erases/op");
+    for (k = 0; k < ARRAY_SIZE(key_counts); k++) {
+        for (f = 0; f < ARRAY_SIZE(overwrites); f++) {
+            for (type = OP_GET; type <= OP_ITERATE; type++) {
+                if (!bench(num_sectors, key_counts[k], overwrites[f], type, count)) return 1;
+            }
+        }
+    }
+    return 0;
+}
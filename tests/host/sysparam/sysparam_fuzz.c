@@ -0,0 +1,415 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Power-cut fuzzer for sysparam.
+ *
+ * Each round applies a random update (a single set or delete, a transaction
+ * or a compaction) in a forked child process, which is usually killed part way
+ * through by a simulated power cut.  The parent then runs sysparam_init() on
+ * what was left in the flash and checks that every key has either its value
+ * from before the update or its value from after it (and, for transactions,
+ * that either all of the changes happened or none of them did), that the
+ * regions of the area are being worn evenly, and that two-region areas stay in
+ * the format older firmware can read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <sysparam.h>
+#include <spiflash.h>
+
+#include "flash_sim.h"
+
+#define FLASH_SIZE      0x40000
+#define AREA_BASE       0x10000
+#define NUM_KEYS        24
+#define MAX_VALUE_LEN   48
+#define MAX_TXN_CHANGES 8
+
+typedef struct {
+    bool present;
+    uint8_t len;
+    bool binary;
+    uint8_t data[MAX_VALUE_LEN];
+} value_t;
+
+typedef enum {
+    OP_SET,
+    OP_DELETE,
+    OP_TXN,
+    OP_COMPACT,
+} op_type_t;
+
+typedef struct {
+    op_type_t type;
+    int num_changes;
+    int key[MAX_TXN_CHANGES];
+    value_t value[MAX_TXN_CHANGES];
+} op_t;
+
+static value_t model[NUM_KEYS];
+static bool verbose;
+
+/* Shared with the child, so it can report how much flash activity an
+ * uninterrupted update took (used to pick the range of cut points).
+ */
+static uint32_t *child_ops;
+
+static void key_name(int i, char *buf) {
+    sprintf(buf, "fuzz.key%02d", i);
+}
+
+static void random_value(value_t *v) {
+    int i;
+
+    v->present = true;
+    v->len = 1 + rand() % MAX_VALUE_LEN;
+    v->binary = rand() % 2;
+    for (i = 0; i < v->len; i++) {
+        v->data[i] = v->binary ? rand() : 'a' + rand() % 26;
+    }
+}
+
+static void random_op(op_t *op) {
+    int r = rand() % 100;
+    int i, j;
+
+    memset(op, 0, sizeof(*op));
+    if (r < 45) {
+        op->type = OP_SET;
+        op->num_changes = 1;
+    } else if (r < 60) {
+        op->type = OP_DELETE;
+        op->num_changes = 1;
+    } else if (r < 95) {
+        op->type = OP_TXN;
+        op->num_changes = 2 + rand() % (MAX_TXN_CHANGES - 1);
+    } else {
+        op->type = OP_COMPACT;
+    }
+    for (i = 0; i < op->num_changes; i++) {
+        // Each key at most once per operation
+        do {
+            op->key[i] = rand() % NUM_KEYS;
+            for (j = 0; j < i; j++) {
+                if (op->key[j] == op->key[i]) break;
+            }
+        } while (j < i);
+        if (op->type == OP_DELETE || (op->type == OP_TXN && rand() % 4 == 0)) {
+            op->value[i].present = false;
+        } else {
+            random_value(&op->value[i]);
+        }
+    }
+}
+
+static sysparam_status_t apply_change(int key, const value_t *v) {
+    char name[16];
+
+    key_name(key, name);
+    if (!v->present) {
+        return sysparam_set_data(name, NULL, 0, false);
+    }
+    return sysparam_set_data(name, v->data, v->len, v->binary);
+}
+
+static void run_op(const op_t *op) {
+    sysparam_status_t status = SYSPARAM_OK;
+    int i;
+
+    switch (op->type) {
+    case OP_SET:
+    case OP_DELETE:
+        status = apply_change(op->key[0], &op->value[0]);
+        break;
+    case OP_TXN:
+        sysparam_begin();
+        for (i = 0; i < op->num_changes; i++) {
+            apply_change(op->key[i], &op->value[i]);
+        }
+        status = sysparam_commit();
+        break;
+    case OP_COMPACT:
+        status = sysparam_compact();
+        break;
+    }
+    if (status < 0) {
+        fprintf(stderr, "operation failed: %d\n", status);
+        _exit(1);
+    }
+}
+
+static bool value_equal(const value_t *a, const value_t *b) {
+    if (a->present != b->present) return false;
+    if (!a->present) return true;
+    return a->len == b->len && a->binary == b->binary && !memcmp(a->data, b->data, a->len);
+}
+
+/* Read back the current value of every key, and check that iterating gives
+ * exactly the same set of keys.
+ */
+static bool read_state(value_t *state) {
+    sysparam_iter_t iter;
+    sysparam_status_t status;
+    char name[16];
+    size_t len;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        key_name(i, name);
+        memset(&state[i], 0, sizeof(value_t));
+        status = sysparam_get_data_static(name, state[i].data, MAX_VALUE_LEN, &len, &state[i].binary);
+        if (status == SYSPARAM_OK) {
+            state[i].present = true;
+            state[i].len = len;
+            count++;
+        } else if (status != SYSPARAM_NOTFOUND) {
+            printf("get '%s' failed: %d\n", name, status);
+            return false;
+        }
+    }
+
+    if (sysparam_iter_start(&iter) != SYSPARAM_OK) return false;
+    while ((status = sysparam_iter_next(&iter)) == SYSPARAM_OK) {
+        if (sscanf(iter.key, "fuzz.key%d", &i) != 1 || i < 0 || i >= NUM_KEYS || !state[i].present) {
+            printf("iteration returned unexpected key '%s'\n", iter.key);
+            sysparam_iter_end(&iter);
+            return false;
+        }
+        count--;
+    }
+    sysparam_iter_end(&iter);
+    if (status < 0 || count) {
+        printf("iteration mismatch (status %d, %d keys unaccounted for)\n", status, count);
+        return false;
+    }
+    return true;
+}
+
+/* Check the state after an update, which may or may not have completed. */
+static bool check_state(const op_t *op, const value_t *state, bool completed) {
+    int matched_old = 0, matched_new = 0;
+    int i, j;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        for (j = 0; j < op->num_changes; j++) {
+            if (op->key[j] == i) break;
+        }
+        if (j == op->num_changes || value_equal(&op->value[j], &model[i])) {
+            // Not (actually) changed by the update
+            if (!value_equal(&state[i], &model[i])) {
+                printf("key %d changed, but was not part of the update\n", i);
+                return false;
+            }
+        } else if (value_equal(&state[i], &op->value[j])) {
+            matched_new++;
+        } else if (value_equal(&state[i], &model[i])) {
+            matched_old++;
+        } else {
+            printf("key %d has neither its old nor its new value (got %d/%d, old %d/%d, new %d/%d)\n", i,
+                    state[i].present, state[i].len, model[i].present, model[i].len, op->value[j].present, op->value[j].len);
+            return false;
+        }
+    }
+    if (completed && matched_old) {
+        printf("update completed, but not all changes were made\n");
+        return false;
+    }
+    if (matched_old && matched_new) {
+        printf("transaction was only partially applied\n");
+        return false;
+    }
+    return true;
+}
+
+/* Set up an area in the original two-region format (8-byte region headers
+ * with no erase counts), as created by older versions of sysparam, to check
+ * that it is still understood and stays in that format as it is compacted.
+ */
+static bool create_legacy_area(int num_sectors) {
+    uint32_t region_size = num_sectors / 2 * SPI_FLASH_SECTOR_SIZE;
+    uint32_t header[2];
+    int i;
+
+    for (i = 0; i < num_sectors; i++) {
+        if (!spiflash_erase_sector(AREA_BASE + i * SPI_FLASH_SECTOR_SIZE)) return false;
+    }
+    header[0] = 0x70524f45;  // SYSPARAM_MAGIC
+    header[1] = 0x4000 | (num_sectors / 2);  // REGION_FLAG_ACTIVE
+    if (!spiflash_write(AREA_BASE, (uint8_t *)header, sizeof(header))) return false;
+    header[1] = 0x8000 | (num_sectors / 2);  // REGION_FLAG_SECOND
+    return spiflash_write(AREA_BASE + region_size, (uint8_t *)header, sizeof(header));
+}
+
+/* Check that every region header of a two-region area is still in the
+ * original format: no ring flag, and the word after the flags (which older
+ * firmware ignores, but which is where ring headers keep `pending`) zero.
+ * Older firmware reads entries straight after these 8 bytes.
+ */
+static bool check_format(void) {
+    sysparam_stats_t stats;
+    uint32_t header[2];
+    int i;
+
+    if (sysparam_get_stats(&stats) != SYSPARAM_OK) {
+        printf("sysparam_get_stats failed\n");
+        return false;
+    }
+    if (stats.num_regions != 2) return true;
+    if (stats.ring_format) {
+        printf("two-region area in ring format\n");
+        return false;
+    }
+    for (i = 0; i < 2; i++) {
+        uint32_t addr = stats.base_addr + i * stats.region_sectors * SPI_FLASH_SECTOR_SIZE;
+        if (!spiflash_read(addr, (uint8_t *)header, sizeof(header))) return false;
+        if (header[0] != 0x70524f45) continue;  // SYSPARAM_MAGIC, else erased or cut
+        if ((header[1] & 0x2000) || (header[1] >> 16) != 0) {  // REGION_FLAG_RING
+            printf("region %d: header 0x%08x is not in the original format\n", i, header[1]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Check the erase counts sysparam reports against the simulator's.  Until
+ * there has been a power cut they should match exactly in ring format areas
+ * (two-region areas only count since sysparam_init()), and since regions are
+ * used in turn, never be more than one apart.  (A power cut just after a
+ * region is erased loses its count, which then has to be estimated.)
+ */
+static bool check_wear(bool exact) {
+    sysparam_stats_t stats;
+    uint32_t actual;
+    int i;
+
+    if (sysparam_get_stats(&stats) != SYSPARAM_OK) {
+        printf("sysparam_get_stats failed\n");
+        return false;
+    }
+    if (!exact || !stats.ring_format) return true;
+    for (i = 0; i < stats.num_regions; i++) {
+        actual = flash_sim_sector_erases(stats.base_addr + i * stats.region_sectors * SPI_FLASH_SECTOR_SIZE);
+        if (stats.erase_count[i] != actual) {
+            printf("region %d: erase count %u, but erased %u times\n", i, stats.erase_count[i], actual);
+            return false;
+        }
+    }
+    if (stats.max_erase_count - stats.min_erase_count > 1) {
+        printf("uneven wear (erase counts %u..%u)\n", stats.min_erase_count, stats.max_erase_count);
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-n rounds] [-S seed] [-s sectors] [-r regions] [-p cut-percent] [-L] [-f flash-file] [-v]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 2000;
+    unsigned seed = 1;
+    int num_sectors = 2;
+    int num_regions = 2;
+    int cut_percent = 75;
+    bool legacy = false;
+    const char *flash_file = NULL;
+    uint32_t max_ops = 16;
+    uint32_t area_top;
+    value_t state[NUM_KEYS];
+    sysparam_status_t status;
+    int cuts = 0;
+    op_t op;
+    pid_t pid;
+    int wstatus;
+    int round;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:S:s:r:p:Lf:vh")) != -1) {
+        switch (opt) {
+        case 'n': rounds = atoi(optarg); break;
+        case 'S': seed = strtoul(optarg, NULL, 0); break;
+        case 's': num_sectors = atoi(optarg); break;
+        case 'r': num_regions = atoi(optarg); break;
+        case 'p': cut_percent = atoi(optarg); break;
+        case 'L': legacy = true; break;
+        case 'f': flash_file = optarg; break;
+        case 'v': verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+    // Like app_main, search the whole area for the active region on "boot"
+    area_top = AREA_BASE + num_sectors * SPI_FLASH_SECTOR_SIZE;
+
+    child_ops = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (child_ops == MAP_FAILED || !flash_sim_init(flash_file, FLASH_SIZE)) return 1;
+    flash_sim_erase_all();
+    if (legacy ? !create_legacy_area(num_sectors) :
+            sysparam_create_ring_area(AREA_BASE, num_sectors, num_regions, true) != SYSPARAM_OK) {
+        printf("could not create sysparam area\n");
+        return 1;
+    }
+    if (sysparam_init(AREA_BASE, area_top) != SYSPARAM_OK) {
+        printf("could not initialize sysparam area\n");
+        return 1;
+    }
+
+    for (round = 0; round < rounds; round++) {
+        bool cut = rand() % 100 < cut_percent;
+        // Most updates are short, but ones which compact take many more
+        // operations, so spread the cut points over both ranges.
+        long cut_point = rand() % ((rand() % 2 ? 64 : max_ops) + 1);
+
+        random_op(&op);
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            if (cut) flash_sim_cut_after(cut_point);
+            run_op(&op);
+            *child_ops = flash_sim_stats.writes + flash_sim_stats.erases;
+            _exit(0);
+        }
+        if (pid < 0 || waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus)) {
+            printf("round %d: child failed\n", round);
+            return 1;
+        }
+        if (WEXITSTATUS(wstatus) == FLASH_SIM_CUT_EXIT) {
+            cuts++;
+        } else if (WEXITSTATUS(wstatus) != 0) {
+            printf("round %d: update failed\n", round);
+            return 1;
+        } else if (*child_ops > max_ops) {
+            max_ops = *child_ops;
+        }
+        if (verbose) {
+            printf("round %d: op %d (%d changes), %s\n", round, op.type, op.num_changes,
+                    WEXITSTATUS(wstatus) ? "cut" : "completed");
+        }
+
+        // "Reboot"
+        status = sysparam_init(AREA_BASE, area_top);
+        if (status != SYSPARAM_OK) {
+            printf("round %d: sysparam_init failed after power cut (%d)\n", round, status);
+            return 1;
+        }
+        if (!read_state(state) || !check_state(&op, state, WEXITSTATUS(wstatus) == 0) || !check_wear(!cuts) ||
+                !check_format()) {
+            printf("round %d: FAILED (seed %u)\n", round, seed);
+            return 1;
+        }
+        memcpy(model, state, sizeof(model));
+    }
+
+    printf("%d rounds OK (%d interrupted by power cuts)\n", rounds, cuts);
+    return 0;
+}
@@ -0,0 +1,16 @@
+/* Host stand-in for the SDK system functions used by ws2812_i2s */
+#ifndef _HOST_ESP_SYSTEM_H_
+#define _HOST_ESP_SYSTEM_H_
+
+#include <stdint.h>
+
+#define IRAM_DATA
+
+/* Microseconds of simulated time, advanced by the test as blocks are sent */
+extern uint32_t fake_now_us;
+
+static inline uint32_t sdk_system_get_time(void) {
+    return fake_now_us;
+}
+
+#endif /* _HOST_ESP_SYSTEM_H_ */
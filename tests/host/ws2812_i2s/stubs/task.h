@@ -0,0 +1,24 @@
+/* Minimal FreeRTOS task API for building ws2812_i2s on the host.
+ *
+ * The host test is single threaded. Waiting for a notification lets the
+ * fake DMA play blocks until the interrupt gives one, see ws2812_i2s_test.c.
+ */
+#ifndef _HOST_TASK_H_
+#define _HOST_TASK_H_
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+
+#define taskENTER_CRITICAL()
+#define taskEXIT_CRITICAL()
+
+static inline TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return (TaskHandle_t)1;
+}
+
+/* Implemented by the test */
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken);
+
+#endif /* _HOST_TASK_H_ */
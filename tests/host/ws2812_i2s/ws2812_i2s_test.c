@@ -0,0 +1,328 @@
+/*
+ * Part of esp-open-rtos
+ * BSD Licensed as described in the file LICENSE
+ *
+ * Tests for the streaming mode of extras/ws2812_i2s against the fake DMA
+ * from host/i2s_stream.
+ *
+ * Decodes what the DMA sent back into the frames the strip would latch and
+ * checks them against the frames queued: blocking and queued updates, frames
+ * replaced before they start, interrupts that come late but within what the
+ * ring allows, and interrupts held off long enough for stale blocks to be
+ * sent, which must be counted as an underrun and followed by the whole
+ * frame again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ws2812_i2s/ws2812_i2s.h>
+#include <espressif/esp_system.h>
+#include <task.h>
+
+#include "fake_dma.h"
+
+#define LEDS        100
+#define MAX_FRAMES  16
+
+/* Time to send one block, 28.8us per pixel */
+#define BLOCK_US    (WS2812_I2S_BLOCK_PIXELS * 288 / 10)
+
+/* Zero words (4.8us each) the strip takes as a reset and latches on */
+#define RESET_WORDS 11
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return false; \
+        } \
+    } while (0)
+
+uint32_t fake_now_us;
+
+static bool notified;
+static bool stuck;
+
+/* Frames handed to the done callback, in order */
+static const ws2812_pixel_t *done[MAX_FRAMES];
+static int num_done;
+
+/* Frames the strip latched */
+static struct {
+    ws2812_pixel_t pixels[LEDS];
+    int len;
+} latched[MAX_FRAMES * 2];
+static int num_latched;
+
+static ws2812_pixel_t frames[MAX_FRAMES][LEDS];
+
+/* Send one block, taking as long as the real output would */
+static bool step(void)
+{
+    if (!fake_dma_running()) {
+        return false;
+    }
+    fake_now_us += BLOCK_US;
+    return fake_dma_step();
+}
+
+static void drain(void)
+{
+    while (step()) {
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    while (!notified) {
+        if (!step()) {
+            stuck = true;
+            break;
+        }
+    }
+    notified = false;
+    return 1;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+    notified = true;
+}
+
+static void frame_done(const ws2812_pixel_t *pixels)
+{
+    if (num_done < MAX_FRAMES) {
+        done[num_done] = pixels;
+    }
+    num_done++;
+}
+
+static void reset(void)
+{
+    fake_dma_reset();
+    num_done = num_latched = 0;
+    stuck = false;
+}
+
+static int decode_nibble(uint16_t word)
+{
+    int value = 0;
+
+    for (int shift = 12; shift >= 0; shift -= 4) {
+        switch ((word >> shift) & 0xf) {
+        case 0x8: value <<= 1; break;
+        case 0xe: value = (value << 1) | 1; break;
+        default: return -1;
+        }
+    }
+    return value;
+}
+
+/* Turn the captured output back into the frames the strip latched */
+static bool decode(void)
+{
+    const uint16_t *words = (const uint16_t *)fake_dma_capture.words;
+    size_t len = fake_dma_capture.len * 2;
+    uint8_t colour[6];
+    int pixel = 0, nibble = 0, zeroes = 0;
+
+    num_latched = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || words[i] == 0) {
+            if (++zeroes == RESET_WORDS || (i == len && zeroes < RESET_WORDS)) {
+                CHECK(nibble == 0, "reset in the middle of a pixel");
+                if (pixel) {
+                    CHECK(num_latched < ARRAY_SIZE(latched), "too many frames");
+                    latched[num_latched++].len = pixel;
+                    pixel = 0;
+                }
+            }
+            continue;
+        }
+        CHECK(zeroes == 0 || zeroes >= RESET_WORDS, "%d zero words inside a frame", zeroes);
+        zeroes = 0;
+
+        int value = decode_nibble(words[i]);
+        CHECK(value >= 0, "bad bit pattern 0x%04x", words[i]);
+        colour[nibble++] = value;
+        if (nibble == 6) {
+            if (pixel < LEDS) {
+                ws2812_pixel_t *p = &latched[num_latched].pixels[pixel];
+                p->green = colour[0] | colour[1] << 4;
+                p->red = colour[2] | colour[3] << 4;
+                p->blue = colour[4] | colour[5] << 4;
+            }
+            pixel++;
+            nibble = 0;
+        }
+    }
+    return true;
+}
+
+static bool check_latched(int i, const ws2812_pixel_t *expected)
+{
+    CHECK(i < num_latched, "only %d frames latched", num_latched);
+    CHECK(latched[i].len == LEDS, "frame %d has %d pixels", i, latched[i].len);
+    CHECK(!memcmp(latched[i].pixels, expected, sizeof(latched[i].pixels)),
+            "frame %d has the wrong pixels", i);
+    return true;
+}
+
+static bool test_update(void)
+{
+    ws2812_i2s_stats_t before, after;
+
+    reset();
+    ws2812_i2s_get_stats(&before);
+    for (int i = 0; i < 5; i++) {
+        ws2812_i2s_update(frames[i]);
+        CHECK(!stuck, "update %d never woke", i);
+    }
+    drain();
+    CHECK(!ws2812_i2s_busy(), "busy after the last frame");
+    ws2812_i2s_get_stats(&after);
+    CHECK(after.frames - before.frames == 5, "%u frames", after.frames - before.frames);
+    CHECK(after.underruns == before.underruns, "underrun");
+    CHECK(num_done == 5, "%d callbacks", num_done);
+
+    CHECK(decode(), "decode failed");
+    CHECK(num_latched == 5, "%d frames latched", num_latched);
+    for (int i = 0; i < 5; i++) {
+        CHECK(done[i] == frames[i], "callback %d for the wrong frame", i);
+        if (!check_latched(i, frames[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool test_async(void)
+{
+    ws2812_i2s_stats_t before, after;
+
+    reset();
+    ws2812_i2s_get_stats(&before);
+    // The second frame is still pending when the third replaces it
+    ws2812_i2s_update_async(frames[0]);
+    ws2812_i2s_update_async(frames[1]);
+    ws2812_i2s_update_async(frames[2]);
+    CHECK(ws2812_i2s_busy(), "not busy");
+    drain();
+    ws2812_i2s_get_stats(&after);
+    CHECK(after.frames - before.frames == 2, "%u frames", after.frames - before.frames);
+    CHECK(after.dropped - before.dropped == 1, "%u dropped", after.dropped - before.dropped);
+    CHECK(num_done == 2 && done[0] == frames[0] && done[1] == frames[2], "wrong callbacks");
+    // Back to back frames: data blocks and one reset block each
+    CHECK(after.frame_us == ((LEDS + WS2812_I2S_BLOCK_PIXELS - 1) / WS2812_I2S_BLOCK_PIXELS + 1) * BLOCK_US,
+            "%u us between frames", after.frame_us);
+
+    CHECK(decode(), "decode failed");
+    CHECK(num_latched == 2, "%d frames latched", num_latched);
+    return check_latched(0, frames[0]) && check_latched(1, frames[2]);
+}
+
+/* Hold the interrupt off while `blocks` blocks are sent, starting `after`
+ * blocks into the frame, and return how many underruns that caused.  The
+ * first interrupt missed is handled `blocks - 1` blocks late.
+ */
+static uint32_t late_irq(int after, int blocks)
+{
+    ws2812_i2s_stats_t before, stats;
+
+    ws2812_i2s_get_stats(&before);
+    ws2812_i2s_update_async(frames[3]);
+    for (int i = 0; i < after; i++) {
+        step();
+    }
+    fake_dma_irq_off = true;
+    for (int i = 0; i < blocks; i++) {
+        step();
+    }
+    fake_dma_irq_on();
+    drain();
+    ws2812_i2s_get_stats(&stats);
+    return stats.underruns - before.underruns;
+}
+
+static bool test_late_irq(void)
+{
+    // WS2812_I2S_RING_BLOCKS - 2 blocks late, the block after the ones
+    // refilled has just been refilled the interrupt before
+    for (int after = 0; after < 6; after++) {
+        reset();
+        CHECK(late_irq(after, WS2812_I2S_RING_BLOCKS - 1) == 0, "underrun after %d blocks", after);
+        CHECK(num_done == 1 && done[0] == frames[3], "%d callbacks", num_done);
+        CHECK(decode(), "decode failed");
+        CHECK(num_latched == 1, "%d frames latched", num_latched);
+        if (!check_latched(0, frames[3])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool test_underrun(void)
+{
+    int underruns = 0;
+
+    // Late enough for the DMA to get back to a block it has already sent,
+    // up to several times round the ring
+    for (int late = WS2812_I2S_RING_BLOCKS; late < 3 * WS2812_I2S_RING_BLOCKS; late++) {
+        for (int after = 0; after < 3; after++) {
+            reset();
+            underruns += late_irq(after, late);
+            CHECK(num_done == 1 && done[0] == frames[3], "%d callbacks", num_done);
+            CHECK(decode(), "decode failed");
+            // Whatever stale data went out, the frame is then sent again
+            // and that is what the strip ends up showing
+            CHECK(num_latched > 0, "nothing latched");
+            if (!check_latched(num_latched - 1, frames[3])) {
+                return false;
+            }
+        }
+    }
+    CHECK(underruns == 3 * 2 * WS2812_I2S_RING_BLOCKS, "%d underruns", underruns);
+    printf("  %d underruns detected and recovered\n", underruns);
+    return true;
+}
+
+static const struct {
+    const char *name;
+    bool (*fn)(void);
+} tests[] = {
+    {"update", test_update},
+    {"async", test_async},
+    {"late_irq", test_late_irq},
+    {"underrun", test_underrun},
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    for (int i = 0; i < MAX_FRAMES; i++) {
+        for (int j = 0; j < LEDS; j++) {
+            frames[i][j].red = rand();
+            frames[i][j].green = rand();
+            frames[i][j].blue = rand();
+        }
+    }
+    if (!ws2812_i2s_init_stream(LEDS, frame_done)) {
+        printf("init failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        bool ok = tests[i].fn();
+        printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}